@@ -145,6 +145,7 @@ extern void vttidy(void);
 extern void vtmove(int row, int col);
 extern int upscreen(int f, int n);
 extern int update(int force);
+extern void updframe(void);
 extern void updpos(void);
 extern void upddex(void);
 extern int get_line_number_cached(struct window *wp);
@@ -171,7 +172,10 @@ extern int getregion(struct region *rp);
 extern void ttopen(void);
 extern void ttclose(void);
 extern int ttputc(int c);
+extern void ttputs(const char *s, size_t n);
 extern void ttflush(void);
+extern size_t ttframe_last(int *writes);
+extern void ttsetsync(int on);
 extern int ttgetc(void);
 extern int typahead(void);
 
@@ -186,6 +190,7 @@ extern int tgetc(void);
 extern int get1key(void);
 int getcmd(void);
 extern void input_reset_parser_state(void);
+extern int input_pending(void);
 
 
 extern int getstring(const char *prompt, char *buf, int nbuf, int eolchar);
@@ -221,6 +226,7 @@ extern int zotbuf(struct buffer *bp);
 extern int namebuffer(int f, int n);
 extern int listbuffers(int f, int n);
 extern int makelist(int iflag);
+extern int showlist(void);
 #if !WIN32
 #endif
 extern int addline(char *text);
@@ -233,6 +239,9 @@ extern struct buffer *bfind(char *bname, int cflag, int bflag);
 extern void buffer_update_stats_incremental(struct buffer *bp, int line_delta, long byte_delta, int word_delta);
 extern void buffer_mark_stats_dirty(struct buffer *bp);
 extern void buffer_get_stats_fast(struct buffer *bp, int *line_count, long *byte_count, int *word_count);
+/* Text storage backend selection */
+extern int buffer_default_storage(void);
+extern int buffer_set_storage(struct buffer *bp, int storage);
 
 /* file.c */
 extern int fileread(int f, int n);
@@ -255,6 +264,10 @@ extern int ffwopen(const char *fn);
 extern int ffclose(void);
 extern int ffputline(char *buf, int nbuf);
 extern int ffgetline(void);
+extern int ffputspan(const char *buf, size_t nbuf);
+extern int ffreadall(struct gap_buffer *gb);
+extern int ffmap(const char **textp, size_t *lenp);
+extern void ffunmap(void);
 extern int fexist(const char *fname);
 
 /* exec.c */
@@ -301,6 +314,9 @@ extern int forwsearch(int f, int n);
 extern int forwhunt(int f, int n);
 extern int backsearch(int f, int n);
 extern int backhunt(int f, int n);
+extern int countmatches(int f, int n);
+extern int listmatches(int f, int n);
+extern int hilite_matches(int f, int n);
 extern int mcscanner(struct magic *mcpatrn, int direct, int beg_or_end);
 extern int scanner(const char *patrn, int direct, int beg_or_end);
 extern int eq(unsigned char bc, unsigned char pc);
@@ -309,6 +325,7 @@ extern void rvstrcpy(char *rvstr, char *str);
 extern int sreplace(int f, int n);
 extern int qreplace(int f, int n);
 extern int delins(int dlength, char *instr, int use_meta);
+extern int replace_all(long max, int *nsub);
 extern int expandp(char *srcstr, char *deststr, int maxlength);
 extern int boundry(struct line *curline, int curoff, int dir);
 extern void mcclear(void);
@@ -320,6 +337,8 @@ extern int fisearch(int f, int n);
 extern int isearch(int f, int n);
 extern int checknext(char chr, const char *patrn, int dir);
 extern int scanmore(char *patrn, int dir);
+extern int isearch_forward(char *patrn, struct line *lp, int off);
+extern int isearch_extend(char *patrn, int dir);
 extern int match_pat(const char *patrn);
 extern int promptpattern(char *prompt);
 extern int get_char(void);
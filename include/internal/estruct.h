@@ -28,6 +28,9 @@
 
 /* Forward declarations */
 struct edit_stack;
+struct gap_buffer;
+struct line_chunk;
+struct line_arena;
 
 /* Configuration options not in config.h */
 #define CVMVAS  1  /* arguments to page forward/back in pages      */
@@ -268,7 +271,10 @@ struct buffer {
 	uint8_t b_active;	/* window activated flag (was char) */
 	uint8_t b_nwnd;		/* Count of windows on buffer (was char) */
 	uint8_t b_flag;		/* Buffer flags - see BufferFlags enum */
-	uint8_t _reserved;	/* Padding for 32-bit alignment */
+	uint8_t b_storage;	/* Text backend - see BufferStorage enum */
+	struct gap_buffer *b_gap;	/* Gap buffer text when BSTORE_GAP */
+	struct line_chunk *b_lindex;	/* Root of the line number index */
+	struct line_arena *b_arena;	/* Slabs the lines are cut from  */
 	
 	// Cached status line statistics for instant updates
 	_Atomic int b_line_count;	/* Total lines in buffer - cached */
@@ -294,6 +300,12 @@ enum BufferFlags {
 	BFTRUNC = 0x04		/* buffer was truncated when read */
 };
 
+/* Buffer storage backends - Standard enum */
+enum BufferStorage {
+	BSTORE_LINES = 0,	/* Line list only (classic)     */
+	BSTORE_GAP   = 1	/* Gap buffer mirrored by lines */
+};
+
 /* Hash table for O(1) buffer lookup by name */
 #define BUFFER_HASH_SIZE 256  /* Power of 2 for fast modulo */
 struct buffer_hash_entry {
@@ -363,6 +375,7 @@ struct terminal {
 #endif
 #if     SCROLLCODE
 	void (*t_scroll)(int, int,int);	/* scroll a region of the screen */
+	int (*t_scrcost)(int, int, int);	/* bytes t_scroll would send */
 #endif
 };
 
@@ -470,6 +483,7 @@ struct while_block {
 #define	BOL		5
 #define	EOL		6
 #define	DITTO		7
+#define	GROUP		8	/* What a group matched, in replacement. */
 #define	CLOSURE		256	/* An or-able value. */
 #define	MASKCL		(CLOSURE - 1)
 
@@ -506,6 +520,7 @@ struct magic {
 
 struct magic_replacement {
 	short int mc_type;
+	short int mc_group;	/* Group number, for GROUP. */
 	char *rstr;
 };
 
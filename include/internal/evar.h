@@ -60,6 +60,8 @@ static char *envars[] = {
 	"tab",			/* tab 4 or 8 */
 	"overlap",
 	"jump",
+	"framems",		/* ms between frames while input is queued */
+	"latency",		/* us from key to screen of the last frame */
 #if SCROLLCODE
 	"scroll",		/* scroll enabled */
 #endif
@@ -107,7 +109,9 @@ static char *envars[] = {
 #define EVTAB		37
 #define EVOVERLAP	38
 #define EVSCROLLCOUNT	39
-#define EVSCROLL	40
+#define EVFRAMEMS	40
+#define EVLATENCY	41
+#define EVSCROLL	42
 
 enum function_type {
 	NILNAMIC = 0,
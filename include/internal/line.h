@@ -4,6 +4,9 @@
 #include "utf8.h"
 #include "c23_compat.h"
 
+struct buffer;
+struct line_chunk;
+
 /*
  * All text is kept in circularly linked lists of "struct line" structures. These
  * begin at the header line (which is the blank line beyond the end of the
@@ -13,27 +16,55 @@
  * additions will include update hints, and a list of marks into the line.
  * 
  * C23 modernization: Uses flexible array member for cache-efficient text storage.
+ *
+ * A buffer kept in a gap buffer (BSTORE_GAP) need not have all its lines
+ * built: "l_hole" counts the lines of text that follow a line (or, on the
+ * header line, that open the buffer) and have no struct line yet. lforw()
+ * and lback() build them from the gap text on the way, a run at a time,
+ * so code walking the list never sees the difference.
  */
 struct line {
 	struct line *l_fp;	/* Link to the next line        */
 	struct line *l_bp;	/* Link to the previous line    */
 	int l_size;		/* Allocated size               */
 	int l_used;		/* Used size                    */
+	struct line_chunk *l_chunk;	/* Line number index chunk */
 	
 	// Atomic column cache for instant UTF-8 cursor positioning
 	_Atomic int l_column_cache_offset;  /* Last cached byte offset */
 	_Atomic int l_column_cache_column;  /* Display column at offset */
 	_Atomic bool l_column_cache_dirty;  /* Cache needs invalidation */
+	uint8_t l_slot;		/* Where the line lives - see line_arena.h */
+	uint32_t l_gen;		/* Stamp of the last change to the text */
+	int l_hole;		/* Unbuilt lines after this one */
 	
 	ALIGN_TO(8) char l_text[];	/* C23 flexible array - cache aligned */
 };
 
-#define lforw(lp)       ((lp)->l_fp)
-#define lback(lp)       ((lp)->l_bp)
+#define LBUILD_RUN	32	/* Unbuilt lines built at a time */
+
+extern struct line *lbuildnext(struct line *lp);
+extern struct line *lbuildprev(struct line *lp);
+
+static inline struct line *lforw(struct line *lp)
+{
+	return lp->l_hole ? lbuildnext(lp) : lp->l_fp;
+}
+
+static inline struct line *lback(struct line *lp)
+{
+	return lp->l_bp->l_hole ? lbuildprev(lp) : lp->l_bp;
+}
+
 #define lgetc(lp, n)    ((lp)->l_text[(n)]&0xFF)
-#define lputc(lp, n, c) ((lp)->l_text[(n)]=(c))
+#define ltouch(lp)      ((lp)->l_gen = ++line_generation)
+#define lputc(lp, n, c) (ltouch(lp), (lp)->l_text[(n)]=(c))
 #define llength(lp)     ((lp)->l_used)
 
+/* Source of line stamps: a line changed since a stamp was taken has
+ * another one, even if it has been freed and its memory used again. */
+extern uint32_t line_generation;
+
 extern void lfree(struct line *lp);
 extern void lchange(int flag);
 extern int insspace(int f, int n);
@@ -44,16 +75,23 @@ extern int lowrite(int c);
 extern int lover(char *ostr);
 extern int lnewline(void);
 extern int ldelete(long n, int kflag);
+extern int lreplace(struct line *lp, long lnum, int off, int dlen,
+		    const char *text, int ilen);
 extern int ldelchar(long n, int kflag);
 extern int lgetchar(unicode_t *);
 extern char *getctext(void);
 extern int putctext(const char *iline);
 extern int ldelnewline(void);
+extern void lsync(struct line *lp, int off, long n);
 extern void kdelete(void);
 extern int kinsert(int c);
 extern int yank(int f, int n);
 extern int yank_clipboard(int f, int n);
 extern int yankpop(int f, int n);
-extern struct line *lalloc(int);  /* Allocate a line. */
+extern struct line *lbuild(struct buffer *bp, struct line *lp, int k, int n);
+extern int lbuildall(struct buffer *bp);
+extern int lsyncnew(struct line *lp, int n);
+extern struct line *lalloc(struct buffer *bp, int used);  /* Allocate a line. */
+extern void lrelease(struct line *lp);  /* Free an unlinked line. */
 
 #endif  /* LINE_H_ */
@@ -0,0 +1,38 @@
+#ifndef LINE_ARENA_H_
+#define LINE_ARENA_H_
+
+/*
+ * Per-buffer line arena.
+ *
+ * Lines of a buffer are carved out of slabs of LARENA_SLAB bytes, one
+ * slab per size class, so loading a file costs one allocation per slab
+ * rather than per line. A freed line goes back on its class' free list;
+ * lines too long for the largest class get an allocation of their own
+ * that the arena still keeps track of. Clearing a buffer drops the whole
+ * arena at once, without visiting the lines.
+ *
+ * Slabs are aligned to their size, so a line finds its slab (and from
+ * there its arena) by masking its address. "l_slot" in the line tells
+ * which kind of allocation it is.
+ */
+
+#include <stddef.h>
+
+struct buffer;
+struct line;
+
+#define LARENA_SLAB    32768	/* Bytes per slab, a power of two    */
+#define LARENA_CLASSES 11	/* Text sizes 16, 24, 32, ... 512    */
+#define LARENA_MAXTEXT 512
+
+/* Values of l_slot */
+#define LSLOT_HEAP  0		/* Own safe_alloc block (no buffer)  */
+#define LSLOT_BIG   255		/* Own block, tracked by the arena   */
+				/* 1..LARENA_CLASSES: slab slot class */
+
+extern struct line *larena_alloc(struct buffer *bp, int size);
+extern void larena_free(struct line *lp);
+extern void larena_release(struct buffer *bp);
+extern size_t larena_slabs(struct buffer *bp);
+
+#endif  /* LINE_ARENA_H_ */
@@ -0,0 +1,42 @@
+#ifndef LINE_INDEX_H_
+#define LINE_INDEX_H_
+
+/*
+ * Per-buffer line number index.
+ *
+ * The lines of a buffer are grouped into runs of consecutive lines
+ * ("chunks"), and the chunks are kept in a treap ordered by position and
+ * annotated with subtree line counts. Each line points at its chunk, so
+ * both "line -> number" and "number -> line" cost O(log n) plus a walk
+ * inside one chunk, which is bounded by LINDEX_CHUNK_MAX lines.
+ *
+ * Code that links a line into a buffer calls lindex_link() afterwards;
+ * code that unlinks one calls lindex_unlink() first. Bulk loaders may
+ * link lines directly and call lindex_rebuild() when done. Lines built
+ * from gap text are counted before they exist; lbuild() hands them over
+ * with lindex_built().
+ */
+
+#include <stdbool.h>
+
+struct buffer;
+struct line;
+
+#define LINDEX_CHUNK     64	/* Lines per chunk when (re)built  */
+#define LINDEX_CHUNK_MAX 128	/* Split a chunk beyond this size  */
+
+extern void lindex_link(struct buffer *bp, struct line *lp);
+extern void lindex_unlink(struct line *lp);
+extern void lindex_replace(struct line *olp, struct line *nlp);
+extern void lindex_rebuild(struct buffer *bp);
+extern void lindex_clear(struct buffer *bp);
+extern void lindex_free(struct buffer *bp);
+extern long lindex_number(struct buffer *bp, struct line *lp);
+extern struct line *lindex_line(struct buffer *bp, long n);
+extern long lindex_count(struct buffer *bp);
+extern long lindex_peek(struct buffer *bp, struct line *lp);
+extern bool lindex_complete(struct buffer *bp);
+extern void lindex_built(struct buffer *bp, struct line *lp, struct line *first, int n);
+extern struct buffer *lindex_buffer(struct line *lp);
+
+#endif  /* LINE_INDEX_H_ */
@@ -0,0 +1,79 @@
+/*
+ * literal_scan.h - Vectorised literal search for scanner()
+ *
+ * Candidates are found by comparing the first and the last byte of the
+ * pattern against whole blocks of text at once, and only those are
+ * checked in full. The kernel (AVX2, SSE2 or plain C) is picked once at
+ * run time from what the CPU supports.
+ */
+
+#ifndef LITERAL_SCAN_H_
+#define LITERAL_SCAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Forward decls to avoid leaking editor internals */
+struct line;
+
+#define LSCAN_MAX_PATTERN 256
+
+/* A pattern made ready for the kernels (no heap allocations) */
+struct literal_scan {
+    unsigned char pattern[LSCAN_MAX_PATTERN];  /* lower case unless case_sensitive */
+    int len;
+    bool case_sensitive;
+    unsigned char first, last;          /* filter bytes */
+    unsigned char first_fold, last_fold; /* 0x20 where a filter byte is a letter to fold */
+};
+
+enum lscan_kernel {
+    LSCAN_AUTO,     /* best the CPU supports */
+    LSCAN_SCALAR,
+    LSCAN_SSE2,
+    LSCAN_AVX2,
+};
+
+/* Prepare a pattern; returns 0, or -1 if it is empty or too long. */
+int lscan_init(struct literal_scan *ls, const unsigned char *pattern, int len,
+               bool case_sensitive);
+
+/* Offset of the first match in text[0..n), or -1. */
+long lscan_find(const struct literal_scan *ls, const unsigned char *text, size_t n);
+
+/* Force a kernel; false if the CPU lacks it. UEMACS_SEARCH_SIMD=0 in the
+ * environment keeps the scalar one. */
+bool lscan_set_kernel(enum lscan_kernel kernel);
+const char *lscan_kernel_name(void);
+
+/*
+ * Search the lines from (start_lp,start_off) up to the header line "head"
+ * as one stream, each line followed by a newline but the last. Matches
+ * may span lines. On success sets the start of the match and the position
+ * just past it.
+ */
+bool lscan_search_forward(const struct literal_scan *ls,
+                          struct line *start_lp, int start_off, struct line *head,
+                          struct line **match_lp, int *match_off,
+                          struct line **end_lp, int *end_off);
+
+/* Called for each match with its start and the position just past it;
+ * returns false to stop the search. */
+typedef bool (*lscan_found_fn)(void *arg, struct line *match_lp, int match_off,
+                               struct line *end_lp, int end_off);
+
+/*
+ * Every match from (start_lp,start_off) up to "head", in order and not
+ * overlapping, as lscan_search_forward() would find them going on from
+ * the end of each, but with the text copied into windows only once.
+ * Returns false only when out of memory.
+ */
+bool lscan_search_all(const struct literal_scan *ls,
+                      struct line *start_lp, int start_off, struct line *head,
+                      lscan_found_fn found, void *arg);
+
+/* Free the calling thread's search window; threads other than the
+ * editor's call it before they exit. */
+void lscan_release(void);
+
+#endif /* LITERAL_SCAN_H_ */
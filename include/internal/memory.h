@@ -6,6 +6,7 @@
 #define MEMORY_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <assert.h>
 
 /* Safe allocation functions */
@@ -14,8 +15,13 @@ void* safe_realloc(void* old_ptr, size_t new_size, const char* context);
 void safe_free(void** ptr);
 char* safe_strdup(const char* str, const char* context);
 
+/* Threads other than the editor's say nothing when an allocation fails,
+ * and hand the failure back for the editor thread to report */
+void memory_quiet(bool quiet);
+
 /* Memory tracking and debugging */
 void memory_report(void);
+void memory_usage(size_t* bytes, size_t* blocks);
 void memory_cleanup(void);
 
 /* C23 compile-time validation for memory safety */
@@ -1,7 +1,11 @@
 /*
  * nfa.h - Thompson NFA (regex-lite) for MAGIC search
- * Supports: literals, dot (.), anchors (^,$), closure (*) on single atoms.
- * Zero-heap runtime via fixed arenas and state sets.
+ * Supports: literals, dot (.), classes, anchors (^,$), alternation (|),
+ * groups (...), and *, +, ? and {m,n} on any atom or group; what each of
+ * the first nine groups matched is found on request.
+ * Each compiled program owns its storage, with a lazy DFA in front of the
+ * NFA (UEMACS_SEARCH_DFA=0 turns it off); the editor reuses programs
+ * through a small LRU cache.
  */
 
 #ifndef NFA_H_
@@ -14,13 +18,34 @@
 /* Forward decls to avoid leaking editor internals */
 struct line;
 
+/* Group 0 is the whole match, 1 to 9 the parenthesised groups */
+#define NFA_GROUPS 10
+#define NFA_SLOTS  (2 * NFA_GROUPS)
+
+/* A compiled pattern with all the state its searches use */
+typedef struct nfa_program nfa_program;
+
 typedef struct {
     int start_state;
     int state_count;
     bool case_sensitive;
+    nfa_program* program;
 } nfa_program_info;
 
-/* Compile pattern into internal fixed-size arena.
+/* Compile a pattern into a program of its own; NULL if the pattern is
+ * unsupported or exceeds capacity. Free with nfa_program_free().
+ */
+nfa_program* nfa_program_new(const char* pattern, bool case_sensitive);
+void nfa_program_free(nfa_program* prog);
+
+/* The program for a pattern from the LRU cache, compiled on a miss. The
+ * cache owns it; it stays valid until NFA_CACHE_SIZE other patterns have
+ * been fetched or the cache is cleared. Editor thread only.
+ */
+nfa_program* nfa_program_get(const char* pattern, bool case_sensitive);
+void nfa_cache_clear(void);
+
+/* Fetch pattern from the cache and describe it.
  * Returns true on success; false if pattern unsupported or exceeds capacity.
  */
 bool nfa_compile(const char* pattern, bool case_sensitive, nfa_program_info* out_info);
@@ -36,5 +61,70 @@ bool nfa_search_forward(const nfa_program_info* prog,
                         struct line** match_lp,
                         int* match_off);
 
-#endif /* NFA_H_ */
+/* Leftmost-longest match from (start_lp,start_off) on: its line and the
+ * offsets it starts and ends at. Returns true if found.
+ */
+bool nfa_search_match(nfa_program* prog,
+                      struct line* start_lp,
+                      int start_off,
+                      struct line** match_lp,
+                      int* match_start,
+                      int* match_end);
+
+/* The same, stopping before line stop_lp rather than at the end of the
+ * buffer. Programs are not shared: a thread searching on its own needs a
+ * program of its own from nfa_program_new().
+ */
+bool nfa_search_match_until(nfa_program* prog,
+                            struct line* start_lp,
+                            int start_off,
+                            struct line* stop_lp,
+                            struct line** match_lp,
+                            int* match_start,
+                            int* match_end);
+
+/* Whether prog can search backward: its reversed program, built on first
+ * use, has to fit the same capacity.
+ */
+bool nfa_can_reverse(nfa_program* prog);
+
+/* Backward search on the reversed program: the match ending nearest
+ * before (start_lp,start_off), longest of those. Reads lines from their
+ * ends, back from start_lp only as far as the match.
+ */
+bool nfa_search_match_reverse(nfa_program* prog,
+                              struct line* start_lp,
+                              int start_off,
+                              struct line** match_lp,
+                              int* match_start,
+                              int* match_end);
+
+/* Numbered groups in prog's pattern */
+int nfa_program_groups(const nfa_program* prog);
+
+/* What the groups matched in the match [ms..me) of line lp, found by one
+ * of the searches: sub[2g] and sub[2g+1] bound group g, -1 for a group
+ * that took no part, for g below nsub. Where the pattern could match the
+ * span in several ways, the groups are those of the leftmost alternative
+ * and the greediest repeats. Returns false if prog does not match there.
+ */
+bool nfa_match_groups(nfa_program* prog, struct line* lp, int ms, int me, int* sub, int nsub);
 
+/* Whether pattern uses syntax only the NFA knows: |, (, ), +, ? or {m,n} */
+bool nfa_pattern_extended(const char* pattern);
+
+/* DFA and program cache counters, over all programs */
+typedef struct {
+    uint64_t hits;          /* transitions found in the cache */
+    uint64_t misses;        /* transitions computed from the NFA */
+    uint64_t flushes;       /* times the full cache was dropped */
+    uint64_t fallbacks;     /* searches left to the NFA for thrashing */
+    size_t states;          /* DFA states cached by the last program searched */
+    uint64_t compiles;      /* programs compiled */
+    uint64_t reuses;        /* programs found in the LRU cache */
+} nfa_dfa_stats;
+
+void nfa_dfa_get_stats(nfa_dfa_stats* out);
+void nfa_dfa_reset_stats(void);
+
+#endif /* NFA_H_ */
@@ -3,6 +3,7 @@
 #ifndef PROFILER_H
 #define PROFILER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 // Initialization
@@ -18,6 +19,9 @@ void perf_count_key_lookup(void);
 void perf_count_display_update(void);
 void perf_count_file_read(void);
 void perf_count_file_write(void);
+void perf_count_frame(size_t bytes, int writes);
+void perf_count_latency(uint64_t ns);
+void perf_count_deferred(void);
 
 // Timing functions
 void perf_start_timing(const char* operation);
@@ -0,0 +1,35 @@
+/*
+ * redraw.h - When the command loop puts a frame on the screen
+ *
+ * The loop asks before each command whether to redraw. With no input
+ * waiting it always does, so the first key after a pause is on screen at
+ * once; while keys are queued up (key repeat, a paste, a macro) it draws
+ * at most one frame per interval and lets the rest of the burst be folded
+ * into the next one. The time from a key being read to the frame that
+ * shows it is kept for every frame.
+ */
+
+#ifndef REDRAW_H_
+#define REDRAW_H_
+
+#include <stdbool.h>
+
+#define REDRAW_MS   8       /* Default shortest time between frames in a burst */
+
+/* Whether the command loop is to update() now */
+bool redraw_due(void);
+
+/* A key was read from the terminal; the first since the last frame is timed */
+void redraw_key(void);
+
+/* update() has flushed a frame */
+void redraw_drawn(void);
+
+/* Microseconds from key to screen of the last frame that showed a key */
+long redraw_latency(void);
+
+/* The interval in ms; 0 draws after every command */
+int redraw_interval(void);
+void redraw_set_interval(int ms);
+
+#endif /* REDRAW_H_ */
@@ -0,0 +1,36 @@
+/*
+ * row_diff.h - Vectorised compare of two screen rows for update()
+ *
+ * A row of the screen is an array of 32-bit cells. The span that differs
+ * between the row wanted and the row on the terminal is found from both
+ * ends at once per block of cells, so a row costs no more than one pass
+ * and a row that did not change costs no hashing at all. The kernel
+ * (AVX2, SSE2 or plain C) is picked once at run time from what the CPU
+ * supports.
+ */
+
+#ifndef ROW_DIFF_H_
+#define ROW_DIFF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum rdiff_kernel {
+    RDIFF_AUTO,     /* best the CPU supports */
+    RDIFF_SCALAR,
+    RDIFF_SSE2,
+    RDIFF_AVX2,
+};
+
+/*
+ * The first cell in which a[0..n) and b[0..n) differ, or -1 if they are
+ * the same; *end is set to one past the last cell that differs.
+ */
+int rdiff_span(const uint32_t *a, const uint32_t *b, int n, int *end);
+
+/* Force a kernel; false if the CPU lacks it. UEMACS_DISPLAY_SIMD=0 in the
+ * environment keeps the scalar one. */
+bool rdiff_set_kernel(enum rdiff_kernel kernel);
+const char *rdiff_kernel_name(void);
+
+#endif /* ROW_DIFF_H_ */
@@ -0,0 +1,45 @@
+/*
+ * search_highlight.h - Every match of the last search shown on screen
+ *
+ * With highlight-matches on, the display shows each match of the search
+ * pattern in the rows it draws in reverse video, like the selection. The
+ * matches of a line are found the first time it is drawn and kept, keyed
+ * by the line and its generation stamp, so only rows new on screen or
+ * changed since are searched: the cost follows the screen, not the file.
+ */
+
+#ifndef SEARCH_HIGHLIGHT_H_
+#define SEARCH_HIGHLIGHT_H_
+
+#include <stdbool.h>
+
+/* Forward decls to avoid leaking editor internals */
+struct buffer;
+struct line;
+
+#define HL_BITS     9
+#define HL_SLOTS    (1 << HL_BITS)  /* Lines whose matches are kept */
+
+/* Bytes [from, to) of a line that match */
+struct hl_span {
+    int from;
+    int to;
+};
+
+/*
+ * Called once per update(): whether matches are to be shown. When the
+ * mode or the pattern has changed since the last call, the kept matches
+ * are dropped and every window is marked for a full redraw.
+ */
+bool hl_resolve(void);
+
+/*
+ * The matches in line "lp" of "bp", in order and not overlapping, in
+ * *spans; returns how many. Only valid until the next call.
+ */
+int hl_line(struct buffer *bp, struct line *lp, const struct hl_span **spans);
+
+/* Drop the kept matches and the prepared pattern */
+void hl_flush(void);
+
+#endif /* SEARCH_HIGHLIGHT_H_ */
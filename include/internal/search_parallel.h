@@ -0,0 +1,56 @@
+/*
+ * search_parallel.h - Whole-buffer search on a pool of worker threads
+ *
+ * The buffer is cut into chunks of whole lines that the workers take in
+ * turn, each searching its chunks with the literal kernel or an NFA
+ * program of its own. The per-chunk results are joined in buffer order,
+ * so they are the matches a forward search repeated from the top of the
+ * buffer would find, one after the other.
+ */
+
+#ifndef SEARCH_PARALLEL_H_
+#define SEARCH_PARALLEL_H_
+
+#include <stdbool.h>
+
+/* Forward decls to avoid leaking editor internals */
+struct buffer;
+struct line;
+
+#define PSEARCH_MAX_THREADS     32      /* Workers used at most */
+#define PSEARCH_CHUNKS          4       /* Chunks per worker, for balance */
+#define PSEARCH_MIN_LINES       2048    /* Smaller buffers get one worker */
+
+struct psearch_match {
+    struct line *lp;    /* line the match starts on */
+    long line;          /* ... its number, from 1 */
+    int off;            /* ... and the offset there */
+    struct line *elp;   /* position just past the match */
+    int eoff;
+};
+
+struct psearch_result {
+    struct psearch_match *match;    /* in buffer order; NULL unless listed */
+    long count;                     /* matches found */
+    size_t room;                    /* slots allocated in match */
+    int threads;                    /* workers that did it */
+};
+
+/*
+ * Find every match of "pattern" in "bp", MAGIC pattern when "magic",
+ * without overlaps. With "list" the matches themselves are kept, else
+ * only counted. Returns TRUE, FALSE when out of memory, or ABORT when
+ * the pattern is beyond the engines here and must be searched the slow
+ * way. Free the result with psearch_free().
+ */
+int psearch_buffer(struct buffer *bp, const char *pattern, bool magic,
+                   bool case_sensitive, bool list, struct psearch_result *res);
+void psearch_free(struct psearch_result *res);
+
+/* Append a match to a listing result; false when out of memory */
+bool psearch_add(struct psearch_result *res, const struct psearch_match *pm);
+
+/* Workers a search would use: UEMACS_SEARCH_THREADS, else the CPUs online */
+int psearch_threads(void);
+
+#endif /* SEARCH_PARALLEL_H_ */
@@ -21,6 +21,7 @@ typedef struct terminal_caps {
     int height;            /* Rows */
     bool utf8_capable;     /* UTF-8 support */
     bool alt_screen;       /* Alternate screen buffer */
+    bool sync_update;      /* Synchronized update (DEC mode 2026) */
 } terminal_caps_t;
 
 /* Core capability functions */
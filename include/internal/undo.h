@@ -1,8 +1,3 @@
-#include <stdio.h>
-
-/* Undo history persistence API (stub) */
-bool undo_stack_save_to_file(struct buffer *bp, const char *filename);
-bool undo_stack_load_from_file(struct buffer *bp, const char *filename);
 /*
  * undo.h - Public API for the per-buffer undo system.
  */
@@ -10,6 +5,7 @@ bool undo_stack_load_from_file(struct buffer *bp, const char *filename);
 #define UNDO_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 
 // Forward declarations
 struct buffer;
@@ -36,6 +32,17 @@ struct atomic_undo_stack *undo_stack_create(void);
  */
 void undo_stack_destroy(struct atomic_undo_stack *stack);
 
+/**
+ * @brief Returns the memory held by the undo history of a buffer.
+ *
+ * The history is kept in chunks and trimmed from the oldest end once it
+ * outgrows a fixed byte budget.
+ *
+ * @param bp Pointer to the buffer.
+ * @return Bytes allocated for the buffer's undo log.
+ */
+size_t undo_memory(struct buffer *bp);
+
 /**
  * @brief Records a text insertion operation for undo.
  * 
@@ -86,4 +93,42 @@ void undo_group_end(struct buffer *bp);
  */
 void undo_mark_saved(struct buffer *bp);
 
+/**
+ * @brief Writes the undo history of a buffer to its history file.
+ *
+ * The undo point becomes a save point of the current text. Records the
+ * file already holds are not written again; the file is synced once.
+ *
+ * @param bp Pointer to the buffer, just written out.
+ * @param filename Path of the history file.
+ * @return true on success.
+ */
+bool undo_stack_save_to_file(struct buffer *bp, const char *filename);
+
+/**
+ * @brief Takes up a history file for a buffer that has just been read.
+ *
+ * The file is only used when its last save point matches the buffer
+ * text. Its records are read back lazily as undo walks back to them.
+ *
+ * @param bp Pointer to the buffer.
+ * @param filename Path of the history file.
+ * @return true if the history was taken up.
+ */
+bool undo_stack_load_from_file(struct buffer *bp, const char *filename);
+
+/**
+ * @brief Names the history file kept for a file.
+ *
+ * @param fname The file being edited.
+ * @param path Receives the history file path.
+ * @param size Size of "path".
+ * @return false if undo history is not kept (see UEMACS_UNDO_HISTORY).
+ */
+bool undo_history_file(const char *fname, char *path, size_t size);
+
+/* Save or pick up the history of a buffer's file, when history is kept */
+void undo_history_save(struct buffer *bp);
+void undo_history_load(struct buffer *bp);
+
 #endif // UNDO_H_
@@ -0,0 +1,97 @@
+#ifndef UNDO_LOG_H_
+#define UNDO_LOG_H_
+
+/*
+ * Undo log internals, shared by undo.c and undo_persist.c.
+ *
+ * The history of a buffer is an append-only log of variable-sized records
+ * packed into large chunks. A keystroke that continues the previous edit
+ * (typing on, backspacing, deleting forward) is merged into the last
+ * record in place, so a typed word costs one record rather than one per
+ * character. The log is bounded by bytes: once it grows past
+ * UNDO_MAX_BYTES the oldest chunks are dropped.
+ *
+ * The on-disk history file is a header followed by the very same records,
+ * byte for byte, with a save point record written at every save. A
+ * record's "r_prev" always gives the size of the record before it, so
+ * the file can be walked backwards from its end, and chunks of it copied
+ * back into memory as undo reaches them.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UNDO_CHUNK      65536           /* Usual size of a log chunk */
+#define UNDO_MAX_BYTES  (64L << 20)     /* Log size kept per buffer */
+#define UNDO_GROUP_NS   400000000LL     /* Typing pause that ends a group */
+
+#define UNDO_SAVED      0x7f            /* r_type of a save point */
+
+// One edit in the log, followed by its text and a NUL
+struct undo_record {
+    uint32_t r_size;        // whole record, header and padding included
+    uint32_t r_prev;        // size of the record before it
+    int r_len;              // text length
+    int r_off;              // offset on line
+    long r_line;            // line number of change
+    uint64_t r_version;     // buffer version once this edit is applied
+    uint64_t r_group;       // grouping id for coalesced undo steps
+    int64_t r_stamp;        // time of the last keystroke merged in, ns
+    uint8_t r_type;         // enum edit_type, or UNDO_SAVED
+    char r_text[];
+};
+
+struct undo_chunk {
+    struct undo_chunk *c_prev;  // older chunk
+    struct undo_chunk *c_next;  // newer chunk
+    size_t c_size;              // room for records
+    size_t c_used;              // bytes of records
+    size_t c_last;              // size of the last record, 0 if none
+    unsigned char c_data[];     // records, 8-byte aligned
+};
+
+// The log of a buffer and the undo point within it
+struct atomic_undo_stack {
+    struct undo_chunk *first;   // oldest chunk
+    struct undo_chunk *last;    // newest chunk
+    struct undo_chunk *cur;     // undo point: records before it are applied,
+    size_t cur_off;             // ... the ones after it can be redone
+    size_t bytes;               // memory held by the chunks
+    uint64_t base_version;      // buffer version at the start of the log
+    int last_len;               // length of the last edit recorded, 0 after undo/redo
+    int last_byte;              // ... and the byte it ended on (began on, backspacing)
+    _Atomic uint64_t version;
+    _Atomic bool in_operation;   // Prevents recursive undo/redo
+    _Atomic bool group_forced;   // Within an explicit group
+    _Atomic uint64_t current_group_id; // Current group id
+
+    // History file, see undo_persist.c
+    char *p_path;               // file the log is kept in, NULL if none
+    const unsigned char *p_map; // the file mapped, for reading back old records
+    size_t p_maplen;
+    size_t p_base;              // file offset of the first record in memory
+    uint32_t p_prev;            // size of the record before that one
+    size_t p_synced;            // the file matches the log up to here, 0 if not at all
+};
+
+static inline size_t undo_record_size(int len) {
+    return (offsetof(struct undo_record, r_text) + (size_t)len + 1 + 7) & ~(size_t)7;
+}
+
+static inline struct undo_record *undo_rec_at(struct undo_chunk *c, size_t off) {
+    return (struct undo_record *)(c->c_data + off);
+}
+
+/* undo.c */
+extern struct undo_record *undo_log_insert(struct atomic_undo_stack *stack, size_t size);
+extern void undo_log_reset(struct atomic_undo_stack *stack);
+extern uint64_t undo_log_version(struct atomic_undo_stack *stack);
+extern size_t undo_log_offset(struct atomic_undo_stack *stack, struct undo_chunk *c, size_t off);
+
+/* undo_persist.c */
+extern bool undo_persist_fetch(struct atomic_undo_stack *stack);
+extern void undo_persist_release(struct atomic_undo_stack *stack);
+
+#endif  /* UNDO_LOG_H_ */
@@ -142,6 +142,9 @@ int display_matrix_get_dirty_regions(struct dirty_region **regions);
 void display_matrix_optimize_updates(void);
 bool display_matrix_needs_update(void);
 void display_matrix_commit_updates(void);
+int display_matrix_dirty_span(int row, int col, int width, int *end);
+void display_matrix_blank_line(int row, uint8_t fg, uint8_t bg);
+void display_matrix_reset(uint8_t fg, uint8_t bg);
 
 // Scrolling support
 void display_matrix_scroll_up(int start_row, int end_row, int lines);
@@ -185,6 +188,8 @@ extern struct display_matrix_stats display_matrix_global_stats;
 
 void display_matrix_stats_reset(void);
 void display_matrix_stats_update(size_t cells_updated, uint64_t update_time_ns);
+void display_matrix_get_stats(size_t *cells_updated, size_t *partial_redraws,
+                              size_t *full_redraws);
 
 // Validation and debugging
 #ifdef DEBUG
@@ -200,6 +205,7 @@ void display_matrix_check_consistency(void);
 #define DISPLAY_MATRIX_MIN_COLS     80
 #define DISPLAY_MATRIX_MAX_ROWS     300
 #define DISPLAY_MATRIX_MAX_COLS     500
+#define DISPLAY_MATRIX_SPAN_GAP     8   // Clean cells worth rewriting over a cursor move
 #define DIRTY_REGION_MERGE_THRESHOLD 3
 #define MAX_DIRTY_REGIONS           64
 
@@ -104,8 +104,8 @@ void gap_buffer_rebuild_line_index(struct gap_buffer *gb);
 void gap_buffer_update_char_cache(struct gap_buffer *gb, size_t line_num, size_t byte_pos);
 
 // Legacy compatibility for line-based interface
-struct line *gap_buffer_get_line_struct(struct gap_buffer *gb, size_t line_num);
-int gap_buffer_sync_to_lines(struct gap_buffer *gb, struct line **head_line);
+struct line *gap_buffer_get_line_struct(struct gap_buffer *gb, struct buffer *bp, size_t line_num);
+int gap_buffer_sync_to_lines(struct gap_buffer *gb, struct buffer *bp);
 int gap_buffer_sync_from_lines(struct gap_buffer *gb, struct line *head_line);
 
 // Debug and statistics
@@ -13,6 +13,7 @@
 #include "efunc.h"
 #include "evar.h"
 #include "line.h"
+#include "redraw.h"
 #include "string_safe.h"
 #include "util.h"
 #include "version.h"
@@ -340,6 +341,10 @@ char *gtenv(const char *vname)
 		return itoa(overlap);
 	case EVSCROLLCOUNT:
 		return itoa(scrollcount);
+	case EVFRAMEMS:
+		return itoa(redraw_interval());
+	case EVLATENCY:
+		return itoa((int)redraw_latency());
 #if SCROLLCODE
 	case EVSCROLL:
 		return ltos(term.t_scroll != NULL);
@@ -702,6 +707,11 @@ int svar(struct variable_description *var, const char *value)
 		case EVSCROLLCOUNT:
 			scrollcount = atoi(value);
 			break;
+		case EVFRAMEMS:
+			redraw_set_interval(atoi(value));
+			break;
+		case EVLATENCY:
+			break;
 		case EVSCROLL:
 #if SCROLLCODE
 			if (!stol(value))
@@ -858,7 +868,7 @@ static const char *internal_getval(char *token)
 		buf[blen] = 0;
 
 		/* and step the buffer's line ptr ahead a line */
-		bp->b_dotp = bp->b_dotp->l_fp;
+		bp->b_dotp = lforw(bp->b_dotp);
 		bp->b_doto = 0;
 
 		/* if displayed buffer, reset window ptr vars */
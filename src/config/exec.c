@@ -7,6 +7,7 @@
 #include "efunc.h"
 #include "string_utils.h"
 #include "line.h"
+#include "line_index.h"
 #include "memory.h"
 #include "error.h"
 
@@ -477,7 +478,7 @@ int dobuf(struct buffer *bp)
 static int scan_while_blocks(struct buffer *bp, struct exec_state *state)
 {
 	struct line *hlp = bp->b_linep;
-	struct line *lp = hlp->l_fp;
+	struct line *lp = lforw(hlp);
 	struct while_block *whtemp;
 	char *eline;
 	int i;
@@ -491,7 +492,7 @@ static int scan_while_blocks(struct buffer *bp, struct exec_state *state)
 			++eline;
 
 		if (i <= 0) {
-			lp = lp->l_fp;
+			lp = lforw(lp);
 			continue;
 		}
 
@@ -538,7 +539,7 @@ static int scan_while_blocks(struct buffer *bp, struct exec_state *state)
 			} while (state->whlist->w_type == BTBREAK);
 		}
 
-		lp = lp->l_fp;
+		lp = lforw(lp);
 	}
 
 	// Check for unmatched WHILE blocks
@@ -561,7 +562,7 @@ static int execute_buffer_lines(struct buffer *bp, struct exec_state *state)
 	thisflag = lastflag;
 
 	ctx.hlp = bp->b_linep;
-	ctx.lp = ctx.hlp->l_fp;
+	ctx.lp = lforw(ctx.hlp);
 
 	while (ctx.lp != ctx.hlp) {
 		// Allocate and copy line
@@ -588,7 +589,7 @@ static int execute_buffer_lines(struct buffer *bp, struct exec_state *state)
 		// Skip comments and blank lines
 		if (*ctx.eline == ';' || *ctx.eline == 0) {
 			SAFE_FREE(ctx.einit);
-			ctx.lp = ctx.lp->l_fp;
+			ctx.lp = lforw(ctx.lp);
 			continue;
 		}
 
@@ -596,7 +597,7 @@ static int execute_buffer_lines(struct buffer *bp, struct exec_state *state)
 		if ((status = process_line_directive(&ctx, state, bp)) == -1) {
 			// Continue to next line
 			SAFE_FREE(ctx.einit);
-			ctx.lp = ctx.lp->l_fp;
+			ctx.lp = lforw(ctx.lp);
 			continue;
 		} else if (status != TRUE) {
 			// Error occurred
@@ -618,7 +619,7 @@ static int execute_buffer_lines(struct buffer *bp, struct exec_state *state)
 		}
 
 		SAFE_FREE(ctx.einit);
-		ctx.lp = ctx.lp->l_fp;
+		ctx.lp = lforw(ctx.lp);
 	}
 
 	return TRUE;
@@ -655,7 +656,7 @@ static int process_line_directive(struct line_context *ctx, struct exec_state *s
 	// Handle macro store
 	if (mstore) {
 		ctx->linlen = strlen(ctx->eline);
-		if ((ctx->mp = lalloc(ctx->linlen)) == NULL) {
+		if ((ctx->mp = lalloc(bstore, ctx->linlen)) == NULL) {
 			REPORT_ERROR(ERR_MEMORY, "Out of memory while storing macro");
 			return FALSE;
 		}
@@ -667,6 +668,7 @@ static int process_line_directive(struct line_context *ctx, struct exec_state *s
 		ctx->mp->l_bp = bstore->b_linep->l_bp;
 		bstore->b_linep->l_bp = ctx->mp;
 		ctx->mp->l_fp = bstore->b_linep;
+		lindex_link(bstore, ctx->mp);
 		return -1; // Continue to next line
 	}
 
@@ -756,14 +758,14 @@ static int handle_control_flow(struct line_context *ctx, struct exec_state *stat
 			if (state->execlevel == 0) {
 				ctx->eline = (char *)token(ctx->eline, golabel, NPAT);
 				linlen = strlen(golabel);
-				ctx->glp = ctx->hlp->l_fp;
+				ctx->glp = lforw(ctx->hlp);
 				while (ctx->glp != ctx->hlp) {
 					if (*ctx->glp->l_text == '*' &&
 					    (strncmp(&ctx->glp->l_text[1], golabel, linlen) == 0)) {
 						ctx->lp = ctx->glp;
 						return -1; // Continue to next line
 					}
-					ctx->glp = ctx->glp->l_fp;
+					ctx->glp = lforw(ctx->glp);
 				}
 				mlwrite("%%No such label");
 				return FALSE;
@@ -792,7 +794,7 @@ static int handle_control_flow(struct line_context *ctx, struct exec_state *stat
 					return FALSE;
 				}
 
-				ctx->lp = whtemp->w_begin->l_bp;
+				ctx->lp = lback(whtemp->w_begin);
 				return -1; // Continue to next line
 			}
 
@@ -34,6 +34,7 @@ struct name_bind names[] = {
 	{"clear-and-redraw", redraw},
 	{"clear-message-line", clrmes},
 	{"copy-region", copyregion},
+	{"count-matches", countmatches},
 #if	WORDPRO
 	{"count-words", wordcount},
 #endif
@@ -126,6 +127,7 @@ struct name_bind names[] = {
 	{"hunt-forward", forwhunt},
 	{"hunt-backward", backhunt},
 	{"help", help},
+	{"highlight-matches", hilite_matches},
 	{"i-shell", spawncli},
 #if	ISRCH
 	{"incremental-search", fisearch},
@@ -142,6 +144,7 @@ struct name_bind names[] = {
 	{"kill-region", killregion},
 	{"kill-to-end-of-line", killtext},
 	{"list-buffers", listbuffers},
+	{"list-matches", listmatches},
 	{"meta-prefix", metafn},
 	{"move-line-down", move_line_down},
 	{"move-line-up", move_line_up},
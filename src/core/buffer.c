@@ -6,10 +6,13 @@
 #include "edef.h"
 #include "efunc.h"
 #include "line.h"
+#include "line_index.h"
+#include "line_arena.h"
 #include "memory.h"
 #include "error.h"
 #include "undo.h"
 #include "string_safe.h"
+#include "μemacs/gapbuffer.h"
 
 /*
  * Hash table functions for O(1) buffer lookup by name
@@ -303,12 +306,23 @@ int namebuffer(int f, int n)
  */
 int listbuffers(int f, int n)
 {
-	struct window *wp;
-	struct buffer *bp;
 	int s;
 
 	if ((s = makelist(f)) != TRUE)
 		return s;
+	return showlist();
+}
+
+/*
+ * Show the list buffer, as built by makelist() or the other users of
+ * addline(), in a window, popping one up if it is not on the screen
+ * yet, with "." at the top of the list.
+ */
+int showlist(void)
+{
+	struct window *wp;
+	struct buffer *bp;
+
 	if (blistp->b_nwnd == 0) {	/* Not on screen yet.   */
 		if ((wp = wpopup()) == NULL) {
 			REPORT_ERROR(ERR_MEMORY, "Failed to create popup window for buffer list");
@@ -477,7 +491,7 @@ int addline(char *text)
 	int ntext;
 
 	ntext = strlen(text);
-	if ((lp = lalloc(ntext)) == NULL) {
+	if ((lp = lalloc(blistp, ntext)) == NULL) {
 		REPORT_ERROR(ERR_MEMORY, "Failed to allocate line for buffer list");
 		return FALSE;
 	}
@@ -487,6 +501,7 @@ int addline(char *text)
 	lp->l_bp = blistp->b_linep->l_bp;
 	blistp->b_linep->l_bp = lp;
 	lp->l_fp = blistp->b_linep;
+	lindex_link(blistp, lp);
 	if (blistp->b_dotp == blistp->b_linep)	/* If "." is at the end */
 		blistp->b_dotp = lp;	/* move it to new line  */
 	return TRUE;
@@ -539,7 +554,7 @@ struct buffer *bfind(char *bname, int cflag, int bflag)
 			REPORT_ERROR(ERR_MEMORY, "Failed to allocate buffer structure");
 			return NULL;
 		}
-		if ((lp = lalloc(0)) == NULL) {
+		if ((lp = lalloc(NULL, 0)) == NULL) {
 			REPORT_ERROR(ERR_MEMORY, "Failed to allocate header line for buffer");
 			SAFE_FREE(bp);
 			return NULL;
@@ -572,6 +587,10 @@ struct buffer *bfind(char *bname, int cflag, int bflag)
 		bp->b_mode = gmode;
 		bp->b_nwnd = 0;
 		bp->b_linep = lp;
+		bp->b_storage = BSTORE_LINES;
+		bp->b_gap = NULL;
+		bp->b_lindex = NULL;
+		bp->b_arena = NULL;
         safe_strcpy(bp->b_fname, "", NFILEN);
         safe_strcpy(bp->b_bname, bname, NBUFN);
 		
@@ -617,7 +636,7 @@ struct buffer *bfind(char *bname, int cflag, int bflag)
  */
 int bclear(struct buffer *bp)
 {
-	struct line *lp;
+	struct window *wp;
 	int s;
 
 	if ((bp->b_flag & BFINVS) == 0	/* Not scratch buffer.  */
@@ -625,8 +644,22 @@ int bclear(struct buffer *bp)
 	    && (s = mlyesno("Discard changes")) != TRUE)
 		return s;
 	bp->b_flag &= ~BFCHG;	/* Not changed          */
-	while ((lp = lforw(bp->b_linep)) != bp->b_linep)
-		lfree(lp);
+	lindex_free(bp);	/* Lines go wholesale       */
+	larena_release(bp);
+	bp->b_linep->l_fp = bp->b_linep;
+	bp->b_linep->l_bp = bp->b_linep;
+	bp->b_linep->l_hole = 0;	/* Unbuilt lines went too */
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != bp)
+			continue;
+		wp->w_linep = wp->w_dotp = bp->b_linep;
+		wp->w_doto = 0;
+		if (wp->w_markp != NULL) {
+			wp->w_markp = bp->b_linep;
+			wp->w_marko = 0;
+		}
+	}
+	buffer_set_storage(bp, BSTORE_LINES);	/* Drop gap text */
 	bp->b_dotp = bp->b_linep;	/* Fix "."              */
 	bp->b_doto = 0;
 	bp->b_markp = NULL;	/* Invalidate "mark"    */
@@ -640,6 +673,52 @@ int bclear(struct buffer *bp)
 	return TRUE;
 }
 
+/*
+ * Storage backend for files read from now on: the classic line list, or a
+ * gap buffer when UEMACS_STORAGE=gap is set in the environment.
+ */
+int buffer_default_storage(void)
+{
+	const char *env = getenv("UEMACS_STORAGE");
+
+	if (env != NULL && strcmp(env, "gap") == 0)
+		return BSTORE_GAP;
+	return BSTORE_LINES;
+}
+
+/*
+ * Switch the text backend of a buffer. Going to gap storage builds the gap
+ * buffer from the current lines; going back builds whatever lines were still
+ * left unbuilt in it and then drops it. Return TRUE if all looks ok.
+ */
+int buffer_set_storage(struct buffer *bp, int storage)
+{
+	if (storage == bp->b_storage)
+		return TRUE;
+	if (storage == BSTORE_LINES) {
+		if (lbuildall(bp) != TRUE) {	/* The gap text is their only copy */
+			REPORT_ERROR(ERR_MEMORY, "Failed to build lines from gap buffer storage");
+			return FALSE;
+		}
+		gap_buffer_destroy(bp->b_gap);
+		bp->b_gap = NULL;
+		bp->b_storage = BSTORE_LINES;
+		return TRUE;
+	}
+	if ((bp->b_gap = gap_buffer_create(0)) == NULL) {
+		REPORT_ERROR(ERR_MEMORY, "Failed to allocate gap buffer storage");
+		return FALSE;
+	}
+	if (gap_buffer_sync_from_lines(bp->b_gap, bp->b_linep) != GAP_BUFFER_SUCCESS) {
+		gap_buffer_destroy(bp->b_gap);
+		bp->b_gap = NULL;
+		REPORT_ERROR(ERR_MEMORY, "Failed to fill gap buffer storage");
+		return FALSE;
+	}
+	bp->b_storage = BSTORE_GAP;
+	return TRUE;
+}
+
 /*
  * Update buffer statistics incrementally for instant status line updates
  * Called when text is inserted/deleted to maintain cached counts
@@ -688,20 +767,43 @@ void buffer_get_stats_fast(struct buffer *bp, int *line_count, long *byte_count,
 		long bytes = 0;
 		int words = 0;
 		
-		lp = bp->b_linep;
-		while ((lp = lforw(lp)) != bp->b_linep) {
-			lines++;
-			bytes += lp->l_used + 1; // +1 for newline
-			
-			// Count words in line
+		if (bp->b_storage == BSTORE_GAP) {
+			// Count the gap text rather than build every line
+			char block[4096];
+			size_t size = gap_buffer_size(bp->b_gap);
+			size_t n;
 			bool in_word = false;
-			for (int i = 0; i < lp->l_used; i++) {
-				char c = lp->l_text[i];
-				if (c == ' ' || c == '\t' || c == '\n') {
-					in_word = false;
-				} else if (!in_word) {
-					in_word = true;
-					words++;
+			for (size_t pos = 0; pos < size; pos += n) {
+				n = gap_buffer_get_text(bp->b_gap, pos, sizeof(block),
+							block, sizeof(block));
+				for (size_t i = 0; i < n; i++) {
+					char c = block[i];
+					if (c == ' ' || c == '\t' || c == '\n') {
+						in_word = false;
+					} else if (!in_word) {
+						in_word = true;
+						words++;
+					}
+				}
+			}
+			lines = (int)gap_buffer_line_count(bp->b_gap) - 1;
+			bytes = (long)size;
+		} else {
+			lp = bp->b_linep;
+			while ((lp = lforw(lp)) != bp->b_linep) {
+				lines++;
+				bytes += lp->l_used + 1; // +1 for newline
+				
+				// Count words in line
+				bool in_word = false;
+				for (int i = 0; i < lp->l_used; i++) {
+					char c = lp->l_text[i];
+					if (c == ' ' || c == '\t' || c == '\n') {
+						in_word = false;
+					} else if (!in_word) {
+						in_word = true;
+						words++;
+					}
 				}
 			}
 		}
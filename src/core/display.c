@@ -15,6 +15,7 @@
 #include <time.h>
 #include <locale.h>
 #include <string.h>
+#include <limits.h>
 #include <signal.h>
 #include <pthread.h>
 
@@ -23,6 +24,10 @@
 #include "efunc.h"
 #include "profiler.h"
 #include "line.h"
+#include "line_index.h"
+#include "redraw.h"
+#include "row_diff.h"
+#include "search_highlight.h"
 #include "version.h"
 #include "wrapper.h"
 #include "utf8.h"
@@ -31,6 +36,7 @@
 #include "memory.h"
 #include "error.h"
 #include "display_ops.h"
+#include "μemacs/display_matrix.h"
 
 #include "../util/git_status.h"
 
@@ -40,7 +46,6 @@ struct video {
 	int v_bcolor;		/* current background color */
 	int v_rfcolor;		/* requested forground color */
 	int v_rbcolor;		/* requested background color */
-	_Atomic uint32_t v_checksum;  /* Fast change detection checksum */
 	unicode_t v_text[1];	/* Screen data. */
 };
 
@@ -55,36 +60,9 @@ static struct video **pscreen;		/* Physical screen. */
 
 static int displaying = TRUE;
 
-/* Fast checksum calculation for change detection optimization */
-static uint32_t video_checksum(unicode_t *text, int len)
-{
-	uint32_t hash = 2166136261U; // FNV-1a hash
-	for (int i = 0; i < len; i++) {
-		hash ^= text[i];
-		hash *= 16777619U;
-	}
-	return hash;
-}
-
-/* Update video line checksum atomically */
-static void video_update_checksum(struct video *vp)
-{
-	uint32_t checksum = video_checksum(vp->v_text, term.t_ncol);
-	atomic_store(&vp->v_checksum, checksum);
-}
+/* Rows are compared as arrays of 32-bit cells */
+static_assert(sizeof(unicode_t) == sizeof(uint32_t), "row_diff compares 32-bit cells");
 
-/* Fast comparison using checksums to avoid character-by-character scan */
-static bool video_lines_differ(struct video *vp1, struct video *vp2)
-{
-	uint32_t sum1 = atomic_load(&vp1->v_checksum);
-	uint32_t sum2 = atomic_load(&vp2->v_checksum);
-	
-	// If checksums differ, lines definitely differ
-	if (sum1 != sum2) return true;
-	
-	// Checksums match - do byte comparison to confirm (handles hash collisions)
-	return memcmp(vp1->v_text, vp2->v_text, term.t_ncol * sizeof(unicode_t)) != 0;
-}
 #if UNIX
 #include <signal.h>
 #endif
@@ -94,15 +72,20 @@ static bool video_lines_differ(struct video *vp1, struct video *vp2)
 int chg_width, chg_height;
 #endif
 
+static void resolve_selection(void);
 static int reframe(struct window *wp);
 static void updone(struct window *wp);
 static void updall(struct window *wp);
-static int scrolls(int inserts);
+static void scrolls(void);
 static void scrscroll(int from, int to, int count);
 static int texttest(int vrow, int prow);
 static int endofline(unicode_t *s, int n);
 static void updext(void);
 static int updateline(int row, struct video *vp1, struct video *vp2);
+#if	MEMMAP == 0
+static void updrow(int row, struct video *vp1, struct video *vp2, int first, int end);
+static void updflush(void);
+#endif
 static void modeline(struct window *wp);
 #if MODERN
 static void clean_statusline(struct window *wp);
@@ -142,13 +125,15 @@ void vtinit(void)
 		vp->v_flag = 0;
 		vp->v_rfcolor = 7;
 		vp->v_rbcolor = 0;
-		atomic_store(&vp->v_checksum, 0); // Initialize checksum
 		vscreen[i] = vp;
 		vp = (struct video*)safe_alloc(sizeof(struct video) + term.t_mcol*4, "physical video row", __FILE__, __LINE__);
 		vp->v_flag = 0;
-		atomic_store(&vp->v_checksum, 0); // Initialize checksum
 		pscreen[i] = vp;
 	}
+#if	MEMMAP == 0
+	/* The display matrix tracks what the terminal shows, cell by cell */
+	display_matrix_init(term.t_mrow, term.t_mcol);
+#endif
 }
 
 
@@ -242,7 +227,6 @@ static void vtputc(int c)
 	
 	if (vtcol >= 0) {
 		vp->v_text[vtcol] = c;
-		// Mark line as changed - checksum will be updated later
 		vp->v_flag |= VFCHG;
 	}
 	++vtcol;
@@ -302,7 +286,6 @@ static void vtputc_highlighted(int c)
 	/* Store character with highlight bit set */
 	if (vtcol >= 0) {
 		vp->v_text[vtcol] = c | HIGHLIGHT_BIT;
-		// Mark line as changed - checksum will be updated later
 		vp->v_flag |= VFCHG;
 	}
 	++vtcol;
@@ -332,6 +315,10 @@ int upscreen(int f, int n)
 }
 
 static int scrflags;
+static int scrhard;		/* a window was redrawn whole: rows may have moved */
+
+/* Whether matches of the search pattern are shown, as of this update() */
+static bool hlshow;
 
 /*
  * Make sure that the display is right. This is a three part process. First,
@@ -371,6 +358,8 @@ int update(int force)
 #endif
 
 	displaying = TRUE;
+	resolve_selection();
+	hlshow = hl_resolve();
 
 	/* first, propagate mode line changes to all instances of
 	   a buffer displayed in more than one window */
@@ -397,6 +386,8 @@ int update(int force)
 		if (wp->w_flag) {
 			/* if the window has changed, service it */
 			reframe(wp);	/* check the framing */
+			if (wp->w_flag & WFHARD)
+				scrhard = TRUE;
 			if (wp->w_flag & (WFKILLS | WFINS)) {
 				scrflags |=
 				    (wp->w_flag & (WFINS | WFKILLS));
@@ -436,6 +427,7 @@ int update(int force)
 	/* update the cursor and flush the buffers */
 	movecursor(currow, curcol - lbound);
 	TTflush();
+	redraw_drawn();
 	displaying = FALSE;
 #if SIGWINCH
 	while (chg_width || chg_height)
@@ -448,6 +440,29 @@ int update(int force)
 	return TRUE;
 }
 
+/*
+ * The framing half of update(), for a command whose frame is put off:
+ * each window is moved to where update() would have left it, so what
+ * the next command does does not depend on whether it was drawn.
+ */
+void updframe(void)
+{
+	struct window *wp;
+
+	if (atomic_load(&edit_transaction_depth) > 0)
+		return;
+#if	VISMAC == 0
+	if (kbdmode == PLAY)
+		return;
+#endif
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_flag) {
+			reframe(wp);
+			wp->w_force = 0;
+		}
+	}
+}
+
 /*
  * reframe:
  *	check to see if the cursor is on in the window
@@ -528,91 +543,92 @@ static int reframe(struct window *wp)
 	return TRUE;
 }
 
-/* Check if a character position is within the marked region */
-static int in_region(struct line *lp, int pos)
+/*
+ * The selection of the current window, resolved once per update() into an
+ * ordered span of line numbers. Rows are then classified against it with
+ * plain comparisons, so highlighting costs nothing per character.
+ */
+static struct {
+	struct buffer *bp;	/* Buffer holding the selection, or NULL */
+	long start_line;	/* First selected line (from 1)         */
+	long end_line;		/* Last selected line                   */
+	int start_off;		/* Offset of the first selected byte    */
+	int end_off;		/* Offset just past the selection       */
+} selspan;
+
+/* Order mark and dot of the current window into "selspan". */
+static void resolve_selection(void)
 {
 	struct window *wp = curwp;
-	struct line *markp = wp->w_markp;
-	int marko = wp->w_marko;
-	struct line *dotp = wp->w_dotp;
-	int doto = wp->w_doto;
-	
+	long markn, dotn;
+
+	selspan.bp = NULL;
 	/* No mark set or same position - no selection */
-	if (markp == NULL || (markp == dotp && marko == doto))
-		return FALSE;
-	
-	/* For single-line selections, handle directly */
-	if (markp == dotp) {
-		/* Same line - only highlight between mark and cursor */
-		if (lp != markp) return FALSE; /* Wrong line entirely */
-		
-		int start_pos = (marko < doto) ? marko : doto;
-		int end_pos = (marko < doto) ? doto : marko;
-		return (pos >= start_pos && pos < end_pos);
-	}
-	
-	/* Multi-line selection - determine line order */
-	struct line *start_line, *end_line;
-	int start_pos, end_pos;
-	int mark_before_cursor = FALSE;
-	
-	/* Find which line comes first in buffer order */
-	struct line *scan = wp->w_bufp->b_linep;
-	while ((scan = lforw(scan)) != wp->w_bufp->b_linep) {
-		if (scan == markp) {
-			mark_before_cursor = TRUE;
-			break;
-		} else if (scan == dotp) {
-			mark_before_cursor = FALSE;
-			break;
-		}
-	}
-	
-	if (mark_before_cursor) {
-		start_line = markp; start_pos = marko;
-		end_line = dotp; end_pos = doto;
-	} else {
-		start_line = dotp; start_pos = doto;
-		end_line = markp; end_pos = marko;
-	}
-	
-	/* Check position within multi-line selection */
-	if (lp == start_line) {
-		return (pos >= start_pos);
-	} else if (lp == end_line) {
-		return (pos < end_pos);
+	if (wp == NULL || wp->w_markp == NULL
+	    || (wp->w_markp == wp->w_dotp && wp->w_marko == wp->w_doto))
+		return;
+
+	markn = lindex_number(wp->w_bufp, wp->w_markp);
+	dotn = lindex_number(wp->w_bufp, wp->w_dotp);
+	if (markn < dotn || (markn == dotn && wp->w_marko < wp->w_doto)) {
+		selspan.start_line = markn; selspan.start_off = wp->w_marko;
+		selspan.end_line = dotn; selspan.end_off = wp->w_doto;
 	} else {
-		/* Check if line is between start and end */
-		struct line *between_scan = start_line;
-		while ((between_scan = lforw(between_scan)) != wp->w_bufp->b_linep && 
-		       between_scan != end_line) {
-			if (between_scan == lp)
-				return TRUE;
-		}
-		return FALSE;
+		selspan.start_line = dotn; selspan.start_off = wp->w_doto;
+		selspan.end_line = markn; selspan.end_off = wp->w_marko;
 	}
+	selspan.bp = wp->w_bufp;
 }
 
-static void show_line(struct line *lp)
+/*
+ * First line number of a run of rows of "wp" starting at "lp", or 0 when
+ * no row of the window can be selected.
+ */
+static long selection_lnum(struct window *wp, struct line *lp)
+{
+	if (selspan.bp == NULL || wp->w_bufp != selspan.bp || lp == wp->w_bufp->b_linep)
+		return 0;
+	return lindex_number(wp->w_bufp, lp);
+}
+
+/*
+ * Selected byte range [*from, *to) of line number "lnum"; an empty range
+ * when the line is outside the selection.
+ */
+static void selection_row(long lnum, int *from, int *to)
+{
+	*from = 0;
+	*to = 0;
+	if (lnum == 0 || lnum < selspan.start_line || lnum > selspan.end_line)
+		return;
+	if (lnum == selspan.start_line)
+		*from = selspan.start_off;
+	*to = (lnum == selspan.end_line) ? selspan.end_off : INT_MAX;
+}
+
+/*
+ * Put line "lp" of window "wp" to the virtual screen, highlighting the
+ * bytes in [sel_from, sel_to) and, with highlight-matches on, the matches
+ * of the search pattern.
+ */
+static void show_line(struct window *wp, struct line *lp, int sel_from, int sel_to)
 {
 	int i = 0, len = llength(lp);
-	int in_selection = FALSE;
-	
-	/* Only apply selection highlighting to content lines in the current window */
-	/* Also ensure this line belongs to the current window's buffer */
-	int apply_highlighting = (curwp != NULL && curwp->w_markp != NULL && 
-	                         lp != NULL && lp != curwp->w_bufp->b_linep);
+	const struct hl_span *hl = NULL;
+	int nhl = hlshow ? hl_line(wp->w_bufp, lp, &hl) : 0;
 
 	while (i < len) {
 		unicode_t c;
 		int bytes = utf8_to_unicode(lp->l_text, i, len, &c);
-		int char_in_selection = apply_highlighting ? in_region(lp, i) : FALSE;
-		
-		/* Apply highlighting by modifying character representation */
-		if (char_in_selection != in_selection) {
-			in_selection = char_in_selection;
+		int in_selection = (i >= sel_from && i < sel_to);
+
+		while (nhl > 0 && hl->to <= i) {
+			++hl;
+			--nhl;
 		}
-		
+		if (nhl > 0 && i >= hl->from)
+			in_selection = TRUE;
+
 		// Filter control characters that corrupt terminal display
 		if (c == '\r') {
 			// Skip carriage returns - they show as ^M and corrupt display
@@ -649,6 +665,7 @@ static void updone(struct window *wp)
 {
 	struct line *lp;	/* line to update */
 	int sline;	/* physical screen line to update */
+	int from, to;	/* selected part of the line */
 
 	/* search down the line we want */
 	lp = wp->w_linep;
@@ -662,7 +679,8 @@ static void updone(struct window *wp)
 	vscreen[sline]->v_flag |= VFCHG;
 	vscreen[sline]->v_flag &= ~VFREQ;
 	vtmove(sline, 0);
-	show_line(lp);
+	selection_row(selection_lnum(wp, lp), &from, &to);
+	show_line(wp, lp, from, to);
 	vscreen[sline]->v_rfcolor = wp->w_fcolor;
 	vscreen[sline]->v_rbcolor = wp->w_bcolor;
 	vteeol();
@@ -678,9 +696,12 @@ static void updall(struct window *wp)
 {
 	struct line *lp;	/* line to update */
 	int sline;	/* physical screen line to update */
+	long lnum;	/* its line number, 0 if it can't be selected */
+	int from, to;	/* selected part of the line */
 
 	/* search down the lines, updating them */
 	lp = wp->w_linep;
+	lnum = selection_lnum(wp, lp);
 	sline = wp->w_toprow;
 	while (sline < wp->w_toprow + wp->w_ntrows) {
 
@@ -690,8 +711,11 @@ static void updall(struct window *wp)
 		vtmove(sline, 0);
 		if (lp != wp->w_bufp->b_linep) {
 			/* if we are not at the end */
-			show_line(lp);
+			selection_row(lnum, &from, &to);
+			show_line(wp, lp, from, to);
 			lp = lforw(lp);
+			if (lnum)
+				++lnum;
 		}
 
 		/* on to the next one */
@@ -733,26 +757,18 @@ void updpos(void)
 }
 
 /*
- * Atomic line number cache for instant status line updates
+ * Line number of dot for the status line. The buffer's line index answers
+ * in O(log n), so it is asked on every call; edits above dot can not leave
+ * a stale number behind. The result is still published in w_line_cache.
  */
 int get_line_number_cached(struct window *wp)
 {
 	if (!wp || !wp->w_dotp) return 1;
 	
-	// Check if cache is clean and current
-	bool cache_dirty = atomic_load(&wp->w_line_cache_dirty);
-	if (!cache_dirty) {
-		int cached_line = atomic_load(&wp->w_line_cache);
-		if (cached_line > 0) return cached_line;  // Ensure never return 0
-	}
-	
-	// Cache miss - calculate from scratch
-	int current_line = 1;
-	struct line *lp = wp->w_bufp->b_linep->l_fp;
-	while (lp != wp->w_dotp && lp != wp->w_bufp->b_linep) {
-		current_line++;
-		lp = lp->l_fp;
-	}
+	struct buffer *bp = wp->w_bufp;
+	int current_line = wp->w_dotp == bp->b_linep
+		? (int)lindex_count(bp) + 1
+		: (int)lindex_number(bp, wp->w_dotp);
 	
 	// Ensure we never cache or return 0
 	if (current_line <= 0) current_line = 1;
@@ -791,8 +807,11 @@ void upddex(void)
 			if (vscreen[i]->v_flag & VFEXT) {
 				if ((wp != curwp) || (lp != wp->w_dotp) ||
 				    (curcol < term.t_ncol - 1)) {
+					int from, to;
+
 					vtmove(i, 0);
-					show_line(lp);
+					selection_row(selection_lnum(wp, lp), &from, &to);
+					show_line(wp, lp, from, to);
 					vteeol();
 
 					/* this line no longer is extended */
@@ -834,8 +853,13 @@ void updgar(void)
 
 	movecursor(0, 0);	/* Erase the screen. */
 	(*term.t_eeop) ();
+#if	MEMMAP == 0
+	display_matrix_reset(gfcolor, gbcolor);
+#endif
 	sgarbf = FALSE;		/* Erase-page clears */
 	mpresf = FALSE;		/* the message area. */
+	scrflags = 0;		/* nothing left on screen to scroll */
+	scrhard = FALSE;
 	mlerase();		/* needs to be cleared if colored */
 }
 
@@ -850,160 +874,319 @@ int updupd(int force)
 	struct video *vp1;
 	int i;
 
-	if (scrflags & WFKILLS)
-		scrolls(FALSE);
-	if (scrflags & WFINS)
-		scrolls(TRUE);
+#if SCROLLCODE
+	if (scrflags || scrhard)
+		scrolls();
+#endif
 	scrflags = 0;
+	scrhard = FALSE;
 
 	for (i = 0; i < term.t_nrow; ++i) {
 		vp1 = vscreen[i];
 
 		/* for each line that needs to be updated */
 		if ((vp1->v_flag & VFCHG) != 0) {
-			// Update checksum after content changes
-			video_update_checksum(vp1);
-			
-			// Use checksum-optimized comparison before expensive update
-			if (!force && !video_lines_differ(vp1, pscreen[i])) {
-				vp1->v_flag &= ~VFCHG; // Clear change flag - lines are identical
+			int end;
+			int first = rdiff_span(vp1->v_text, pscreen[i]->v_text, term.t_ncol, &end);
+
+			if (!force && first < 0) {
+				vp1->v_flag &= ~VFCHG;	/* redrawn as it was */
+#if	MEMMAP == 0
+			} else if (global_display_matrix) {
+				if (force || first < 0) {
+					first = 0;
+					end = term.t_ncol;
+				}
+				updrow(i, vp1, pscreen[i], first, end);
+#endif
 			} else {
 				updateline(i, vp1, pscreen[i]);
 			}
 		}
 	}
+#if	MEMMAP == 0
+	updflush();
+#endif
 	return TRUE;
 }
 
 #if SCROLLCODE
 
 /*
- * optimize out scrolls (line breaks, and newlines)
- * arg. chooses between looking for inserts or deletes
+ * Rows that moved on the screen are moved on the terminal by scrolling,
+ * where that costs fewer bytes than drawing them again. As in the
+ * hashmap of ncurses, each row is hashed; a row that appears once on
+ * the physical screen and once on the virtual one, at another place,
+ * anchors a block that moved, and the block is grown over the rows
+ * around it that moved with it. Each block is priced with the bytes of
+ * the rows it would leave to redraw against those it saves and what
+ * the terminal says the scroll costs. One that pays is scrolled, and
+ * the search is made again over the rows as the terminal now has them,
+ * until no scroll pays: several blocks can so move in one update.
  */
-static int scrolls(int inserts)
-{				/* returns true if it does something */
-	struct video *vpv;	/* virtual screen image */
-	struct video *vpp;	/* physical screen image */
-	int i, j, k;
-	int rows, cols;
-	int first, match, count, target, end;
-	int longmatch, longcount;
-	int from, to;
 
-	if (!term.t_scroll)	/* no way to scroll */
-		return FALSE;
+#define SCROLL_MOVE	6	/* cursor move before a row is drawn, in bytes */
 
-	rows = term.t_nrow;
-	cols = term.t_ncol;
+/* Rows "from" on of the physical screen are wanted at "to" on */
+struct hunk {
+	int from;
+	int to;
+	int count;
+	int gain;		/* bytes saved by scrolling them there */
+};
 
-	first = -1;
-	for (i = 0; i < rows; i++) {	/* find first wrong line */
-		if (!texttest(i, i)) {
-			first = i;
-			break;
-		}
+static uint32_t *scr_vhash;	/* hash of each virtual row */
+static uint32_t *scr_phash;	/* ... and physical one */
+static int *scr_oldnum;		/* physical row each virtual one was, or -1 */
+static int *scr_cost;		/* bytes to draw each row as it is */
+static int *scr_slot;		/* hash table of rows: physical row + 1 */
+static int *scr_vslot;		/* ... and virtual row + 1 */
+static struct video **scr_tmp;	/* rows of a region being turned round */
+static uint32_t *scr_tmph;	/* ... and their hashes */
+static int scr_rows;
+
+static uint32_t rowhash(const unicode_t *s, int n)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+
+	for (int i = 0; i < n; i++) {
+		h ^= s[i];
+		h *= 16777619u;
 	}
+	return h;
+}
 
-	if (first < 0)
-		return FALSE;	/* no text changes */
+/* Bytes to draw virtual row "v" over what physical row "p" shows */
+static int rowcost(int v, struct video *pp)
+{
+	int end;
+	int first = rdiff_span(vscreen[v]->v_text, pp->v_text, term.t_ncol, &end);
 
-	vpv = vscreen[first];
-	vpp = pscreen[first];
+	return first < 0 ? 0 : SCROLL_MOVE + end - first;
+}
 
-	if (inserts) {
-		/* determine types of potential scrolls */
-		end = endofline(vpv->v_text, cols);
-		if (end == 0)
-			target = first;	/* newlines */
-		else if (memcmp(vpp->v_text, vpv->v_text, 4*end) == 0)
-			target = first + 1;	/* broken line newlines */
-		else
-			target = first;
-	} else {
-		target = first + 1;
-	}
-
-	/* find the matching shifted area */
-	match = -1;
-	longmatch = -1;
-	longcount = 0;
-	from = target;
-	for (i = from + 1; i < rows - longcount /* P.K. */ ; i++) {
-		if (inserts ? texttest(i, from) : texttest(from, i)) {
-			match = i;
-			count = 1;
-			for (j = match + 1, k = from + 1;
-			     j < rows && k < rows; j++, k++) {
-				if (inserts ? texttest(j, k) :
-				    texttest(k, j))
-					count++;
-				else
-					break;
-			}
-			if (longcount < count) {
-				longcount = count;
-				longmatch = match;
-			}
+/* Bytes to draw virtual row "v" on a blank row */
+static int blankcost(int v)
+{
+	int n = endofline(vscreen[v]->v_text, term.t_ncol);
+
+	return n ? SCROLL_MOVE + n : 0;
+}
+
+/* Bytes the terminal takes to move the "count" rows at "from" to "to" */
+static int scrollcost(int from, int to, int count)
+{
+	if (term.t_scrcost)
+		return (*term.t_scrcost)(from, to, count);
+	return 2 * SCROLL_MOVE + 4 * abs(from - to);
+}
+
+static bool scroll_room(int rows)
+{
+	if (rows <= scr_rows)
+		return true;
+	SAFE_FREE(scr_vhash);
+	SAFE_FREE(scr_phash);
+	SAFE_FREE(scr_oldnum);
+	SAFE_FREE(scr_cost);
+	SAFE_FREE(scr_slot);
+	SAFE_FREE(scr_vslot);
+	SAFE_FREE(scr_tmp);
+	SAFE_FREE(scr_tmph);
+	scr_rows = 0;
+	scr_vhash = safe_alloc(rows * sizeof(uint32_t), "scroll hashes", __FILE__, __LINE__);
+	scr_phash = safe_alloc(rows * sizeof(uint32_t), "scroll hashes", __FILE__, __LINE__);
+	scr_oldnum = safe_alloc(rows * sizeof(int), "scroll rows", __FILE__, __LINE__);
+	scr_cost = safe_alloc(rows * sizeof(int), "scroll costs", __FILE__, __LINE__);
+	scr_slot = safe_alloc(2 * rows * sizeof(int), "scroll table", __FILE__, __LINE__);
+	scr_vslot = safe_alloc(2 * rows * sizeof(int), "scroll table", __FILE__, __LINE__);
+	scr_tmp = safe_alloc(rows * sizeof(struct video *), "scroll rows", __FILE__, __LINE__);
+	scr_tmph = safe_alloc(rows * sizeof(uint32_t), "scroll hashes", __FILE__, __LINE__);
+	if (!scr_vhash || !scr_phash || !scr_oldnum || !scr_cost || !scr_slot ||
+	    !scr_vslot || !scr_tmp || !scr_tmph)
+		return false;
+	scr_rows = rows;
+	return true;
+}
+
+/*
+ * Pair off the rows found once on each screen, through a hash table of
+ * 2 * rows slots: a slot holds the physical row with that hash and the
+ * virtual one, or -1 where there is more than one of either.
+ */
+static void scroll_anchor(int rows)
+{
+	int size = 2 * rows;
+	int i, k;
+
+	for (k = 0; k < size; k++)
+		scr_slot[k] = scr_vslot[k] = 0;
+	for (i = 0; i < rows; i++) {
+		for (k = scr_phash[i] % size; scr_slot[k] != 0; k = (k + 1) % size) {
+			if (scr_slot[k] > 0 && scr_phash[scr_slot[k] - 1] == scr_phash[i])
+				break;
+			if (scr_slot[k] < 0 && scr_phash[-scr_slot[k] - 1] == scr_phash[i])
+				break;
 		}
+		scr_slot[k] = scr_slot[k] == 0 ? i + 1 : -abs(scr_slot[k]);
 	}
-	match = longmatch;
-	count = longcount;
-
-	if (!inserts) {
-		/* full kill case? */
-		if (match > 0 && texttest(first, match - 1)) {
-			target--;
-			match--;
-			count++;
+	for (i = 0; i < rows; i++) {
+		scr_oldnum[i] = -1;
+		for (k = scr_vhash[i] % size; scr_slot[k] != 0; k = (k + 1) % size) {
+			if (scr_phash[abs(scr_slot[k]) - 1] == scr_vhash[i])
+				break;
 		}
+		if (scr_slot[k] == 0)
+			continue;	/* not on the physical screen */
+		scr_vslot[k] = scr_vslot[k] == 0 ? i + 1 : -1;
 	}
+	for (k = 0; k < size; k++) {
+		if (scr_slot[k] > 0 && scr_vslot[k] > 0 &&
+		    texttest(scr_vslot[k] - 1, scr_slot[k] - 1))
+			scr_oldnum[scr_vslot[k] - 1] = scr_slot[k] - 1;
+	}
+}
 
-	/* do the scroll */
-	if (match > 0 && count > 2) {	/* got a scroll */
-		/* move the count lines starting at target to match */
-		if (inserts) {
-			from = target;
-			to = match;
-		} else {
-			from = match;
-			to = target;
+/* Grow each block over the rows next to it that moved with it */
+static void scroll_grow(int rows)
+{
+	int i, j;
+
+	for (i = 0; i + 1 < rows; i++) {
+		j = scr_oldnum[i] + 1;
+		if (scr_oldnum[i] >= 0 && scr_oldnum[i + 1] < 0 && j < rows &&
+		    scr_vhash[i + 1] == scr_phash[j] && texttest(i + 1, j))
+			scr_oldnum[i + 1] = j;
+	}
+	for (i = rows - 1; i > 0; i--) {
+		j = scr_oldnum[i] - 1;
+		if (scr_oldnum[i] >= 0 && scr_oldnum[i - 1] < 0 && j >= 0 &&
+		    scr_vhash[i - 1] == scr_phash[j] && texttest(i - 1, j))
+			scr_oldnum[i - 1] = j;
+	}
+}
+
+/* Price the block of "count" rows wanted at "to" from physical row "from" */
+static int scroll_gain(int from, int to, int count)
+{
+	int lo = from < to ? from : to;
+	int hi = (from < to ? to : from) + count;
+	int gain = -scrollcost(from, to, count);
+	int r;
+
+	/* every row in the region but those moved into place is redrawn */
+	for (r = lo; r < hi; r++) {
+		gain += scr_cost[r];
+		if (r < to || r >= to + count)
+			gain -= blankcost(r);
+	}
+	return gain;
+}
+
+/*
+ * The next block to scroll of those that pay; false if none does. Blocks
+ * going up are taken from the top down and then those going down from
+ * the bottom up, so that no scroll covers rows another is still to move.
+ */
+static bool scroll_next(int rows, struct hunk *next)
+{
+	struct hunk h;
+	int i;
+
+	next->gain = 0;
+	for (i = 0; i < rows; i++)
+		scr_cost[i] = rowcost(i, pscreen[i]);
+	scroll_anchor(rows);
+	scroll_grow(rows);
+	for (i = 0; i < rows; ) {
+		if (scr_oldnum[i] < 0 || scr_oldnum[i] == i) {
+			i++;
+			continue;
 		}
-		if (2 * count < abs(from - to))
-			return FALSE;
-		scrscroll(from, to, count);
-		for (i = 0; i < count; i++) {
-			vpp = pscreen[to + i];
-			vpv = vscreen[to + i];
-			memcpy(vpp->v_text, vpv->v_text, 4*cols);
-			vpp->v_flag = vpv->v_flag;	/* XXX */
-			if (vpp->v_flag & VFREV) {
-				vpp->v_flag &= ~VFREV;
-				vpp->v_flag |= ~VFREQ;
-			}
-#if	MEMMAP
-			vscreen[to + i]->v_flag &= ~VFCHG;
+		h.from = scr_oldnum[i];
+		h.to = i;
+		while (++i < rows && scr_oldnum[i] == h.from + (i - h.to))
+			;
+		h.count = i - h.to;
+		h.gain = scroll_gain(h.from, h.to, h.count);
+		if (h.gain <= 0)
+			continue;
+		*next = h;
+		if (h.to < h.from)
+			break;		/* the topmost going up */
+	}
+	return next->gain > 0;
+}
+
+/*
+ * Scroll a block on the terminal, and make the physical screen and the
+ * display matrix follow: the rows of the region turn round by the
+ * distance moved, and those the block uncovered are blank.
+ */
+static void scroll_do(const struct hunk *h)
+{
+	int lo = h->from < h->to ? h->from : h->to;
+	int len = h->count + abs(h->to - h->from);
+	int d = h->to - h->from;
+	int i, k, r;
+
+	scrscroll(h->from, h->to, h->count);
+#if	MEMMAP == 0
+	/* the display matrix follows the lines the terminal moved */
+	if (h->from < h->to) {
+		for (i = h->count - 1; i >= 0; i--)
+			display_matrix_copy_line(h->from + i, h->to + i);
+	} else {
+		for (i = 0; i < h->count; i++)
+			display_matrix_copy_line(h->from + i, h->to + i);
+	}
 #endif
-		}
-		if (inserts) {
-			from = target;
-			to = match;
-		} else {
-			from = target + count;
-			to = match + count;
-		}
+	for (k = 0; k < len; k++) {
+		scr_tmp[k] = pscreen[lo + k];
+		scr_tmph[k] = scr_phash[lo + k];
+	}
+	for (k = 0; k < len; k++) {
+		i = ((k - d) % len + len) % len;
+		pscreen[lo + k] = scr_tmp[i];
+		scr_phash[lo + k] = scr_tmph[i];
+	}
+	for (r = lo; r < lo + len; r++) {
+		if (r >= h->to && r < h->to + h->count)
+			continue;
+		for (i = 0; i < term.t_ncol; ++i)
+			pscreen[r]->v_text[i] = ' ';
+		scr_phash[r] = rowhash(pscreen[r]->v_text, term.t_ncol);
+		vscreen[r]->v_flag |= VFCHG;
 #if	MEMMAP == 0
-		for (i = from; i < to; i++) {
-			unicode_t *txt;
-			txt = pscreen[i]->v_text;
-			for (j = 0; j < term.t_ncol; ++j)
-				txt[j] = ' ';
-			vscreen[i]->v_flag |= VFCHG;
-		}
+		display_matrix_blank_line(r, gfcolor, gbcolor);
 #endif
-		return TRUE;
 	}
-	return FALSE;
+}
+
+/*
+ * optimize out scrolls (line breaks, newlines, paging): move the rows
+ * that moved, as many blocks of them as pay
+ */
+static void scrolls(void)
+{
+	struct hunk h;
+	int rows = term.t_nrow;
+	int changed = 0;
+	int i;
+
+	if (!term.t_scroll)	/* no way to scroll */
+		return;
+	for (i = 0; i < rows; i++)
+		changed += !texttest(i, i);
+	if (changed < 2 || !scroll_room(rows))
+		return;		/* nothing that moved */
+
+	for (i = 0; i < rows; i++) {
+		scr_vhash[i] = rowhash(vscreen[i]->v_text, term.t_ncol);
+		scr_phash[i] = rowhash(pscreen[i]->v_text, term.t_ncol);
+	}
+	for (i = 0; i < rows && scroll_next(rows, &h); i++)
+		scroll_do(&h);
 }
 
 /* move the "count" lines starting at "from" to "to" */
@@ -1051,6 +1234,7 @@ static void updext(void)
 {
 	int rcursor;	/* real cursor location */
 	struct line *lp;	/* pointer to current line */
+	int from, to;	/* selected part of the line */
 
 	/* calculate what column the real cursor will end up in */
 	rcursor = ((curcol - term.t_ncol) % term.t_scrsiz) + term.t_margin;
@@ -1060,7 +1244,8 @@ static void updext(void)
 	/* once we reach the left edge                                  */
 	vtmove(currow, -lbound);	/* start scanning offscreen */
 	lp = curwp->w_dotp;	/* line to output */
-	show_line(lp);
+	selection_row(selection_lnum(curwp, lp), &from, &to);
+	show_line(curwp, lp, from, to);
 
 	/* truncate the virtual line, restore tab offset */
 	vteeol();
@@ -1151,6 +1336,7 @@ static int updateline(int row, struct video *vp1, struct video *vp2)
 	unicode_t *cp3;
 	unicode_t *cp4;
 	unicode_t *cp5;
+	int first, end;	/* span of the line that differs */
 	int nbflag;	/* non-blanks to the right flag? */
 	int rev;		/* reverse video flag */
 	int req;		/* reverse video request flag */
@@ -1216,11 +1402,8 @@ static int updateline(int row, struct video *vp1, struct video *vp2)
 	}
 #endif
 
-	/* advance past any common chars at the left */
-	while (cp1 != &vp1->v_text[term.t_ncol] && cp1[0] == cp2[0]) {
-		++cp1;
-		++cp2;
-	}
+	/* find the common chars at the left and at the right */
+	first = rdiff_span(vp1->v_text, vp2->v_text, term.t_ncol, &end);
 
 /* This can still happen, even though we only call this routine on changed
  * lines. A hard update is always done when a line splits, a massive
@@ -1229,21 +1412,21 @@ static int updateline(int row, struct video *vp1, struct video *vp2)
  * be hard operations that do a lot of update, so I don't really care.
  */
 	/* if both lines are the same, no update needs to be done */
-	if (cp1 == &vp1->v_text[term.t_ncol]) {
+	if (first < 0) {
 		vp1->v_flag &= ~VFCHG;	/* flag this line is changed */
 		return TRUE;
 	}
+	cp1 += first;
+	cp2 += first;
 
-	/* find out if there is a match on the right */
+	/* note if there is a nonblank in the match on the right */
 	nbflag = FALSE;
-	cp3 = &vp1->v_text[term.t_ncol];
-	cp4 = &vp2->v_text[term.t_ncol];
-
-	while (cp3[-1] == cp4[-1]) {
-		--cp3;
-		--cp4;
-		if (cp3[0] != ' ')	/* Note if any nonblank */
-			nbflag = TRUE;	/* in right match. */
+	cp3 = &vp1->v_text[end];
+	for (cp4 = cp3; cp4 != &vp1->v_text[term.t_ncol]; ++cp4) {
+		if (*cp4 != ' ') {
+			nbflag = TRUE;
+			break;
+		}
 	}
 
 	cp5 = cp3;
@@ -1294,13 +1477,125 @@ static int updateline(int row, struct video *vp1, struct video *vp2)
 	TTrev(FALSE);
 #endif
 	vp1->v_flag &= ~VFCHG;	/* flag this line as updated */
-	
-	// Update physical screen checksum after copying data
-	video_update_checksum(vp2);
-	
 	return TRUE;
 #endif
 }
+
+/*
+ * updrow:
+ *	render the cells "first" up to "end" of a changed row of the
+ *	virtual screen, the span in which it differs from the physical
+ *	one, into the display matrix, which marks the cells that differ
+ *	from the terminal. A change of reverse video or colour renders
+ *	the whole row.
+ *
+ * int row;		row of screen to update
+ * struct video *vp1;	virtual screen image
+ * struct video *vp2;	physical screen image
+ */
+static void updrow(int row, struct video *vp1, struct video *vp2, int first, int end)
+{
+	unicode_t c;
+	uint8_t attr;
+	int col;
+
+	attr = (vp1->v_flag & VFREQ) ? ATTR_REVERSE : ATTR_NORMAL;
+	if (((vp1->v_flag & VFREV) != 0) != (attr == ATTR_REVERSE) ||
+	    vp1->v_fcolor != vp1->v_rfcolor || vp1->v_bcolor != vp1->v_rbcolor) {
+		first = 0;
+		end = term.t_ncol;
+	}
+	for (col = first; col < end; ++col) {
+		c = vp1->v_text[col];
+		display_matrix_set_cell(row, col, c & ~HIGHLIGHT_BIT,
+					(c & HIGHLIGHT_BIT) ? ATTR_REVERSE : attr,
+					vp1->v_rfcolor, vp1->v_rbcolor);
+	}
+	memcpy(&vp2->v_text[first], &vp1->v_text[first], (end - first) * sizeof(unicode_t));
+
+	vp1->v_flag &= ~VFCHG;
+	if (attr == ATTR_REVERSE)
+		vp1->v_flag |= VFREV;
+	else
+		vp1->v_flag &= ~VFREV;
+	vp1->v_fcolor = vp1->v_rfcolor;
+	vp1->v_bcolor = vp1->v_rbcolor;
+}
+
+/*
+ * updspan:
+ *	write the cells "col" up to "end" of a row, switching reverse
+ *	video only where a run of equal attributes ends
+ */
+static void updspan(int row, int col, int end)
+{
+	struct display_cell *cell;
+	int rev = FALSE;
+	int want;
+
+	movecursor(row, col);
+	for (; col < end; ++col) {
+		cell = display_matrix_get_cell(row, col);
+		want = (cell->attr & ATTR_REVERSE) != 0;
+		if (want != rev) {
+			rev = want;
+			TTrev(rev);
+		}
+		TTputc(cell->codepoint);
+		++ttcol;
+	}
+	if (rev)
+		TTrev(FALSE);
+}
+
+/*
+ * updflush:
+ *	send the dirty cells of the display matrix to the terminal. Each
+ *	row is written in spans around its dirty cells only; a span that
+ *	runs into the blank tail of the row is cut short with an erase to
+ *	end of line when that is fewer characters.
+ */
+static void updflush(void)
+{
+	struct display_cell *cell;
+	int row, col, end, blank;
+
+	if (!display_matrix_needs_update())
+		return;
+
+	for (row = 0; row < term.t_nrow; ++row) {
+		if (!display_matrix_is_line_dirty(row))
+			continue;
+
+		/* find where the trailing blanks of the row begin */
+		blank = term.t_ncol;
+		while (blank > 0) {
+			cell = display_matrix_get_cell(row, blank - 1);
+			if (cell->codepoint != ' ' || cell->attr != ATTR_NORMAL)
+				break;
+			--blank;
+		}
+
+		cell = display_matrix_get_cell(row, 0);
+		TTforg(cell->fg_color);
+		TTbacg(cell->bg_color);
+
+		col = 0;
+		while ((col = display_matrix_dirty_span(row, col, term.t_ncol, &end)) >= 0) {
+			if (eolexist == TRUE && end - blank > 3) {
+				if (col < blank)
+					updspan(row, col, blank);
+				else
+					movecursor(row, col);
+				TTeeol();
+				break;
+			}
+			updspan(row, col, end);
+			col = end;
+		}
+	}
+	display_matrix_commit_updates();
+}
 #endif
 
 /*
@@ -1410,10 +1705,8 @@ static void modeline(struct window *wp)
 	long file_bytes;
 	int word_count;
 	
-	// Fast line number calculation - only count to current position
-	struct line *lp = bp->b_linep;
-	while ((lp = lforw(lp)) != wp->w_dotp && lp != bp->b_linep)
-		current_line++;
+	// Line number from the buffer's line index
+	current_line = get_line_number_cached(wp);
 	
 	// Get cached file statistics instantly (O(1) operation)
 	buffer_get_stats_fast(bp, &total_lines, &file_bytes, &word_count);
@@ -1478,19 +1771,12 @@ static void modeline(struct window *wp)
 			}
 		}
 		if (!msg) {
-			struct line *lp;
-			int numlines, predlines, ratio;
-
-			lp = lforw(bp->b_linep);
-			numlines = 0;
-			predlines = 0;
-			while (lp != bp->b_linep) {
-				if (lp == wp->w_linep) {
-					predlines = numlines;
-				}
-				++numlines;
-				lp = lforw(lp);
-			}
+			long numlines, predlines;
+			int ratio;
+
+			numlines = lindex_count(bp);
+			predlines = wp->w_linep == bp->b_linep
+				? numlines : lindex_number(bp, wp->w_linep) - 1;
 			if (wp->w_dotp == bp->b_linep) {
 				msg = " Bot ";
 			} else {
@@ -1531,19 +1817,15 @@ void upmode(void)
  */
 void movecursor(int row, int col)
 {
-	// CRITICAL FIX: Signal masking during cursor coordinate updates
-	// Prevents SIGWINCH and other interrupts from corrupting cursor position
-	sigset_t oldmask, mask;
-	sigfillset(&mask);
-	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
-	
+	/* The driver reads ttrow and ttcol for where the cursor comes from.
+	 * Only the editor thread touches them; sizesignal() sets a flag and
+	 * no more, so there is nothing to mask signals against.
+	 */
 	if (row != ttrow || col != ttcol) {
+		TTmove(row, col);
 		ttrow = row;
 		ttcol = col;
-		TTmove(row, col);
 	}
-	
-	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 }
 
 /*
@@ -1837,15 +2119,7 @@ static int newscreensize(int h, int w)
 /* Helper function to count total lines in buffer */
 static int getlinecount_modern(struct buffer *bp)
 {
-	struct line *lp;
-	int count = 0;
-	
-	lp = lforw(bp->b_linep);
-	while (lp != bp->b_linep) {
-		count++;
-		lp = lforw(lp);
-	}
-	return count;
+	return (int)lindex_count(bp);
 }
 
 // Clean statusline matching user's lightline format
@@ -98,6 +98,19 @@ void display_matrix_destroy(void) {
     SAFE_FREE(global_display_matrix);
 }
 
+// Drop the list of dirty regions
+void dirty_region_clear_all(void) {
+    if (!global_display_matrix) return;
+    
+    struct dirty_region *region = global_display_matrix->dirty_regions;
+    while (region) {
+        struct dirty_region *next = region->next;
+        SAFE_FREE(region);
+        region = next;
+    }
+    global_display_matrix->dirty_regions = NULL;
+}
+
 // Resize display matrix
 int display_matrix_resize(int new_rows, int new_cols) {
     if (!global_display_matrix) return DISPLAY_MATRIX_ERROR;
@@ -307,7 +320,6 @@ void display_matrix_mark_all_dirty(void) {
     }
     
     atomic_fetch_add(&global_display_matrix->generation, 1);
-    atomic_fetch_add(&global_display_matrix->full_redraws, 1);
 }
 
 // Check if cell is dirty
@@ -428,13 +440,100 @@ void display_matrix_commit_updates(void) {
     memset(global_display_matrix->line_dirty, false, global_display_matrix->rows * sizeof(bool));
     global_display_matrix->first_dirty_line = -1;
     global_display_matrix->last_dirty_line = -1;
-    global_display_matrix->full_redraw_pending = false;
     
     if (global_display_matrix->full_redraw_pending) {
         atomic_fetch_add(&global_display_matrix->full_redraws, 1);
     } else {
         atomic_fetch_add(&global_display_matrix->partial_redraws, 1);
     }
+    global_display_matrix->full_redraw_pending = false;
+}
+
+// Next span of dirty cells in a row, at or after "col" and below "width".
+// Clean gaps shorter than DISPLAY_MATRIX_SPAN_GAP are taken into the span:
+// rewriting a few cells costs less than the cursor motion to skip them.
+// Returns the first column of the span and sets *end past its last one,
+// or returns -1 when the rest of the row is clean.
+int display_matrix_dirty_span(int row, int col, int width, int *end) {
+    if (!global_display_matrix || row < 0 || row >= global_display_matrix->rows ||
+        !global_display_matrix->line_dirty[row]) {
+        return -1;
+    }
+    if (width > global_display_matrix->cols) width = global_display_matrix->cols;
+    if (col < 0) col = 0;
+    
+    struct display_cell *line = &global_display_matrix->cells[row * global_display_matrix->cols];
+    while (col < width && !(line[col].flags & CELL_DIRTY)) {
+        col++;
+    }
+    if (col >= width) return -1;
+    
+    int last = col;
+    for (int c = col + 1; c < width && c - last <= DISPLAY_MATRIX_SPAN_GAP; c++) {
+        if (line[c].flags & CELL_DIRTY) last = c;
+    }
+    *end = last + 1;
+    return col;
+}
+
+// The terminal has blanked this row by itself (erase, scroll): record it
+// as blank without scheduling any output for it
+void display_matrix_blank_line(int row, uint8_t fg, uint8_t bg) {
+    if (!global_display_matrix || row < 0 || row >= global_display_matrix->rows) {
+        return;
+    }
+    
+    struct display_cell *line = &global_display_matrix->cells[row * global_display_matrix->cols];
+    for (int col = 0; col < global_display_matrix->cols; col++) {
+        line[col].codepoint = ' ';
+        line[col].attr = ATTR_NORMAL;
+        line[col].fg_color = fg;
+        line[col].bg_color = bg;
+        line[col].flags = 0;
+    }
+    global_display_matrix->line_dirty[row] = false;
+}
+
+// Copy a row as it stands, dirty flags included, as the terminal does
+// when it scrolls a region
+void display_matrix_copy_line(int src_row, int dst_row) {
+    if (!global_display_matrix || src_row < 0 || src_row >= global_display_matrix->rows ||
+        dst_row < 0 || dst_row >= global_display_matrix->rows || src_row == dst_row) {
+        return;
+    }
+    
+    memcpy(&global_display_matrix->cells[dst_row * global_display_matrix->cols],
+           &global_display_matrix->cells[src_row * global_display_matrix->cols],
+           global_display_matrix->cols * sizeof(struct display_cell));
+    if (global_display_matrix->line_dirty[src_row]) {
+        display_matrix_mark_dirty(dst_row, -1);
+    } else {
+        global_display_matrix->line_dirty[dst_row] = false;
+    }
+}
+
+// The whole terminal has been erased: every cell is blank and clean, and
+// the next commit counts as a full redraw
+void display_matrix_reset(uint8_t fg, uint8_t bg) {
+    if (!global_display_matrix) return;
+    
+    for (int row = 0; row < global_display_matrix->rows; row++) {
+        display_matrix_blank_line(row, fg, bg);
+    }
+    global_display_matrix->first_dirty_line = -1;
+    global_display_matrix->last_dirty_line = -1;
+    global_display_matrix->full_redraw_pending = true;
+    atomic_fetch_add(&global_display_matrix->generation, 1);
+}
+
+// Read the redraw counters
+void display_matrix_get_stats(size_t *cells_updated, size_t *partial_redraws,
+                              size_t *full_redraws) {
+    struct display_matrix *dm = global_display_matrix;
+    
+    if (cells_updated) *cells_updated = dm ? atomic_load(&dm->cells_updated) : 0;
+    if (partial_redraws) *partial_redraws = dm ? atomic_load(&dm->partial_redraws) : 0;
+    if (full_redraws) *full_redraws = dm ? atomic_load(&dm->full_redraws) : 0;
 }
 
 // Scroll region up
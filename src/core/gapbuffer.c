@@ -5,9 +5,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 #include "estruct.h"
 #include "edef.h"
 #include "efunc.h"
+#include "line.h"
 #include "memory.h"
 #include "utf8.h"
 #include "../text/boyer_moore.h"
@@ -97,8 +99,8 @@ static int move_gap_to(struct gap_buffer *gb, size_t pos) {
 static int expand_gap_buffer(struct gap_buffer *gb, size_t min_additional) {
     size_t new_capacity = gb->capacity;
     
-    // Calculate new capacity using growth factor
-    while (new_capacity - gb->logical_size < min_additional) {
+    // Grow by the growth factor until the gap gains "min_additional" bytes
+    while (new_capacity - gb->capacity < min_additional) {
         new_capacity = (size_t)(new_capacity * GAP_BUFFER_GROW_FACTOR);
     }
     
@@ -123,6 +125,88 @@ static int expand_gap_buffer(struct gap_buffer *gb, size_t min_additional) {
     return GAP_BUFFER_SUCCESS;
 }
 
+// Make room for "extra" more entries in the line index
+static bool line_index_reserve(struct gap_buffer *gb, size_t extra) {
+    if (gb->line_idx.count + extra <= gb->line_idx.capacity) return true;
+
+    size_t new_capacity = gb->line_idx.capacity;
+    while (new_capacity < gb->line_idx.count + extra) {
+        new_capacity += new_capacity / 2 + LINE_INDEX_CHUNK;
+    }
+    size_t *new_offsets = SAFE_REALLOC(gb->line_idx.offsets,
+                                       new_capacity * sizeof(size_t), "gapbuffer");
+    if (!new_offsets) return false;
+    gb->line_idx.offsets = new_offsets;
+    gb->line_idx.capacity = new_capacity;
+    return true;
+}
+
+// Index of the line containing "offset" - index must be clean
+static size_t line_index_find(struct gap_buffer *gb, size_t offset) {
+    size_t left = 0;
+    size_t right = gb->line_idx.count - 1;
+
+    while (left < right) {
+        size_t mid = left + (right - left + 1) / 2;
+        if (gb->line_idx.offsets[mid] <= offset) {
+            left = mid;
+        } else {
+            right = mid - 1;
+        }
+    }
+    return left;
+}
+
+// Patch a clean line index for "len" bytes inserted at "pos"
+static void line_index_insert(struct gap_buffer *gb, size_t pos,
+                              const char *text, size_t len) {
+    if (atomic_load(&gb->line_idx.dirty)) return;
+
+    size_t newlines = 0;
+    for (const char *p = text; (p = memchr(p, '\n', (size_t)(text + len - p))) != NULL; p++) {
+        newlines++;
+    }
+    if (!line_index_reserve(gb, newlines)) {
+        atomic_store(&gb->line_idx.dirty, true);
+        return;
+    }
+
+    size_t line = line_index_find(gb, pos);
+    size_t *offsets = gb->line_idx.offsets;
+    size_t tail = gb->line_idx.count - (line + 1);
+
+    memmove(&offsets[line + 1 + newlines], &offsets[line + 1], tail * sizeof(size_t));
+    for (size_t i = line + 1 + newlines; i < gb->line_idx.count + newlines; i++) {
+        offsets[i] += len;
+    }
+
+    size_t slot = line + 1;
+    for (const char *p = text; (p = memchr(p, '\n', (size_t)(text + len - p))) != NULL; p++) {
+        offsets[slot++] = pos + (size_t)(p - text) + 1;
+    }
+    gb->line_idx.count += newlines;
+}
+
+// Patch a clean line index for "len" bytes removed at "pos"
+static void line_index_delete(struct gap_buffer *gb, size_t pos, size_t len) {
+    if (atomic_load(&gb->line_idx.dirty)) return;
+
+    size_t *offsets = gb->line_idx.offsets;
+    size_t first = line_index_find(gb, pos) + 1;
+    size_t last = first;
+
+    // Lines starting inside (pos, pos + len] lost their newline
+    while (last < gb->line_idx.count && offsets[last] <= pos + len) {
+        last++;
+    }
+    size_t tail = gb->line_idx.count - last;
+    memmove(&offsets[first], &offsets[last], tail * sizeof(size_t));
+    gb->line_idx.count -= last - first;
+    for (size_t i = first; i < gb->line_idx.count; i++) {
+        offsets[i] -= len;
+    }
+}
+
 // Insert text at specified position
 int gap_buffer_insert(struct gap_buffer *gb, size_t pos, const char *text, size_t len) {
     if (!gb || !text || pos > gb->logical_size) {
@@ -147,8 +231,8 @@ int gap_buffer_insert(struct gap_buffer *gb, size_t pos, const char *text, size_
     gb->gap_start += len;
     gb->logical_size += len;
     
-    // Invalidate caches
-    atomic_store(&gb->line_idx.dirty, true);
+    // Keep the line index current; the char cache is positional
+    line_index_insert(gb, pos, text, len);
     atomic_store(&gb->char_cache.valid, false);
     
     atomic_fetch_add(&gap_buffer_global_stats.insertions, 1);
@@ -171,13 +255,14 @@ int gap_buffer_delete(struct gap_buffer *gb, size_t pos, size_t len) {
     gb->gap_end += len;
     gb->logical_size -= len;
     
-    // Compact gap if it becomes too large
-    if (gb->gap_end - gb->gap_start > GAP_BUFFER_MAX_GAP) {
+    // Compact gap once it outweighs the text, so alternating insert and
+    // delete around an expansion does not copy the whole buffer each time
+    size_t gap_size = gb->gap_end - gb->gap_start;
+    if (gap_size > GAP_BUFFER_MAX_GAP && gap_size > gb->logical_size) {
         gap_buffer_compact(gb);
     }
     
-    // Invalidate caches
-    atomic_store(&gb->line_idx.dirty, true);
+    line_index_delete(gb, pos, len);
     atomic_store(&gb->char_cache.valid, false);
     
     atomic_fetch_add(&gap_buffer_global_stats.deletions, 1);
@@ -185,6 +270,34 @@ int gap_buffer_delete(struct gap_buffer *gb, size_t pos, size_t len) {
     return GAP_BUFFER_SUCCESS;
 }
 
+// Replace old_len bytes at pos with new_text
+int gap_buffer_replace(struct gap_buffer *gb, size_t pos, size_t old_len,
+                       const char *new_text, size_t new_len) {
+    if (!gb || !new_text || pos > gb->logical_size || pos + old_len > gb->logical_size) {
+        return GAP_BUFFER_INVALID;
+    }
+
+    // Same-size rewrites that keep every newline in place (case changes,
+    // transposes) are patched in place: no gap move, line index stays valid
+    if (old_len == new_len) {
+        bool same_lines = true;
+        for (size_t i = 0; i < old_len && same_lines; i++) {
+            same_lines = (gap_buffer_get_char(gb, pos + i) == '\n') == (new_text[i] == '\n');
+        }
+        if (same_lines) {
+            for (size_t i = 0; i < new_len; i++) {
+                gb->data[GAP_BUFFER_ACTUAL_POS(gb, pos + i)] = new_text[i];
+            }
+            atomic_fetch_add(&gb->generation, 1);
+            return GAP_BUFFER_SUCCESS;
+        }
+    }
+
+    int status = gap_buffer_delete(gb, pos, old_len);
+    if (status != GAP_BUFFER_SUCCESS) return status;
+    return gap_buffer_insert(gb, pos, new_text, new_len);
+}
+
 // Set cursor position
 int gap_buffer_set_cursor(struct gap_buffer *gb, size_t pos) {
     if (!gb || pos > gb->logical_size) {
@@ -253,43 +366,26 @@ size_t gap_buffer_get_text(struct gap_buffer *gb, size_t pos, size_t len,
 void gap_buffer_rebuild_line_index(struct gap_buffer *gb) {
     if (!gb) return;
     
-    gb->line_idx.count = 0;
     size_t gap_size = gb->gap_end - gb->gap_start;
     
     // Scan text and record line starts
     gb->line_idx.offsets[0] = 0;
     gb->line_idx.count = 1;
     
-    // Scan before gap
-    for (size_t i = 0; i < gb->gap_start; i++) {
-        if (gb->data[i] == '\n') {
-            // Ensure capacity
-            if (gb->line_idx.count >= gb->line_idx.capacity) {
-                size_t new_capacity = gb->line_idx.capacity + LINE_INDEX_CHUNK;
-                size_t *new_offsets = SAFE_REALLOC(gb->line_idx.offsets, 
-                                            new_capacity * sizeof(size_t), "gapbuffer");
-                if (!new_offsets) return; // Keep old index
-                gb->line_idx.offsets = new_offsets;
-                gb->line_idx.capacity = new_capacity;
-            }
-            gb->line_idx.offsets[gb->line_idx.count++] = i + 1;
-        }
-    }
-    
-    // Scan after gap
-    for (size_t i = gb->gap_end; i < gb->capacity; i++) {
-        if (gb->data[i] == '\n') {
-            // Ensure capacity
-            if (gb->line_idx.count >= gb->line_idx.capacity) {
-                size_t new_capacity = gb->line_idx.capacity + LINE_INDEX_CHUNK;
-                size_t *new_offsets = SAFE_REALLOC(gb->line_idx.offsets,
-                                            new_capacity * sizeof(size_t), "gapbuffer");
-                if (!new_offsets) return; // Keep old index
-                gb->line_idx.offsets = new_offsets;
-                gb->line_idx.capacity = new_capacity;
-            }
-            // Adjust offset to account for gap
-            gb->line_idx.offsets[gb->line_idx.count++] = i - gap_size + 1;
+    // Scan both spans; logical offsets after the gap are shifted back
+    const struct { size_t from, to, shift; } spans[2] = {
+        { 0, gb->gap_start, 0 },
+        { gb->gap_end, gb->capacity, gap_size },
+    };
+    for (int s = 0; s < 2; s++) {
+        const char *base = gb->data;
+        const char *p = base + spans[s].from;
+        const char *end = base + spans[s].to;
+        while (p < end && (p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+            if (!line_index_reserve(gb, 1)) return; // Keep old index
+            gb->line_idx.offsets[gb->line_idx.count++] =
+                (size_t)(p - base) - spans[s].shift + 1;
+            p++;
         }
     }
     
@@ -342,6 +438,43 @@ size_t gap_buffer_offset_to_line(struct gap_buffer *gb, size_t offset) {
     return left;
 }
 
+// Length of a line in bytes, excluding its newline
+size_t gap_buffer_line_length(struct gap_buffer *gb, size_t line_num) {
+    if (!gb || line_num >= gap_buffer_line_count(gb)) return 0;
+
+    size_t start = gb->line_idx.offsets[line_num];
+    if (line_num + 1 < gb->line_idx.count) {
+        return gb->line_idx.offsets[line_num + 1] - 1 - start;
+    }
+    return gb->logical_size - start;
+}
+
+// Contiguous view of a line; moves the gap out of the way if it splits it.
+// The pointer is valid until the next modification of the buffer.
+const char *gap_buffer_get_line(struct gap_buffer *gb, size_t line_num, size_t *length) {
+    if (!gb || line_num >= gap_buffer_line_count(gb)) {
+        if (length) *length = 0;
+        return NULL;
+    }
+
+    size_t start = gb->line_idx.offsets[line_num];
+    size_t len = gap_buffer_line_length(gb, line_num);
+    if (start < gb->gap_start && start + len > gb->gap_start) {
+        move_gap_to(gb, start + len);
+    }
+    if (length) *length = len;
+    return &gb->data[GAP_BUFFER_ACTUAL_POS(gb, start)];
+}
+
+// Make sure the gap can take "additional_capacity" bytes without growing
+int gap_buffer_reserve(struct gap_buffer *gb, size_t additional_capacity) {
+    if (!gb) return GAP_BUFFER_INVALID;
+
+    size_t gap_size = gb->gap_end - gb->gap_start;
+    if (gap_size >= additional_capacity) return GAP_BUFFER_SUCCESS;
+    return expand_gap_buffer(gb, additional_capacity - gap_size);
+}
+
 // Get buffer size (excluding gap)
 size_t gap_buffer_size(struct gap_buffer *gb) {
     return gb ? gb->logical_size : 0;
@@ -435,6 +568,70 @@ void gap_buffer_invalidate_caches(struct gap_buffer *gb) {
     atomic_fetch_add(&gb->generation, 1);
 }
 
+// Build a struct line of "bp" holding a copy of one line of text
+struct line *gap_buffer_get_line_struct(struct gap_buffer *gb, struct buffer *bp, size_t line_num) {
+    size_t len;
+    const char *text = gap_buffer_get_line(gb, line_num, &len);
+    if (!text || len > INT_MAX) return NULL;
+
+    struct line *lp = lalloc(bp, (int)len);
+    if (lp) memcpy(lp->l_text, text, len);
+    return lp;
+}
+
+// Append the text as lines to the (empty) line list of "bp".
+// Every line is newline terminated, so the final empty index entry is
+// not a line of its own; text without a final newline still yields it.
+int gap_buffer_sync_to_lines(struct gap_buffer *gb, struct buffer *bp) {
+    if (!gb || !bp || !bp->b_linep) return GAP_BUFFER_INVALID;
+
+    struct line *head = bp->b_linep;
+    size_t nlines = gap_buffer_line_count(gb);
+    if (nlines > 0 && gap_buffer_line_length(gb, nlines - 1) == 0) {
+        nlines--;
+    }
+
+    // One gap move up front makes every line contiguous
+    move_gap_to(gb, gb->logical_size);
+    for (size_t i = 0; i < nlines; i++) {
+        struct line *lp = gap_buffer_get_line_struct(gb, bp, i);
+        if (!lp) return GAP_BUFFER_OUT_OF_MEM;
+        lp->l_bp = head->l_bp;
+        lp->l_fp = head;
+        head->l_bp->l_fp = lp;
+        head->l_bp = lp;
+    }
+    return GAP_BUFFER_SUCCESS;
+}
+
+// Replace the gap buffer contents with the lines headed by head_line
+int gap_buffer_sync_from_lines(struct gap_buffer *gb, struct line *head_line) {
+    if (!gb || !head_line) return GAP_BUFFER_INVALID;
+
+    size_t total = 0;
+    for (struct line *lp = lforw(head_line); lp != head_line; lp = lforw(lp)) {
+        total += (size_t)llength(lp) + 1;
+    }
+
+    gb->gap_start = 0;
+    gb->gap_end = gb->capacity;
+    gb->logical_size = 0;
+    if (gap_buffer_reserve(gb, total) != GAP_BUFFER_SUCCESS) {
+        return GAP_BUFFER_OUT_OF_MEM;
+    }
+
+    for (struct line *lp = lforw(head_line); lp != head_line; lp = lforw(lp)) {
+        memcpy(&gb->data[gb->gap_start], lp->l_text, (size_t)llength(lp));
+        gb->gap_start += (size_t)llength(lp);
+        gb->data[gb->gap_start++] = '\n';
+    }
+    gb->logical_size = total;
+
+    gap_buffer_invalidate_caches(gb);
+    gap_buffer_rebuild_line_index(gb);
+    return GAP_BUFFER_SUCCESS;
+}
+
 #ifdef DEBUG
 // Debug: dump gap buffer statistics
 void gap_buffer_dump_stats(struct gap_buffer *gb) {
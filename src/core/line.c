@@ -35,9 +35,14 @@ static size_t temp_kill_len = 0;
 #include "utf8.h"
 #include "memory.h"
 #include "undo.h"
+#include "line_index.h"
+#include "line_arena.h"
+#include "μemacs/gapbuffer.h"
 
 #define	BLOCK_SIZE 16 /* Line block chunk size. */
 
+uint32_t line_generation;	/* Last stamp given to a line */
+
 
 /* Unicode-aware word boundary detection for I18N */
 #include <wchar.h>
@@ -69,50 +74,281 @@ static inline bool is_word_byte(int ch) {
 	return ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r';
 }
 
-// Get the line number of a line pointer in a buffer
+// Get the line number of a line pointer in a buffer (0 for the header)
 static long getlinenum(struct buffer *bp, struct line *lp) {
-    struct line *clp;
-    long lnum = 0;
-    clp = lforw(bp->b_linep);
-    while (clp != bp->b_linep) {
-        lnum++;
-        if (clp == lp) {
-            return lnum;
-        }
-        clp = lforw(clp);
-    }
-    return 0; // Should not happen
+    return lindex_number(bp, lp);
+}
+
+/*
+ * Byte offset of (lp, off) in the gap storage of "bp". Every line is one
+ * newline terminated record, so the header line maps to the end of text.
+ */
+static size_t lgapoffset(struct buffer *bp, struct line *lp, int off)
+{
+	long lnum = getlinenum(bp, lp);
+
+	if (lnum == 0)
+		return gap_buffer_size(bp->b_gap);
+	return gap_buffer_line_to_offset(bp->b_gap, (size_t)(lnum - 1)) + off;
+}
+
+/*
+ * Make room in the gap storage of the current buffer for "n" more bytes
+ * before changing its lines, so that mirroring the change cannot run out
+ * of memory half way. Returns FALSE if there is no memory for it.
+ */
+static int lgapreserve(size_t n)
+{
+	return curbp->b_storage != BSTORE_GAP
+	    || gap_buffer_reserve(curbp->b_gap, n) == GAP_BUFFER_SUCCESS;
+}
+
+/*
+ * Mirror a change of the line list into the gap storage of "bp": "dlen"
+ * bytes at "pos" are replaced by "ilen" bytes of "text". Room was made
+ * with lgapreserve() first; should the gap buffer fail all the same, the
+ * buffer drops back to plain line storage rather than keep a copy that no
+ * longer matches.
+ */
+static void lgapmirror(struct buffer *bp, size_t pos, size_t dlen,
+		       const char *text, size_t ilen)
+{
+	if (gap_buffer_replace(bp->b_gap, pos, dlen, text, ilen) != GAP_BUFFER_SUCCESS) {
+		buffer_set_storage(bp, BSTORE_LINES);
+		mlwrite("(Gap storage failed, using line storage)");
+	}
+}
+
+/*
+ * Propagate "n" bytes changed in place from (lp, off) onwards to the
+ * backing store of the current buffer. The span may cross line ends, each
+ * counting as one byte as in a region. Commands that rewrite text with
+ * lputc() call this afterwards; plain line buffers need nothing.
+ */
+void lsync(struct line *lp, int off, long n)
+{
+	char *text;
+	long len = 0;
+
+	if (curbp->b_storage != BSTORE_GAP || n <= 0)
+		return;
+	text = safe_alloc((size_t)n, "gap sync buffer", __FILE__, __LINE__);
+	if (text == NULL) {
+		buffer_set_storage(curbp, BSTORE_LINES);
+		return;
+	}
+	size_t pos = lgapoffset(curbp, lp, off);
+	while (len < n && lp != curbp->b_linep) {
+		if (off == llength(lp)) {
+			text[len++] = '\n';
+			lp = lforw(lp);
+			off = 0;
+		} else {
+			text[len++] = lp->l_text[off++];
+		}
+	}
+	lgapmirror(curbp, pos, (size_t)len, text, (size_t)len);
+	SAFE_FREE(text);
+}
+
+/*
+ * The "n" lines from "lp" on were linked into the current buffer by the
+ * caller; add their text to its gap storage. Should there be no memory
+ * for it, they are taken out of the buffer again and FALSE is returned.
+ */
+int lsyncnew(struct line *lp, int n)
+{
+	struct line *clp;
+	size_t len = 0;
+	char *text, *cp;
+	int i;
+
+	if (curbp->b_storage != BSTORE_GAP || n <= 0)
+		return TRUE;
+	for (i = 0, clp = lp; i < n; ++i, clp = clp->l_fp)
+		len += (size_t)llength(clp) + 1;
+	if ((text = safe_alloc(len, "gap sync buffer", __FILE__, __LINE__)) != NULL) {
+		for (i = 0, clp = lp, cp = text; i < n; ++i, clp = clp->l_fp) {
+			memcpy(cp, clp->l_text, (size_t)llength(clp));
+			cp += llength(clp);
+			*cp++ = '\n';
+		}
+		i = gap_buffer_insert(curbp->b_gap, lgapoffset(curbp, lp, 0), text, len);
+		SAFE_FREE(text);
+		if (i == GAP_BUFFER_SUCCESS)
+			return TRUE;
+	}
+	while (n-- > 0) {
+		clp = lp->l_fp;
+		lfree(lp);
+		lp = clp;
+	}
+	return FALSE;
+}
+
+/* Buffer whose line list "lp" is in: the index knows, or it is a header */
+static struct buffer *lbuffer(struct line *lp)
+{
+	struct buffer *bp = lindex_buffer(lp);
+
+	if (bp == NULL)
+		for (bp = bheadp; bp != NULL && bp->b_linep != lp; bp = bp->b_bufp)
+			;
+	return bp;
+}
+
+/*
+ * Build lines "k" (from 1) on of the unbuilt run after "lp" in "bp", "n"
+ * of them at most, from its gap text, and link them in. The lines of the
+ * run before line "k" stay unbuilt after "lp", and those after the last
+ * line built after that line. Returns the first line built, or NULL if
+ * there was no memory for it.
+ */
+struct line *lbuild(struct buffer *bp, struct line *lp, int k, int n)
+{
+	struct line *first = NULL;
+	struct line *last = NULL;
+	struct line *nlp;
+	int h = lp->l_hole;
+	long num;
+	int i;
+
+	if (bp->b_gap == NULL || k < 1 || k > h)
+		return NULL;
+	if (n > h - k + 1)
+		n = h - k + 1;
+	num = lindex_number(bp, lp) + k;	/* Line number of the first */
+	for (i = 0; i < n; ++i) {
+		nlp = gap_buffer_get_line_struct(bp->b_gap, bp, (size_t)(num - 1 + i));
+		if (nlp == NULL)
+			break;
+		nlp->l_bp = last;
+		if (last != NULL)
+			last->l_fp = nlp;
+		else
+			first = nlp;
+		last = nlp;
+	}
+	if (first == NULL)
+		return NULL;
+	first->l_bp = lp;
+	last->l_fp = lp->l_fp;
+	lp->l_fp->l_bp = last;
+	lp->l_fp = first;
+	last->l_hole = h - (k - 1) - i;
+	lp->l_hole = k - 1;
+	lindex_built(bp, lp, first, i);
+	return first;
+}
+
+/* lforw() of a line with unbuilt lines after it */
+struct line *lbuildnext(struct line *lp)
+{
+	struct buffer *bp = lbuffer(lp);
+	struct line *nlp;
+
+	if (bp != NULL && (nlp = lbuild(bp, lp, 1, LBUILD_RUN)) != NULL)
+		return nlp;
+	return lp->l_fp;	/* No memory: step over them */
+}
+
+/* lback() of a line with unbuilt lines before it */
+struct line *lbuildprev(struct line *lp)
+{
+	struct line *prev = lp->l_bp;
+	struct buffer *bp = lbuffer(prev);
+	int k = prev->l_hole > LBUILD_RUN ? prev->l_hole - LBUILD_RUN + 1 : 1;
+
+	if (bp != NULL && lbuild(bp, prev, k, LBUILD_RUN) != NULL)
+		return lp->l_bp;
+	return prev;
+}
+
+/*
+ * Build every unbuilt line of "bp", for code that must walk its lines
+ * without building any, like the search workers, or that drops the gap
+ * text. Returns FALSE if there was no memory for them all.
+ */
+int lbuildall(struct buffer *bp)
+{
+	struct line *lp = bp->b_linep;
+	int built = FALSE;
+	int s = TRUE;
+
+	do {
+		if (lp->l_hole > 0) {
+			if (lbuild(bp, lp, 1, lp->l_hole) == NULL) {
+				s = FALSE;
+				break;
+			}
+			built = TRUE;
+		}
+		lp = lp->l_fp;
+	} while (lp != bp->b_linep);
+	if (built)
+		lindex_rebuild(bp);	/* Built in long runs: even out the chunks */
+	return s;
 }
 
 /*
  * This routine allocates a block of memory large enough to hold a struct line
- * containing "used" characters. The block is always rounded up a bit. Return
- * a pointer to the new block, or NULL if there isn't any memory left. Print a
- * message in the message line if no space.
+ * containing "used" characters. Lines of a buffer come from the arena of
+ * "bp"; with no buffer (header lines) the block is a heap allocation of its
+ * own, rounded up a bit. Return a pointer to the new block, or NULL if there
+ * isn't any memory left.
  */
-struct line *lalloc(int used)
+struct line *lalloc(struct buffer *bp, int used)
 {
 	struct line *lp;
 	int size;
 
-	size = (used + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
-	if (size == 0)	/* Assume that is an empty. */
-		size = BLOCK_SIZE;  /* Line is for type-in. */
-	lp = (struct line *)safe_alloc(sizeof(struct line) + size, "line buffer", __FILE__, __LINE__);
-	if (!lp) {
-		return NULL;
+	if (bp != NULL) {
+		if ((lp = larena_alloc(bp, used)) == NULL)
+			return NULL;
+	} else {
+		size = (used + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+		if (size == 0)	/* Assume that is an empty. */
+			size = BLOCK_SIZE;  /* Line is for type-in. */
+		lp = (struct line *)safe_alloc(sizeof(struct line) + size, "line buffer", __FILE__, __LINE__);
+		if (!lp) {
+			return NULL;
+		}
+		lp->l_size = size;
+		lp->l_slot = LSLOT_HEAP;
 	}
-	lp->l_size = size;
 	lp->l_used = used;
+	lp->l_chunk = NULL;
+	lp->l_hole = 0;
+	ltouch(lp);
 	
 	// Initialize atomic column cache for instant UTF-8 cursor positioning
-	atomic_store(&lp->l_column_cache_offset, 0);
-	atomic_store(&lp->l_column_cache_column, 0);
-	atomic_store(&lp->l_column_cache_dirty, false);
+	// (the line is not shared yet, so plain initialisation is enough)
+	atomic_init(&lp->l_column_cache_offset, 0);
+	atomic_init(&lp->l_column_cache_column, 0);
+	atomic_init(&lp->l_column_cache_dirty, false);
 	
 	return lp;
 }
 
+/* Release the memory of a line that is no longer linked anywhere. */
+void lrelease(struct line *lp)
+{
+	if (lp->l_slot == LSLOT_HEAP)
+		safe_free((void **) &lp);
+	else
+		larena_free(lp);
+}
+
+/*
+ * Room to ask for when a line of "need" bytes outgrows its block: half as
+ * much again, so typing at the end of a long line reallocates it only
+ * O(log n) times.
+ */
+static inline int lgrowth(int need)
+{
+	return need + (need >> 1);
+}
+
 /*
  * Delete line "lp". Fix all of the links that might point at it (they are
  * moved to offset 0 of the next line. Unlink the line from whatever buffer it
@@ -123,17 +359,18 @@ void lfree(struct line *lp)
 {
 	struct buffer *bp;
 	struct window *wp;
+	struct line *next = lforw(lp);
 
 	wp = wheadp;
 	while (wp != NULL) {
 		if (wp->w_linep == lp)
-			wp->w_linep = lp->l_fp;
+			wp->w_linep = next;
 		if (wp->w_dotp == lp) {
-			wp->w_dotp = lp->l_fp;
+			wp->w_dotp = next;
 			wp->w_doto = 0;
 		}
 		if (wp->w_markp == lp) {
-			wp->w_markp = lp->l_fp;
+			wp->w_markp = next;
 			wp->w_marko = 0;
 		}
 		wp = wp->w_wndp;
@@ -142,19 +379,20 @@ void lfree(struct line *lp)
 	while (bp != NULL) {
 		if (bp->b_nwnd == 0) {
 			if (bp->b_dotp == lp) {
-				bp->b_dotp = lp->l_fp;
+				bp->b_dotp = next;
 				bp->b_doto = 0;
 			}
 			if (bp->b_markp == lp) {
-				bp->b_markp = lp->l_fp;
+				bp->b_markp = next;
 				bp->b_marko = 0;
 			}
 		}
 		bp = bp->b_bufp;
 	}
+	lindex_unlink(lp);
 	lp->l_bp->l_fp = lp->l_fp;
 	lp->l_fp->l_bp = lp->l_bp;
-	safe_free((void **) &lp);
+	lrelease(lp);
 }
 
 /*
@@ -318,10 +556,15 @@ int linsert(int n, int c)
 		for (i = 0; i < n; ++i) inserted_text[i] = c;
 		inserted_text[n] = '\0';
 
+		if (!lgapreserve((size_t)n + 1)) {
+			SAFE_FREE(inserted_text);
+			perf_end_timing("linsert");
+			return FALSE;
+		}
 		if (lp1 == curbp->b_linep) {
-			if (lp1->l_fp == lp1) {
+			if (lforw(lp1) == lp1) {
 				// Empty buffer - create first line
-				struct line *first = lalloc(0);
+				struct line *first = lalloc(curbp, 0);
 				if (first == NULL) {
 					SAFE_FREE(inserted_text);
 					perf_end_timing("linsert");
@@ -331,6 +574,7 @@ int linsert(int n, int c)
 				first->l_fp = lp1->l_fp;
 				lp1->l_fp->l_bp = first;
 				lp1->l_fp = first;
+				lindex_link(curbp, first);
 				wp = wheadp;
 				while (wp != NULL) {
 					if (wp->w_linep == lp1) wp->w_linep = first;
@@ -340,17 +584,22 @@ int linsert(int n, int c)
 				}
 				lp1 = curwp->w_dotp = first;
 				curwp->w_doto = 0;
+				if (curbp->b_storage == BSTORE_GAP)
+					lgapmirror(curbp, 0, 0, "\n", 1);
 			} else {
 				// At EOF but buffer not empty - extend last line
-				lp1 = curwp->w_dotp = lp1->l_bp;  // Go to last actual line
+				lp1 = curwp->w_dotp = lback(lp1);  // Go to last actual line
 				curwp->w_doto = lp1->l_used;      // Position at end of line
 			}
 			doto = curwp->w_doto;
+			lnum = getlinenum(curbp, lp1);
 		}
+		size_t gap_pos = curbp->b_storage == BSTORE_GAP
+			? lgapoffset(curbp, lp1, doto) : 0;
 
 		if (lp1->l_used == doto) {
 			if (lp1->l_used + n > lp1->l_size) {
-				if ((lp2 = lalloc(lp1->l_used + n)) == NULL) {
+				if ((lp2 = lalloc(curbp, lgrowth(lp1->l_used + n))) == NULL) {
 					perf_end_timing("linsert");
 					return FALSE;
 				}
@@ -361,6 +610,7 @@ int linsert(int n, int c)
 				lp2->l_fp = lp1->l_fp;
 				lp1->l_fp->l_bp = lp2;
 				lp2->l_bp = lp1->l_bp;
+				lindex_replace(lp1, lp2);
 				wp = wheadp;
 				while (wp != NULL) {
 					if (wp->w_linep == lp1) wp->w_linep = lp2;
@@ -371,15 +621,16 @@ int linsert(int n, int c)
 					if (wp->w_markp == lp1) wp->w_markp = lp2;
 					wp = wp->w_wndp;
 				}
-				safe_free((void **) &lp1);
+				lrelease(lp1);
 			} else {
 				memcpy(lp1->l_text + lp1->l_used, inserted_text, n);
 				lp1->l_used += n;
+				ltouch(lp1);
 				curwp->w_doto = lp1->l_used;  // Move cursor to end of line after insertion
 			}
 		} else {
 			if (lp1->l_used + n > lp1->l_size) {
-				if ((lp2 = lalloc(lp1->l_used + n)) == NULL) {
+				if ((lp2 = lalloc(curbp, lgrowth(lp1->l_used + n))) == NULL) {
 					perf_end_timing("linsert");
 					return FALSE;
 				}
@@ -391,6 +642,7 @@ int linsert(int n, int c)
 				lp2->l_fp = lp1->l_fp;
 				lp1->l_fp->l_bp = lp2;
 				lp2->l_bp = lp1->l_bp;
+				lindex_replace(lp1, lp2);
 				wp = wheadp;
 				while (wp != NULL) {
 					if (wp->w_linep == lp1) wp->w_linep = lp2;
@@ -404,11 +656,12 @@ int linsert(int n, int c)
 					wp = wp->w_wndp;
 				}
 				// Note: cursor advancement for curwp is handled in the loop above
-				safe_free((void **) &lp1);
+				lrelease(lp1);
 			} else {
 				memmove(lp1->l_text + doto + n, lp1->l_text + doto, lp1->l_used - doto);
 				memcpy(lp1->l_text + doto, inserted_text, n);
 				lp1->l_used += n;
+				ltouch(lp1);
 				curwp->w_doto += n;  // Advance cursor after mid-line insertion
 			}
 		}
@@ -421,6 +674,8 @@ int linsert(int n, int c)
 		buffer_update_stats_incremental(curbp, 0, n, word_delta);
 		if (word_delta == 0) buffer_mark_stats_dirty(curbp); // Fallback for complex cases
 
+		if (curbp->b_storage == BSTORE_GAP)
+			lgapmirror(curbp, gap_pos, 0, inserted_text, (size_t)n);
 		undo_record_insert(curbp, lnum, doto, inserted_text, n);
 		SAFE_FREE(inserted_text);
 
@@ -447,6 +702,8 @@ int ldelete(long n, int kflag)
 	struct window *wp;
     char *deleted_text;
     long lnum;
+	size_t gap_pos = 0;	/* Gap storage offset of dot    */
+	size_t gap_len = 0;	/* Bytes actually removed       */
 
 	if (curbp->b_mode & MDVIEW)	/* don't allow this command if      */
 		return rdonly();	/* we are in read only mode     */
@@ -462,7 +719,8 @@ int ldelete(long n, int kflag)
     deleted_text = safe_alloc((size_t)n + 1, "undo delete buffer", __FILE__, __LINE__);
     if (deleted_text == NULL) return FALSE;
 
-    // Collect text that will be deleted
+    // Collect text that will be deleted; this builds every line the
+    // deletion reaches, so none is built before the gap storage catches up
     long collected_len = 0;
     struct line *scan_p = dotp;
     int scan_o = doto;
@@ -477,6 +735,8 @@ int ldelete(long n, int kflag)
         }
     }
     deleted_text[collected_len] = '\0';
+	if (curbp->b_storage == BSTORE_GAP)
+		gap_pos = lgapoffset(curbp, dotp, doto);
 
 	lchange(WFHARD);
 	while (n > 0) {
@@ -488,6 +748,9 @@ int ldelete(long n, int kflag)
 		if (chunk > n)
 			chunk = n;
 		if (chunk == 0) {	/* End of line, merge.  */
+			/* Joining the last line with the header is a no-op */
+			if (lforw(dotp) != curbp->b_linep || llength(dotp) == 0)
+				++gap_len;
 			if (ldelnewline() == FALSE
 			    || (kflag != FALSE && kinsert('\n') == FALSE))
 				goto undo_fail;
@@ -506,6 +769,8 @@ int ldelete(long n, int kflag)
 			while (cp2 != &dotp->l_text[dotp->l_used])
 				*cp1++ = *cp2++;
 			dotp->l_used -= chunk;
+			ltouch(dotp);
+			gap_len += chunk;
 			wp = wheadp;	/* Fix windows          */
 			while (wp != NULL) {
 				if (wp->w_dotp == dotp && wp->w_doto >= doto) {
@@ -546,6 +811,8 @@ int ldelete(long n, int kflag)
     }
 	buffer_update_stats_incremental(curbp, 0, -collected_len, word_delta);
     if (word_delta == 0) buffer_mark_stats_dirty(curbp); // Fallback for complex cases
+	if (curbp->b_storage == BSTORE_GAP)
+		lgapmirror(curbp, gap_pos, gap_len, "", 0);
 
 	undo_record_delete(curbp, lnum, doto, deleted_text, collected_len);
 	/* If this was a kill, also update the system clipboard with the exact text */
@@ -556,10 +823,91 @@ int ldelete(long n, int kflag)
 	return n == 0;
 
 undo_fail:
+	if (curbp->b_storage == BSTORE_GAP)
+		lgapmirror(curbp, gap_pos, gap_len, "", 0);
     SAFE_FREE(deleted_text);
     return FALSE;
 }
 
+/*
+ * Replace "dlen" bytes at offset "off" of line "lp", line number "lnum" of
+ * the current buffer, by "ilen" bytes of "text", which holds no newline.
+ * The line is rewritten once, whatever the text, and the change logged as
+ * one deletion and one insertion; marks past the span move with the text
+ * and marks inside it go to its start. The caller calls lchange(), so that
+ * a batch of these costs one redisplay. Returns FALSE if out of memory.
+ */
+int lreplace(struct line *lp, long lnum, int off, int dlen, const char *text, int ilen)
+{
+	struct line *lp2 = lp;
+	struct window *wp;
+	char *deleted_text;
+	int used = lp->l_used - dlen + ilen;
+	int delta = ilen - dlen;
+	size_t gap_pos = 0;
+
+	deleted_text = safe_alloc((size_t)dlen + 1, "undo delete buffer", __FILE__, __LINE__);
+	if (deleted_text == NULL)
+		return FALSE;
+	memcpy(deleted_text, lp->l_text + off, dlen);
+	if (!lgapreserve(ilen > dlen ? (size_t)(ilen - dlen) : 0)) {
+		SAFE_FREE(deleted_text);
+		return FALSE;
+	}
+	if (curbp->b_storage == BSTORE_GAP)
+		gap_pos = lgapoffset(curbp, lp, off);
+
+	if (used > lp->l_size) {
+		if ((lp2 = lalloc(curbp, used)) == NULL) {
+			SAFE_FREE(deleted_text);
+			return FALSE;
+		}
+		memcpy(lp2->l_text, lp->l_text, off);
+		memcpy(lp2->l_text + off + ilen, lp->l_text + off + dlen, lp->l_used - off - dlen);
+		lp->l_bp->l_fp = lp2;
+		lp2->l_fp = lp->l_fp;
+		lp->l_fp->l_bp = lp2;
+		lp2->l_bp = lp->l_bp;
+		lindex_replace(lp, lp2);
+	} else {
+		memmove(lp->l_text + off + ilen, lp->l_text + off + dlen, lp->l_used - off - dlen);
+	}
+	memcpy(lp2->l_text + off, text, ilen);
+	lp2->l_used = used;
+	ltouch(lp2);
+
+	wp = wheadp;		/* Fix windows          */
+	while (wp != NULL) {
+		if (wp->w_linep == lp)
+			wp->w_linep = lp2;
+		if (wp->w_dotp == lp) {
+			wp->w_dotp = lp2;
+			if (wp->w_doto >= off + dlen)
+				wp->w_doto += delta;
+			else if (wp->w_doto > off)
+				wp->w_doto = off;
+		}
+		if (wp->w_markp == lp) {
+			wp->w_markp = lp2;
+			if (wp->w_marko >= off + dlen)
+				wp->w_marko += delta;
+			else if (wp->w_marko > off)
+				wp->w_marko = off;
+		}
+		wp = wp->w_wndp;
+	}
+	if (lp2 != lp)
+		lrelease(lp);
+
+	buffer_update_stats_incremental(curbp, 0, delta, 0);
+	if (curbp->b_storage == BSTORE_GAP)
+		lgapmirror(curbp, gap_pos, (size_t)dlen, text, (size_t)ilen);
+	undo_record_delete(curbp, lnum, off, deleted_text, dlen);
+	undo_record_insert(curbp, lnum, off, text, ilen);
+	SAFE_FREE(deleted_text);
+	return TRUE;
+}
+
 /*
  * Delete a newline. Join the current line with the next line. If the next line
  * is the magic header line always return TRUE; merging the last line with the
@@ -567,7 +915,7 @@ undo_fail:
  * if nothing is done, and this makes the kill buffer work "right". Easy cases
  * can be done by shuffling data around. Hard cases require that lines be moved
  * about in memory. Return FALSE on error and TRUE if all looks ok. Called by
- * "ldelete" only.
+ * "ldelete" only, which also accounts for the change in gap storage.
  */
 int ldelnewline(void)
 {
@@ -581,7 +929,7 @@ int ldelnewline(void)
 	if (curbp->b_mode & MDVIEW)	/* don't allow this command if      */
 		return rdonly();	/* we are in read only mode     */
 	lp1 = curwp->w_dotp;
-	lp2 = lp1->l_fp;
+	lp2 = lforw(lp1);
 	if (lp2 == curbp->b_linep) {	/* At the buffer end.   */
 		if (lp1->l_used == 0) {	/* Blank line.              */
 			lfree(lp1);
@@ -611,12 +959,14 @@ int ldelnewline(void)
 			wp = wp->w_wndp;
 		}
 		lp1->l_used += lp2->l_used;
+		ltouch(lp1);
+		lindex_unlink(lp2);
 		lp1->l_fp = lp2->l_fp;
 		lp2->l_fp->l_bp = lp1;
-		safe_free((void **) &lp2);
+		lrelease(lp2);
 		return TRUE;
 	}
-	if ((lp3 = lalloc(lp1->l_used + lp2->l_used)) == NULL)
+	if ((lp3 = lalloc(curbp, lp1->l_used + lp2->l_used)) == NULL)
 		return FALSE;
 	cp1 = &lp1->l_text[0];
 	cp2 = &lp3->l_text[0];
@@ -625,6 +975,8 @@ int ldelnewline(void)
 	cp1 = &lp2->l_text[0];
 	while (cp1 != &lp2->l_text[lp2->l_used])
 		*cp2++ = *cp1++;
+	lindex_unlink(lp2);
+	lindex_replace(lp1, lp3);
 	lp1->l_bp->l_fp = lp3;
 	lp3->l_fp = lp2->l_fp;
 	lp2->l_fp->l_bp = lp3;
@@ -651,8 +1003,8 @@ int ldelnewline(void)
     buffer_update_stats_incremental(curbp, -1, -1, 0); // -1 line, -1 byte (for newline)
     buffer_mark_stats_dirty(curbp); // Mark dirty for word count recalculation
 
-	safe_free((void **) &lp1);
-	safe_free((void **) &lp2);
+	lrelease(lp1);
+	lrelease(lp2);
 	return TRUE;
 }
 
@@ -881,6 +1233,7 @@ int lnewline(void)
 	struct line *lp2;
 	int doto;
 	struct window *wp;
+	size_t gap_pos;
 
 	if (curbp->b_mode & MDVIEW)	/* don't allow this command if      */
 		return rdonly();	/* we are in read only mode     */
@@ -888,9 +1241,12 @@ int lnewline(void)
 	lp1 = curwp->w_dotp;	/* Get the address and  */
 	doto = curwp->w_doto;	/* offset of "."        */
 
+	if (!lgapreserve(1))
+		return FALSE;
     undo_record_insert(curbp, getlinenum(curbp, lp1), doto, "\n", 1);
+	gap_pos = curbp->b_storage == BSTORE_GAP ? lgapoffset(curbp, lp1, doto) : 0;
 
-	if ((lp2 = lalloc(doto)) == NULL)	/* New first half line      */
+	if ((lp2 = lalloc(curbp, doto)) == NULL)	/* New first half line      */
 		return FALSE;
 	cp1 = &lp1->l_text[0];	/* Shuffle text around  */
 	cp2 = &lp2->l_text[0];
@@ -900,10 +1256,12 @@ int lnewline(void)
 	while (cp1 != &lp1->l_text[lp1->l_used])
 		*cp2++ = *cp1++;
 	lp1->l_used -= doto;
-lp2->l_bp = lp1->l_bp;
-lp1->l_bp = lp2;
-lp2->l_bp->l_fp = lp2;
-lp2->l_fp = lp1;
+	ltouch(lp1);
+	lp2->l_bp = lp1->l_bp;
+	lp1->l_bp = lp2;
+	lp2->l_bp->l_fp = lp2;
+	lp2->l_fp = lp1;
+	lindex_link(curbp, lp2);
 	wp = wheadp;		/* Windows              */
 	while (wp != NULL) {
 		if (wp->w_linep == lp1)
@@ -922,6 +1280,8 @@ lp2->l_fp = lp1;
 		}
 		wp = wp->w_wndp;
 	}
+	if (curbp->b_storage == BSTORE_GAP)
+		lgapmirror(curbp, gap_pos, 0, "\n", 1);
 	// Update atomic statistics for new line insertion
     buffer_update_stats_incremental(curbp, 1, 1, 0); // +1 line, +1 byte (for newline)
     buffer_mark_stats_dirty(curbp); // Mark dirty for word count recalculation
@@ -0,0 +1,197 @@
+/*
+ * line_arena.c - slab allocation of the lines of a buffer.
+ *
+ * Each buffer gets an arena on its first line. An arena keeps one bump
+ * region and one free list per size class, the list of its slabs, and a
+ * doubly linked list of the oversized lines it handed out, so that all of
+ * it can be released in one sweep by larena_release().
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "estruct.h"
+#include "edef.h"
+#include "efunc.h"
+#include "line.h"
+#include "line_arena.h"
+#include "memory.h"
+
+struct line_slab {
+	struct line_arena *s_arena;	/* Arena the slab belongs to    */
+	struct line_slab *s_next;	/* Next slab of the arena       */
+};
+
+/* Header in front of a line too long for any slab class */
+struct line_big {
+	struct line_big *g_prev;
+	struct line_big *g_next;
+	struct line_arena *g_arena;
+	size_t g_pad;			/* Keep the line 16-byte aligned */
+};
+
+struct line_arena {
+	struct line_slab *a_slabs;	/* Every slab, newest first      */
+	struct line_big *a_big;		/* Oversized lines               */
+	struct line *a_free[LARENA_CLASSES];	/* Freed slots, via l_fp */
+	char *a_next[LARENA_CLASSES];	/* Bump pointer in newest slab   */
+	char *a_end[LARENA_CLASSES];	/* End of the bump region        */
+	size_t a_nslabs;
+};
+
+/* Text room of each class: steps of about a third keep slack low */
+static const int class_sizes[LARENA_CLASSES] = {
+	16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+
+static inline int class_text(int cls)
+{
+	return class_sizes[cls];
+}
+
+static inline size_t class_slot(int cls)
+{
+	return sizeof(struct line) + (size_t)class_text(cls);
+}
+
+/* Smallest class holding "size" bytes of text; -1 if none does. */
+static int class_of(int size)
+{
+	int cls;
+
+	for (cls = 0; cls < LARENA_CLASSES; ++cls)
+		if (size <= class_text(cls))
+			return cls;
+	return -1;
+}
+
+static struct line_arena *arena_of(struct buffer *bp)
+{
+	if (bp->b_arena == NULL)
+		bp->b_arena = safe_alloc(sizeof(struct line_arena), "line arena", __FILE__, __LINE__);
+	return bp->b_arena;
+}
+
+/* Start a new slab for class "cls"; FALSE if out of memory. */
+static int slab_new(struct line_arena *ap, int cls)
+{
+	struct line_slab *sp;
+
+	sp = aligned_alloc(LARENA_SLAB, LARENA_SLAB);
+	if (sp == NULL)
+		return FALSE;
+	sp->s_arena = ap;
+	sp->s_next = ap->a_slabs;
+	ap->a_slabs = sp;
+	ap->a_nslabs++;
+	ap->a_next[cls] = (char *)sp + sizeof(struct line_slab);
+	ap->a_end[cls] = (char *)sp + LARENA_SLAB;
+	return TRUE;
+}
+
+static struct line *big_alloc(struct line_arena *ap, int size)
+{
+	struct line_big *gp;
+
+	size = (size + 15) & ~15;
+	gp = malloc(sizeof(struct line_big) + sizeof(struct line) + (size_t)size);
+	if (gp == NULL)
+		return NULL;
+	gp->g_arena = ap;
+	gp->g_prev = NULL;
+	gp->g_next = ap->a_big;
+	if (ap->a_big != NULL)
+		ap->a_big->g_prev = gp;
+	ap->a_big = gp;
+
+	struct line *lp = (struct line *)(gp + 1);
+	memset(lp, 0, sizeof(struct line));
+	lp->l_size = size;
+	lp->l_slot = LSLOT_BIG;
+	return lp;
+}
+
+/*
+ * A line of "bp" with room for at least "size" bytes of text. Only the
+ * line header is cleared; l_size is set to the room actually available.
+ */
+struct line *larena_alloc(struct buffer *bp, int size)
+{
+	struct line_arena *ap;
+	struct line *lp;
+	int cls;
+
+	if ((ap = arena_of(bp)) == NULL)
+		return NULL;
+	if ((cls = class_of(size)) < 0)
+		return big_alloc(ap, size);
+
+	if ((lp = ap->a_free[cls]) != NULL) {
+		ap->a_free[cls] = lp->l_fp;
+	} else {
+		if ((size_t)(ap->a_end[cls] - ap->a_next[cls]) < class_slot(cls)
+		    && !slab_new(ap, cls))
+			return NULL;
+		lp = (struct line *)ap->a_next[cls];
+		ap->a_next[cls] += class_slot(cls);
+	}
+	memset(lp, 0, sizeof(struct line));
+	lp->l_size = class_text(cls);
+	lp->l_slot = (uint8_t)(cls + 1);
+	return lp;
+}
+
+/* Give the memory of an arena line back to its arena. */
+void larena_free(struct line *lp)
+{
+	if (lp->l_slot == LSLOT_BIG) {
+		struct line_big *gp = (struct line_big *)lp - 1;
+
+		if (gp->g_prev != NULL)
+			gp->g_prev->g_next = gp->g_next;
+		else
+			gp->g_arena->a_big = gp->g_next;
+		if (gp->g_next != NULL)
+			gp->g_next->g_prev = gp->g_prev;
+		free(gp);
+		return;
+	}
+
+	struct line_slab *sp = (struct line_slab *)((uintptr_t)lp & ~(uintptr_t)(LARENA_SLAB - 1));
+	struct line_arena *ap = sp->s_arena;
+	int cls = lp->l_slot - 1;
+
+	lp->l_fp = ap->a_free[cls];
+	ap->a_free[cls] = lp;
+}
+
+/*
+ * Drop every line of "bp" at once. The lines must already be unlinked
+ * from the buffer (or about to be forgotten with it).
+ */
+void larena_release(struct buffer *bp)
+{
+	struct line_arena *ap = bp->b_arena;
+	struct line_slab *sp;
+	struct line_big *gp;
+
+	if (ap == NULL)
+		return;
+	while ((sp = ap->a_slabs) != NULL) {
+		ap->a_slabs = sp->s_next;
+		free(sp);
+	}
+	while ((gp = ap->a_big) != NULL) {
+		ap->a_big = gp->g_next;
+		free(gp);
+	}
+	SAFE_FREE(bp->b_arena);
+}
+
+/* Number of slabs "bp" holds, for statistics and tests. */
+size_t larena_slabs(struct buffer *bp)
+{
+	return bp->b_arena ? bp->b_arena->a_nslabs : 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * line_index.c - O(log n) line numbers for the line lists of buffers.
+ *
+ * A buffer's lines are cut into chunks of consecutive lines. The chunks
+ * form a treap (randomised balanced tree) in buffer order, where every
+ * node also carries the number of lines in its subtree. The rank of a
+ * chunk is then found by walking up to the root, and the chunk holding
+ * line "n" by walking down from it.
+ *
+ * Lines of a gap stored buffer not built yet count too: each chunk also
+ * carries the unbuilt lines after its lines (see "l_hole" in line.h), and
+ * those opening the buffer are the header line's. Lines are always walked
+ * here by their raw links, so that looking a line up builds no others.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "estruct.h"
+#include "edef.h"
+#include "efunc.h"
+#include "line.h"
+#include "line_index.h"
+#include "memory.h"
+
+struct line_chunk {
+	struct line_chunk *c_left;	/* Chunks before this one       */
+	struct line_chunk *c_right;	/* Chunks after this one        */
+	struct line_chunk *c_up;	/* Parent, NULL at the root     */
+	struct buffer *c_bp;	/* Buffer owning the tree       */
+	struct line *c_first;	/* First line of the run        */
+	long c_lines;		/* Lines in this chunk          */
+	long c_holes;		/* ... and unbuilt lines after them */
+	long c_total;		/* Lines in this subtree, unbuilt too */
+	uint32_t c_prio;	/* Heap priority for balancing  */
+};
+
+static uint32_t lindex_seed = 2463534242U;
+
+/* xorshift32 - priorities only need to be well spread, not secure */
+static uint32_t lindex_random(void)
+{
+	lindex_seed ^= lindex_seed << 13;
+	lindex_seed ^= lindex_seed >> 17;
+	lindex_seed ^= lindex_seed << 5;
+	return lindex_seed;
+}
+
+static inline long ctotal(struct line_chunk *c)
+{
+	return c ? c->c_total : 0;
+}
+
+static inline void cpull(struct line_chunk *c)
+{
+	c->c_total = ctotal(c->c_left) + c->c_lines + c->c_holes + ctotal(c->c_right);
+}
+
+/* Add "delta" lines to the subtree counts from "c" up to the root. */
+static void cadjust(struct line_chunk *c, long delta)
+{
+	for (; c != NULL; c = c->c_up)
+		c->c_total += delta;
+}
+
+/* Rotate "x" above its parent, keeping order and subtree counts. */
+static void crotate(struct line_chunk *x)
+{
+	struct line_chunk *p = x->c_up;
+	struct line_chunk *g = p->c_up;
+
+	if (p->c_left == x) {
+		p->c_left = x->c_right;
+		if (x->c_right)
+			x->c_right->c_up = p;
+		x->c_right = p;
+	} else {
+		p->c_right = x->c_left;
+		if (x->c_left)
+			x->c_left->c_up = p;
+		x->c_left = p;
+	}
+	p->c_up = x;
+	x->c_up = g;
+	if (g == NULL)
+		x->c_bp->b_lindex = x;
+	else if (g->c_left == p)
+		g->c_left = x;
+	else
+		g->c_right = x;
+	cpull(p);
+	cpull(x);
+}
+
+static struct line_chunk *cnew(struct buffer *bp, struct line *first)
+{
+	struct line_chunk *c;
+
+	c = safe_alloc(sizeof(struct line_chunk), "line index chunk", __FILE__, __LINE__);
+	if (c == NULL)
+		return NULL;
+	c->c_bp = bp;
+	c->c_first = first;
+	c->c_prio = lindex_random();
+	return c;
+}
+
+/* Hook "nc" into the tree directly after "c", or as root if "c" is NULL. */
+static void cinsert_after(struct buffer *bp, struct line_chunk *c, struct line_chunk *nc)
+{
+	nc->c_total = nc->c_lines + nc->c_holes;
+	if (c == NULL) {
+		bp->b_lindex = nc;
+		return;
+	}
+	if (c->c_right == NULL) {
+		c->c_right = nc;
+		nc->c_up = c;
+	} else {
+		struct line_chunk *s = c->c_right;
+		while (s->c_left != NULL)
+			s = s->c_left;
+		s->c_left = nc;
+		nc->c_up = s;
+	}
+	cadjust(nc->c_up, nc->c_total);
+	while (nc->c_up != NULL && nc->c_up->c_prio < nc->c_prio)
+		crotate(nc);
+}
+
+/* Unhook an empty chunk from the tree and release it. */
+static void cremove(struct line_chunk *c)
+{
+	struct line_chunk *p;
+
+	while (c->c_left != NULL || c->c_right != NULL) {
+		if (c->c_right == NULL
+		    || (c->c_left != NULL && c->c_left->c_prio > c->c_right->c_prio))
+			crotate(c->c_left);
+		else
+			crotate(c->c_right);
+	}
+	p = c->c_up;
+	if (p == NULL)
+		c->c_bp->b_lindex = NULL;
+	else {
+		if (p->c_left == c)
+			p->c_left = NULL;
+		else
+			p->c_right = NULL;
+		cadjust(p, -c->c_total);
+	}
+	SAFE_FREE(c);
+}
+
+/*
+ * Cut an oversized chunk in two. The tail half gets a new chunk, so only
+ * its lines need their chunk pointer rewritten.
+ */
+static void csplit(struct line_chunk *c)
+{
+	struct line_chunk *nc;
+	struct line *lp;
+	long i;
+
+	lp = c->c_first;
+	for (i = 0; i < LINDEX_CHUNK; ++i)
+		lp = lp->l_fp;
+	if ((nc = cnew(c->c_bp, lp)) == NULL)
+		return;		/* Keep the big chunk; still correct */
+	nc->c_lines = c->c_lines - LINDEX_CHUNK;
+	for (i = 0; i < nc->c_lines; ++i, lp = lp->l_fp) {
+		lp->l_chunk = nc;
+		nc->c_holes += lp->l_hole;
+	}
+	c->c_lines = LINDEX_CHUNK;
+	c->c_holes -= nc->c_holes;
+	cadjust(c, -(nc->c_lines + nc->c_holes));
+	cinsert_after(c->c_bp, c, nc);
+}
+
+static void cfree_tree(struct line_chunk *c)
+{
+	if (c == NULL)
+		return;
+	cfree_tree(c->c_left);
+	cfree_tree(c->c_right);
+	SAFE_FREE(c);
+}
+
+/*
+ * A line has just been linked into the list of "bp"; give it a place in
+ * the index. It joins the chunk of the line before it, or of the line
+ * after it when it became the first line of the buffer.
+ */
+void lindex_link(struct buffer *bp, struct line *lp)
+{
+	struct line *prev = lp->l_bp;
+	struct line *next = lp->l_fp;
+	struct line_chunk *c;
+
+	lp->l_chunk = NULL;
+	if (prev != bp->b_linep && prev->l_chunk != NULL) {
+		c = prev->l_chunk;
+	} else if (prev == bp->b_linep && next != bp->b_linep && next->l_chunk != NULL) {
+		c = next->l_chunk;
+		c->c_first = lp;
+	} else if (bp->b_lindex == NULL && prev == bp->b_linep && next == bp->b_linep) {
+		if ((c = cnew(bp, lp)) == NULL)
+			return;	/* Unindexed line: rebuilt on next query */
+		cinsert_after(bp, NULL, c);
+	} else {
+		return;		/* Neighbours unindexed: rebuilt on query */
+	}
+	lp->l_chunk = c;
+	c->c_lines++;
+	cadjust(c, 1);
+	if (c->c_lines > LINDEX_CHUNK_MAX)
+		csplit(c);
+}
+
+/*
+ * Line "lp" is about to be unlinked from its buffer; take it out of the
+ * index. Must be called while its links are still intact. Unbuilt lines
+ * after it are left to the line before it.
+ */
+void lindex_unlink(struct line *lp)
+{
+	struct line_chunk *c = lp->l_chunk;
+	struct line *prev = lp->l_bp;
+	long h = lp->l_hole;
+
+	if (h != 0) {
+		prev->l_hole += h;
+		lp->l_hole = 0;
+		if (prev->l_chunk != NULL) {
+			prev->l_chunk->c_holes += h;
+			cadjust(prev->l_chunk, h);
+		}
+		if (c != NULL) {
+			c->c_holes -= h;
+			cadjust(c, -h);
+		}
+	}
+	if (c == NULL)
+		return;
+	lp->l_chunk = NULL;
+	if (c->c_first == lp)
+		c->c_first = lp->l_fp;
+	c->c_lines--;
+	cadjust(c, -1);
+	if (c->c_lines == 0)
+		cremove(c);
+}
+
+/* Line "nlp" takes the place of "olp" in the list, and its unbuilt lines. */
+void lindex_replace(struct line *olp, struct line *nlp)
+{
+	struct line_chunk *c = olp->l_chunk;
+
+	nlp->l_chunk = c;
+	olp->l_chunk = NULL;
+	nlp->l_hole = olp->l_hole;
+	olp->l_hole = 0;
+	if (c != NULL && c->c_first == olp)
+		c->c_first = nlp;
+}
+
+/* Drop the whole index of "bp", leaving every line unindexed. */
+void lindex_clear(struct buffer *bp)
+{
+	struct line *lp;
+
+	for (lp = bp->b_linep->l_fp; lp != bp->b_linep; lp = lp->l_fp)
+		lp->l_chunk = NULL;
+	cfree_tree(bp->b_lindex);
+	bp->b_lindex = NULL;
+}
+
+/* Drop the index of "bp" whose lines are being released wholesale. */
+void lindex_free(struct buffer *bp)
+{
+	cfree_tree(bp->b_lindex);
+	bp->b_lindex = NULL;
+}
+
+/*
+ * Index all lines of "bp" from scratch, in chunks of LINDEX_CHUNK. Each
+ * chunk is filled before it is hooked into the tree, so the subtree counts
+ * are adjusted once per chunk rather than once per line.
+ */
+void lindex_rebuild(struct buffer *bp)
+{
+	struct line_chunk *c = NULL;
+	struct line_chunk *nc;
+	struct line *lp;
+	long n;
+
+	lindex_free(bp);	/* Every line gets its chunk set below */
+	lp = bp->b_linep->l_fp;
+	while (lp != bp->b_linep) {
+		if ((nc = cnew(bp, lp)) == NULL) {
+			lindex_clear(bp);
+			return;
+		}
+		for (n = 0; n < LINDEX_CHUNK && lp != bp->b_linep; ++n, lp = lp->l_fp) {
+			lp->l_chunk = nc;
+			nc->c_holes += lp->l_hole;
+		}
+		nc->c_lines = n;
+		cinsert_after(bp, c, nc);
+		c = nc;
+	}
+}
+
+/* Line number of "lp" from the index as it is, counted by hand if not indexed */
+static long lnumber(struct buffer *bp, struct line *lp)
+{
+	struct line_chunk *c;
+	struct line_chunk *x;
+	struct line *clp;
+	long n;
+
+	if (lp == bp->b_linep)
+		return 0;
+	n = 1 + bp->b_linep->l_hole;
+	if (lp->l_chunk == NULL) {
+		for (clp = bp->b_linep->l_fp; clp != bp->b_linep; clp = clp->l_fp) {
+			if (clp == lp)
+				return n;
+			n += 1 + clp->l_hole;
+		}
+		return 0;
+	}
+	c = lp->l_chunk;
+	for (clp = lp; clp != c->c_first;) {
+		clp = clp->l_bp;
+		n += 1 + clp->l_hole;
+	}
+	n += ctotal(c->c_left);
+	for (x = c; x->c_up != NULL; x = x->c_up)
+		if (x->c_up->c_right == x)
+			n += ctotal(x->c_up->c_left) + x->c_up->c_lines + x->c_up->c_holes;
+	return n;
+}
+
+/* Line number (from 1) of "lp" in "bp"; the header line is 0. */
+long lindex_number(struct buffer *bp, struct line *lp)
+{
+	if (lp != bp->b_linep && lp->l_chunk == NULL)
+		lindex_rebuild(bp);	/* On failure it is counted by hand */
+	return lnumber(bp, lp);
+}
+
+/*
+ * The same without ever changing the index, for threads other than the
+ * editor's: they may read it while the editor thread waits, no more.
+ */
+long lindex_peek(struct buffer *bp, struct line *lp)
+{
+	return lnumber(bp, lp);
+}
+
+/*
+ * Index any line of "bp" linked in behind the index's back, so that
+ * lookups that follow find it whole; false if there was no memory to.
+ */
+bool lindex_complete(struct buffer *bp)
+{
+	struct line *lp;
+
+	for (lp = bp->b_linep->l_fp; lp != bp->b_linep; lp = lp->l_fp) {
+		if (lp->l_chunk == NULL) {
+			lindex_rebuild(bp);
+			return bp->b_linep->l_fp->l_chunk != NULL;
+		}
+	}
+	return true;
+}
+
+/*
+ * Line "n" (from 1) of "bp", or the header line when out of range. An
+ * unbuilt line is built, with a run of those after it.
+ */
+struct line *lindex_line(struct buffer *bp, long n)
+{
+	struct line_chunk *c;
+	struct line *lp;
+
+	if (n < 1 || n > lindex_count(bp))
+		return bp->b_linep;
+	lp = bp->b_linep;
+	if (n > lp->l_hole) {
+		n -= lp->l_hole;
+		c = bp->b_lindex;
+		for (;;) {
+			if (n <= ctotal(c->c_left)) {
+				c = c->c_left;
+				continue;
+			}
+			n -= ctotal(c->c_left);
+			if (n <= c->c_lines + c->c_holes)
+				break;
+			n -= c->c_lines + c->c_holes;
+			c = c->c_right;
+		}
+		for (lp = c->c_first; n > 1 + lp->l_hole; lp = lp->l_fp)
+			n -= 1 + lp->l_hole;
+		if (--n == 0)
+			return lp;
+	}
+	/* Line "n" of the unbuilt run after "lp" */
+	lp = lbuild(bp, lp, (int)n, LBUILD_RUN);
+	return lp != NULL ? lp : bp->b_linep;
+}
+
+/* Number of lines in "bp", unbuilt ones too. */
+long lindex_count(struct buffer *bp)
+{
+	struct line *first = bp->b_linep->l_fp;
+
+	/* A line linked in behind the index's back forces a rebuild */
+	if (first != bp->b_linep && first->l_chunk == NULL)
+		lindex_rebuild(bp);
+	return ctotal(bp->b_lindex) + bp->b_linep->l_hole;
+}
+
+/*
+ * The "n" lines from "first" on were just built out of the unbuilt run
+ * after "lp" and linked in there, the rest of the run now after the last
+ * of them; give them their place in the index.
+ */
+void lindex_built(struct buffer *bp, struct line *lp, struct line *first, int n)
+{
+	struct line_chunk *c;
+	struct line *last = first;
+	int i;
+
+	for (i = 1; i < n; ++i)
+		last = last->l_fp;
+	if (lp != bp->b_linep) {
+		/* Lines of the chunk of "lp" already, only no longer unbuilt */
+		c = lp->l_chunk;
+		if (c == NULL)
+			return;	/* Unindexed: rebuilt on next query */
+		for (i = 0, lp = first; i < n; ++i, lp = lp->l_fp)
+			lp->l_chunk = c;
+		c->c_lines += n;
+		c->c_holes -= n;
+	} else {
+		/* The new first lines of the buffer: they open its first chunk */
+		long moved = n + last->l_hole;
+
+		if (last->l_fp != bp->b_linep && last->l_fp->l_chunk != NULL) {
+			c = last->l_fp->l_chunk;
+		} else if (bp->b_lindex == NULL && last->l_fp == bp->b_linep) {
+			if ((c = cnew(bp, first)) == NULL)
+				return;
+			cinsert_after(bp, NULL, c);
+		} else {
+			return;
+		}
+		c->c_first = first;
+		for (i = 0, lp = first; i < n; ++i, lp = lp->l_fp)
+			lp->l_chunk = c;
+		c->c_lines += n;
+		c->c_holes += last->l_hole;
+		cadjust(c, moved);
+	}
+	if (c->c_lines > LINDEX_CHUNK_MAX)
+		csplit(c);
+}
+
+/* Buffer of an indexed line, NULL if it is not indexed. */
+struct buffer *lindex_buffer(struct line *lp)
+{
+	return lp->l_chunk != NULL ? lp->l_chunk->c_bp : NULL;
+}
@@ -63,6 +63,7 @@
 #include "efunc.h"   /* Function declarations and name table. */
 #include "ebind.h"   /* Default key bindings. */
 #include "keymap.h"  /* Keymap system functions. */
+#include "redraw.h"  /* When to draw a frame. */
 #include "version.h"
 #include "string_safe.h"
 #include "memory.h"
@@ -351,15 +352,20 @@ loop:
 	check_pending_resize();
 #endif
 
-	// Fix up the screen
-	update(FALSE);
+	// Fix up the screen, unless more input is queued and a frame went out
+	// less than an interval ago: a burst of keys then shares one update
+	if (redraw_due())
+		update(FALSE);
+	else
+		updframe();
 
 	// get the next command from the keyboard (C23 atomic processing)
 	state->c = getcmd();
 	// if there is something on the command line, clear it
 	if (mpresf != FALSE) {
 		mlerase();
-		update(FALSE);
+		if (redraw_due())
+			update(FALSE);
 	}
 	state->f = FALSE;
 	state->n = 1;
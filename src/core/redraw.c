@@ -0,0 +1,72 @@
+/*
+ * redraw.c - When the command loop puts a frame on the screen
+ *
+ * A command is cheap next to the frame that shows it, so when keys arrive
+ * faster than frames can be drawn the old loop fell behind by a full
+ * update() per key. Here a frame is drawn when the input has run dry, or
+ * when the last one is older than the interval; in between the commands
+ * just run and their window flags pile up for the next update().
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "estruct.h"
+#include "edef.h"
+#include "efunc.h"
+#include "profiler.h"
+#include "redraw.h"
+
+static int frame_ms = REDRAW_MS;
+static uint64_t last_frame;     /* when the last frame was flushed */
+static uint64_t first_key;      /* when the first key not yet shown was read, or 0 */
+static long last_latency;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+bool redraw_due(void)
+{
+    if (frame_ms <= 0 || !input_pending())
+        return true;
+    if (now_ns() - last_frame >= (uint64_t)frame_ms * 1000000ULL)
+        return true;
+    perf_count_deferred();
+    return false;
+}
+
+void redraw_key(void)
+{
+    if (first_key == 0)
+        first_key = now_ns();
+}
+
+void redraw_drawn(void)
+{
+    last_frame = now_ns();
+    if (first_key != 0) {
+        last_latency = (long)((last_frame - first_key) / 1000);
+        perf_count_latency(last_frame - first_key);
+        first_key = 0;
+    }
+}
+
+long redraw_latency(void)
+{
+    return last_latency;
+}
+
+int redraw_interval(void)
+{
+    return frame_ms;
+}
+
+void redraw_set_interval(int ms)
+{
+    frame_ms = ms < 0 ? 0 : ms;
+}
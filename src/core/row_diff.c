@@ -0,0 +1,169 @@
+/*
+ * row_diff.c - Vectorised compare of two screen rows for update()
+ *
+ * Every kernel walks forward from the left edge to the first cell that
+ * differs, then back from the right edge to the last one; the cells in
+ * between are never read. The SIMD kernels compare 4 or 8 cells per step
+ * and take the position out of the compare mask, so a row of a 4K-wide
+ * terminal is a few dozen steps whether or not it changed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "row_diff.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RDIFF_X86 1
+#include <immintrin.h>
+#endif
+
+typedef int (*rdiff_fn)(const uint32_t *a, const uint32_t *b, int n, int *end);
+
+/* Back from "n" to just past the last cell that differs, which is >= first */
+static inline int rdiff_back_scalar(const uint32_t *a, const uint32_t *b, int first, int n)
+{
+    while (n > first && a[n - 1] == b[n - 1])
+        --n;
+    return n;
+}
+
+static int rdiff_span_scalar(const uint32_t *a, const uint32_t *b, int n, int *end)
+{
+    int i = 0;
+
+    while (i < n && a[i] == b[i])
+        ++i;
+    if (i == n)
+        return -1;
+    *end = rdiff_back_scalar(a, b, i, n);
+    return i;
+}
+
+#ifdef RDIFF_X86
+__attribute__((target("sse2")))
+static int rdiff_span_sse2(const uint32_t *a, const uint32_t *b, int n, int *end)
+{
+    int i, j;
+    unsigned diff;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        diff = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i *)(a + i)),
+            _mm_loadu_si128((const __m128i *)(b + i)))) & 0xFFFF;
+        if (diff) {
+            i += __builtin_ctz(diff) >> 2;
+            break;
+        }
+    }
+    while (i < n && a[i] == b[i])      /* the tail, or nothing after a break */
+        ++i;
+    if (i == n)
+        return -1;
+
+    for (j = n; j - 4 >= i; j -= 4) {
+        diff = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i *)(a + j - 4)),
+            _mm_loadu_si128((const __m128i *)(b + j - 4)))) & 0xFFFF;
+        if (diff) {
+            *end = j - 4 + ((31 - __builtin_clz(diff)) >> 2) + 1;
+            return i;
+        }
+    }
+    *end = rdiff_back_scalar(a, b, i, j);
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int rdiff_span_avx2(const uint32_t *a, const uint32_t *b, int n, int *end)
+{
+    int i, j;
+    unsigned diff;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(
+            _mm256_loadu_si256((const __m256i *)(a + i)),
+            _mm256_loadu_si256((const __m256i *)(b + i))));
+        if (diff) {
+            i += __builtin_ctz(diff) >> 2;
+            break;
+        }
+    }
+    while (i < n && a[i] == b[i])      /* the tail, or nothing after a break */
+        ++i;
+    if (i == n)
+        return -1;
+
+    for (j = n; j - 8 >= i; j -= 8) {
+        diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(
+            _mm256_loadu_si256((const __m256i *)(a + j - 8)),
+            _mm256_loadu_si256((const __m256i *)(b + j - 8))));
+        if (diff) {
+            *end = j - 8 + ((31 - __builtin_clz(diff)) >> 2) + 1;
+            return i;
+        }
+    }
+    *end = rdiff_back_scalar(a, b, i, j);
+    return i;
+}
+#endif
+
+static rdiff_fn rdiff_kernel;
+static const char *rdiff_name = "scalar";
+
+bool rdiff_set_kernel(enum rdiff_kernel kernel)
+{
+    const char *env;
+
+    if (kernel == RDIFF_AUTO) {
+        env = getenv("UEMACS_DISPLAY_SIMD");
+        kernel = RDIFF_SCALAR;
+#ifdef RDIFF_X86
+        if (!(env && strcmp(env, "0") == 0)) {
+            __builtin_cpu_init();
+            kernel = __builtin_cpu_supports("avx2") ? RDIFF_AVX2 : RDIFF_SSE2;
+        }
+#else
+        (void)env;
+#endif
+    }
+
+    switch (kernel) {
+    case RDIFF_SCALAR:
+        rdiff_kernel = rdiff_span_scalar;
+        rdiff_name = "scalar";
+        return true;
+#ifdef RDIFF_X86
+    case RDIFF_SSE2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("sse2"))
+            return false;
+        rdiff_kernel = rdiff_span_sse2;
+        rdiff_name = "sse2";
+        return true;
+    case RDIFF_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2"))
+            return false;
+        rdiff_kernel = rdiff_span_avx2;
+        rdiff_name = "avx2";
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *rdiff_kernel_name(void)
+{
+    if (!rdiff_kernel)
+        rdiff_set_kernel(RDIFF_AUTO);
+    return rdiff_name;
+}
+
+int rdiff_span(const uint32_t *a, const uint32_t *b, int n, int *end)
+{
+    if (!rdiff_kernel)
+        rdiff_set_kernel(RDIFF_AUTO);
+    return rdiff_kernel(a, b, n, end);
+}
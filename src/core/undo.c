@@ -1,11 +1,13 @@
 /*
- * undo.c - Per-buffer, circular-array-based C23 undo system.
+ * undo.c - Per-buffer, chunked append-only log C23 undo system.
  * Inspired by VSCode/GNU Emacs, designed for performance and correctness.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <time.h> // Required for struct timespec and clock_gettime
@@ -15,9 +17,12 @@
 #include "efunc.h"
 #include "evar.h"
 #include "line.h"
+#include "line_index.h"
 #include "memory.h"
 #include "error.h" // Required for REPORT_ERROR and ERR_MEMORY
 #include "undo.h"
+#include "undo_log.h"
+
 /* Helper: mark all windows showing bp to refresh their modelines */
 static inline void refresh_modelines_for_buffer(struct buffer *bp) {
     struct window *wp = wheadp;
@@ -29,96 +34,305 @@ static inline bool undo_is_word_byte(int ch) {
     return ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r';
 }
 
-// Per-buffer atomic undo stack
-#define UNDO_INITIAL_CAPACITY 100
-#define UNDO_MAX_CAPACITY 10000 // A reasonable upper limit for dynamic resizing
-
-// An undoable operation
-struct undo_operation {
-    enum edit_type type;
-    long dot_l;             // line number of change
-    int dot_o;              // offset on line
-    char *text_data;
-    int text_length;
-    uint64_t version_id;
-    struct timespec timestamp;
-    uint64_t group_id;      // grouping id for coalesced undo steps
-};
-
-// A circular array of undo operations for a buffer
-struct atomic_undo_stack {
-    struct undo_operation *operations;
-    _Atomic int capacity;
-    _Atomic int head;           // Index of the next slot to be written to
-    _Atomic int tail;           // Index of the oldest operation
-    _Atomic int undo_ptr;       // Index of the last operation that can be undone
-    _Atomic int count;          // Number of valid operations in the stack
-    _Atomic uint64_t version;
-    _Atomic bool in_operation;   // Prevents recursive undo/redo
-    _Atomic bool group_forced;   // Within an explicit group
-    _Atomic bool resize_failed;  // Prevents infinite resize attempts
-    _Atomic uint64_t current_group_id; // Current group id
-};
-
 // --- Private Functions ---
 
-// Frees the data associated with a single undo operation
-static void free_undo_operation(struct undo_operation *op) {
-    if (op && op->text_data) {
-        SAFE_FREE(op->text_data);
+static int64_t undo_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* The record just before the undo point, or NULL at the start of the log. */
+static struct undo_record *undo_before(struct atomic_undo_stack *stack,
+                                       struct undo_chunk **cp, size_t *offp) {
+    struct undo_chunk *c = stack->cur;
+    size_t off = stack->cur_off;
+    uint32_t sz;
+
+    while (c && off == 0) {
+        c = c->c_prev;
+        if (c)
+            off = c->c_used;
     }
+    if (!c)
+        return NULL;
+    sz = off == c->c_used ? (uint32_t)c->c_last : undo_rec_at(c, off)->r_prev;
+    off -= sz;
+    if (cp) { *cp = c; *offp = off; }
+    return undo_rec_at(c, off);
 }
 
-// --- Private Functions ---
+/* The record just after the undo point, or NULL at the end of the log. */
+static struct undo_record *undo_after(struct atomic_undo_stack *stack,
+                                      struct undo_chunk **cp, size_t *offp) {
+    struct undo_chunk *c = stack->cur;
+    size_t off = stack->cur_off;
 
-// Resizes the undo stack if it's full, doubling its capacity up to UNDO_MAX_CAPACITY
-static bool undo_stack_resize_if_needed(struct atomic_undo_stack *stack) {
-    if (atomic_load(&stack->count) < atomic_load(&stack->capacity)) {
-        return true; // No resize needed
+    while (c && off == c->c_used) {
+        c = c->c_next;
+        off = 0;
     }
+    if (!c)
+        return NULL;
+    if (cp) { *cp = c; *offp = off; }
+    return undo_rec_at(c, off);
+}
 
-    // If resize has already failed, don't keep trying
-    if (atomic_load(&stack->resize_failed)) {
-        return false;
-    }
+/*
+ * Like undo_before(), but when the records in memory run out, read older
+ * ones back from the history file.
+ */
+static struct undo_record *undo_back(struct atomic_undo_stack *stack,
+                                     struct undo_chunk **cp, size_t *offp) {
+    struct undo_record *rp;
+
+    while (!(rp = undo_before(stack, cp, offp)) && undo_persist_fetch(stack))
+        ;
+    return rp;
+}
+
+/* Size of the record before the start of chunk "c", 0 if none. */
+static uint32_t undo_prev_size(struct atomic_undo_stack *stack, struct undo_chunk *c) {
+    for (c = c ? c->c_prev : stack->last; c && c->c_used == 0; c = c->c_prev)
+        ;
+    return c ? (uint32_t)c->c_last : stack->p_prev;
+}
+
+/* Offset in the history file of position "off" in chunk "c". */
+size_t undo_log_offset(struct atomic_undo_stack *stack, struct undo_chunk *c, size_t off) {
+    struct undo_chunk *p;
 
-    if (atomic_load(&stack->capacity) >= UNDO_MAX_CAPACITY) {
-        atomic_store(&stack->resize_failed, true);
-        return false; // Cannot resize further
+    for (p = stack->first; p && p != c; p = p->c_next)
+        off += p->c_used;
+    return stack->p_base + off;
+}
+
+/* Buffer version at the undo point. */
+uint64_t undo_log_version(struct atomic_undo_stack *stack) {
+    struct undo_record *rp = undo_before(stack, NULL, NULL);
+    return rp ? rp->r_version : stack->base_version;
+}
+
+/* Forget everything after the undo point: a new edit ends the redo chain. */
+static void undo_truncate(struct atomic_undo_stack *stack) {
+    struct undo_chunk *c = stack->cur;
+    struct undo_chunk *next;
+
+    if (!c)
+        return;
+    if (stack->p_synced && (stack->cur_off < c->c_used || c->c_next)) {
+        size_t at = undo_log_offset(stack, c, stack->cur_off);
+        if (at < stack->p_synced)
+            stack->p_synced = at;   // The file is cut back on the next save
     }
+    if (stack->cur_off < c->c_used) {
+        c->c_last = stack->cur_off ? undo_rec_at(c, stack->cur_off)->r_prev : 0;
+        c->c_used = stack->cur_off;
+        stack->last_len = 0;
+    }
+    for (next = c->c_next; next; next = c->c_next) {
+        c->c_next = next->c_next;
+        stack->bytes -= sizeof(*next) + next->c_size;
+        SAFE_FREE(next);
+        stack->last_len = 0;
+    }
+    stack->last = c;
+}
 
-    int old_capacity = atomic_load(&stack->capacity);
-    int new_capacity = old_capacity * 2;
-    if (new_capacity > UNDO_MAX_CAPACITY) {
-        new_capacity = UNDO_MAX_CAPACITY;
+/* Drop the oldest chunks while the log is over budget. */
+static void undo_trim(struct atomic_undo_stack *stack) {
+    struct undo_chunk *c;
+
+    while (stack->bytes > UNDO_MAX_BYTES && stack->first != stack->cur) {
+        c = stack->first;
+        if (c->c_used > 0) {
+            stack->base_version = undo_rec_at(c, c->c_used - c->c_last)->r_version;
+            stack->p_prev = (uint32_t)c->c_last;
+        }
+        stack->p_base += c->c_used;
+        if (stack->p_synced < stack->p_base)
+            stack->p_synced = 0;    // Dropped before it was saved
+        stack->first = c->c_next;
+        stack->first->c_prev = NULL;
+        stack->bytes -= sizeof(*c) + c->c_size;
+        SAFE_FREE(c);
     }
+}
 
-    struct undo_operation *new_operations = safe_alloc(new_capacity * sizeof(struct undo_operation), "resized undo operations array", __FILE__, __LINE__);
-    if (!new_operations) {
-        atomic_store(&stack->resize_failed, true);
-        return false; // Allocation failed
+/*
+ * Room for a record of "size" bytes at the end of the log, which the
+ * caller fills in. Returns NULL if out of memory.
+ */
+static struct undo_record *undo_append(struct atomic_undo_stack *stack, size_t size) {
+    struct undo_chunk *c = stack->last;
+    struct undo_record *rp;
+
+    if (!c || c->c_size - c->c_used < size) {
+        size_t room = size > UNDO_CHUNK ? size : UNDO_CHUNK;
+        struct undo_chunk *nc = safe_alloc(sizeof(*nc) + room, "undo log chunk", __FILE__, __LINE__);
+        if (!nc)
+            return NULL;
+        nc->c_size = room;
+        nc->c_prev = c;
+        if (c)
+            c->c_next = nc;
+        else
+            stack->first = nc;
+        stack->last = nc;
+        stack->bytes += sizeof(*nc) + room;
+        c = nc;
     }
+    rp = undo_rec_at(c, c->c_used);
+    rp->r_size = (uint32_t)size;
+    rp->r_prev = c->c_used ? (uint32_t)c->c_last : undo_prev_size(stack, c);
+    c->c_used += size;
+    c->c_last = size;
+    stack->cur = c;
+    stack->cur_off = c->c_used;
+    return rp;
+}
 
-    // Copy existing operations, handling circular buffer wrap-around
-    int current_index = atomic_load(&stack->tail);
-    for (int i = 0; i < atomic_load(&stack->count); ++i) {
-        memcpy(&new_operations[i], &stack->operations[current_index], sizeof(struct undo_operation));
-        current_index = (current_index + 1) % old_capacity;
+/*
+ * Room for a record of "size" bytes at the undo point, leaving any redo
+ * records after it in place. The records following the point in its
+ * chunk move to a new chunk behind the new record.
+ */
+struct undo_record *undo_log_insert(struct atomic_undo_stack *stack, size_t size) {
+    struct undo_chunk *c = stack->cur;
+    struct undo_chunk *nc;
+    struct undo_record *rp;
+    size_t off = stack->cur_off;
+    size_t tail, room;
+    uint32_t prev;
+
+    if (!c || (off == c->c_used && c == stack->last))
+        return undo_append(stack, size);
+
+    tail = c->c_used - off;
+    room = size + tail > UNDO_CHUNK ? size + tail : UNDO_CHUNK;
+    nc = safe_alloc(sizeof(*nc) + room, "undo log chunk", __FILE__, __LINE__);
+    if (!nc)
+        return NULL;
+    if (tail == 0)
+        prev = c->c_used ? (uint32_t)c->c_last : undo_prev_size(stack, c);
+    else
+        prev = off ? undo_rec_at(c, off)->r_prev : undo_prev_size(stack, c);
+    memcpy(nc->c_data + size, c->c_data + off, tail);
+    nc->c_size = room;
+    nc->c_used = size + tail;
+    if (tail) {
+        undo_rec_at(nc, size)->r_prev = (uint32_t)size;
+        nc->c_last = c->c_last;
+        c->c_last = off ? prev : 0;
+    } else {
+        nc->c_last = size;
     }
+    c->c_used = off;
+
+    nc->c_prev = c;
+    nc->c_next = c->c_next;
+    if (c->c_next)
+        c->c_next->c_prev = nc;
+    else
+        stack->last = nc;
+    c->c_next = nc;
+    stack->bytes += sizeof(*nc) + room;
+
+    rp = undo_rec_at(nc, 0);
+    rp->r_size = (uint32_t)size;
+    rp->r_prev = prev;
+    stack->cur = nc;
+    stack->cur_off = size;
+    return rp;
+}
 
-    // Free old operations array
-    SAFE_FREE(stack->operations);
+/* Forget the whole log, in memory and on disk. */
+void undo_log_reset(struct atomic_undo_stack *stack) {
+    struct undo_chunk *c = stack->first;
 
-    // Update stack pointers atomically
-    stack->operations = new_operations;
-    atomic_store(&stack->capacity, new_capacity);
-    atomic_store(&stack->head, atomic_load(&stack->count)); // Head is now at the end of copied elements
-    atomic_store(&stack->tail, 0); // Tail is at the beginning of the new array
-    atomic_store(&stack->undo_ptr, atomic_load(&stack->count) - 1); // undo_ptr points to the last copied element
+    while (c) {
+        struct undo_chunk *next = c->c_next;
+        SAFE_FREE(c);
+        c = next;
+    }
+    undo_persist_release(stack);
+    stack->first = stack->last = stack->cur = NULL;
+    stack->cur_off = 0;
+    stack->bytes = 0;
+    stack->last_len = 0;
+}
 
+/*
+ * Make room for "extra" more text bytes in "rp", the last record of the
+ * log. Fails when that would overflow its chunk.
+ */
+static bool undo_grow(struct atomic_undo_stack *stack, struct undo_record *rp, int extra) {
+    struct undo_chunk *c = stack->last;
+    size_t size = undo_record_size(rp->r_len + extra);
+
+    if ((unsigned char *)rp != c->c_data + c->c_used - c->c_last
+        || c->c_size - (c->c_used - rp->r_size) < size)
+        return false;
+    c->c_used += size - rp->r_size;
+    c->c_last = size;
+    rp->r_size = (uint32_t)size;
+    stack->cur_off = c->c_used;
     return true;
 }
 
+/*
+ * Log one edit. "prev" is the last record when the edit follows it
+ * directly; the group decision has been made by the caller. The edit is
+ * merged into "prev" when it is in the same group and lands right where
+ * "prev" leaves off, and "prev" is not the saved state.
+ */
+static void undo_log(struct buffer *bp, enum edit_type type, long l, int o,
+                     const char *text, int len, uint64_t group_id,
+                     struct undo_record *prev, int64_t now) {
+    struct atomic_undo_stack *stack = bp->b_undo_stack;
+    struct undo_record *rp;
+
+    if (prev && prev->r_group == group_id && prev->r_type == type && prev->r_line == l
+        && prev->r_version != atomic_load(&bp->b_saved_version_id)) {
+        if (type == EDIT_INSERT && prev->r_off + prev->r_len == o
+            && !memchr(prev->r_text, '\n', prev->r_len) && undo_grow(stack, prev, len)) {
+            memcpy(prev->r_text + prev->r_len, text, len);
+            goto merged;
+        }
+        if (type == EDIT_DELETE && prev->r_off == o && undo_grow(stack, prev, len)) {
+            memcpy(prev->r_text + prev->r_len, text, len);  // forward delete
+            goto merged;
+        }
+        if (type == EDIT_DELETE && prev->r_off == o + len
+            && !memchr(text, '\n', len) && undo_grow(stack, prev, len)) {
+            memmove(prev->r_text + len, prev->r_text, prev->r_len);  // backspace
+            memcpy(prev->r_text, text, len);
+            prev->r_off = o;
+            goto merged;
+        }
+    }
+
+    if (!(rp = undo_append(stack, undo_record_size(len))))
+        return;     // Out of memory: this edit cannot be undone
+    rp->r_type = (uint8_t)type;
+    rp->r_line = l;
+    rp->r_off = o;
+    rp->r_len = len;
+    rp->r_group = group_id;
+    memcpy(rp->r_text, text, len);
+    rp->r_text[len] = '\0';
+    rp->r_version = atomic_fetch_add(&stack->version, 1);
+    rp->r_stamp = now;
+    undo_trim(stack);
+    return;
+
+merged:
+    prev->r_len += len;
+    prev->r_text[prev->r_len] = '\0';
+    prev->r_version = atomic_fetch_add(&stack->version, 1);
+    prev->r_stamp = now;
+}
+
 // --- Public API ---
 
 // Creates and initializes a new undo stack for a buffer.
@@ -126,21 +340,10 @@ struct atomic_undo_stack *undo_stack_create(void) {
     struct atomic_undo_stack *stack = safe_alloc(sizeof(struct atomic_undo_stack), "undo stack", __FILE__, __LINE__);
     if (!stack) return NULL;
 
-    stack->operations = safe_alloc(UNDO_INITIAL_CAPACITY * sizeof(struct undo_operation), "undo operations array", __FILE__, __LINE__);
-    if (!stack->operations) {
-        SAFE_FREE(stack);
-        return NULL;
-    }
-
-    atomic_store(&stack->capacity, UNDO_INITIAL_CAPACITY);
-    atomic_store(&stack->head, 0);
-    atomic_store(&stack->tail, 0);
-    atomic_store(&stack->undo_ptr, -1);
-    atomic_store(&stack->count, 0);
-    atomic_store(&stack->version, 1);
+    stack->base_version = 1;
+    atomic_store(&stack->version, 2);
     atomic_store(&stack->in_operation, false);
     atomic_store(&stack->group_forced, false);
-    atomic_store(&stack->resize_failed, false);
     atomic_store(&stack->current_group_id, 1);
 
     return stack;
@@ -150,192 +353,131 @@ struct atomic_undo_stack *undo_stack_create(void) {
 void undo_stack_destroy(struct atomic_undo_stack *stack) {
     if (!stack) return;
 
-    for (int i = 0; i < atomic_load(&stack->capacity); ++i) {
-        free_undo_operation(&stack->operations[i]);
-    }
-    SAFE_FREE(stack->operations);
+    undo_log_reset(stack);
     SAFE_FREE(stack);
 }
 
+// Bytes held by the undo log of a buffer.
+size_t undo_memory(struct buffer *bp) {
+    if (!bp || !bp->b_undo_stack) return 0;
+    return bp->b_undo_stack->bytes;
+}
+
 // Records a text insertion for undo.
 void undo_record_insert(struct buffer *bp, long l, int o, const char *text, int len) {
-    if (!bp || !bp->b_undo_stack || !text) return;
+    if (!bp || !bp->b_undo_stack || !text || len <= 0) return;
     struct atomic_undo_stack *stack = bp->b_undo_stack;
 
     if (atomic_load(&stack->in_operation)) return;
 
-    // Resize if needed before adding new operation
-    if (!undo_stack_resize_if_needed(stack)) {
-        // Silently disable undo to prevent infinite error loop
-        atomic_store(&stack->resize_failed, true);
-        return;
-    }
-
     // Invalidate any "redo" operations
-    int undo_ptr = atomic_load(&stack->undo_ptr);
-    if (undo_ptr != (atomic_load(&stack->head) - 1 + atomic_load(&stack->capacity)) % atomic_load(&stack->capacity)) {
-        int current = (undo_ptr + 1) % atomic_load(&stack->capacity);
-        while (current != atomic_load(&stack->head)) {
-            free_undo_operation(&stack->operations[current]);
-            atomic_fetch_sub(&stack->count, 1);
-            current = (current + 1) % atomic_load(&stack->capacity);
-        }
-        atomic_store(&stack->head, (undo_ptr + 1) % atomic_load(&stack->capacity));
-    }
+    undo_truncate(stack);
 
-    // Get the next slot
-    int head = atomic_load(&stack->head);
-    struct undo_operation *op = &stack->operations[head];
-    free_undo_operation(op); // Free any old data at this slot
-
-    op->type = EDIT_INSERT;
-    op->dot_l = l;
-    op->dot_o = o;
-    op->text_length = len;
-    op->version_id = atomic_fetch_add(&stack->version, 1);
-    clock_gettime(CLOCK_MONOTONIC, &op->timestamp);
-    op->text_data = safe_alloc(len + 1, "undo text", __FILE__, __LINE__);
-    if (op->text_data) {
-        memcpy(op->text_data, text, len);
-        op->text_data[len] = '\0';
-    }
+    int64_t now = undo_now_ns();
+    struct undo_record *prev = undo_before(stack, NULL, NULL);
 
     // Assign grouping id (auto or forced)
     uint64_t group_id = atomic_load(&stack->current_group_id);
     bool forced = atomic_load(&stack->group_forced);
     if (!forced) {
         // Auto-group with previous op if insertion at adjacent location and recent
-        int prev_idx = (head - 1 + atomic_load(&stack->capacity)) % atomic_load(&stack->capacity);
-        if (atomic_load(&stack->count) > 0) {
-            struct undo_operation *prev = &stack->operations[prev_idx];
-            if (prev->type == EDIT_INSERT && prev->dot_l == l && (prev->dot_o + prev->text_length == o)) {
-                long dt_ns = (op->timestamp.tv_sec - prev->timestamp.tv_sec) * 1000000000LL + (op->timestamp.tv_nsec - prev->timestamp.tv_nsec);
-                bool time_ok = (dt_ns >= 0 && dt_ns < 400000000); // 400ms
-                bool single_char = (len == 1 && prev->text_length == 1);
-                bool keep_group = time_ok;
-                if (single_char && prev->text_data && op->text_data) {
-                    int a = (unsigned char)op->text_data[0];
-                    int b = (unsigned char)prev->text_data[0];
-                    // Keep grouping for word characters; break when transitioning into a new word
-                    if (undo_is_word_byte(a) && undo_is_word_byte(b)) {
-                        keep_group = keep_group && true;
-                    } else if (!undo_is_word_byte(a)) {
-                        // Whitespace: safe to keep grouping
-                        keep_group = keep_group && true;
-                    } else {
-                        keep_group = false;
-                    }
+        if (prev && prev->r_type == EDIT_INSERT && prev->r_line == l && (prev->r_off + prev->r_len == o)) {
+            int64_t dt_ns = now - prev->r_stamp;
+            bool time_ok = (dt_ns >= 0 && dt_ns < UNDO_GROUP_NS);
+            bool single_char = (len == 1 && stack->last_len == 1);
+            bool keep_group = time_ok;
+            if (single_char) {
+                int a = (unsigned char)text[0];
+                int b = stack->last_byte;
+                // Keep grouping for word characters and whitespace; break when
+                // transitioning into a new word
+                if (undo_is_word_byte(a) && !undo_is_word_byte(b)) {
+                    keep_group = false;
                 }
-                group_id = keep_group ? prev->group_id : (atomic_fetch_add(&stack->current_group_id, 1) + 1);
-            } else {
-                group_id = atomic_fetch_add(&stack->current_group_id, 1) + 1;
             }
+            group_id = keep_group ? prev->r_group : (atomic_fetch_add(&stack->current_group_id, 1) + 1);
         } else {
             group_id = atomic_fetch_add(&stack->current_group_id, 1) + 1;
         }
     }
-    op->group_id = group_id;
 
-    // Advance head and undo_ptr
-    atomic_store(&stack->head, (head + 1) % atomic_load(&stack->capacity));
-    atomic_store(&stack->undo_ptr, head);
-
-    // Manage count and tail for circular buffer
-    if (atomic_load(&stack->count) < atomic_load(&stack->capacity)) {
-        atomic_fetch_add(&stack->count, 1);
-    } else {
-        atomic_store(&stack->tail, (atomic_load(&stack->tail) + 1) % atomic_load(&stack->capacity));
-    }
+    undo_log(bp, EDIT_INSERT, l, o, text, len, group_id, prev, now);
+    stack->last_len = len;
+    stack->last_byte = (unsigned char)text[len - 1];
 }
 
 // Records a text deletion for undo.
 void undo_record_delete(struct buffer *bp, long l, int o, const char *text, int len) {
-    if (!bp || !bp->b_undo_stack || !text) return;
+    if (!bp || !bp->b_undo_stack || !text || len <= 0) return;
     struct atomic_undo_stack *stack = bp->b_undo_stack;
 
     if (atomic_load(&stack->in_operation)) return;
 
-    // Resize if needed before adding new operation
-    if (!undo_stack_resize_if_needed(stack)) {
-        // Silently disable undo to prevent infinite error loop
-        atomic_store(&stack->resize_failed, true);
-        return;
-    }
-
     // Invalidate any "redo" operations (same logic as insert)
-    int undo_ptr = atomic_load(&stack->undo_ptr);
-    if (undo_ptr != (atomic_load(&stack->head) - 1 + atomic_load(&stack->capacity)) % atomic_load(&stack->capacity)) {
-        int current = (undo_ptr + 1) % atomic_load(&stack->capacity);
-        while (current != atomic_load(&stack->head)) {
-            free_undo_operation(&stack->operations[current]);
-            atomic_fetch_sub(&stack->count, 1);
-            current = (current + 1) % atomic_load(&stack->capacity);
-        }
-        atomic_store(&stack->head, (undo_ptr + 1) % atomic_load(&stack->capacity));
-    }
+    undo_truncate(stack);
 
-    // Get the next slot
-    int head = atomic_load(&stack->head);
-    struct undo_operation *op = &stack->operations[head];
-    free_undo_operation(op);
-
-    op->type = EDIT_DELETE;
-    op->dot_l = l;
-    op->dot_o = o;
-    op->text_length = len;
-    op->version_id = atomic_fetch_add(&stack->version, 1);
-    clock_gettime(CLOCK_MONOTONIC, &op->timestamp);
-    op->text_data = safe_alloc(len + 1, "undo text", __FILE__, __LINE__);
-    if (op->text_data) {
-        memcpy(op->text_data, text, len);
-        op->text_data[len] = '\0';
-    }
+    int64_t now = undo_now_ns();
+    struct undo_record *prev = undo_before(stack, NULL, NULL);
 
     // Assign grouping id (auto or forced)
     uint64_t group_id = atomic_load(&stack->current_group_id);
     bool forced = atomic_load(&stack->group_forced);
     if (!forced) {
-        int prev_idx = (head - 1 + atomic_load(&stack->capacity)) % atomic_load(&stack->capacity);
-        if (atomic_load(&stack->count) > 0) {
-            struct undo_operation *prev = &stack->operations[prev_idx];
-            long dt_ns = (op->timestamp.tv_sec - prev->timestamp.tv_sec) * 1000000000LL + (op->timestamp.tv_nsec - prev->timestamp.tv_nsec);
-            bool time_ok = (dt_ns >= 0 && dt_ns < 400000000);
-            bool same_line = (prev->dot_l == l);
-            bool same_offset = (prev->dot_o == o); // forward delete
-            bool backspace_adjacent = (prev->dot_o == o + op->text_length);
-            bool single_char = (len == 1 && prev->text_length == 1);
+        if (prev) {
+            int64_t dt_ns = now - prev->r_stamp;
+            bool time_ok = (dt_ns >= 0 && dt_ns < UNDO_GROUP_NS);
+            bool same_line = (prev->r_line == l);
+            bool same_offset = (prev->r_off == o); // forward delete
+            bool backspace_adjacent = (prev->r_off == o + len);
+            bool single_char = (len == 1 && stack->last_len == 1);
             bool keep_group = false;
-            if (prev->type == EDIT_DELETE && same_line && time_ok && (same_offset || backspace_adjacent)) {
+            if (prev->r_type == EDIT_DELETE && same_line && time_ok && (same_offset || backspace_adjacent)) {
                 keep_group = true;
-                if (single_char && prev->text_data && op->text_data) {
-                    int a = (unsigned char)op->text_data[0];
-                    int b = (unsigned char)prev->text_data[0];
-                    if (undo_is_word_byte(a) && undo_is_word_byte(b)) {
-                        keep_group = keep_group && true;
-                    } else if (!undo_is_word_byte(a)) {
-                        keep_group = keep_group && true;
-                    } else {
+                if (single_char) {
+                    int a = (unsigned char)text[0];
+                    int b = stack->last_byte;
+                    if (undo_is_word_byte(a) && !undo_is_word_byte(b)) {
                         keep_group = false;
                     }
                 }
             }
-            group_id = keep_group ? prev->group_id : (atomic_fetch_add(&stack->current_group_id, 1) + 1);
+            group_id = keep_group ? prev->r_group : (atomic_fetch_add(&stack->current_group_id, 1) + 1);
         } else {
             group_id = atomic_fetch_add(&stack->current_group_id, 1) + 1;
         }
     }
-    op->group_id = group_id;
 
-    // Advance head and undo_ptr
-    atomic_store(&stack->head, (head + 1) % atomic_load(&stack->capacity));
-    atomic_store(&stack->undo_ptr, head);
+    undo_log(bp, EDIT_DELETE, l, o, text, len, group_id, prev, now);
+    stack->last_len = len;
+    stack->last_byte = (unsigned char)text[0];
+}
 
-    // Manage count and tail for circular buffer
-    if (atomic_load(&stack->count) < atomic_load(&stack->capacity)) {
-        atomic_fetch_add(&stack->count, 1);
+/*
+ * Undo ("revert") or redo one record at its place in the current window.
+ * Records read back from a history file may not fit the text; their place
+ * is kept within the buffer (past the last line is its end).
+ */
+static bool undo_apply(struct undo_record *rp, bool revert) {
+    long line = rp->r_line;
+
+    if (line < 0 || line > lindex_count(curbp))
+        line = 0;
+    gotoline(TRUE, (int)line);
+    curwp->w_doto = rp->r_off < 0 ? 0
+        : rp->r_off > llength(curwp->w_dotp) ? llength(curwp->w_dotp) : rp->r_off;
+    if ((rp->r_type == EDIT_INSERT) == revert)
+        return ldelete(rp->r_len, FALSE);
+    return linsert_str(rp->r_text);
+}
+
+/* Clean/dirty decision: clean if the undo point is at the saved version */
+static void undo_update_changed(struct buffer *bp) {
+    if (undo_log_version(bp->b_undo_stack) == atomic_load(&bp->b_saved_version_id)) {
+        bp->b_flag &= ~BFCHG;
     } else {
-        atomic_store(&stack->tail, (atomic_load(&stack->tail) + 1) % atomic_load(&stack->capacity));
+        bp->b_flag |= BFCHG;
     }
+    refresh_modelines_for_buffer(bp);
 }
 
 // Performs an undo operation on the given buffer.
@@ -344,61 +486,35 @@ int undo_operation(struct buffer *bp) {
     struct atomic_undo_stack *stack = bp->b_undo_stack;
 
     if (atomic_load(&stack->in_operation)) return FALSE;
-    
-    int undo_ptr = atomic_load(&stack->undo_ptr);
-    if (undo_ptr == -1 || undo_ptr == (atomic_load(&stack->tail) - 1 + atomic_load(&stack->capacity)) % atomic_load(&stack->capacity)) {
+
+    struct undo_chunk *c;
+    size_t off;
+    struct undo_record *rp;
+    while ((rp = undo_back(stack, &c, &off)) && rp->r_type == UNDO_SAVED) {
+        stack->cur = c;     // Step back over save points
+        stack->cur_off = off;
+    }
+    if (!rp) {
         return FALSE; // Nothing to undo
     }
 
-    struct undo_operation *op = &stack->operations[undo_ptr];
     atomic_store(&stack->in_operation, true);
 
-    gotoline(TRUE, op->dot_l);
-    curwp->w_doto = op->dot_o;
-
+    // Undo all operations in the same group, newest first
+    uint64_t gid = rp->r_group;
     bool success = false;
-    if (op->type == EDIT_INSERT) {
-        success = ldelete(op->text_length, FALSE);
-    } else if (op->type == EDIT_DELETE) {
-        success = linsert_str(op->text_data);
-    }
+    do {
+        if (!undo_apply(rp, true)) break;
+        success = true;
+        stack->cur = c;
+        stack->cur_off = off;
+    } while ((rp = undo_back(stack, &c, &off)) && rp->r_group == gid);
 
     if (success) {
-        // Undo all operations in the same group
-        uint64_t gid = op->group_id;
-        int cap = atomic_load(&stack->capacity);
-        int cursor = undo_ptr;
-        while (true) {
-            int prev = (cursor - 1 + cap) % cap;
-            if (prev == ((atomic_load(&stack->tail) - 1 + cap) % cap)) break;
-            struct undo_operation *pop = &stack->operations[prev];
-            if (pop->group_id != gid) break;
-            // apply previous op in group
-            gotoline(TRUE, pop->dot_l);
-            curwp->w_doto = pop->dot_o;
-            if (pop->type == EDIT_INSERT) {
-                if (!ldelete(pop->text_length, FALSE)) break;
-            } else if (pop->type == EDIT_DELETE) {
-                if (!linsert_str(pop->text_data)) break;
-            } else {
-                break;
-            }
-            cursor = prev;
-        }
-        atomic_store(&stack->undo_ptr, (cursor - 1 + cap) % cap);
-
-        // Clean/dirty decision: if current version equals saved_version, we are clean
-        uint64_t cur_version = (atomic_load(&stack->undo_ptr) == -1)
-            ? 1
-            : stack->operations[atomic_load(&stack->undo_ptr)].version_id;
-        if (cur_version == atomic_load(&bp->b_saved_version_id)) {
-            bp->b_flag &= ~BFCHG;
-        } else {
-            bp->b_flag |= BFCHG;
-        }
-        refresh_modelines_for_buffer(bp);
+        stack->last_len = 0;
+        undo_update_changed(bp);
     }
-    
+
     curwp->w_flag |= WFHARD;
     atomic_store(&stack->in_operation, false);
     return success ? TRUE : FALSE;
@@ -411,66 +527,32 @@ int redo_operation(struct buffer *bp) {
 
     if (atomic_load(&stack->in_operation)) return FALSE;
 
-    int undo_ptr = atomic_load(&stack->undo_ptr);
-    int capacity = atomic_load(&stack->capacity);
-    int head = atomic_load(&stack->head);
-    
-    // If undo_ptr is -1, we're at the beginning, so redo from tail
-    int redo_ptr;
-    if (undo_ptr == -1) {
-        redo_ptr = atomic_load(&stack->tail);
-    } else {
-        redo_ptr = (undo_ptr + 1) % capacity;
+    struct undo_chunk *c;
+    size_t off;
+    struct undo_record *rp;
+    while ((rp = undo_after(stack, &c, &off)) && rp->r_type == UNDO_SAVED) {
+        stack->cur = c;     // Step over save points
+        stack->cur_off = off + rp->r_size;
     }
-
-    if (redo_ptr == head) {
+    if (!rp) {
         return FALSE; // Nothing to redo
     }
 
-    struct undo_operation *op = &stack->operations[redo_ptr];
     atomic_store(&stack->in_operation, true);
 
-    gotoline(TRUE, op->dot_l);
-    curwp->w_doto = op->dot_o;
-
+    // Redo all operations in the same group, oldest first
+    uint64_t gid = rp->r_group;
     bool success = false;
-    if (op->type == EDIT_INSERT) {
-        success = linsert_str(op->text_data);
-    } else if (op->type == EDIT_DELETE) {
-        success = ldelete(op->text_length, FALSE);
-    }
+    do {
+        if (!undo_apply(rp, false)) break;
+        success = true;
+        stack->cur = c;
+        stack->cur_off = off + rp->r_size;
+    } while ((rp = undo_after(stack, &c, &off)) && rp->r_group == gid);
 
     if (success) {
-        // Redo all operations in the same group
-        uint64_t gid = op->group_id;
-        int cap = atomic_load(&stack->capacity);
-        int cursor = redo_ptr;
-        while (true) {
-            int next = (cursor + 1) % cap;
-            if (next == atomic_load(&stack->head)) break;
-            struct undo_operation *nop = &stack->operations[next];
-            if (nop->group_id != gid) break;
-            gotoline(TRUE, nop->dot_l);
-            curwp->w_doto = nop->dot_o;
-            if (nop->type == EDIT_INSERT) {
-                if (!linsert_str(nop->text_data)) break;
-            } else if (nop->type == EDIT_DELETE) {
-                if (!ldelete(nop->text_length, FALSE)) break;
-            } else {
-                break;
-            }
-            cursor = next;
-        }
-        atomic_store(&stack->undo_ptr, cursor);
-
-        // Clean/dirty decision vs saved baseline
-        uint64_t cur_version = stack->operations[cursor].version_id;
-        if (cur_version == atomic_load(&bp->b_saved_version_id)) {
-            bp->b_flag &= ~BFCHG;
-        } else {
-            bp->b_flag |= BFCHG;
-        }
-        refresh_modelines_for_buffer(bp);
+        stack->last_len = 0;
+        undo_update_changed(bp);
     }
 
     curwp->w_flag |= WFHARD;
@@ -492,16 +574,16 @@ int redo_cmd(int f, int n) {
 /* Mark current state as saved baseline for clean/dirty checks */
 void undo_mark_saved(struct buffer *bp) {
     if (!bp || !bp->b_undo_stack) return;
-    struct atomic_undo_stack *stack = bp->b_undo_stack;
-    int up = atomic_load(&stack->undo_ptr);
-    uint64_t version = (up == -1) ? 1 : stack->operations[up].version_id;
-    atomic_store(&bp->b_saved_version_id, version);
+    atomic_store(&bp->b_saved_version_id, undo_log_version(bp->b_undo_stack));
     bp->b_flag &= ~BFCHG;
     refresh_modelines_for_buffer(bp);
 }
 
 void undo_group_begin(struct buffer *bp) {
     if (!bp || !bp->b_undo_stack) return;
+    // Start from a fresh group id so the group never joins the edit before it
+    if (!atomic_load(&bp->b_undo_stack->group_forced))
+        atomic_fetch_add(&bp->b_undo_stack->current_group_id, 1);
     atomic_store(&bp->b_undo_stack->group_forced, true);
 }
 
@@ -1,31 +1,528 @@
 /*
- * undo_persist.c - Stub for undo history persistence (WIP)
- * This file provides stub functions for saving/loading undo history for a buffer.
+ * undo_persist.c - Undo history kept on disk across sessions.
+ *
+ * A buffer's history file holds a small header and then the undo log
+ * records exactly as they lie in memory (see undo_log.h). Every save
+ * appends the records made since the last one, followed by a save point
+ * that carries a hash of the text as written, and syncs the file once.
+ * Undoing back past a save point that was never written, or running out
+ * of memory for the log, makes the next save rewrite the file instead.
+ *
+ * Reading a file back only checks that its last save point matches the
+ * buffer text; the records themselves stay in the mapped file until
+ * undo walks back to them, a chunk at a time.
+ *
+ * History files are named after a hash of the file's full path and live
+ * in the directory given by UEMACS_UNDO_HISTORY ("1" picks
+ * $XDG_STATE_HOME/uemacs/undo); without it nothing is kept.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include "estruct.h"
 #include "edef.h"
+#include "efunc.h"
+#include "line.h"
+#include "memory.h"
+#include "string_utils.h"
 #include "undo.h"
-#include <stdio.h>
-#include <stdbool.h>
+#include "undo_log.h"
+#include "μemacs/gapbuffer.h"
+
+#define UNDO_MAGIC   "uEmUndo\n"
+#define UNDO_FORMAT  1
+
+struct undo_file_header {
+    char h_magic[8];        // UNDO_MAGIC
+    uint32_t h_format;      // UNDO_FORMAT
+    uint32_t h_recsize;     // record header size, catches layout changes
+    uint64_t h_base;        // buffer version before the first record
+    uint64_t h_pad;
+};
+
+// Text of a save point record
+struct undo_saved {
+    uint64_t s_hash;        // hash of the text as saved
+    uint64_t s_length;      // ... and its length
+    uint64_t s_group;       // last group id handed out
+};
+
+#define UNDO_HDRSIZE   sizeof(struct undo_file_header)
+#define UNDO_SAVEDSIZE undo_record_size((int)sizeof(struct undo_saved))
+
+// --- Content hash ---
 
-// Serialize undo stack to file (stub)
+struct undo_hash {
+    uint64_t h;
+    uint64_t n;             // bytes hashed
+    uint64_t w;             // partial word
+    int k;                  // bytes in it
+};
+
+static inline uint64_t undo_mix(uint64_t h, uint64_t w) {
+    h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+/* Hash "len" bytes a word at a time, carrying odd bytes over to the next call. */
+static void undo_hash_feed(struct undo_hash *st, const unsigned char *p, size_t len) {
+    uint64_t w;
+
+    st->n += len;
+    while (st->k > 0 && len > 0) {
+        st->w |= (uint64_t)*p++ << (8 * st->k);
+        --len;
+        if (++st->k == 8) {
+            st->h = undo_mix(st->h, st->w);
+            st->w = 0;
+            st->k = 0;
+        }
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        st->h = undo_mix(st->h, w);
+    }
+    for (; len > 0; --len)
+        st->w |= (uint64_t)*p++ << (8 * st->k++);
+}
+
+static uint64_t undo_hash_done(struct undo_hash *st) {
+    uint64_t h = undo_mix(undo_mix(st->h, st->w), st->n);
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 29);
+}
+
+/* Hash of the text of "bp" as writeout() puts it on disk. */
+static uint64_t undo_content_hash(struct buffer *bp, uint64_t *lenp) {
+    struct undo_hash st = { 0x6A09E667F3BCC908ULL, 0, 0, 0 };
+    struct line *lp;
+
+    if (bp->b_storage == BSTORE_GAP) {
+        struct gap_buffer *gb = bp->b_gap;
+        undo_hash_feed(&st, (const unsigned char *)gb->data, gb->gap_start);
+        undo_hash_feed(&st, (const unsigned char *)gb->data + gb->gap_end,
+                       gb->capacity - gb->gap_end);
+    } else {
+        for (lp = lforw(bp->b_linep); lp != bp->b_linep; lp = lforw(lp)) {
+            undo_hash_feed(&st, (const unsigned char *)lp->l_text, (size_t)llength(lp));
+            undo_hash_feed(&st, (const unsigned char *)"\n", 1);
+        }
+    }
+    *lenp = st.n;
+    return undo_hash_done(&st);
+}
+
+// --- History file I/O ---
+
+static void undo_unmap(struct atomic_undo_stack *stack) {
+    if (stack->p_map)
+        munmap((void *)stack->p_map, stack->p_maplen);
+    stack->p_map = NULL;
+    stack->p_maplen = 0;
+}
+
+/* Map the whole history file, for reading old records back. */
+static bool undo_map(struct atomic_undo_stack *stack) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    undo_unmap(stack);
+    if ((fd = open(stack->p_path, O_RDONLY)) < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)UNDO_HDRSIZE) {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    stack->p_map = map;
+    stack->p_maplen = (size_t)st.st_size;
+    return true;
+}
+
+/* Write log offsets ["from", "to") of the records in memory to "fd". */
+static bool undo_write_range(struct atomic_undo_stack *stack, int fd, size_t from, size_t to) {
+    struct iovec iov[64];
+    struct undo_chunk *c;
+    size_t pos = stack->p_base;
+    size_t a, b;
+    int n = 0;
+    ssize_t w;
+
+    for (c = stack->first; c && pos < to; pos += c->c_used, c = c->c_next) {
+        a = from > pos ? from - pos : 0;
+        b = to - pos < c->c_used ? to - pos : c->c_used;
+        if (a < b) {
+            iov[n].iov_base = c->c_data + a;
+            iov[n++].iov_len = b - a;
+        }
+        if (n < 64 && c->c_next && pos + c->c_used < to)
+            continue;
+        // Flush the gathered pieces, picking up after short writes
+        struct iovec *v = iov;
+        while (n > 0) {
+            if ((w = writev(fd, v, n)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            while (n > 0 && (size_t)w >= v->iov_len) {
+                w -= (ssize_t)v->iov_len;
+                ++v;
+                --n;
+            }
+            if (n > 0) {
+                v->iov_base = (char *)v->iov_base + w;
+                v->iov_len -= (size_t)w;
+            }
+        }
+    }
+    return true;
+}
+
+/* Write the log up to "end" to a new file that replaces "filename". */
+static bool undo_rewrite(struct atomic_undo_stack *stack, const char *filename, size_t end) {
+    struct undo_file_header hdr;
+    char tmp[PATH_MAX];
+    int fd;
+    bool ok;
+
+    safe_snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename);
+    if ((fd = mkstemp(tmp)) < 0)
+        return false;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.h_magic, UNDO_MAGIC, sizeof(hdr.h_magic));
+    hdr.h_format = UNDO_FORMAT;
+    hdr.h_recsize = (uint32_t)offsetof(struct undo_record, r_text);
+    hdr.h_base = stack->base_version;
+    ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr)
+        && undo_write_range(stack, fd, stack->p_base, end)
+        && fsync(fd) == 0;
+    if (close(fd) != 0)
+        ok = false;
+    if (!ok || rename(tmp, filename) != 0) {
+        unlink(tmp);
+        return false;
+    }
+
+    // Older records only the old file had are gone now
+    undo_unmap(stack);
+    stack->p_prev = 0;
+    stack->p_synced = UNDO_HDRSIZE + (end - stack->p_base);
+    stack->p_base = UNDO_HDRSIZE;
+    return true;
+}
+
+/*
+ * Whether a record read back from the history file, "sz" bytes long by the
+ * record after it, is whole: undo_apply() trusts its length, its text and
+ * its type as much as those of a record it logged itself.
+ */
+static bool undo_record_sane(const struct undo_record *rp, uint32_t sz) {
+    if (rp->r_size != sz || rp->r_len < 0 || undo_record_size(rp->r_len) != sz)
+        return false;
+    if (rp->r_text[rp->r_len] != '\0')
+        return false;
+    switch (rp->r_type) {
+    case EDIT_INSERT:
+    case EDIT_DELETE:
+        return true;
+    case UNDO_SAVED:
+        return rp->r_len == (int)sizeof(struct undo_saved);
+    default:
+        return false;
+    }
+}
+
+/*
+ * Copy the chunk's worth of records just before the first one in memory
+ * back from the history file. Returns false when there are none left.
+ */
+bool undo_persist_fetch(struct atomic_undo_stack *stack) {
+    const size_t minrec = undo_record_size(0);
+    struct undo_chunk *nc;
+    struct undo_record *rp;
+    size_t start, end;
+    uint32_t sz;
+    bool damaged = false;
+
+    if (!stack->p_path || stack->p_base <= UNDO_HDRSIZE || stack->p_synced < stack->p_base)
+        return false;
+    if ((!stack->p_map || stack->p_maplen < stack->p_base) && !undo_map(stack))
+        return false;
+
+    // Walk back over whole records, checking each one fits where it claims
+    end = start = stack->p_base;
+    sz = stack->p_prev;
+    while (start > UNDO_HDRSIZE && end - start < UNDO_CHUNK) {
+        if (sz < minrec || sz % 8 || sz > start - UNDO_HDRSIZE) {
+            damaged = true;
+            break;
+        }
+        rp = (struct undo_record *)(stack->p_map + start - sz);
+        if (!undo_record_sane(rp, sz)) {
+            damaged = true;
+            break;
+        }
+        start -= sz;
+        sz = rp->r_prev;
+    }
+    if (start == end) {
+        stack->p_synced = 0;    // Damaged: stop here and start afresh on save
+        return false;
+    }
+
+    nc = safe_alloc(sizeof(*nc) + (end - start > UNDO_CHUNK ? end - start : UNDO_CHUNK),
+                    "undo log chunk", __FILE__, __LINE__);
+    if (!nc)
+        return false;
+    nc->c_size = end - start > UNDO_CHUNK ? end - start : UNDO_CHUNK;
+    nc->c_used = end - start;
+    nc->c_last = stack->p_prev;
+    memcpy(nc->c_data, stack->p_map + start, end - start);
+    nc->c_next = stack->first;
+    if (stack->first)
+        stack->first->c_prev = nc;
+    else
+        stack->last = nc;
+    stack->first = nc;
+    stack->bytes += sizeof(*nc) + nc->c_size;
+    if (!stack->cur) {
+        stack->cur = nc;
+        stack->cur_off = nc->c_used;
+    }
+
+    if (!damaged && start > UNDO_HDRSIZE && sz >= minrec && sz <= start - UNDO_HDRSIZE) {
+        stack->base_version = ((struct undo_record *)(stack->p_map + start - sz))->r_version;
+        stack->p_prev = sz;
+    } else {
+        stack->base_version = ((const struct undo_file_header *)stack->p_map)->h_base;
+        stack->p_prev = 0;
+        if (start > UNDO_HDRSIZE)
+            stack->p_synced = 0;    // Cannot go further back
+    }
+    stack->p_base = start;
+    return true;
+}
+
+/* Drop the history file connection of a log. */
+void undo_persist_release(struct atomic_undo_stack *stack) {
+    undo_unmap(stack);
+    if (stack->p_path)
+        SAFE_FREE(stack->p_path);
+    stack->p_path = NULL;
+    stack->p_base = 0;
+    stack->p_prev = 0;
+    stack->p_synced = 0;
+}
+
+// --- Public API ---
+
+/*
+ * Bring the history file "filename" of "bp" up to date: mark the undo
+ * point as a save point of the current text, and append what the file
+ * lacks. Call this right after the buffer has been written out.
+ */
 bool undo_stack_save_to_file(struct buffer *bp, const char *filename) {
-    // TODO: Serialize bp->b_undo_stack to disk
-    // For now, just create the file and write a stub header
-    FILE *f = fopen(filename, "w");
-    if (!f) return false;
-    fprintf(f, "# μEmacs Undo History (stub)\n");
-    fclose(f);
+    struct atomic_undo_stack *stack;
+    struct undo_record *rp;
+    struct undo_saved sv;
+    struct timespec ts;
+    struct stat st;
+    size_t end;
+    bool ok;
+    int fd;
+
+    if (!bp || !(stack = bp->b_undo_stack) || !filename)
+        return false;
+
+    sv.s_hash = undo_content_hash(bp, &sv.s_length);
+    sv.s_group = atomic_load(&stack->current_group_id);
+    uint64_t version = undo_log_version(stack);
+    if (!(rp = undo_log_insert(stack, UNDO_SAVEDSIZE)))
+        return false;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rp->r_type = UNDO_SAVED;
+    rp->r_len = (int)sizeof(sv);
+    rp->r_off = 0;
+    rp->r_line = 0;
+    rp->r_version = version;
+    rp->r_group = 0;
+    rp->r_stamp = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    memcpy(rp->r_text, &sv, sizeof(sv));
+    rp->r_text[sizeof(sv)] = '\0';
+    stack->last_len = 0;
+
+    // Append to the file when it holds the log up to where ours changed
+    if (stack->p_path && strcmp(stack->p_path, filename) == 0
+        && stack->p_synced >= UNDO_HDRSIZE && stack->p_synced >= stack->p_base
+        && (fd = open(filename, O_WRONLY)) >= 0) {
+        end = undo_log_offset(stack, stack->cur, stack->cur_off);
+        ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= stack->p_synced
+            && ((size_t)st.st_size == stack->p_synced || ftruncate(fd, (off_t)stack->p_synced) == 0)
+            && lseek(fd, (off_t)stack->p_synced, SEEK_SET) == (off_t)stack->p_synced
+            && undo_write_range(stack, fd, stack->p_synced, end)
+            && fsync(fd) == 0;
+        if (close(fd) != 0)
+            ok = false;
+        if (ok) {
+            stack->p_synced = end;
+            return true;
+        }
+    }
+
+    if (!stack->p_path || strcmp(stack->p_path, filename) != 0) {
+        undo_persist_release(stack);
+        size_t n = strlen(filename) + 1;
+        if (!(stack->p_path = safe_alloc(n, "undo history path", __FILE__, __LINE__)))
+            return false;
+        memcpy(stack->p_path, filename, n);
+    }
+    end = undo_log_offset(stack, stack->cur, stack->cur_off);
+    if (!undo_rewrite(stack, filename, end)) {
+        stack->p_synced = 0;
+        return false;
+    }
     return true;
 }
 
-// Load undo stack from file (stub)
+/*
+ * Take up the history file "filename" for "bp", which has just been read
+ * in. The file is used only if its last save point is of the text now in
+ * the buffer; its records are read back as undo reaches them.
+ */
 bool undo_stack_load_from_file(struct buffer *bp, const char *filename) {
-    // TODO: Deserialize undo history from disk into bp->b_undo_stack
-    // For now, just check if file exists
-    FILE *f = fopen(filename, "r");
-    if (!f) return false;
-    fclose(f);
+    struct atomic_undo_stack *stack;
+    const struct undo_file_header *hdr;
+    const struct undo_record *rp;
+    struct undo_saved sv;
+    uint64_t length;
+    struct stat st;
+    void *map;
+    size_t size;
+    int fd;
+
+    if (!bp || !(stack = bp->b_undo_stack) || !filename)
+        return false;
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < UNDO_HDRSIZE + UNDO_SAVEDSIZE) {
+        close(fd);
+        return false;
+    }
+    size = (size_t)st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    hdr = map;
+    rp = (const struct undo_record *)((const unsigned char *)map + size - UNDO_SAVEDSIZE);
+    if (memcmp(hdr->h_magic, UNDO_MAGIC, sizeof(hdr->h_magic)) != 0
+        || hdr->h_format != UNDO_FORMAT
+        || hdr->h_recsize != offsetof(struct undo_record, r_text)
+        || (size - UNDO_HDRSIZE) % 8 != 0
+        || rp->r_size != UNDO_SAVEDSIZE || rp->r_type != UNDO_SAVED
+        || rp->r_len != (int)sizeof(sv)) {
+        munmap(map, size);
+        return false;
+    }
+    memcpy(&sv, rp->r_text, sizeof(sv));
+    if (undo_content_hash(bp, &length) != sv.s_hash || length != sv.s_length) {
+        munmap(map, size);     // The file changed behind our back
+        return false;
+    }
+
+    undo_log_reset(stack);
+    if (!(stack->p_path = safe_alloc(strlen(filename) + 1, "undo history path", __FILE__, __LINE__))) {
+        munmap(map, size);
+        return false;
+    }
+    strcpy(stack->p_path, filename);
+    stack->p_map = map;
+    stack->p_maplen = size;
+    stack->p_base = size;
+    stack->p_prev = UNDO_SAVEDSIZE;
+    stack->p_synced = size;
+    stack->base_version = rp->r_version;
+    if (atomic_load(&stack->version) <= rp->r_version)
+        atomic_store(&stack->version, rp->r_version + 1);
+    if (atomic_load(&stack->current_group_id) <= sv.s_group)
+        atomic_store(&stack->current_group_id, sv.s_group + 1);
     return true;
 }
+
+/*
+ * Name of the history file for "fname" in "path". Returns false when
+ * history is not kept (UEMACS_UNDO_HISTORY unset or "0") or the
+ * directory cannot be made.
+ */
+bool undo_history_file(const char *fname, char *path, size_t size) {
+    const char *env = getenv("UEMACS_UNDO_HISTORY");
+    const char *base;
+    char dir[PATH_MAX];
+    char full[PATH_MAX];
+    struct undo_hash st = { 0x6A09E667F3BCC908ULL, 0, 0, 0 };
+    char *p;
+
+    if (!env || !*env || strcmp(env, "0") == 0 || !fname || !*fname)
+        return false;
+    if (env[0] == '/') {
+        safe_snprintf(dir, sizeof(dir), "%s", env);
+    } else if ((base = getenv("XDG_STATE_HOME")) && base[0] == '/') {
+        safe_snprintf(dir, sizeof(dir), "%s/uemacs/undo", base);
+    } else if ((base = getenv("HOME")) && *base) {
+        safe_snprintf(dir, sizeof(dir), "%s/.local/state/uemacs/undo", base);
+    } else {
+        return false;
+    }
+    // mkdir -p
+    for (p = dir + 1; ; ++p) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+                return false;
+            *p = c;
+            if (c == '\0')
+                break;
+        }
+    }
+
+    if (!realpath(fname, full))
+        safe_snprintf(full, sizeof(full), "%s", fname);
+    undo_hash_feed(&st, (const unsigned char *)full, strlen(full));
+    safe_snprintf(path, size, "%s/%016llx.undo", dir, (unsigned long long)undo_hash_done(&st));
+    return true;
+}
+
+/* Save the history of "bp" next to its file having been written. */
+void undo_history_save(struct buffer *bp) {
+    char path[PATH_MAX];
+
+    if (!(bp->b_mode & MDCRYPT) && undo_history_file(bp->b_fname, path, sizeof(path)))
+        undo_stack_save_to_file(bp, path);
+}
+
+/* Pick up the history of "bp" after its file has been read in. */
+void undo_history_load(struct buffer *bp) {
+    char path[PATH_MAX];
+
+    if (!(bp->b_mode & MDCRYPT) && undo_history_file(bp->b_fname, path, sizeof(path)))
+        undo_stack_load_from_file(bp, path);
+}
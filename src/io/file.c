@@ -8,16 +8,22 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include "estruct.h"
 #include "edef.h"
 #include "efunc.h"
 #include "line.h"
+#include "line_index.h"
 #include "util.h"
 #include "error.h"
 #include "file_utils.h"
 #include "string_safe.h"
+#include "undo.h"
+#include "internal/plugin.h"
+#include "μemacs/gapbuffer.h"
 
 /* Max number of lines from one file. */
 #define	MAXNLINE 10000000
@@ -200,6 +206,88 @@ int getfile(const char *fname, int lockfl)
 	return s;
 }
 
+/*
+ * Read the opened file in one go into the gap storage of "bp". No line is
+ * built here: they are all left unbuilt after the header, and built from
+ * the gap text as the editor walks to them. A last line without its
+ * newline gets one, as the line reader does.
+ */
+static int readgap(struct buffer *bp, int *nlinep)
+{
+	struct gap_buffer *gb = bp->b_gap;
+	size_t size;
+	int s;
+
+	if ((s = ffreadall(gb)) != FIOEOF)
+		return s;
+	size = gap_buffer_size(gb);
+	if (size > 0 && gap_buffer_get_char(gb, size - 1) != '\n'
+	    && gap_buffer_insert(gb, size, "\n", 1) != GAP_BUFFER_SUCCESS)
+		return FIOMEM;
+	if (gap_buffer_line_count(gb) - 1 > MAXNLINE)
+		return FIOMEM;
+	*nlinep = (int)(gap_buffer_line_count(gb) - 1);
+	bp->b_linep->l_hole = *nlinep;
+	return FIOEOF;
+}
+
+#define	READPROGRESS	(64L << 20)	/* Show progress on files this big */
+
+/*
+ * Read the opened file into the line list of "bp" in one pass: the file
+ * is mapped (or read whole), split at newlines with memchr(), and every
+ * line copied once into a line from the buffer's arena. Lines are counted,
+ * not NUL terminated, so NUL bytes are kept as they are. Decryption runs
+ * over each line in file order, which is what the line reader did.
+ */
+static int readlines(struct buffer *bp, int *nlinep)
+{
+	const char *text, *p, *end, *nl;
+	struct line *head = bp->b_linep;
+	struct line *lp;
+	size_t len, next_report;
+	int nline = 0;
+	int s;
+
+	if ((s = ffmap(&text, &len)) != FIOSUC)
+		return s;
+	p = text;
+	end = text + len;
+	next_report = READPROGRESS;
+	while (p < end) {
+		nl = memchr(p, '\n', (size_t)(end - p));
+		if (nl == NULL)
+			nl = end;	/* Last line, no newline */
+		if (nline >= MAXNLINE || nl - p > INT_MAX) {
+			s = FIOMEM;
+			break;
+		}
+		if ((lp = lalloc(bp, (int)(nl - p))) == NULL) {
+			REPORT_ERROR(ERR_MEMORY, "Failed to allocate memory for file line");
+			s = FIOMEM;
+			break;
+		}
+		memcpy(lp->l_text, p, (size_t)(nl - p));
+#if	CRYPT
+		if (cryptflag)
+			myencrypt(lp->l_text, (unsigned)(nl - p));
+#endif
+		lp->l_bp = head->l_bp;
+		lp->l_fp = head;
+		head->l_bp->l_fp = lp;
+		head->l_bp = lp;
+		++nline;
+		p = nl + 1;
+		if ((size_t)(p - text) >= next_report && p < end) {
+			mlwrite("(Reading file: %d%%)", (int)((p - text) * 100.0 / len));
+			next_report += READPROGRESS;
+		}
+	}
+	ffunmap();
+	*nlinep = nline;
+	return s == FIOSUC ? FIOEOF : s;
+}
+
 /*
  * Read file "fname" into the current buffer, blowing away any text
  * found there.  Called by both the read and find commands.  Return
@@ -213,13 +301,9 @@ int getfile(const char *fname, int lockfl)
  */
 int readin(const char *fname, int lockfl)
 {
-	struct line *lp1;
-	struct line *lp2;
-	int i;
 	struct window *wp;
 	struct buffer *bp;
 	int s;
-	int nbytes;
 	int nline;
 	char mesg[NSTRING];
 
@@ -248,26 +332,15 @@ int readin(const char *fname, int lockfl)
 	/* read the file in */
 	mlwrite("(Reading file)");
 	nline = 0;
-	while ((s = ffgetline()) == FIOSUC) {
-		nbytes = strlen(fline);
-		if ((lp1 = lalloc(nbytes)) == NULL) {
-			REPORT_ERROR(ERR_MEMORY, "Failed to allocate memory for file line");
-			s = FIOMEM;	/* Keep message on the  */
-			break;	/* display.             */
-		}
-		if (nline > MAXNLINE) {
-			s = FIOMEM;
-			break;
-		}
-		lp2 = lback(curbp->b_linep);
-		lp2->l_fp = lp1;
-		lp1->l_fp = curbp->b_linep;
-		lp1->l_bp = lp2;
-		curbp->b_linep->l_bp = lp1;
-		for (i = 0; i < nbytes; ++i)
-			lputc(lp1, i, fline[i]);
-		++nline;
+	if (buffer_default_storage() == BSTORE_GAP
+	    && buffer_set_storage(bp, BSTORE_GAP) == TRUE) {
+		s = readgap(bp, &nline);
+		if (s != FIOEOF)	/* Partial text: lines only */
+			buffer_set_storage(bp, BSTORE_LINES);
+	} else {
+		s = readlines(bp, &nline);
 	}
+	lindex_rebuild(bp);	/* Lines were linked in bulk */
 	ffclose();		/* Ignore errors.       */
     safe_strcpy(mesg, "(", NSTRING);
 	if (s == FIOERR) {
@@ -303,7 +376,8 @@ int readin(const char *fname, int lockfl)
 	}
 	if (s == FIOERR || s == FIOFNF) /* False if error.      */
 		return FALSE;
-	/* Successful read: mark current state as saved baseline */
+	/* Successful read: pick up kept history, mark the saved baseline */
+	undo_history_load(curbp);
 	undo_mark_saved(curbp);
 	return TRUE;
 }
@@ -378,6 +452,7 @@ int filewrite(int f, int n)
 	if ((s = writeout(fname)) == TRUE) {
 		safe_strcpy(curbp->b_fname, fname, NFILEN);
 		/* Mark saved baseline so undo-to-clean clears delta */
+		undo_history_save(curbp);
 		undo_mark_saved(curbp);
 	}
 	return s;
@@ -413,7 +488,13 @@ int filesave(int f, int n)
 		}
 	}
 
+	/* Invoke ON_SAVE hooks before saving */
+	uemacs_invoke_hooks(UEMACS_EVENT_ON_SAVE);
+
 	if ((s = writeout(curbp->b_fname)) == TRUE) {
+		/* Mark saved baseline so undo-to-clean clears delta */
+		undo_history_save(curbp);
+		undo_mark_saved(curbp);
 		curbp->b_flag &= ~BFCHG;
 		wp = wheadp;	/* Update mode lines.   */
 		while (wp != NULL) {
@@ -435,39 +516,44 @@ int filesave(int f, int n)
  */
 int writeout(const char *fn)
 {
-	int s;
-	struct line *lp;
-	{
-		struct window *wp;
-		int s;
-
-		if (curbp->b_mode & MDVIEW)    /* don't allow this command if      */
-			return rdonly();    /* we are in read only mode     */
-		if ((curbp->b_flag & BFCHG) == 0)    /* Return, no changes.  */
-			return TRUE;
-		if (curbp->b_fname[0] == 0) {    /* Must have a name.    */
-			mlwrite("No file name");
-			return FALSE;
-		}
-
-		/* complain about truncated files */
-		if ((curbp->b_flag & BFTRUNC) != 0) {
-			if (mlyesno("Truncated file ... write it out") == FALSE) {
-				mlwrite("(Aborted)");
-				return FALSE;
-			}
-		}
+	int s;			/* return status */
+	struct line *lp;	/* current line */
+	int nline;		/* number of lines */
 
-		/* Invoke ON_SAVE hooks before saving */
-	#include "internal/plugin.h"
-		uemacs_invoke_hooks(UEMACS_EVENT_ON_SAVE);
-
-		if ((s = writeout(curbp->b_fname)) == TRUE) {
-			/* Mark saved baseline so undo-to-clean clears delta */
-			undo_mark_saved(curbp);
+	if ((s = ffwopen(fn)) != FIOSUC)	/* Open writes message. */
+		return FALSE;
+	mlwrite("(Writing...)");	/* tell us were writing */
+	nline = 0;
+	if (curbp->b_storage == BSTORE_GAP) {
+		/* The text is two contiguous spans either side of the gap */
+		struct gap_buffer *gb = curbp->b_gap;
+		size_t tail = gb->capacity - gb->gap_end;
+
+		s = ffputspan(gb->data, gb->gap_start);
+		if (s == FIOSUC)
+			s = ffputspan(gb->data + gb->gap_end, tail);
+		nline = (int)(gap_buffer_line_count(gb) - 1);
+	} else {
+		lp = lforw(curbp->b_linep);	/* First line.          */
+		while (lp != curbp->b_linep) {
+			if ((s = ffputline(&lp->l_text[0], llength(lp))) != FIOSUC)
+				break;
+			++nline;
+			lp = lforw(lp);
 		}
-		return s;
 	}
+	if (s == FIOSUC) {	/* No write error.      */
+		s = ffclose();
+		if (s == FIOSUC) {	/* No close error.      */
+			if (nline == 1)
+				mlwrite("(Wrote 1 line)");
+			else
+				mlwrite("(Wrote %d lines)", nline);
+		}
+	} else			/* Ignore close error   */
+		ffclose();	/* if a write error.    */
+	if (s != FIOSUC)	/* Some sort of error.  */
+		return FALSE;
 	return TRUE;
 }
 
@@ -547,7 +633,7 @@ int ifile(const char *fname)
 	nline = 0;
 	while ((s = ffgetline()) == FIOSUC) {
 		nbytes = strlen(fline);
-		if ((lp1 = lalloc(nbytes)) == NULL) {
+		if ((lp1 = lalloc(curbp, nbytes)) == NULL) {
 			REPORT_ERROR(ERR_MEMORY, "Failed to allocate memory for file line");
 			s = FIOMEM;	/* Keep message on the  */
 			break;	/* display.             */
@@ -560,6 +646,7 @@ int ifile(const char *fname)
 		lp0->l_fp = lp1;
 		lp1->l_bp = lp0;
 		lp1->l_fp = lp2;
+		lindex_link(curbp, lp1);
 
 		/* and advance and write out the current line */
 		curwp->w_dotp = lp1;
@@ -569,6 +656,13 @@ int ifile(const char *fname)
 	}
 	ffclose();		/* Ignore errors.       */
 	curwp->w_markp = lforw(curwp->w_markp);
+
+	/* the new lines were linked in directly; add them to gap storage */
+	if (lsyncnew(curwp->w_markp, nline) == FALSE) {
+		curwp->w_dotp = lback(curwp->w_markp);
+		s = FIOMEM;
+		nline = 0;
+	}
     safe_strcpy(mesg, "(", NSTRING);
 	if (s == FIOERR) {
         safe_strcat(mesg, "I/O ERROR, ", NSTRING);
@@ -13,9 +13,45 @@
 #include	"memory.h"
 #include	"error.h"
 #include	"file_utils.h"
+#include	"string_utils.h"
+#include	"util.h"
+#include	"μemacs/gapbuffer.h"
+
+#include	<sys/stat.h>
+#include	<sys/mman.h>
+#include	<sys/uio.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<errno.h>
+#include	<limits.h>
+#include	<stdlib.h>
+
+#define	FFCHUNK	65536		/* Block size for whole-file transfers */
+#define	FFIOV	1024		/* Pieces gathered per writev()        */
+#define	FFSTAGE	262144		/* Staging area for short lines        */
+#define	FFDIRECT 1024		/* Lines this long are written in place */
 
 static FILE *ffp;			/* File pointer, all functions. */
 static int eofflag;			/* end-of-file flag */
+static char *ffmapped;			/* Whole file text from ffmap() */
+static size_t ffmaplen;			/* ... and its length */
+static int ffmapkind;			/* 1 if mmap()ed, 0 if read in */
+
+/*
+ * Output side. Text is gathered into iovecs: short lines are copied into
+ * the staging area (and encrypted there), long ones are pointed at where
+ * they lie, so callers must keep them unchanged until ffclose(). The file
+ * is written under a temporary name in the same directory, synced, and
+ * renamed over the original, so a crash never leaves a half-written file.
+ */
+static int ffwfd = -1;			/* Output descriptor, -1 if none */
+static int fferr;			/* A write has failed */
+static struct iovec ffiov[FFIOV];
+static int ffniov;
+static char ffstage[FFSTAGE];
+static size_t ffstaged;
+static char fftarget[PATH_MAX];		/* File being replaced */
+static char fftemp[PATH_MAX];		/* Its stand-in, "" if in place */
 
 /*
  * Open a file for reading.
@@ -30,22 +66,173 @@ int ffropen(const char *fn)
 
 /*
  * Open a file for writing. Return TRUE if all is well, and FALSE on error
- * (cannot create).
+ * (cannot create). The text goes to a temporary file next to "fn" that
+ * ffclose() renames into place; it takes over the mode and owner of the
+ * file it replaces. Symbolic links are followed. Files that are not
+ * plain, have other hard links, are not writable by us, or sit in a
+ * directory we cannot create files in are overwritten in place as before.
  */
 int ffwopen(const char *fn)
 {
-	if ((ffp = safe_fopen(fn, FILE_WRITE)) == NULL) {
+	struct stat st;
+	int have, mask;
+	char *slash;
+
+	fferr = FALSE;
+	ffniov = 0;
+	ffstaged = 0;
+	fftemp[0] = 0;
+	if (realpath(fn, fftarget) == NULL)	/* New file, or dangling */
+		mystrscpy(fftarget, fn, sizeof(fftarget));
+	have = stat(fftarget, &st) == 0;
+
+	/* A file we may not write is left to fail the in-place open */
+	if (!have || (S_ISREG(st.st_mode) && st.st_nlink == 1
+		      && access(fftarget, W_OK) == 0)) {
+		slash = strrchr(fftarget, '/');
+		if (slash == NULL)
+			safe_snprintf(fftemp, sizeof(fftemp), ".%s.XXXXXX", fftarget);
+		else
+			safe_snprintf(fftemp, sizeof(fftemp), "%.*s/.%s.XXXXXX",
+				      (int)(slash - fftarget), fftarget, slash + 1);
+		if ((ffwfd = mkstemp(fftemp)) < 0) {
+			fftemp[0] = 0;
+		} else if (have) {
+			if (fchown(ffwfd, st.st_uid, st.st_gid) != 0) {
+				/* Not ours to give away; keep our owner */
+			}
+			fchmod(ffwfd, st.st_mode & 07777);
+		} else {
+			mask = umask(0);
+			umask(mask);
+			fchmod(ffwfd, 0666 & ~mask);
+		}
+	}
+	if (fftemp[0] == 0
+	    && (ffwfd = open(fftarget, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
 		REPORT_ERROR(ERR_FILE_WRITE, fn);
 		return FIOERR;
 	}
 	return FIOSUC;
 }
 
+/* Write out everything gathered so far. */
+static int ffflush(void)
+{
+	struct iovec *iov = ffiov;
+	int cnt = ffniov;
+	ssize_t n;
+
+	while (cnt > 0 && !fferr) {
+		if ((n = writev(ffwfd, iov, cnt)) < 0) {
+			if (errno != EINTR)
+				fferr = TRUE;
+			continue;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	ffniov = 0;
+	ffstaged = 0;
+	return fferr ? FIOERR : FIOSUC;
+}
+
+/*
+ * Queue "n" bytes for output: long runs by reference, the rest copied
+ * into the staging area, where neighbouring copies share one iovec.
+ */
+static int ffqueue(const char *buf, size_t n)
+{
+	size_t k;
+	char *dst;
+
+#if	CRYPT
+	if (n >= FFDIRECT && !cryptflag) {
+#else
+	if (n >= FFDIRECT) {
+#endif
+		if (ffniov == FFIOV && ffflush() != FIOSUC)
+			return FIOERR;
+		ffiov[ffniov].iov_base = (void *)buf;
+		ffiov[ffniov++].iov_len = n;
+		return FIOSUC;
+	}
+	while (n > 0) {
+		if ((ffstaged == FFSTAGE || ffniov == FFIOV) && ffflush() != FIOSUC)
+			return FIOERR;
+		k = FFSTAGE - ffstaged < n ? FFSTAGE - ffstaged : n;
+		dst = &ffstage[ffstaged];
+		memcpy(dst, buf, k);
+#if	CRYPT
+		if (cryptflag)
+			myencrypt(dst, (unsigned)k);
+#endif
+		if (ffniov > 0 && (char *)ffiov[ffniov - 1].iov_base
+		    + ffiov[ffniov - 1].iov_len == dst)
+			ffiov[ffniov - 1].iov_len += k;
+		else {
+			ffiov[ffniov].iov_base = dst;
+			ffiov[ffniov++].iov_len = k;
+		}
+		ffstaged += k;
+		buf += k;
+		n -= k;
+	}
+	return FIOSUC;
+}
+
+/*
+ * Finish the output file: flush, sync, and move it into place. After a
+ * write error the stand-in is removed and the original left alone.
+ */
+static int ffwclose(void)
+{
+	char *slash;
+	int dfd;
+
+	if (!fferr)
+		ffflush();
+	if (!fferr && fsync(ffwfd) != 0 && errno != EINVAL)
+		fferr = TRUE;	/* EINVAL: device that cannot sync */
+	if (close(ffwfd) != 0)
+		fferr = TRUE;
+	ffwfd = -1;
+	if (fftemp[0] != 0) {
+		if (!fferr && rename(fftemp, fftarget) != 0)
+			fferr = TRUE;
+		if (fferr) {
+			unlink(fftemp);
+		} else if ((slash = strrchr(fftarget, '/')) != NULL) {
+			/* Make the rename itself durable */
+			*slash = 0;
+			if ((dfd = open(*fftarget ? fftarget : "/", O_RDONLY)) >= 0) {
+				fsync(dfd);
+				close(dfd);
+			}
+			*slash = '/';
+		}
+		fftemp[0] = 0;
+	}
+	if (fferr) {
+		REPORT_ERROR(ERR_FILE_WRITE, "Error closing file");
+		return FIOERR;
+	}
+	return FIOSUC;
+}
+
 /*
  * Close a file. Should look at the status in all systems.
  */
 int ffclose(void)
 {
+	ffunmap();
 	/* free this since we do not need it anymore */
 	if (fline) {
 		SAFE_FREE(fline);
@@ -53,6 +240,8 @@ int ffclose(void)
 	}
 	eofflag = FALSE;
 
+	if (ffwfd >= 0)
+		return ffwclose();
 
 	if (!safe_fclose(&ffp)) {
 		REPORT_ERROR(ERR_FILE_WRITE, "Error closing file");
@@ -63,39 +252,143 @@ int ffclose(void)
 
 /*
  * Write a line to the already opened file. The "buf" points to the buffer,
- * and the "nbuf" is its length, less the free newline. Return the status.
- * Check only at the newline.
+ * and the "nbuf" is its length, less the free newline. Long lines are
+ * written straight from "buf", which must stay put until ffclose().
+ * Return the status.
  */
 int ffputline(char *buf, int nbuf)
 {
-	int i;
-#if	CRYPT
-	char c;			/* character to translate */
+	if (ffqueue(buf, (size_t)nbuf) != FIOSUC || ffqueue("\n", 1) != FIOSUC) {
+		REPORT_ERROR(ERR_FILE_WRITE, "Write I/O error");
+		return FIOERR;
+	}
+	return FIOSUC;
+}
 
-	if (cryptflag) {
-		for (i = 0; i < nbuf; ++i) {
-			c = buf[i] & 0xff;
-			myencrypt(&c, 1);
-			fputc(c, ffp);
-		}
-	} else
-		for (i = 0; i < nbuf; ++i)
-			fputc(buf[i] & 0xFF, ffp);
-#else
-	for (i = 0; i < nbuf; ++i)
-		fputc(buf[i] & 0xFF, ffp);
-#endif
+/*
+ * Write "nbuf" bytes of raw text, newlines included, to the already opened
+ * file, with the same rules as ffputline(). Encryption only touches
+ * printable characters, so a span encrypts exactly as the same text
+ * written line by line. Return the status.
+ */
+int ffputspan(const char *buf, size_t nbuf)
+{
+	if (ffqueue(buf, nbuf) != FIOSUC) {
+		REPORT_ERROR(ERR_FILE_WRITE, "Write I/O error");
+		return FIOERR;
+	}
+	return FIOSUC;
+}
 
-	fputc('\n', ffp);
+/*
+ * Read the rest of the already opened file into the end of a gap buffer,
+ * decrypting as it goes. Unlike ffgetline() the bytes are kept exactly as
+ * they are. Return FIOEOF once everything is in, like the line reader.
+ */
+int ffreadall(struct gap_buffer *gb)
+{
+	struct stat st;
+	char *chunk;
+	size_t n;
 
+	/* size the gap once so the read does not keep regrowing it */
+	if (fstat(fileno(ffp), &st) == 0 && st.st_size > 0
+	    && gap_buffer_reserve(gb, (size_t)st.st_size + 1) != GAP_BUFFER_SUCCESS)
+		return FIOMEM;
+	if ((chunk = safe_alloc(FFCHUNK, "file read chunk", __FILE__, __LINE__)) == NULL)
+		return FIOMEM;
+	while ((n = fread(chunk, 1, FFCHUNK, ffp)) > 0) {
+#if	CRYPT
+		if (cryptflag)
+			myencrypt(chunk, (unsigned)n);
+#endif
+		if (gap_buffer_insert(gb, gap_buffer_size(gb), chunk, n) != GAP_BUFFER_SUCCESS) {
+			SAFE_FREE(chunk);
+			return FIOMEM;
+		}
+	}
+	SAFE_FREE(chunk);
 	if (ferror(ffp)) {
-		REPORT_ERROR(ERR_FILE_WRITE, "Write I/O error");
+		REPORT_ERROR(ERR_FILE_READ, "File read error");
 		return FIOERR;
 	}
+	return FIOEOF;
+}
+
+/*
+ * Make the rest of the already opened file available as one block of
+ * memory. Regular files are mapped; anything else (pipes, terminals) is
+ * read in with large reads. The text is read-only and stays valid until
+ * ffunmap() or ffclose(). Return FIOSUC, or FIOMEM/FIOERR.
+ */
+int ffmap(const char **textp, size_t *lenp)
+{
+	struct stat st;
+	size_t cap, n;
+	char *buf, *nbuf;
 
+	ffunmap();
+	*textp = NULL;
+	*lenp = 0;
+	if (fstat(fileno(ffp), &st) == 0 && S_ISREG(st.st_mode)
+	    && ftell(ffp) == 0) {
+		if (st.st_size == 0)
+			return FIOSUC;
+		buf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+			   fileno(ffp), 0);
+		if (buf != MAP_FAILED) {
+			madvise(buf, (size_t)st.st_size, MADV_SEQUENTIAL);
+			ffmapped = buf;
+			ffmaplen = (size_t)st.st_size;
+			ffmapkind = 1;
+			*textp = ffmapped;
+			*lenp = ffmaplen;
+			return FIOSUC;
+		}
+	}
+
+	/* Not mappable: read it all, doubling the buffer as it fills */
+	cap = FFCHUNK;
+	if ((buf = safe_alloc(cap, "file text", __FILE__, __LINE__)) == NULL)
+		return FIOMEM;
+	n = 0;
+	for (;;) {
+		n += fread(buf + n, 1, cap - n, ffp);
+		if (n < cap)
+			break;
+		if ((nbuf = SAFE_REALLOC(buf, cap * 2, "file text")) == NULL) {
+			SAFE_FREE(buf);
+			return FIOMEM;
+		}
+		buf = nbuf;
+		cap *= 2;
+	}
+	if (ferror(ffp)) {
+		SAFE_FREE(buf);
+		REPORT_ERROR(ERR_FILE_READ, "File read error");
+		return FIOERR;
+	}
+	ffmapped = buf;
+	ffmaplen = n;
+	ffmapkind = 0;
+	*textp = ffmapped;
+	*lenp = ffmaplen;
 	return FIOSUC;
 }
 
+/* Release the text handed out by ffmap(), if any. */
+void ffunmap(void)
+{
+	if (ffmapped == NULL)
+		return;
+	if (ffmapkind)
+		munmap(ffmapped, ffmaplen);
+	else
+		SAFE_FREE(ffmapped);
+	ffmapped = NULL;
+	ffmaplen = 0;
+}
+
 /*
  * Read a line from a file, and store the bytes in the supplied buffer. The
  * "nbuf" is the length of the buffer. Complain about long lines and lines
@@ -19,6 +19,7 @@
 #include "wrapper.h"
 #include "file_utils.h"
 #include "string_safe.h"
+#include "redraw.h"
 
 #if	PKCODE
 #define	COMPLC	1
@@ -470,6 +471,15 @@ void input_reset_parser_state(void)
     paste.end_seq[4] = '1';
     paste.end_seq[5] = '~';
 }
+
+/* Whether a key can be had without waiting: replayed paste lookahead, a
+ * macro being played or bytes already in from the terminal */
+int input_pending(void)
+{
+	if (paste.pend_pos < paste.pend_len || kbdmode == PLAY)
+		return TRUE;
+	return typahead() > 0;
+}
 /*	tgetc:	Get a key from the terminal driver, resolve any keyboard
 		macro action					*/
 
@@ -502,6 +512,7 @@ int tgetc(void)
 	/* fetch a character from the terminal driver, resolve macros */
 	/* Use UTF-8 atomic collector to avoid sequence interleaving */
 	c = get_utf8_character_atomic();
+	redraw_key();
 	
 	/* Validate character to prevent corruption during fast typing */
 	if (c < 0 || c > 0x10FFFF) {
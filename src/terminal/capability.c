@@ -18,21 +18,7 @@
 #include "string_utils.h"
 #include "error.h"
 #include "c23_compat.h"
-
-/* Terminal capability structure */
-typedef struct terminal_caps {
-    bool truecolor;         /* 24-bit color support */
-    bool mouse;             /* Mouse tracking */
-    bool bracketed_paste;   /* Bracketed paste mode */
-    bool focus_events;      /* Focus in/out events */
-    bool sixel;            /* Sixel graphics */
-    bool kitty_graphics;   /* Kitty graphics protocol */
-    int max_colors;        /* Color count */
-    int width;             /* Columns */
-    int height;            /* Rows */
-    bool utf8_capable;     /* UTF-8 support */
-    bool alt_screen;       /* Alternate screen buffer */
-} terminal_caps_t;
+#include "terminal_capability.h"
 
 static terminal_caps_t current_caps = {0};
 static bool caps_initialized = false;
@@ -63,8 +49,13 @@ static bool get_terminal_size(int* width, int* height) {
     return false;
 }
 
-/* Send capability query and read response (with timeout) */
-static bool query_terminal_capability(const char* query, char* response, size_t response_size) {
+/*
+ * Send capability query and read response (with timeout). With "last"
+ * non-zero, keep reading until that byte arrives or the terminal goes
+ * quiet, as replies to more than one query may come in pieces.
+ */
+static bool query_terminal_capability(const char* query, char* response, size_t response_size,
+                                      char last) {
     if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
         return false;
     }
@@ -90,13 +81,36 @@ static bool query_terminal_capability(const char* query, char* response, size_t
     }
     
     /* Read response */
-    ssize_t bytes_read = read(STDIN_FILENO, response, response_size - 1);
-    response[SAFE_MAX(0, bytes_read)] = '\0';
+    size_t got = 0;
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(STDIN_FILENO, response + got, response_size - 1 - got);
+        if (bytes_read > 0)
+            got += bytes_read;
+    } while (bytes_read > 0 && last && got < response_size - 1 && !memchr(response, last, got));
+    response[got] = '\0';
     
     /* Restore terminal mode */
     tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
     
-    return bytes_read > 0;
+    return got > 0;
+}
+
+/*
+ * Whether a DECRQM reply in "response" says the terminal knows DEC private
+ * mode "mode": CSI ? mode ; Ps $ y, where Ps is 1 (set) or 2 (reset) if
+ * it does and 0 (unknown) or 4 (permanently reset) if not.
+ */
+static bool decrqm_supported(const char* response, int mode) {
+    char key[16];
+    const char* p;
+
+    snprintf(key, sizeof(key), "\x1b[?%d;", mode);
+    p = strstr(response, key);
+    if (!p)
+        return false;
+    p += strlen(key);
+    return (p[0] == '1' || p[0] == '2') && p[1] == '$' && p[2] == 'y';
 }
 
 /* Detect terminal capabilities */
@@ -167,22 +181,31 @@ terminal_caps_t detect_terminal_capabilities(void) {
     
     /* Query terminal for specific capabilities (if interactive) */
     if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
-        /* Query for DA1 (Device Attributes) */
-        if (query_terminal_capability("\x1b[c", response, sizeof(response))) {
+        /* Query for synchronized update (DECRQM 2026), then DA1 (Device
+         * Attributes): every terminal answers DA1, so a terminal that does
+         * not know DECRQM costs no timeout */
+        if (query_terminal_capability("\x1b[?2026$p\x1b[c", response, sizeof(response), 'c')) {
             /* Parse response for specific features */
             if (strstr(response, "64;")) {  /* Sixel support indicator */
                 caps.sixel = true;
             }
+            caps.sync_update = decrqm_supported(response, 2026);
         }
         
         /* Query for color support */
-        if (!caps.truecolor && query_terminal_capability("\x1b[48;2;1;2;3m\x1b[38;2;1;2;3m", response, sizeof(response))) {
+        if (!caps.truecolor && query_terminal_capability("\x1b[48;2;1;2;3m\x1b[38;2;1;2;3m", response, sizeof(response), 0)) {
             /* If terminal doesn't reject true color, assume support */
             caps.truecolor = true;
             caps.max_colors = 16777216;
         }
     }
     
+    /* UEMACS_SYNC_UPDATE=0 or 1 overrides what the terminal said */
+    const char* sync = getenv("UEMACS_SYNC_UPDATE");
+    if (sync && (*sync == '0' || *sync == '1')) {
+        caps.sync_update = *sync == '1';
+    }
+    
     /* Fallback color detection */
     if (caps.max_colors == 0) {
         caps.max_colors = 8;  /* Conservative fallback */
@@ -275,8 +298,9 @@ void print_terminal_capabilities(void) {
     mlwrite("  UTF-8: %s", caps->utf8_capable ? "yes" : "no");
     mlwrite("  Mouse: %s", caps->mouse ? "yes" : "no");
     mlwrite("  Graphics: %s%s", caps->sixel ? "Sixel " : "", caps->kitty_graphics ? "Kitty" : "none");
-    mlwrite("  Features: %s%s%s",
+    mlwrite("  Features: %s%s%s%s",
             caps->bracketed_paste ? "paste " : "",
             caps->focus_events ? "focus " : "",
-            caps->alt_screen ? "altscreen" : "");
+            caps->alt_screen ? "altscreen " : "",
+            caps->sync_update ? "sync" : "");
 }
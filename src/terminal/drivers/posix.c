@@ -1,8 +1,17 @@
 /*	posix.c
  *
  *      The functions in this file negotiate with the operating system for
- *      characters, and write characters in a barely buffered fashion on the
- *      display. All operating systems.
+ *      characters, and write characters on the display. All operating
+ *      systems.
+ *
+ *	Output is gathered a frame at a time: ttputc() only appends to a
+ *	buffer in memory, and ttflush() hands all of it to the terminal in
+ *	one writev(), so that update() costs one system call however much of
+ *	the screen it redraws. A terminal that knows synchronized update
+ *	(DEC mode 2026) gets each frame between its begin and end marks and
+ *	shows it all at once, however it reads the write; any other has the
+ *	cursor hidden while a large frame goes past, so it is not seen
+ *	darting about the screen.
  *
  *	modified by Petri Kutvonen
  *
@@ -14,15 +23,19 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <sys/select.h>
+#include <sys/ioctl.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -30,6 +43,8 @@
 #include "edef.h"
 #include "terminal_capability.h"
 #include "efunc.h"
+#include "memory.h"
+#include "profiler.h"
 #include "utf8.h"
 
 
@@ -39,8 +54,26 @@ static int kbdpoll;			/* in O_NDELAY mode             */
 static struct termios otermios;		/* original terminal characteristics */
 static struct termios ntermios;		/* charactoristics to use inside */
 
-#define TBUFSIZ 128
-static char tobuf[TBUFSIZ];		/* terminal output buffer */
+#define FRAME_INIT	16384		/* frame buffer without the heap */
+#define FRAME_MAX	(1 << 20)	/* flush early past this */
+#define FRAME_HIDE	512		/* hide the cursor from frames this big */
+
+#define SYNC_BEGIN	"\033[?2026h"
+#define SYNC_END	"\033[?2026l"
+#define HIDE_CURSOR	"\033[?25l"
+#define SHOW_CURSOR	"\033[?25h"
+
+/* The frame being built for the terminal */
+static char frame_init[FRAME_INIT];
+static char *frame = frame_init;
+static size_t frame_len;
+static size_t frame_room = FRAME_INIT;
+static size_t last_bytes;		/* size of the last frame written */
+static int last_writes;			/* ... and the write()s it took */
+static bool frame_sync;			/* wrap frames in synchronized update */
+static const char *frame_tail;		/* end mark owed for a head already sent */
+static size_t sent_bytes;		/* of this frame, by early writes */
+static int sent_writes;
 
 /*
  * Signal-masked UTF-8 input with race condition prevention
@@ -83,18 +116,13 @@ void ttopen(void)
 	ntermios.c_cc[VTIME] = 0; /* No timeout - immediate response */
 	tcsetattr(0, TCSADRAIN, &ntermios);	/* and activate them */
 
-	/*
-	 * provide a smaller terminal output buffer so that
-	 * the type ahead detection works better (more often)
-	 */
-	setbuffer(stdout, &tobuf[0], TBUFSIZ);
-
 	kbdflgs = fcntl(0, F_GETFL, 0);
 	kbdpoll = FALSE;
 
 	/* Setup terminal capabilities and optimizations */
 	terminal_caps_t caps = detect_terminal_capabilities();
 	optimize_for_terminal(&caps);
+	ttsetsync(caps.sync_update);
 
 	/* on all screens we are not sure of the initial position
 	   of the cursor                                        */
@@ -110,37 +138,93 @@ void ttopen(void)
 void ttclose(void)
 {
 	cleanup_terminal_optimizations();	/* restore terminal capabilities */
+	ttflush();
 	tcsetattr(0, TCSADRAIN, &otermios);	/* restore terminal settings */
 }
 
+/* Room for "n" more bytes in the frame; false if there is none to make */
+static void frame_write(bool last);
+
+static bool frame_reserve(size_t n)
+{
+	size_t room;
+	char *nf;
+
+	if (frame_len + n <= frame_room)
+		return true;
+	if (frame_len + n > FRAME_MAX) {
+		frame_write(false);
+		return frame_len + n <= frame_room;
+	}
+	for (room = frame_room * 2; room < frame_len + n; room *= 2)
+		;
+	if (frame == frame_init) {
+		if ((nf = safe_alloc(room, "terminal frame", __FILE__, __LINE__)) != NULL)
+			memcpy(nf, frame_init, frame_len);
+	} else {
+		nf = safe_realloc(frame, room, "terminal frame");
+	}
+	if (nf == NULL) {
+		frame_write(false);
+		return frame_len + n <= frame_room;
+	}
+	frame = nf;
+	frame_room = room;
+	return true;
+}
+
 /*
- * Write a character to the display. On VMS, terminal output is buffered, and
- * we just put the characters in the big array, after checking for overflow.
- * On CPM terminal I/O unbuffered, so we just write the byte out. Ditto on
- * MS-DOS (use the very very raw console output routine).
+ * Write a character to the display: append it, UTF-8 encoded, to the
+ * frame. Nothing reaches the terminal until ttflush().
  */
 int ttputc(int c)
 {
-	char utf8[8];
 	int bytes;
-	
+
+	if (!frame_reserve(8))
+		return 0;
 	// Validate Unicode value to prevent BOM insertion
 	if (c < 0 || c > 0x10FFFF || (c >= 0xFEFF && c <= 0xFFFF)) {
 		// Invalid or BOM range - output as single byte
-		putchar(c & 0xFF);
+		frame[frame_len++] = (char)(c & 0xFF);
 		return 0;
 	}
-	
-	bytes = unicode_to_utf8(c, utf8);
-	fwrite(utf8, 1, bytes, stdout);
+
+	bytes = unicode_to_utf8(c, &frame[frame_len]);
+	frame_len += bytes;
 	return 0;
 }
 
+/* Append "n" bytes of escape sequence or text to the frame as they are */
+void ttputs(const char *s, size_t n)
+{
+	while (n > 0) {
+		size_t k;
+
+		if (!frame_reserve(n > FRAME_INIT ? FRAME_INIT : n))
+			return;
+		k = frame_room - frame_len < n ? frame_room - frame_len : n;
+		memcpy(&frame[frame_len], s, k);
+		frame_len += k;
+		s += k;
+		n -= k;
+	}
+}
+
+/* Wrap frames in synchronized update marks, or hide the cursor instead */
+void ttsetsync(int on)
+{
+	frame_sync = on;
+}
+
 /*
- * Flush terminal buffer. Does real work where the terminal output is buffered
- * up. A no-operation on systems where byte at a time terminal I/O is done.
+ * Write what there is of the frame, with its marks around it, in one
+ * writev() unless the terminal takes less than all of it at a time. The
+ * frame is never moved to make room for the marks. A frame written early,
+ * because it outgrew FRAME_MAX, has its head mark sent with the first part
+ * and its tail mark owed until "last".
  */
-void ttflush(void)
+static void frame_write(bool last)
 {
 /*
  * Add some terminal output success checking, sometimes an orphaned
@@ -153,29 +237,74 @@ void ttflush(void)
  * Jani Jaakkola suggested using select after EAGAIN but let's just wait a bit
  *
  */
-	int status;
-	
-    // Block only SIGWINCH during flush to avoid resize tearing
-    sigset_t oldmask, mask;
-    sigemptyset(&mask);
-#ifdef SIGWINCH
-    sigaddset(&mask, SIGWINCH);
-#endif
-    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
-
-	status = fflush(stdout);
-	while (status < 0 && errno == EAGAIN) {
-		usleep(10000);  // 10ms instead of 1000ms - 100x faster
-		status = fflush(stdout);
+	struct iovec iov[3], *v = iov;
+	const char *head = NULL;
+	int iovcnt = 0;
+
+	if (frame_tail == NULL && frame_len > 0) {
+		if (frame_sync) {
+			head = SYNC_BEGIN;
+			frame_tail = SYNC_END;
+		} else if (!last || frame_len >= FRAME_HIDE) {
+			head = HIDE_CURSOR;
+			frame_tail = SHOW_CURSOR;
+		}
+	}
+	if (head)
+		iov[iovcnt++] = (struct iovec){ (void *)head, strlen(head) };
+	if (frame_len > 0)
+		iov[iovcnt++] = (struct iovec){ frame, frame_len };
+	if (last && frame_tail) {
+		iov[iovcnt++] = (struct iovec){ (void *)frame_tail, strlen(frame_tail) };
+		frame_tail = NULL;
+	}
+	while (iovcnt > 0) {
+		ssize_t n = writev(STDOUT_FILENO, v, iovcnt);
+
+		sent_writes++;
+		if (n > 0) {
+			sent_bytes += n;
+			while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+				n -= v->iov_len;
+				v++;
+				iovcnt--;
+			}
+			if (iovcnt > 0) {
+				v->iov_base = (char *)v->iov_base + n;
+				v->iov_len -= n;
+			}
+		} else if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = STDOUT_FILENO, .events = POLLOUT };
+			poll(&pfd, 1, 10);	/* until the terminal takes more */
+		} else if (n < 0 && errno != EINTR) {
+			exit(15);
+		}
+	}
+	frame_len = 0;
+	if (last && sent_bytes > 0) {
+		last_bytes = sent_bytes;
+		last_writes = sent_writes;
+		perf_count_frame(sent_bytes, sent_writes);
+		sent_bytes = 0;
+		sent_writes = 0;
 	}
-	
-	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
-	
-	if (status < 0)
-		exit(15);
 }
 
+/* Flush terminal buffer: write the frame built since the last flush */
+void ttflush(void)
+{
+	/* Anything printed through stdio goes first, as it was printed first */
+	fflush(stdout);
+	frame_write(true);
+}
 
+/* Size of the last frame flushed, and the write() calls it took */
+size_t ttframe_last(int *writes)
+{
+	if (writes)
+		*writes = last_writes;
+	return last_bytes;
+}
 
 int ttgetc(void) {
     unsigned char byte;
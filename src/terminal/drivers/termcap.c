@@ -16,6 +16,8 @@
 #include <curses.h>
 #include <term.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "string_safe.h"
 
 #include "estruct.h"
@@ -24,16 +26,12 @@
 
 #if TERMCAP
 
-#if UNIX
-#include <signal.h>
-#include <pthread.h>
-#endif
-
 #define	MARGIN	8
 #define	SCRSIZ	64
 #define	NPAUSE	10    /* # times thru update to pause. */
 #define BEL     0x07
 #define ESC     0x1B
+#define MOVELEN 32    /* Longest relative cursor move worth sending */
 
 static void tcapkopen(void);
 static void tcapkclose(void);
@@ -58,6 +56,8 @@ static int tcapbcol(int color);
 #if SCROLLCODE
 static void tcapscroll_reg(int from, int to, int linestoscroll);
 static void tcapscroll_delins(int from, int to, int linestoscroll);
+static int tcapscrcost_reg(int from, int to, int linestoscroll);
+static int tcapscrcost_delins(int from, int to, int linestoscroll);
 #endif
 
 #define TCAPSLEN 315
@@ -105,7 +105,8 @@ struct terminal term = {
 	tcapbcol
 #endif
 #if     SCROLLCODE
-	    , NULL		/* set dynamically at open time */
+	    , NULL,		/* set dynamically at open time */
+	NULL
 #endif
 };
 
@@ -198,10 +199,13 @@ static void tcapopen(void)
 			if (SF == NULL)	/* assume '\n' scrolls forward */
 				SF = "\n";
 			term.t_scroll = tcapscroll_reg;
+			term.t_scrcost = tcapscrcost_reg;
 		} else if (DL && AL) {
 			term.t_scroll = tcapscroll_delins;
+			term.t_scrcost = tcapscrcost_delins;
 		} else {
 			term.t_scroll = NULL;
+			term.t_scrcost = NULL;
 		}
 #endif
 
@@ -246,50 +250,61 @@ static void tcapkclose(void)
 #endif
 }
 
+/*
+ * Append a move of "n" to "out" at "len", as that many of the byte "one"
+ * if there is one and it is short, else as a CSI sequence; the new length.
+ */
+static int hop(char *out, int len, int n, const char *one, const char *csi)
+{
+	if (n <= 3 && one != NULL) {	/* a byte each is as short as it gets */
+		while (n-- > 0)
+			out[len++] = *one;
+		return len;
+	}
+	return len + snprintf(out + len, MOVELEN - len, "\033[%d%s", n, csi);
+}
+
+/*
+ * Move the cursor. movecursor() calls this before it updates ttrow, so
+ * while that is on the screen it tells the row the cursor is on, and a
+ * carriage return, line feeds or a move up, and a move right goes out
+ * instead of the full cursor address when that is shorter. The column is
+ * never taken from ttcol: a wide character leaves the terminal's cursor
+ * further right than the display counted. With OPOST off a line feed
+ * moves down and no more; it never starts on the last row, so it cannot
+ * scroll.
+ */
 static void tcapmove(int row, int col)
 {
-    // Block only SIGWINCH during cursor movement to avoid tearing
-    sigset_t oldmask, mask;
-    sigemptyset(&mask);
-#ifdef SIGWINCH
-    sigaddset(&mask, SIGWINCH);
-#endif
-    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
-	
-	putpad(tgoto(CM, col, row));
-	
-	// Restore signal handling after atomic cursor movement
-	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	char rel[MOVELEN];
+	char *abs = tgoto(CM, col, row);
+	int alen = abs ? strlen(abs) : 0;
+	int len = 0;
+
+	if (abs && ttrow >= 0 && ttrow <= term.t_nrow && ttcol >= 0 && ttcol < term.t_ncol) {
+		if (row > ttrow)
+			len = hop(rel, len, row - ttrow, "\n", "B");
+		else if (row < ttrow)
+			len = hop(rel, len, ttrow - row, NULL, "A");
+		rel[len++] = '\r';
+		if (col > 0)
+			len = hop(rel, len, col, NULL, "C");
+		if (len < alen) {
+			ttputs(rel, len);
+			return;
+		}
+	}
+	putpad(abs);
 }
 
 static void tcapeeol(void)
 {
-    // Block only SIGWINCH during EOL erase
-    sigset_t oldmask, mask;
-    sigemptyset(&mask);
-#ifdef SIGWINCH
-    sigaddset(&mask, SIGWINCH);
-#endif
-    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
-	
 	putpad(CE);
-	
-	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 }
 
 static void tcapeeop(void)
 {
-    // Block only SIGWINCH during EOP erase
-    sigset_t oldmask, mask;
-    sigemptyset(&mask);
-#ifdef SIGWINCH
-    sigaddset(&mask, SIGWINCH);
-#endif
-    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
-	
 	putpad(CL);
-	
-	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 }
 
 /*
@@ -299,22 +314,11 @@ static void tcapeeop(void)
  */
 static void tcaprev(int state)
 {
-    // Block only SIGWINCH during attribute toggles
-    sigset_t oldmask, mask;
-    sigemptyset(&mask);
-#ifdef SIGWINCH
-    sigaddset(&mask, SIGWINCH);
-#endif
-    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
-	
 	if (state) {
-		// Send bold ANSI sequence atomically for modern terminals
-		// This ensures bold + reverse video for status line
-		ttputc('\033');
-		ttputc('[');
-		ttputc('1');
-		ttputc('m');
-		
+		// Bold + reverse video for status line, in one sequence
+		// for modern terminals
+		ttputs("\033[1m", 4);
+
 		// Then send standout mode (reverse video)
 		if (SO != NULL)
 			putpad(SO);
@@ -322,17 +326,10 @@ static void tcaprev(int state)
 		// Reset standout mode
 		if (SE != NULL)
 			putpad(SE);
-		
+
 		// Reset only bold, preserve colors - use ESC[22m instead of ESC[0m
-		ttputc('\033');
-		ttputc('[');
-		ttputc('2');
-		ttputc('2');
-		ttputc('m');
+		ttputs("\033[22m", 5);
 	}
-	
-	// Restore signal handling after atomic escape sequence
-	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 }
 
 /* Change screen resolution. */
@@ -386,6 +383,29 @@ static void tcapscroll_delins(int from, int to, int howmanylines)
 	}
 }
 
+/*
+ * Bytes tcapscroll_reg() sends: the region set and reset with the pad
+ * before each, a cursor move, and a scroll per line moved
+ */
+static int tcapscrcost_reg(int from, int to, int howmanylines)
+{
+	int n = abs(to - from);
+
+	(void)howmanylines;
+	return 2 * (1 + strlen(tgoto(CS, term.t_nrow, 0))) +
+	    strlen(tgoto(CM, 0, from)) + n * strlen(to < from ? SF : SR);
+}
+
+/* Bytes tcapscroll_delins() sends: two cursor moves, a delete and an
+ * insert per line moved */
+static int tcapscrcost_delins(int from, int to, int howmanylines)
+{
+	int n = abs(to - from);
+
+	(void)howmanylines;
+	return 2 * strlen(tgoto(CM, 0, from)) + n * (strlen(DL) + strlen(AL));
+}
+
 /* cs is set up just like cm, so we use tgoto... */
 static void tcapscrollregion(int top, int bot)
 {
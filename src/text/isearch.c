@@ -6,11 +6,13 @@
 #include "edef.h"
 #include "efunc.h"
 #include "line.h"
+#include "literal_scan.h"
 #include "string_safe.h"
 
 #if	ISRCH
 
 static int echo_char(int c, int col);
+static int reprompt(const char *pat_save, int cpos);
 
 /* A couple of "own" variables for re-eat */
 
@@ -23,6 +25,45 @@ static int cmd_buff[CMDBUFLEN];	/* Save the command args here */
 static int cmd_offset;			/* Current offset into command buff */
 static int cmd_reexecute = -1;		/* > 0 if re-executing command */
 
+/* The matcher kept from one keystroke to the next */
+
+static struct literal_scan is_ls;	/* Pattern prepared for the kernel  */
+static char is_lspat[NPAT];		/* ... which pattern that is        */
+static int is_lscase = -1;		/* ... and whether case-sensitive   */
+static struct line *is_mlp;		/* Start of the current match, or   */
+static int is_moff;			/*  NULL if not known               */
+
+/* Each step of the search, so that Rubout can take it back */
+
+struct isearch_step {
+	struct line *s_dotp;	/* "." before the step                */
+	int s_doto;
+	struct line *s_mlp;	/* Start of the match before it       */
+	int s_moff;
+	int s_cpos;		/* Length of the search string        */
+	int s_status;		/* Whether that was found             */
+	int s_dir;		/* Search direction                   */
+};
+
+static struct isearch_step is_steps[CMDBUFLEN];
+static int is_nsteps;
+
+static void push_step(int cpos, int status, int dir)
+{
+	struct isearch_step *sp;
+
+	if (is_nsteps >= CMDBUFLEN)	/* get_char() quits before this */
+		return;
+	sp = &is_steps[is_nsteps++];
+	sp->s_dotp = curwp->w_dotp;
+	sp->s_doto = curwp->w_doto;
+	sp->s_mlp = is_mlp;
+	sp->s_moff = is_moff;
+	sp->s_cpos = cpos;
+	sp->s_status = status;
+	sp->s_dir = dir;
+}
+
 
 /*
  * Subroutine to do incremental reverse search.  It actually uses the
@@ -104,7 +145,8 @@ int fisearch(int f, int n)
  * change to a backwards search, META will terminate the search and Control-G
  * will abort the search.  Rubout will back up to the previous match of the
  * string, or if the starting point is reached first, it will delete the
- * last character from the search string.
+ * last character from the search string.  Every step is kept on a stack,
+ * so Rubout just goes back to the one before, without searching again.
  *
  * While searching backward, each successive character will leave the cursor
  * at the beginning of the matched string.  Typing a Control-R will search
@@ -125,8 +167,6 @@ int isearch(int f, int n)
 	int c;		/* current input character */
 	int expc;	/* function expanded input char       */
 	char pat_save[NPAT];	/* Saved copy of the old pattern str  */
-	struct line *curline;		/* Current line on entry              */
-	int curoff;		/* Current offset on entry            */
 	int init_direction;	/* The initial search direction       */
 
 	/* Initialize starting conditions */
@@ -135,11 +175,11 @@ int isearch(int f, int n)
 	cmd_offset = 0;		/* Start at the beginning of the buff */
 	cmd_buff[0] = '\0';	/* Init the command buffer            */
     safe_strcpy(pat_save, pat, NPAT);	/* Save the old pattern string        */
-	curline = curwp->w_dotp;	/* Save the current line pointer      */
-	curoff = curwp->w_doto;	/* Save the current offset            */
 	init_direction = n;	/* Save the initial search direction  */
+	is_nsteps = 0;		/* Nothing to take back yet           */
+	is_mlp = NULL;		/* No match yet                       */
 
-	/* This is a good place to start a re-execution: */
+	/* Rubout comes back here once all steps are taken back: */
 
       start_over:
 
@@ -156,6 +196,7 @@ int isearch(int f, int n)
 
 	c = ectoc(expc = get_char());	/* Get the first character    */
 	if ((c == IS_FORWARD) || (c == IS_REVERSE)) {	/* Reuse old search string?   */
+		push_step(0, status, n);	/* Rubout goes back to the prompt */
 		for (cpos = 0; pat[cpos] != 0; cpos++)	/* Yup, find the length           */
 			col = echo_char(pat[cpos], col);	/*  and re-echo the string    */
 		if (c == IS_REVERSE) {	/* forward search?            */
@@ -182,6 +223,7 @@ int isearch(int f, int n)
 
 		case IS_REVERSE:	/* If backward search         */
 		case IS_FORWARD:	/* If forward search          */
+			push_step(cpos, status, n);	/* Remember where we were */
 			if (c == IS_REVERSE)	/* If reverse search              */
 				n = -1;	/* Set the reverse direction  */
 			else	/* Otherwise,                     */
@@ -203,16 +245,33 @@ int isearch(int f, int n)
 
 		case IS_BACKSP:	/* If a backspace:            */
 		case IS_RUBOUT:	/*  or if a Rubout:           */
-			if (cmd_offset <= 1)	/* Anything to delete?            */
+			if (is_nsteps == 0)	/* Anything to delete?            */
 				return TRUE;	/* No, just exit              */
 			--cmd_offset;	/* Back up over the Rubout    */
 			cmd_buff[--cmd_offset] = '\0';	/* Yes, delete last char   */
-			curwp->w_dotp = curline;	/* Reset the line pointer     */
-			curwp->w_doto = curoff;	/*  and the offset            */
-			n = init_direction;	/* Reset the search direction */
-                safe_strcpy(pat, pat_save, NPAT);	/* Restore the old search str */
-			cmd_reexecute = 0;	/* Start the whole mess over  */
-			goto start_over;	/* Let it take care of itself */
+			{
+				struct isearch_step *sp = &is_steps[--is_nsteps];
+
+				curwp->w_dotp = sp->s_dotp;	/* Back to "." before */
+				curwp->w_doto = sp->s_doto;	/*  the last step     */
+				curwp->w_flag |= WFMOVE;
+				is_mlp = sp->s_mlp;
+				is_moff = sp->s_moff;
+				status = sp->s_status;
+				n = sp->s_dir;
+				cpos = sp->s_cpos;
+			}
+			if (cpos == 0)	/* Back to the old search str */
+				safe_strcpy(pat, pat_save, NPAT);
+			else
+				pat[cpos] = 0;
+			if (is_nsteps == 0) {	/* Nothing typed any more */
+				n = init_direction;	/* Reset the search direction */
+				goto start_over;	/* Prompt afresh              */
+			}
+			col = reprompt(pat_save, cpos);	/* Redo the echo      */
+			c = ectoc(expc = get_char());	/* Get the next char  */
+			continue;
 
 			/* Presumably a quasi-normal character comes here */
 
@@ -225,6 +284,7 @@ int isearch(int f, int n)
 
 		/* I guess we got something to search for, so search for it           */
 
+		push_step(cpos, status, n);	/* Remember where we were */
 		pat[cpos++] = c;	/* put the char in the buffer */
 		if (cpos >= NPAT) {	/* too many chars in string?  *//* Yup.  Complain about it    */
 			mlwrite("? Search string too long");
@@ -235,8 +295,8 @@ int isearch(int f, int n)
 		if (!status) {	/* If we lost last time       */
 			TTputc(BELL);	/* Feep again                 */
 			TTflush();	/* see that the feep feeps    */
-		} else /* Otherwise, we must have won */ if (!(status = checknext(c, pat, n)))	/* See if match         */
-			status = scanmore(pat, n);	/*  or find the next match    */
+		} else		/* Otherwise, we must have won */
+			status = isearch_extend(pat, n);	/* Match still there? */
 		c = ectoc(expc = get_char());	/* Get the next char          */
 	}			/* for {;;} */
 }
@@ -305,9 +365,12 @@ int scanmore(char *patrn, int dir)	/* search forward or back for a pattern
 
 	if (dir < 0) {		/* reverse search?              */
 		rvstrcpy(tap, patrn);	/* Put reversed string in tap */
-		sts = scanner(tap, REVERSE, PTBEG);
-	} else
-		sts = scanner(patrn, FORWARD, PTEND);	/* Nope. Go forward   */
+		if ((sts = scanner(tap, REVERSE, PTBEG)) == TRUE) {
+			is_mlp = curwp->w_dotp;	/* "." is at its start  */
+			is_moff = curwp->w_doto;
+		}
+	} else			/* Nope. Go forward   */
+		sts = isearch_forward(patrn, curwp->w_dotp, curwp->w_doto);
 
 	if (!sts) {
 		TTputc(BELL);	/* Feep if search fails       */
@@ -317,6 +380,96 @@ int scanmore(char *patrn, int dir)	/* search forward or back for a pattern
 	return sts;		/* else, don't even try       */
 }
 
+/*
+ * Forward search for <pat> from (lp, off).  Literal strings go straight to
+ * the literal kernel, prepared again only when the string has changed, so
+ * a keystroke costs no more than the text it has to look through.  MAGIC
+ * buffers still go through scanner().  "." is left at the end of the match,
+ * or where it was if there is none.
+ *
+ * char *patrn;			string to scan for
+ * struct line *lp; int off;	where to start
+ */
+int isearch_forward(char *patrn, struct line *lp, int off)
+{
+	struct line *odotp = curwp->w_dotp;
+	int odoto = curwp->w_doto;
+	struct line *mlp, *elp;
+	int moff, eoff;
+	int len = strlen(patrn);
+	int exact = (curwp->w_bufp->b_mode & MDEXACT) != 0;
+
+	if ((curwp->w_bufp->b_mode & MDMAGIC) != 0 || len == 0 || len > LSCAN_MAX_PATTERN) {
+		curwp->w_dotp = lp;
+		curwp->w_doto = off;
+		is_mlp = NULL;	/* scanner() doesn't tell where it starts */
+		if (scanner(patrn, FORWARD, PTEND) == TRUE)
+			return TRUE;
+		curwp->w_dotp = odotp;
+		curwp->w_doto = odoto;
+		return FALSE;
+	}
+	if (exact != is_lscase || strcmp(patrn, is_lspat) != 0) {
+		if (lscan_init(&is_ls, (const unsigned char *)patrn, len, exact) != 0)
+			return FALSE;
+		safe_strcpy(is_lspat, patrn, NPAT);
+		is_lscase = exact;
+	}
+	if (!lscan_search_forward(&is_ls, lp, off, curbp->b_linep, &mlp, &moff, &elp, &eoff))
+		return FALSE;
+	matchline = is_mlp = mlp;
+	matchoff = is_moff = moff;
+	curwp->w_dotp = elp;
+	curwp->w_doto = eoff;
+	curwp->w_flag |= WFMOVE;
+	return TRUE;
+}
+
+/*
+ * The search string has just grown by one character.  Check it in place at
+ * the current match, and failing that, search on from just after the start
+ * of that match: a match of the longer string can't start any earlier.
+ *
+ * char *patrn;			The entire search string
+ * int dir;			Search direction
+ */
+int isearch_extend(char *patrn, int dir)
+{
+	struct line *lp = curwp->w_dotp;
+	int off = curwp->w_doto;
+	int cpos = strlen(patrn);
+	int sts;
+
+	if (dir > 0 && cpos == 1) {	/* A first char matches at "."   */
+		is_mlp = lp;
+		is_moff = off;
+	}
+	if (checknext(patrn[cpos - 1], patrn, dir)) {
+		if (dir < 0) {		/* Backward "." is at the start  */
+			is_mlp = curwp->w_dotp;
+			is_moff = curwp->w_doto;
+		}
+		return TRUE;
+	}
+	if (dir < 0 || is_mlp == NULL)
+		return scanmore(patrn, dir);
+
+	lp = is_mlp;		/* Step past the start of the match */
+	off = is_moff;
+	if (off < llength(lp))
+		++off;
+	else {
+		lp = lforw(lp);
+		off = 0;
+	}
+	sts = lp != curbp->b_linep && isearch_forward(patrn, lp, off);
+	if (!sts) {
+		TTputc(BELL);	/* Feep if search fails       */
+		TTflush();	/* see that the feep feeps    */
+	}
+	return sts;
+}
+
 /*
  * The following is a worker subroutine used by the reverse search.  It
  * compares the pattern string with the characters at "." for equality. If
@@ -376,6 +529,25 @@ int promptpattern(char *prompt)
 	return strlen(tpat);
 }
 
+/*
+ * Put the prompt back up after a Rubout, showing the old pattern as the
+ * prompt always does, and echo the first "cpos" characters of the new one.
+ */
+static int reprompt(const char *pat_save, int cpos)
+{
+	char typed[NPAT];
+	int col;
+	int i;
+
+	safe_strcpy(typed, pat, NPAT);
+	safe_strcpy(pat, pat_save, NPAT);
+	col = promptpattern("ISearch: ");
+	safe_strcpy(pat, typed, NPAT);
+	for (i = 0; i < cpos; i++)
+		col = echo_char(pat[i], col);
+	return col;
+}
+
 /*
  * routine to echo i-search characters
  *
@@ -0,0 +1,388 @@
+/*
+ * literal_scan.c - Vectorised literal search for scanner()
+ *
+ * Every kernel runs the same filter: a position is a candidate when the
+ * byte there equals the first byte of the pattern and the byte m-1 further
+ * on equals the last one. The SIMD kernels test 16 or 32 positions per
+ * step with two loads and two compares; the rare candidates are verified
+ * with a full compare. Case folding ORs 0x20 into text bytes that are
+ * compared with a letter, which may let a few non-letters through the
+ * filter but never loses a match; verification settles them.
+ *
+ * Searching a buffer runs the kernel over a window into which the lines
+ * are copied with their newlines, so short lines cost nothing extra per
+ * line and patterns may span line ends. A search starts with a small
+ * window and doubles it while nothing is found, so that searches repeated
+ * from one nearby match to the next copy little more than they cover.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "estruct.h"
+#include "line.h"
+#include "memory.h"
+#include "literal_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#define LSCAN_WINDOW    65536   /* Bytes of text searched per kernel call */
+#define LSCAN_FIRST     512     /* First window of a search, doubled after */
+#define LSCAN_MARKS     4096    /* Line starts in a window */
+
+typedef long (*lscan_fn)(const struct literal_scan *ls, const unsigned char *text, size_t n);
+
+static inline unsigned char lower_ascii(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + 32) : c;
+}
+
+int lscan_init(struct literal_scan *ls, const unsigned char *pattern, int len,
+               bool case_sensitive)
+{
+    if (!ls || !pattern || len <= 0 || len > LSCAN_MAX_PATTERN)
+        return -1;
+
+    ls->len = len;
+    ls->case_sensitive = case_sensitive;
+    for (int i = 0; i < len; i++)
+        ls->pattern[i] = case_sensitive ? pattern[i] : lower_ascii(pattern[i]);
+    ls->first = ls->pattern[0];
+    ls->last = ls->pattern[len - 1];
+    ls->first_fold = (!case_sensitive && ls->first >= 'a' && ls->first <= 'z') ? 0x20 : 0;
+    ls->last_fold = (!case_sensitive && ls->last >= 'a' && ls->last <= 'z') ? 0x20 : 0;
+    return 0;
+}
+
+/* Full compare of a candidate */
+static inline bool lscan_verify(const struct literal_scan *ls, const unsigned char *p)
+{
+    if (ls->case_sensitive)
+        return memcmp(p, ls->pattern, ls->len) == 0;
+    for (int i = 0; i < ls->len; i++) {
+        if (lower_ascii(p[i]) != ls->pattern[i])
+            return false;
+    }
+    return true;
+}
+
+static long lscan_find_scalar(const struct literal_scan *ls, const unsigned char *text, size_t n)
+{
+    size_t m = ls->len;
+    const unsigned char *p, *end;
+
+    if (n < m)
+        return -1;
+    end = text + n - m + 1;     /* candidates are [text, end) */
+
+    if (!ls->first_fold) {
+        /* memchr is the C library's own vectorised byte scan */
+        for (p = text; p < end && (p = memchr(p, ls->first, end - p)) != NULL; p++) {
+            if ((p[m - 1] | ls->last_fold) == ls->last && lscan_verify(ls, p))
+                return p - text;
+        }
+        return -1;
+    }
+    for (p = text; p < end; p++) {
+        if ((*p | 0x20) == ls->first && (p[m - 1] | ls->last_fold) == ls->last &&
+            lscan_verify(ls, p))
+            return p - text;
+    }
+    return -1;
+}
+
+#ifdef LSCAN_X86
+__attribute__((target("sse2")))
+static long lscan_find_sse2(const struct literal_scan *ls, const unsigned char *text, size_t n)
+{
+    size_t m = ls->len;
+    size_t i = 0;
+    long tail;
+
+    const __m128i first = _mm_set1_epi8((char)ls->first);
+    const __m128i last = _mm_set1_epi8((char)ls->last);
+    const __m128i ffold = _mm_set1_epi8((char)ls->first_fold);
+    const __m128i lfold = _mm_set1_epi8((char)ls->last_fold);
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i)), ffold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i + m - 1)), lfold);
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (lscan_verify(ls, text + i + bit))
+                return (long)(i + bit);
+            mask &= mask - 1;
+        }
+    }
+    tail = lscan_find_scalar(ls, text + i, n - i);
+    return tail < 0 ? -1 : (long)i + tail;
+}
+
+__attribute__((target("avx2")))
+static long lscan_find_avx2(const struct literal_scan *ls, const unsigned char *text, size_t n)
+{
+    size_t m = ls->len;
+    size_t i = 0;
+    long tail;
+
+    const __m256i first = _mm256_set1_epi8((char)ls->first);
+    const __m256i last = _mm256_set1_epi8((char)ls->last);
+    const __m256i ffold = _mm256_set1_epi8((char)ls->first_fold);
+    const __m256i lfold = _mm256_set1_epi8((char)ls->last_fold);
+
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i)), ffold);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i + m - 1)), lfold);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (lscan_verify(ls, text + i + bit))
+                return (long)(i + bit);
+            mask &= mask - 1;
+        }
+    }
+    tail = lscan_find_sse2(ls, text + i, n - i);
+    return tail < 0 ? -1 : (long)i + tail;
+}
+#endif
+
+static lscan_fn lscan_kernel;
+static const char *lscan_name = "scalar";
+
+bool lscan_set_kernel(enum lscan_kernel kernel)
+{
+    const char *env;
+
+    if (kernel == LSCAN_AUTO) {
+        env = getenv("UEMACS_SEARCH_SIMD");
+        kernel = LSCAN_SCALAR;
+#ifdef LSCAN_X86
+        if (!(env && strcmp(env, "0") == 0)) {
+            __builtin_cpu_init();
+            kernel = __builtin_cpu_supports("avx2") ? LSCAN_AVX2 : LSCAN_SSE2;
+        }
+#else
+        (void)env;
+#endif
+    }
+
+    switch (kernel) {
+    case LSCAN_SCALAR:
+        lscan_kernel = lscan_find_scalar;
+        lscan_name = "scalar";
+        return true;
+#ifdef LSCAN_X86
+    case LSCAN_SSE2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("sse2"))
+            return false;
+        lscan_kernel = lscan_find_sse2;
+        lscan_name = "sse2";
+        return true;
+    case LSCAN_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2"))
+            return false;
+        lscan_kernel = lscan_find_avx2;
+        lscan_name = "avx2";
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *lscan_kernel_name(void)
+{
+    if (!lscan_kernel)
+        lscan_set_kernel(LSCAN_AUTO);
+    return lscan_name;
+}
+
+long lscan_find(const struct literal_scan *ls, const unsigned char *text, size_t n)
+{
+    if (!lscan_kernel)
+        lscan_set_kernel(LSCAN_AUTO);
+    return lscan_kernel(ls, text, n);
+}
+
+/* Where a window's bytes came from: text from "woff" on is line "lp" from "loff" on */
+struct lscan_mark {
+    struct line *lp;
+    size_t woff;
+    int loff;
+};
+
+/* Each thread keeps its window between searches; see lscan_release() */
+static _Thread_local unsigned char *lscan_window;
+static _Thread_local struct lscan_mark *lscan_marks;
+
+/*
+ * Copy up to "size" bytes of text from (*lpp,*offp) into the window,
+ * less if the stream ends, and leave (*lpp,*offp) at the first byte not
+ * copied. Returns the number of bytes copied; *nmarks gets the marks used.
+ */
+static size_t lscan_fill(struct line **lpp, int *offp, struct line *head, size_t size,
+                         int *nmarks)
+{
+    struct line *lp = *lpp;
+    int off = *offp;
+    size_t w = 0;
+    int n = 0;
+
+    while (lp != head && w < size && n < LSCAN_MARKS) {
+        size_t len = llength(lp) - off;
+
+        lscan_marks[n].lp = lp;
+        lscan_marks[n].woff = w;
+        lscan_marks[n].loff = off;
+        n++;
+        if (len > size - w) {
+            len = size - w;
+            memcpy(lscan_window + w, lp->l_text + off, len);
+            w += len;
+            off += (int)len;
+            break;
+        }
+        memcpy(lscan_window + w, lp->l_text + off, len);
+        w += len;
+        off = llength(lp);
+        if (lforw(lp) == head) {    /* no newline after the last line */
+            lp = head;
+            off = 0;
+            break;
+        }
+        if (w == size)
+            break;
+        lscan_window[w++] = '\n';
+        lp = lforw(lp);
+        off = 0;
+    }
+    *lpp = lp;
+    *offp = off;
+    *nmarks = n;
+    return w;
+}
+
+/* Line position of window offset "pos" */
+static void lscan_locate(int nmarks, size_t pos, struct line **lpp, int *offp)
+{
+    int lo = 0, hi = nmarks - 1;
+    struct line *lp;
+    long off;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (lscan_marks[mid].woff <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    lp = lscan_marks[lo].lp;
+    off = lscan_marks[lo].loff + (long)(pos - lscan_marks[lo].woff);
+    if (off > llength(lp)) {    /* just past the newline ending the window */
+        lp = lforw(lp);
+        off = 0;
+    }
+    *lpp = lp;
+    *offp = (int)off;
+}
+
+/* Allocate this thread's window on its first search */
+static bool lscan_ready(void)
+{
+    if (!lscan_window) {
+        lscan_window = safe_alloc(LSCAN_WINDOW, "literal scan window", __FILE__, __LINE__);
+        lscan_marks = safe_alloc(LSCAN_MARKS * sizeof(struct lscan_mark),
+                                 "literal scan marks", __FILE__, __LINE__);
+        if (!lscan_window || !lscan_marks) {
+            SAFE_FREE(lscan_window);
+            SAFE_FREE(lscan_marks);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool lscan_search_forward(const struct literal_scan *ls,
+                          struct line *start_lp, int start_off, struct line *head,
+                          struct line **match_lp, int *match_off,
+                          struct line **end_lp, int *end_off)
+{
+    struct line *lp = start_lp;
+    int off = start_off;
+    size_t keep = (size_t)ls->len - 1;
+    size_t size = LSCAN_FIRST;
+
+    if (!lscan_ready())
+        return false;
+
+    while (lp != head) {
+        int nmarks;
+        size_t w = lscan_fill(&lp, &off, head, size, &nmarks);
+        long pos = lscan_find(ls, lscan_window, w);
+
+        if (pos >= 0) {
+            lscan_locate(nmarks, (size_t)pos, match_lp, match_off);
+            lscan_locate(nmarks, (size_t)pos + ls->len, end_lp, end_off);
+            return true;
+        }
+        if (lp == head || w <= keep)
+            break;
+        /* A match may straddle windows: start the next one "keep" bytes back */
+        lscan_locate(nmarks, w - keep, &lp, &off);
+        if (size < LSCAN_WINDOW)
+            size *= 2;
+    }
+    return false;
+}
+
+bool lscan_search_all(const struct literal_scan *ls,
+                      struct line *start_lp, int start_off, struct line *head,
+                      lscan_found_fn found, void *arg)
+{
+    struct line *lp = start_lp;
+    int off = start_off;
+    size_t keep = (size_t)ls->len - 1;
+
+    if (!lscan_ready())
+        return false;
+
+    while (lp != head) {
+        int nmarks;
+        size_t w = lscan_fill(&lp, &off, head, LSCAN_WINDOW, &nmarks);
+        size_t from = 0;        /* where the next match may start */
+        long pos;
+
+        while (from < w && (pos = lscan_find(ls, lscan_window + from, w - from)) >= 0) {
+            struct line *mlp, *elp;
+            int moff, eoff;
+
+            pos += (long)from;
+            lscan_locate(nmarks, (size_t)pos, &mlp, &moff);
+            lscan_locate(nmarks, (size_t)pos + ls->len, &elp, &eoff);
+            if (!found(arg, mlp, moff, elp, eoff))
+                return true;
+            from = (size_t)pos + ls->len;
+        }
+        if (lp == head || w <= keep)
+            break;
+        /* Go on after the last match, or "keep" bytes back for one straddling */
+        lscan_locate(nmarks, from > w - keep ? from : w - keep, &lp, &off);
+    }
+    return true;
+}
+
+void lscan_release(void)
+{
+    SAFE_FREE(lscan_window);
+    SAFE_FREE(lscan_marks);
+}
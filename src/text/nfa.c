@@ -1,331 +1,1277 @@
 /*
  * nfa.c - Thompson NFA (regex-lite) for MAGIC search
- * Features: literals, dot (.), anchors (^,$), closure (*) on single atoms.
- * Zero-heap runtime: fixed arenas and active sets.
+ * Features: literals, dot (.), classes, anchors (^,$), alternation (|),
+ * groups, and the repeats *, +, ? and {m,n} on any atom or group.
+ *
+ * A compiled pattern is a program object holding everything its searches
+ * touch: the NFA, the reversed NFA for backward search, the lazy DFA and
+ * the scratch state sets. Searches with different programs share nothing,
+ * so they may run at the same time. The editor fetches programs through a
+ * small LRU cache keyed by pattern and case sensitivity, so searching
+ * again, hunting and query-replace compile a pattern once.
+ *
+ * Matches never span lines, so a search runs line by line. A lazily built
+ * DFA goes over each line first: its states are the NFA state sets met so
+ * far, each with a 256-entry transition table filled in on first use, so
+ * most bytes cost one table lookup. Only a line the DFA accepts is run on
+ * the NFA, to find where the leftmost-longest match starts and ends. The
+ * DFA cache is bounded; when it fills up it is flushed and regrown, and a
+ * pattern that keeps flushing it is left to the NFA alone.
+ *
+ * When every match must contain some literal ("timeout" in error.*timeout)
+ * the literal scanner first skips to the next line that has it.
+ *
+ * Searching backward runs the reversed program over each line read from
+ * its end, starting at the cursor's line and going back from there.
+ *
+ * What the groups matched is only worked out when asked for, once the
+ * match is known: a Pike VM runs the NFA over just that span, its threads
+ * carrying the group offsets in priority order, so the first to reach the
+ * end decides them.
  */
 
 #include "nfa.h"
 #include <string.h>
 #include <ctype.h>
 #include <stdatomic.h>
+#include <stdlib.h>
 
 
 #include "estruct.h"
 #include "edef.h"
 #include "efunc.h"
 #include "line.h"
+#include "literal_scan.h"
+#include "memory.h"
 
 /* Fixed capacities */
 #define NFA_MAX_STATES 2048
-#define NFA_MAX_LIST   4096
 
-typedef enum { ST_CHAR, ST_ANY, ST_CLASS, ST_SPLIT, ST_MATCH, ST_BOL, ST_EOL } stype_t;
+/* Lazy DFA cache */
+#define DFA_MAX_STATES 256                  /* 1 KiB of transitions each */
+#define DFA_POOL       (DFA_MAX_STATES * 32) /* NFA states across all DFA states */
+#define DFA_HASH       512                  /* Power of two, > DFA_MAX_STATES */
+#define DFA_MIN_BYTES  (DFA_MAX_STATES * 16) /* Bytes a cache must last to be worth regrowing */
+#define REQUIRED_MIN   2                    /* Shortest required literal worth a prefilter */
+#define NFA_MAX_REPEAT 255                  /* Largest bound of {m,n} */
+
+/* Compiled programs kept for reuse */
+#define NFA_CACHE_SIZE 8
+
+typedef enum { ST_CHAR, ST_ANY, ST_CLASS, ST_SPLIT, ST_MATCH, ST_BOL, ST_EOL, ST_SAVE } stype_t;
 
 typedef struct {
     stype_t type;
-    unsigned char c; /* for ST_CHAR */
+    unsigned char c; /* for ST_CHAR; the group slot for ST_SAVE */
     unsigned char cls[32]; /* 256-bit char class for ST_CLASS */
+    bool eol_accepts; /* ST_EOL: a match ends once past it */
     int out;
     int out1; /* for split */
 } nfa_state;
 
-static nfa_state arena[NFA_MAX_STATES];
-static int arena_used = 0;
+/*
+ * State sets. Each member carries the offset its thread started at; the
+ * DFA ignores it. A set holds each NFA state once ("seen" marks the
+ * states of the set being built), so it never needs more room than the
+ * automaton has states, and since threads are added in order of their
+ * starts, the one kept is the leftmost.
+ */
+typedef struct { int* idx; int* start; int n; } slist;
+
+/* Lazy DFA: a state is a sorted NFA state set, found again through a hash table */
+struct dfa_state {
+    int first, n;       /* members in pool */
+    uint32_t hash;
+    bool accept;        /* a match ends here */
+    bool accept_eol;    /* ... or would, at the end of the line */
+};
+
+/*
+ * Transitions of state s by raw byte b are at trans[s * 256 + b]: the
+ * next state times 256 so the scan loop adds the byte straight to it,
+ * or DFA_ACCEPTS(next) when that one accepts, or -1 until computed.
+ */
+#define DFA_ACCEPTS(t)  (-((t) << 8) - 2)
+
+struct dfa {
+    struct dfa_state st[DFA_MAX_STATES];
+    int trans[DFA_MAX_STATES * 256];
+    int pool[DFA_POOL];
+    int pool_used;
+    int hash[DFA_HASH];
+    int count;
+    int start[2];       /* start states, by at_bol */
+    size_t bytes;       /* scanned since the last flush */
+    unsigned epoch;     /* bumped by every flush */
+};
+
+/* One automaton, forward or reversed, with the scratch its searches use */
+struct nfa_machine {
+    nfa_state* st;
+    int n;
+    int start;
+    bool cs;
+    unsigned* seen;
+    unsigned seen_gen;
+    slist lists[2];     /* the NFA's current and next sets */
+    slist tmp;          /* a DFA state being built */
+    int* pike;          /* Pike VM threads and their group offsets, on first use */
+    struct dfa* dfa;    /* allocated on the first search */
+    bool dfa_off;       /* UEMACS_SEARCH_DFA=0, or the pattern thrashes the cache */
+};
+
+struct nfa_program {
+    char* pattern;
+    bool cs;
+    struct nfa_machine fwd;
+    struct nfa_machine rev;     /* built on the first backward search */
+    bool have_rev;
+    struct literal_scan required; /* longest run of plain characters every match contains */
+    bool have_required;
+    int groups;                 /* numbered groups, at most NFA_GROUPS - 1 */
+};
+
+/* A program under construction */
+struct nfa_build {
+    nfa_state st[NFA_MAX_STATES];
+    int used;
+    int start;
+};
+
+/* Counters over all programs */
+static _Atomic uint64_t stat_hits, stat_misses, stat_flushes, stat_fallbacks;
+static _Atomic uint64_t stat_compiles, stat_reuses;
+static _Atomic size_t stat_states;
 
 static inline unsigned char norm_byte(unsigned char b, bool cs) {
     return cs ? b : (unsigned char)tolower(b);
 }
 
-static int add_state(stype_t t, unsigned char c, int out, int out1) {
-    if (arena_used >= NFA_MAX_STATES) return -1;
+static int add_state(struct nfa_build* b, stype_t t, unsigned char c, int out, int out1) {
+    if (b->used >= NFA_MAX_STATES) return -1;
     nfa_state st = {0}; st.type=t; st.c=c; st.out=out; st.out1=out1;
-    arena[arena_used] = st;
-    return arena_used++;
+    b->st[b->used] = st;
+    return b->used++;
 }
 
-/* Thompson fragments with patch lists are simplified here: we only support concatenation and '*' */
-typedef struct { int start; int out; } frag;
+static inline void cls_set(unsigned char *cls, int b) { cls[b >> 3] |= (1u << (b & 7)); }
+static inline int cls_has(const unsigned char *cls, int b) { return (cls[b >> 3] & (1u << (b & 7))) != 0; }
 
-static int patch(int s, int target) {
-    if (s < 0) return -1;
-    if (arena[s].type == ST_SPLIT) {
-        if (arena[s].out1 < 0) arena[s].out1 = target;
-        else arena[s].out = target;
-    } else {
-        arena[s].out = target;
+/*
+ * Thompson construction. A fragment is a start state and the list of its
+ * links still dangling, each coded as state * 2 + (0 for out, 1 for out1)
+ * and chained through the links themselves, -1 ending the chain.
+ */
+struct frag {
+    int start;
+    int holes;
+};
+
+static inline int* hole_link(struct nfa_build* b, int code) {
+    return (code & 1) ? &b->st[code >> 1].out1 : &b->st[code >> 1].out;
+}
+
+/* Point every dangling link of a list at "target" */
+static void fill(struct nfa_build* b, int holes, int target) {
+    while (holes >= 0) {
+        int* link = hole_link(b, holes);
+        holes = *link;
+        *link = target;
     }
-    return s;
 }
 
-static inline void cls_set(unsigned char *cls, int b) { cls[b >> 3] |= (1u << (b & 7)); }
-static inline int cls_has(const unsigned char *cls, int b) { return (cls[b >> 3] & (1u << (b & 7))) != 0; }
+static int join(struct nfa_build* b, int h1, int h2) {
+    int h = h1;
+    if (h1 < 0) return h2;
+    while (*hole_link(b, h) >= 0) h = *hole_link(b, h);
+    *hole_link(b, h) = h2;
+    return h1;
+}
 
-/* Compile subset: ^? (atom\*)* $? ; atom: '.', literal, or char class [...] */
-bool nfa_compile(const char* pattern, bool case_sensitive, nfa_program_info* out_info) {
-    if (!pattern || !out_info) return false;
-    if (strlen(pattern) == 0) return false;  // Empty patterns are not valid
-    arena_used = 0;
-
-    const char* p = pattern;
-    bool cs = case_sensitive;
-    int start_anchor = 0, end_anchor = 0;
-    if (*p == '^') { start_anchor = 1; p++; }
-
-    int start = -1;
-    int last = -1;
-
-    /* Optional sequence of (atom or atom*) */
-    while (*p && *p != '$') {
-        if (*p == '\\') { /* escape next as literal */
-            p++; if (!*p) break;
-            int s = add_state(ST_CHAR, norm_byte((unsigned char)*p, cs), -1, -1);
-            if (s < 0) return false;
-            if (start == -1) start = s; else patch(last, s);
-            last = s;
-            p++;
-            continue;
-        }
-        if (*p == '.') {
-            int s = add_state(ST_ANY, 0, -1, -1);
-            if (s < 0) return false;
-            if (start == -1) start = s; else patch(last, s);
-            last = s;
-            p++;
-            if (*p == '*') {
-                /* Closure: create split; loop back from atom to split */
-                int split = add_state(ST_SPLIT, 0, -1, -1);
-                if (split < 0) return false;
-                arena[s].out = split;      /* atom -> split */
-                arena[split].out = s;       /* split -> atom (loop) */
-                if (start == s) start = split;
-                else patch(last, split);
-                last = split;
-                p++;
-            }
-            continue;
+/* A state whose out link is left dangling */
+static bool frag_state(struct nfa_build* b, stype_t t, unsigned char c, struct frag* f) {
+    int s = add_state(b, t, c, -1, -1);
+    if (s < 0) return false;
+    f->start = s;
+    f->holes = s << 1;
+    return true;
+}
+
+/* A split preferring "first", its out1 left dangling */
+static int split_to(struct nfa_build* b, int first) {
+    return add_state(b, ST_SPLIT, 0, first, -1);
+}
+
+struct parse {
+    struct nfa_build* b;
+    const char* p;
+    bool cs;
+    int depth;              /* groups open */
+    int groups;             /* groups opened so far */
+    bool copying;           /* compiling an atom again for {m,n} */
+    bool alt_start;         /* at the start of an alternative, where ^ anchors */
+    bool top_alt;           /* the pattern is an alternation at the top */
+    unsigned char run[LSCAN_MAX_PATTERN], best[LSCAN_MAX_PATTERN];
+    int run_len, best_len;  /* plain characters every match contains */
+};
+
+static void end_run(struct parse* ps) {
+    if (ps->run_len > ps->best_len) {
+        memcpy(ps->best, ps->run, ps->run_len);
+        ps->best_len = ps->run_len;
+    }
+    ps->run_len = 0;
+}
+
+static bool parse_alt(struct parse* ps, struct frag* f);
+
+/* [...] into a class state; ps->p is past the '[' */
+static bool parse_class(struct parse* ps, struct frag* f) {
+    const char* p = ps->p;
+    bool cs = ps->cs;
+    int negate = 0;
+    unsigned char cls[32] = {0};
+
+    if (*p == '^') { negate = 1; p++; }
+    if (*p == ']' || *p == '\0') return false;
+    while (*p && *p != ']') {
+        unsigned char a = (unsigned char)(cs ? *p : tolower(*p));
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            unsigned char z = (unsigned char)(cs ? p[2] : tolower(p[2]));
+            if (a > z) { unsigned char t = a; a = z; z = t; }
+            for (int x = a; x <= z; ++x) cls_set(cls, x);
+            p += 3;
+        } else {
+            cls_set(cls, a); p++;
         }
-        if (*p == '[') {
-            p++;
-            int negate = 0;
-            unsigned char cls[32] = {0};
-            if (*p == '^') { negate = 1; p++; }
-            if (*p == ']' || *p == '\0') return false;
-            while (*p && *p != ']') {
-                unsigned char a = (unsigned char)(case_sensitive ? *p : tolower(*p));
-                if (p[1] == '-' && p[2] && p[2] != ']') {
-                    unsigned char b = (unsigned char)(case_sensitive ? p[2] : tolower(p[2]));
-                    if (a > b) { unsigned char t=a; a=b; b=t; }
-                    for (unsigned char x = a; x <= b; ++x) cls_set(cls, x);
-                    p += 3;
-                } else {
-                    cls_set(cls, a); p++;
-                }
-            }
-            if (*p != ']') {
-                return false;
-            }
-            p++;
-            if (negate) {
-                for (int bi=0; bi<32; ++bi) cls[bi] = (unsigned char)~cls[bi];
-                /* Disallow newline */
-                cls[('\n') >> 3] &= (unsigned char)~(1u << (('\n') & 7));
-            }
-            int s = add_state(ST_CLASS, 0, -1, -1);
-            if (s < 0) return false;
-            memcpy(arena[s].cls, cls, sizeof(cls));
-            if (start == -1) start = s; else patch(last, s);
-            last = s;
-            if (*p == '*') {
-                int split = add_state(ST_SPLIT, 0, -1, -1);
-                if (split < 0) return false;
-                arena[s].out = split;
-                arena[split].out = s;
-                if (start == s) start = split; else patch(last, split);
-                last = split;
-                p++;
-            }
-            continue;
+    }
+    if (*p != ']') return false;
+    ps->p = p + 1;
+    if (negate) {
+        for (int bi = 0; bi < 32; ++bi) cls[bi] = (unsigned char)~cls[bi];
+        /* Disallow newline */
+        cls[('\n') >> 3] &= (unsigned char)~(1u << (('\n') & 7));
+    }
+    if (!frag_state(ps->b, ST_CLASS, 0, f)) return false;
+    memcpy(ps->b->st[f->start].cls, cls, sizeof(cls));
+    return true;
+}
+
+/*
+ * One atom: a character, '.', a class, an anchor or a group. Sets *lit to
+ * the character when the atom is a plain one.
+ */
+static bool parse_atom(struct parse* ps, struct frag* f, int* lit) {
+    const char* p = ps->p;
+    bool alt_start = ps->alt_start;
+
+    *lit = -1;
+    ps->alt_start = false;
+    switch (*p) {
+    case '(': {
+        int g = ++ps->groups;
+        struct frag open, in, close;
+
+        ps->p++;
+        ps->depth++;
+        ps->alt_start = true;
+        if (!parse_alt(ps, &in) || *ps->p != ')') return false;
+        ps->p++;
+        ps->depth--;
+        if (g >= NFA_GROUPS) {      /* groups past \9 only group */
+            *f = in;
+            return true;
         }
-        if (*p == '*') {
-            /* malformed: stray *; reject */
+        if (!frag_state(ps->b, ST_SAVE, (unsigned char)(2 * g), &open) ||
+            !frag_state(ps->b, ST_SAVE, (unsigned char)(2 * g + 1), &close))
             return false;
+        fill(ps->b, open.holes, in.start);
+        fill(ps->b, in.holes, close.start);
+        f->start = open.start;
+        f->holes = close.holes;
+        return true;
+    }
+    case '.':
+        ps->p++;
+        return frag_state(ps->b, ST_ANY, 0, f);
+    case '[':
+        ps->p++;
+        return parse_class(ps, f);
+    case '^':
+        ps->p++;
+        if (alt_start) return frag_state(ps->b, ST_BOL, 0, f);
+        break;
+    case '$':
+        ps->p++;
+        if (p[1] == '\0' || p[1] == ')' || p[1] == '|') return frag_state(ps->b, ST_EOL, 0, f);
+        break;
+    case '\\':
+        if (!*++p) return false;
+        ps->p = p + 1;
+        *lit = (unsigned char)*p;
+        return frag_state(ps->b, ST_CHAR, norm_byte((unsigned char)*p, ps->cs), f);
+    case '*': case '+': case '?': case ')': case '|':
+        return false;   /* nothing to repeat, or out of place */
+    default:
+        ps->p++;
+        break;
+    }
+    /* A plain character; ^ and $ too, where they anchor nothing */
+    *lit = (unsigned char)*p;
+    return frag_state(ps->b, ST_CHAR, norm_byte((unsigned char)*p, ps->cs), f);
+}
+
+/* {m}, {m,} or {m,n} at p: the bounds and the end, or NULL if it isn't one */
+static const char* parse_bound(const char* p, int* min, int* max) {
+    char* end;
+    long m, n;
+
+    if (*p != '{' || !isdigit((unsigned char)p[1])) return NULL;
+    m = strtol(p + 1, &end, 10);
+    n = m;
+    if (*end == ',') {
+        if (end[1] == '}') {
+            n = -1;
+            end++;
+        } else if (isdigit((unsigned char)end[1])) {
+            n = strtol(end + 1, &end, 10);
+        } else {
+            return NULL;
         }
-        /* literal */
-        int s = add_state(ST_CHAR, norm_byte((unsigned char)*p, cs), -1, -1);
+    }
+    if (*end != '}' || m > NFA_MAX_REPEAT || n > NFA_MAX_REPEAT || (n >= 0 && n < m)) return NULL;
+    *min = (int)m;
+    *max = (int)n;
+    return end + 1;
+}
+
+/* Apply a quantifier to fragment *f, built from the atom starting at "atom" */
+static bool quantify(struct parse* ps, struct frag* f, const char* atom, int groups, int min, int max) {
+    struct nfa_build* b = ps->b;
+    struct frag out, copy;
+    const char* resume = ps->p;
+    bool copying = ps->copying;
+    int lit, s;
+
+    if (min == 0 && max == 1) {             /* ? */
+        if ((s = split_to(b, f->start)) < 0) return false;
+        f->holes = join(b, f->holes, s << 1 | 1);
+        f->start = s;
+        return true;
+    }
+    if (min <= 1 && max < 0) {              /* * and + */
+        if ((s = split_to(b, f->start)) < 0) return false;
+        fill(b, f->holes, s);
+        if (min == 0) f->start = s;
+        f->holes = s << 1 | 1;
+        return true;
+    }
+
+    /* {m,n}: the atom m times, then n - m times optional or once more starred */
+    if (max == 0) {
+        if ((s = split_to(b, -1)) < 0) return false;
+        f->start = s;
+        f->holes = s << 1;
+        return true;
+    }
+    out = *f;
+    ps->copying = true;
+    for (int i = 1; i < (max < 0 ? min + 1 : max); i++) {
+        ps->p = atom;
+        ps->groups = groups;
+        if (!parse_atom(ps, &copy, &lit)) return false;
+        if (i >= min && !quantify(ps, &copy, atom, groups, 0, max < 0 ? -1 : 1)) return false;
+        fill(b, out.holes, copy.start);
+        out.holes = copy.holes;
+    }
+    if (min == 0 && !quantify(ps, &out, atom, groups, 0, 1)) return false;
+    ps->copying = copying;
+    ps->p = resume;
+    *f = out;
+    return true;
+}
+
+/* An atom and the quantifier after it, if any */
+static bool parse_repeat(struct parse* ps, struct frag* f, int* lit) {
+    const char* atom = ps->p;
+    const char* after;
+    int groups = ps->groups;
+    int min, max;
+
+    if (!parse_atom(ps, f, lit)) return false;
+    if (*ps->p == '*') { min = 0; max = -1; after = ps->p + 1; }
+    else if (*ps->p == '+') { min = 1; max = -1; after = ps->p + 1; }
+    else if (*ps->p == '?') { min = 0; max = 1; after = ps->p + 1; }
+    else if (!(after = parse_bound(ps->p, &min, &max))) return true;
+    ps->p = after;
+    *lit = -1;
+    if (!quantify(ps, f, atom, groups, min, max)) return false;
+    /* A repeat of a repeat is an error, as with the original matcher */
+    return !(*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || parse_bound(ps->p, &min, &max));
+}
+
+/* Atoms one after the other, up to '|', ')' or the end */
+static bool parse_concat(struct parse* ps, struct frag* f) {
+    bool top = ps->depth == 0 && !ps->copying;
+    bool first = true;
+
+    ps->alt_start = true;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        struct frag next;
+        int lit;
+
+        if (!parse_repeat(ps, &next, &lit)) return false;
+        if (top) {
+            if (lit < 0) end_run(ps);
+            else if (ps->run_len < LSCAN_MAX_PATTERN) ps->run[ps->run_len++] = (unsigned char)lit;
+        }
+        if (first) *f = next;
+        else {
+            fill(ps->b, f->holes, next.start);
+            f->holes = next.holes;
+        }
+        first = false;
+    }
+    if (top) end_run(ps);
+    if (first) {    /* empty: a split that goes straight on */
+        int s = split_to(ps->b, -1);
         if (s < 0) return false;
-        if (start == -1) start = s; else patch(last, s);
-        last = s;
-        p++;
-        if (*p == '*') {
-            int split = add_state(ST_SPLIT, 0, -1, -1);
-            if (split < 0) return false;
-            arena[s].out = split;
-            arena[split].out = s;
-            if (start == s) start = split; else patch(last, split);
-            last = split;
-            p++;
+        f->start = s;
+        f->holes = s << 1;
+    }
+    return true;
+}
+
+/* Alternatives separated by '|', the leftmost preferred */
+static bool parse_alt(struct parse* ps, struct frag* f) {
+    if (!parse_concat(ps, f)) return false;
+    while (*ps->p == '|') {
+        struct frag next;
+        int s;
+
+        if (ps->depth == 0 && !ps->copying) ps->top_alt = true;
+        ps->p++;
+        if (!parse_concat(ps, &next)) return false;
+        if ((s = add_state(ps->b, ST_SPLIT, 0, f->start, next.start)) < 0) return false;
+        f->start = s;
+        f->holes = join(ps->b, f->holes, next.holes);
+    }
+    return true;
+}
+
+/*
+ * Compile a pattern: alternatives (|) of atoms one after the other, an
+ * atom being a character, '.', a class [...], a group (...) or \ and any
+ * character, each optionally followed by *, +, ? or {m,n}. ^ anchors at
+ * the start of an alternative and $ at its end; elsewhere they are plain.
+ */
+static bool compile(struct nfa_build* b, const char* pattern, bool case_sensitive, struct nfa_program* prog) {
+    struct parse* ps;
+    struct frag f;
+    bool ok = false;
+    int match;
+
+    if (strlen(pattern) == 0) return false;  // Empty patterns are not valid
+    if (strchr(pattern, '\n')) return false;  // Matches never span lines
+    if (!(ps = safe_alloc(sizeof(*ps), "nfa parse", __FILE__, __LINE__))) return false;
+    b->used = 0;
+    ps->b = b;
+    ps->p = pattern;
+    ps->cs = case_sensitive;
+
+    if (!parse_alt(ps, &f) || *ps->p != '\0') goto out;   /* a ')' left over */
+    if ((match = add_state(b, ST_MATCH, 0, -1, -1)) < 0) goto out;
+    fill(b, f.holes, match);
+    b->start = f.start;
+    prog->groups = ps->groups < NFA_GROUPS ? ps->groups : NFA_GROUPS - 1;
+
+    /* A literal is only required when there is no choice at the top */
+    if (!ps->top_alt && ps->best_len >= REQUIRED_MIN)
+        prog->have_required = (lscan_init(&prog->required, ps->best, ps->best_len, case_sensitive) == 0);
+    ok = true;
+out:
+    SAFE_FREE(ps);
+    return ok;
+}
+
+/* Whether "pattern" uses syntax the original MAGIC matcher does not know */
+bool nfa_pattern_extended(const char* pattern) {
+    for (const char* p = pattern; *p; p++) {
+        int lo, hi;
+        if (*p == '\\') {
+            if (!*++p) break;
+        } else if (*p == '[') {
+            for (p++; *p && *p != ']'; p++)     /* a class, however odd */
+                ;
+            if (!*p) break;
+        } else if (strchr("|()+?", *p) || parse_bound(p, &lo, &hi)) {
+            return true;
         }
     }
-    if (*p == '$') { end_anchor = 1; p++; }
-    if (*p != '\0') {
-        /* unsupported constructs present */
-        return false;
+    return false;
+}
+
+/*
+ * Reverse the forward automaton into "b": every edge turned around, the
+ * old match state made the start and the old start led to a new match
+ * state. Consuming states keep their byte or class; ^ and $ trade places
+ * and group marks become plain splits. A state with several predecessors leads to all of them through a chain
+ * of splits.
+ */
+static bool reverse_build(const struct nfa_machine* f, struct nfa_build* b) {
+    int fc = f->n;
+    int fmatch = -1;
+    int* pred_n = NULL;
+    int* pred_first = NULL;
+    int* pred_list = NULL;
+    bool ok = false;
+
+    if (2 * fc + 1 > NFA_MAX_STATES) return false;
+    pred_n = safe_alloc(fc * sizeof(int), "nfa reverse", __FILE__, __LINE__);
+    pred_first = safe_alloc(fc * sizeof(int), "nfa reverse", __FILE__, __LINE__);
+    pred_list = safe_alloc(2 * fc * sizeof(int), "nfa reverse", __FILE__, __LINE__);
+    if (!pred_n || !pred_first || !pred_list) goto out;
+
+    /* Predecessors of every state, as lists in pred_list */
+    for (int u = 0; u < fc; u++) {
+        if (f->st[u].type == ST_MATCH) { fmatch = u; continue; }
+        if (f->st[u].out >= 0) pred_n[f->st[u].out]++;
+        if (f->st[u].type == ST_SPLIT && f->st[u].out1 >= 0) pred_n[f->st[u].out1]++;
     }
-    /* Anchors wrap the start with BOL and end with EOL */
-    if (start_anchor) {
-        int bol = add_state(ST_BOL, 0, start, -1);
-        if (bol < 0) return false;
-        start = bol;
-    }
-    int match = add_state(ST_MATCH, 0, -1, -1);
-    if (match < 0) return false;
-    if (last >= 0) patch(last, end_anchor ? add_state(ST_EOL, 0, match, -1) : match);
-    else {
-        /* empty pattern: match at start */
-        if (end_anchor) {
-            int eol = add_state(ST_EOL, 0, match, -1);
-            if (eol < 0) return false;
-            start = start_anchor ? add_state(ST_BOL, 0, eol, -1) : eol;
-        } else {
-            start = start_anchor ? add_state(ST_BOL, 0, match, -1) : match;
+    if (fmatch < 0) goto out;
+    for (int v = 0, at = 0; v < fc; v++) {
+        pred_first[v] = at;
+        at += pred_n[v];
+        pred_n[v] = 0;
+    }
+    for (int u = 0; u < fc; u++) {
+        if (f->st[u].type == ST_MATCH) continue;
+        int v = f->st[u].out;
+        if (v >= 0) pred_list[pred_first[v] + pred_n[v]++] = u;
+        v = f->st[u].out1;
+        if (f->st[u].type == ST_SPLIT && v >= 0) pred_list[pred_first[v] + pred_n[v]++] = u;
+    }
+
+    /* State u reversed keeps its number; the new match state follows them */
+    b->used = 0;
+    for (int u = 0; u < fc; u++) {
+        stype_t t = f->st[u].type;
+        if (t == ST_MATCH || t == ST_SPLIT || t == ST_SAVE) t = ST_SPLIT;   /* out1 stays -1 */
+        else if (t == ST_BOL) t = ST_EOL;
+        else if (t == ST_EOL) t = ST_BOL;
+        int r = add_state(b, t, f->st[u].c, -1, -1);
+        memcpy(b->st[r].cls, f->st[u].cls, sizeof(b->st[r].cls));
+    }
+    int rmatch = add_state(b, ST_MATCH, 0, -1, -1);
+
+    for (int u = 0; u < fc; u++) {
+        int k = pred_n[u] + (u == f->start);
+        int* preds = &pred_list[pred_first[u]];
+        int from = u;
+        /* from -> split -> split ..., each split's out1 one predecessor */
+        for (int i = 0; i < k; i++) {
+            int target = (i < pred_n[u]) ? preds[i] : rmatch;
+            if (i == k - 1) {
+                b->st[from].out = target;
+                break;
+            }
+            int split = add_state(b, ST_SPLIT, 0, -1, target);
+            if (split < 0) goto out;
+            b->st[from].out = split;
+            from = split;
+        }
+    }
+    b->start = fmatch;
+    ok = true;
+out:
+    SAFE_FREE(pred_n);
+    SAFE_FREE(pred_first);
+    SAFE_FREE(pred_list);
+    return ok;
+}
+
+static void machine_free(struct nfa_machine* m) {
+    SAFE_FREE(m->st);
+    SAFE_FREE(m->seen);
+    for (int i = 0; i < 2; i++) {
+        SAFE_FREE(m->lists[i].idx);
+        SAFE_FREE(m->lists[i].start);
+    }
+    SAFE_FREE(m->tmp.idx);
+    SAFE_FREE(m->tmp.start);
+    SAFE_FREE(m->pike);
+    SAFE_FREE(m->dfa);
+}
+
+/* Whether the match state is reached from s without reading anything */
+static bool ends_match(const nfa_state* st, int s, unsigned char* seen) {
+    while (s >= 0 && !seen[s]) {
+        seen[s] = 1;
+        switch (st[s].type) {
+            case ST_MATCH:
+                return true;
+            case ST_SPLIT:
+                if (ends_match(st, st[s].out1, seen)) return true;
+                /* fall through */
+            case ST_SAVE:
+            case ST_EOL:
+                s = st[s].out;
+                break;
+            default:
+                return false;
         }
     }
+    return false;
+}
+
+/* Copy the automaton built in "b" into storage of its own */
+static bool machine_init(struct nfa_machine* m, const struct nfa_build* b, bool cs) {
+    const char* env = getenv("UEMACS_SEARCH_DFA");
+    size_t n = (size_t)b->used;
+
+    memset(m, 0, sizeof(*m));
+    m->n = b->used;
+    m->start = b->start;
+    m->cs = cs;
+    m->dfa_off = (env && strcmp(env, "0") == 0);
+    m->st = safe_alloc(n * sizeof(nfa_state), "nfa states", __FILE__, __LINE__);
+    m->seen = safe_alloc(n * sizeof(unsigned), "nfa sets", __FILE__, __LINE__);
+    for (int i = 0; i < 2; i++) {
+        m->lists[i].idx = safe_alloc(n * sizeof(int), "nfa sets", __FILE__, __LINE__);
+        m->lists[i].start = safe_alloc(n * sizeof(int), "nfa sets", __FILE__, __LINE__);
+    }
+    m->tmp.idx = safe_alloc(n * sizeof(int), "nfa sets", __FILE__, __LINE__);
+    m->tmp.start = safe_alloc(n * sizeof(int), "nfa sets", __FILE__, __LINE__);
+    if (!m->st || !m->seen || !m->lists[0].idx || !m->lists[0].start || !m->lists[1].idx ||
+        !m->lists[1].start || !m->tmp.idx || !m->tmp.start) {
+        machine_free(m);
+        return false;
+    }
+    memcpy(m->st, b->st, n * sizeof(nfa_state));
 
-    out_info->start_state = start;
-    out_info->state_count = arena_used;
-    out_info->case_sensitive = cs;
+    /* $ accepts at the end of a line only if nothing need follow it */
+    for (int s = 0; s < m->n; s++) {
+        if (m->st[s].type == ST_EOL) {
+            unsigned char* seen = (unsigned char*)m->seen;
+            memset(seen, 0, n);
+            m->st[s].eol_accepts = ends_match(m->st, m->st[s].out, seen);
+            memset(seen, 0, n);
+        }
+    }
     return true;
 }
 
-/* Active state set */
-typedef struct { int idx[NFA_MAX_LIST]; int n; } slist;
+nfa_program* nfa_program_new(const char* pattern, bool case_sensitive) {
+    struct nfa_build* b;
+    nfa_program* prog;
 
-static void list_clear(slist* l) { l->n = 0; }
-static void list_add(slist* l, int s) { if (l->n < NFA_MAX_LIST) l->idx[l->n++] = s; }
+    if (!pattern) return NULL;
+    b = safe_alloc(sizeof(*b), "nfa build", __FILE__, __LINE__);
+    prog = safe_alloc(sizeof(*prog), "nfa program", __FILE__, __LINE__);
+    if (!b || !prog) goto fail;
+    prog->cs = case_sensitive;
+    if (!compile(b, pattern, case_sensitive, prog)) goto fail;
+    if (!machine_init(&prog->fwd, b, case_sensitive)) goto fail;
+    if (!(prog->pattern = safe_strdup(pattern, "nfa pattern"))) {
+        machine_free(&prog->fwd);
+        goto fail;
+    }
+    SAFE_FREE(b);
+    atomic_fetch_add(&stat_compiles, 1);
+    return prog;
+fail:
+    SAFE_FREE(b);
+    SAFE_FREE(prog);
+    return NULL;
+}
 
-/* Epsilon-closure add: add state and follow splits/BOL/EOL anchors that accept at this position */
-static void add_epsilon(const nfa_program_info* prog, slist* l, int s, bool at_bol, bool at_eol) {
-    for (;;) {
-        if (s < 0) return;
-        nfa_state* st = &arena[s];
+void nfa_program_free(nfa_program* prog) {
+    if (!prog) return;
+    machine_free(&prog->fwd);
+    if (prog->have_rev) machine_free(&prog->rev);
+    SAFE_FREE(prog->pattern);
+    SAFE_FREE(prog);
+}
+
+/* The reversed automaton, built on first use */
+static struct nfa_machine* reversed(nfa_program* prog) {
+    struct nfa_build* b;
+
+    if (prog->have_rev) return &prog->rev;
+    if (!(b = safe_alloc(sizeof(*b), "nfa build", __FILE__, __LINE__))) return NULL;
+    if (reverse_build(&prog->fwd, b) && machine_init(&prog->rev, b, prog->cs))
+        prog->have_rev = true;
+    SAFE_FREE(b);
+    return prog->have_rev ? &prog->rev : NULL;
+}
+
+/*
+ * LRU cache of programs, most recently used first. It belongs to the
+ * editor thread; other threads make programs of their own.
+ */
+static nfa_program* cache[NFA_CACHE_SIZE];
+static int cache_used;
+
+nfa_program* nfa_program_get(const char* pattern, bool case_sensitive) {
+    nfa_program* prog;
+    int i;
+
+    if (!pattern) return NULL;
+    for (i = 0; i < cache_used; i++) {
+        if (cache[i]->cs == case_sensitive && strcmp(cache[i]->pattern, pattern) == 0)
+            break;
+    }
+    if (i < cache_used) {
+        prog = cache[i];
+        atomic_fetch_add(&stat_reuses, 1);
+    } else {
+        if (!(prog = nfa_program_new(pattern, case_sensitive))) return NULL;
+        if (cache_used == NFA_CACHE_SIZE) nfa_program_free(cache[--cache_used]);
+        i = cache_used++;
+    }
+    memmove(&cache[1], &cache[0], i * sizeof(cache[0]));
+    cache[0] = prog;
+    return prog;
+}
+
+void nfa_cache_clear(void) {
+    while (cache_used > 0) nfa_program_free(cache[--cache_used]);
+}
+
+bool nfa_compile(const char* pattern, bool case_sensitive, nfa_program_info* out_info) {
+    nfa_program* prog;
+
+    if (!pattern || !out_info) return false;
+    if (!(prog = nfa_program_get(pattern, case_sensitive))) return false;
+    out_info->start_state = prog->fwd.start;
+    out_info->state_count = prog->fwd.n;
+    out_info->case_sensitive = case_sensitive;
+    out_info->program = prog;
+    return true;
+}
+
+static void set_begin(struct nfa_machine* m) {
+    if (++m->seen_gen == 0) {
+        memset(m->seen, 0, m->n * sizeof(unsigned));
+        m->seen_gen = 1;
+    }
+}
+
+/*
+ * Add state s and all it reaches without input. BOL only passes at the
+ * start of a line; EOL states stay in the set and accept at its end.
+ */
+static void add_closure(struct nfa_machine* m, slist* l, int s, int start, bool at_bol) {
+    while (s >= 0 && m->seen[s] != m->seen_gen) {
+        const nfa_state* st = &m->st[s];
+        m->seen[s] = m->seen_gen;
         if (st->type == ST_SPLIT) {
-            int a = st->out, b = st->out1;
-            /* Default out1 = -1; if so, treat as pass-through */
-            if (b >= 0) { add_epsilon(prog, l, b, at_bol, at_eol); }
-            s = a; /* tail-recurse */
-            continue;
+            add_closure(m, l, st->out1, start, at_bol);
+            s = st->out;
         } else if (st->type == ST_BOL) {
-            if (!at_bol) return; /* reject this path */
-            s = st->out; continue;
-        } else if (st->type == ST_EOL) {
-            if (!at_eol) return;
-            s = st->out; continue;
+            if (!at_bol) return;
+            s = st->out;
+        } else if (st->type == ST_SAVE) {
+            s = st->out;
         } else {
-            list_add(l, s);
+            l->idx[l->n] = s;
+            l->start[l->n] = start;
+            l->n++;
             return;
         }
     }
 }
 
-static void step(const nfa_program_info* prog, const slist* cur, unsigned char byte, bool is_nl, slist* next) {
-    list_clear(next);
+/* Does state st consume byte (already case folded)? */
+static inline bool takes(const nfa_state* st, unsigned char byte) {
+    switch (st->type) {
+        case ST_CHAR:  return byte == st->c;
+        case ST_ANY:   return true;
+        case ST_CLASS: return cls_has(st->cls, byte);
+        default:       return false;    /* MATCH and EOL consume nothing */
+    }
+}
+
+/* Threads of cur that take byte, into next */
+static void step(struct nfa_machine* m, const slist* cur, unsigned char byte, slist* next) {
+    next->n = 0;
+    set_begin(m);
     for (int i = 0; i < cur->n; i++) {
-        int s = cur->idx[i];
-        const nfa_state* st = &arena[s];
-        switch (st->type) {
-            case ST_CHAR:
-                if (!is_nl && byte == st->c) add_epsilon(prog, next, st->out, false, false);
-                break;
-            case ST_ANY:
-                if (!is_nl) add_epsilon(prog, next, st->out, false, false);
-                break;
-            case ST_CLASS:
-                if (!is_nl && cls_has(st->cls, byte)) add_epsilon(prog, next, st->out, false, false);
-                break;
-            case ST_MATCH:
-                /* Do nothing; match will be detected separately */
-                break;
-            default:
-                break;
+        const nfa_state* st = &m->st[cur->idx[i]];
+        if (takes(st, byte)) add_closure(m, next, st->out, cur->start[i], false);
+    }
+}
+
+/*
+ * A line as the matchers read it: byte i is base[i * dir], so a line read
+ * backward (dir -1) has base at its last byte. Offsets count from "base"
+ * either way.
+ */
+struct line_view {
+    const unsigned char* base;
+    int dir;
+    int n;
+};
+
+static struct line_view view_of(struct line* lp, bool reverse) {
+    struct line_view v;
+    v.n = llength(lp);
+    v.dir = reverse ? -1 : 1;
+    v.base = (const unsigned char*)lp->l_text + (reverse ? v.n - 1 : 0);
+    return v;
+}
+
+/*
+ * Leftmost-longest match within [from..n) of one line, on the NFA.
+ * A new thread starts at every offset until some thread has matched;
+ * after that only threads starting no later than the best match run on.
+ */
+static bool nfa_match_line(struct nfa_machine* m, const struct line_view* v,
+                           int from, int* ms, int* me) {
+    const unsigned char* text = v->base;
+    int dir = v->dir;
+    int n = v->n;
+    slist* cur = &m->lists[0];
+    slist* next = &m->lists[1];
+    int best_s = -1, best_e = -1;
+
+    cur->n = 0;
+    set_begin(m);
+    for (int i = from; ; i++) {
+        if (best_s < 0) add_closure(m, cur, m->start, i, i == 0);
+
+        int keep = 0;
+        for (int k = 0; k < cur->n; k++) {
+            int type = m->st[cur->idx[k]].type;
+            int st = cur->start[k];
+            if (type == ST_MATCH || (type == ST_EOL && i == n && m->st[cur->idx[k]].eol_accepts)) {
+                if (best_s < 0 || st < best_s || (st == best_s && i > best_e)) {
+                    best_s = st;
+                    best_e = i;
+                }
+            }
+        }
+        if (best_s >= 0) {
+            for (int k = 0; k < cur->n; k++) {
+                if (cur->start[k] <= best_s) {
+                    cur->idx[keep] = cur->idx[k];
+                    cur->start[keep] = cur->start[k];
+                    keep++;
+                }
+            }
+            cur->n = keep;
         }
+        if (i == n || cur->n == 0) break;
+
+        step(m, cur, norm_byte(text[i * dir], m->cs), next);
+        slist* t = cur; cur = next; next = t;
     }
+    if (best_s < 0) return false;
+    *ms = best_s;
+    *me = best_e;
+    return true;
 }
 
-/* Iterate across buffer lines forward */
-bool nfa_search_forward(const nfa_program_info* prog,
-                        struct line* start_lp,
-                        int start_off,
-                        int beg_or_end,
-                        struct line** match_lp,
-                        int* match_off) {
-    if (!prog || !start_lp || !match_lp || !match_off) return false;
+static void dfa_flush(struct dfa* d) {
+    d->count = 0;
+    d->pool_used = 0;
+    memset(d->hash, 0xff, sizeof(d->hash));
+    d->start[0] = d->start[1] = -1;
+    d->bytes = 0;
+    d->epoch++;
+}
+
+static int cmp_int(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+/* DFA state for the set in m->tmp; -1 when the cache is full */
+static int dfa_intern(struct nfa_machine* m) {
+    struct dfa* d = m->dfa;
+    int n = m->tmp.n;
+    int* members = m->tmp.idx;
+    uint32_t h = 2166136261U;
+
+    qsort(members, n, sizeof(int), cmp_int);
+    for (int i = 0; i < n; i++) h = (h ^ (uint32_t)members[i]) * 16777619U;
+
+    unsigned slot = h & (DFA_HASH - 1);
+    for (; d->hash[slot] >= 0; slot = (slot + 1) & (DFA_HASH - 1)) {
+        struct dfa_state* ds = &d->st[d->hash[slot]];
+        if (ds->hash == h && ds->n == n &&
+            memcmp(&d->pool[ds->first], members, n * sizeof(int)) == 0)
+            return d->hash[slot];
+    }
+    if (d->count == DFA_MAX_STATES || d->pool_used + n > DFA_POOL) return -1;
+
+    struct dfa_state* ds = &d->st[d->count];
+    memset(&d->trans[d->count << 8], 0xff, 256 * sizeof(int));
+    ds->first = d->pool_used;
+    ds->n = n;
+    ds->hash = h;
+    ds->accept = ds->accept_eol = false;
+    for (int i = 0; i < n; i++) {
+        if (m->st[members[i]].type == ST_MATCH) ds->accept = true;
+        if (m->st[members[i]].type == ST_EOL && m->st[members[i]].eol_accepts) ds->accept_eol = true;
+    }
+    memcpy(&d->pool[d->pool_used], members, n * sizeof(int));
+    d->pool_used += n;
+    d->hash[slot] = d->count;
+    return d->count++;
+}
+
+/*
+ * Intern m->tmp, flushing the cache when it is full. Returns -1 and
+ * gives up on the DFA if the cache did not last DFA_MIN_BYTES.
+ */
+static int dfa_add(struct nfa_machine* m) {
+    int t = dfa_intern(m);
+    if (t >= 0) return t;
+    if (m->dfa->bytes < DFA_MIN_BYTES) {
+        m->dfa_off = true;
+        atomic_fetch_add(&stat_fallbacks, 1);
+        return -1;
+    }
+    atomic_fetch_add(&stat_flushes, 1);
+    dfa_flush(m->dfa);
+    t = dfa_intern(m);
+    if (t < 0) {
+        m->dfa_off = true;
+        atomic_fetch_add(&stat_fallbacks, 1);
+    }
+    return t;
+}
+
+static int dfa_start_state(struct nfa_machine* m, bool at_bol) {
+    struct dfa* d = m->dfa;
+    if (d->start[at_bol] < 0) {
+        m->tmp.n = 0;
+        set_begin(m);
+        add_closure(m, &m->tmp, m->start, 0, at_bol);
+        int s = dfa_add(m);
+        if (s < 0) return -1;
+        d->start[at_bol] = s;
+    }
+    return d->start[at_bol];
+}
+
+/* Compute the transition of s on a byte: its threads that take it, plus
+ * a new thread, as a match may start at any offset. */
+static int dfa_next(struct nfa_machine* m, int s, unsigned char byte) {
+    struct dfa* d = m->dfa;
+    unsigned char b = norm_byte(byte, m->cs);
+    const int* members = &d->pool[d->st[s].first];
+    int n = d->st[s].n;
+
+    m->tmp.n = 0;
+    set_begin(m);
+    for (int i = 0; i < n; i++) {
+        const nfa_state* st = &m->st[members[i]];
+        if (takes(st, b)) add_closure(m, &m->tmp, st->out, 0, false);
+    }
+    add_closure(m, &m->tmp, m->start, 0, false);
+
+    unsigned epoch = d->epoch;
+    int t = dfa_add(m);
+    if (t >= 0 && d->epoch == epoch)   /* no flush: s is still valid */
+        d->trans[(s << 8) + byte] = d->st[t].accept ? DFA_ACCEPTS(t) : t << 8;
+    return t;
+}
+
+/*
+ * Run the DFA over [from..n) of a line. Returns 1 if a match ends within
+ * the line, 0 if none does, -1 if the DFA gave up.
+ */
+static int dfa_scan_line(struct nfa_machine* m, const struct line_view* v, int from) {
+    struct dfa* d = m->dfa;
+    const int* trans = d->trans;
+    const unsigned char* text = v->base;
+    ptrdiff_t dir = v->dir;
+    int n = v->n;
+    int i = from;
+    int mark = i;
+    uint64_t misses = 0;
+    int result = 0;
+    int t = dfa_start_state(m, from == 0);
+
+    if (t < 0) return -1;
+    if (d->st[t].accept) return 1;
+    size_t s = (size_t)t << 8;
+    for (;;) {
+        /* The usual case, kept tight: a cached, non-accepting next state */
+        while (i < n && (t = trans[s + text[i * dir]]) >= 0) {
+            s = (size_t)t;
+            i++;
+        }
+        if (i == n) break;
+        if (t != -1) {
+            s = (size_t)(-t - 2);
+            i++;
+            result = 1;
+            break;
+        }
+        misses++;
+        d->bytes += i - mark;
+        mark = i;
+        if ((t = dfa_next(m, (int)(s >> 8), text[i * dir])) < 0) {
+            result = -1;
+            break;
+        }
+        s = (size_t)t << 8;
+        i++;
+        if (d->st[t].accept) {
+            result = 1;
+            break;
+        }
+    }
+    if (result == 0 && d->st[s >> 8].accept_eol) result = 1;
+    atomic_fetch_add_explicit(&stat_hits, (uint64_t)(i - from) - misses, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_misses, misses, memory_order_relaxed);
+    d->bytes += i - mark;
+    return result;
+}
+
+/* DFA filter, then the NFA for the exact span, on one line */
+static bool match_line(struct nfa_machine* m, const struct line_view* v, int off,
+                       int* match_start, int* match_end) {
+    if (!m->dfa_off && dfa_scan_line(m, v, off) == 0) return false;
+    return nfa_match_line(m, v, off, match_start, match_end);
+}
 
-    slist cur = {0}, next = {0};
+/* Ready the DFA of m for a search; without memory the NFA does it alone */
+static void dfa_prepare(struct nfa_machine* m) {
+    if (m->dfa_off || m->dfa) return;
+    if (!(m->dfa = safe_alloc(sizeof(struct dfa), "nfa dfa cache", __FILE__, __LINE__)))
+        m->dfa_off = true;
+    else
+        dfa_flush(m->dfa);
+}
+
+static void dfa_done(struct nfa_machine* m) {
+    if (m->dfa) atomic_store(&stat_states, (size_t)m->dfa->count);
+}
+
+bool nfa_search_match(nfa_program* prog,
+                      struct line* start_lp,
+                      int start_off,
+                      struct line** match_lp,
+                      int* match_start,
+                      int* match_end) {
+    return nfa_search_match_until(prog, start_lp, start_off, curbp->b_linep,
+                                  match_lp, match_start, match_end);
+}
+
+bool nfa_search_match_until(nfa_program* prog,
+                            struct line* start_lp,
+                            int start_off,
+                            struct line* stop_lp,
+                            struct line** match_lp,
+                            int* match_start,
+                            int* match_end) {
+    if (!prog || !start_lp || !stop_lp || !match_lp || !match_start || !match_end) return false;
+
+    struct nfa_machine* m = &prog->fwd;
     struct line* lp = start_lp;
     int off = start_off;
-    struct line* run_start_lp = lp;
-    int run_start_off = off;
-    bool at_bol = (off == 0);
-    bool have_match = false;
-    struct line* m_lp = NULL; int m_off = 0; /* match boundary to report */
-
-    /* seed epsilon-closure at start */
-    list_clear(&cur);
-    add_epsilon(prog, &cur, prog->start_state, at_bol, false);
-    // Zero-length match check at start
-    for (int i = 0; i < cur.n; i++) {
-        if (arena[cur.idx[i]].type == ST_MATCH) {
-            *match_lp = start_lp; *match_off = start_off; return true;
+    bool found = false;
+
+    dfa_prepare(m);
+    while (lp != stop_lp) {
+        if (prog->have_required) {
+            /* The required literal never spans lines: go to the next line holding it */
+            struct line *hit_lp, *end_lp;
+            int hit_off, end_off;
+            if (!lscan_search_forward(&prog->required, lp, off, stop_lp,
+                                      &hit_lp, &hit_off, &end_lp, &end_off))
+                break;
+            if (hit_lp != lp) off = 0;
+            lp = hit_lp;
         }
+        struct line_view v = view_of(lp, false);
+        if (match_line(m, &v, off, match_start, match_end)) {
+            *match_lp = lp;
+            found = true;
+            break;
+        }
+        lp = lforw(lp);
+        off = 0;
     }
+    dfa_done(m);
+    return found;
+}
 
-    for (;;) {
-        if (lp == curbp->b_linep) break;
-        int n = llength(lp);
-        bool at_eol = (off == n);
-        if (at_eol) {
-            /* Process EOL as a special non-consuming check via epsilon closure */
-            /* Advance to next line */
-            lp = lforw(lp);
-            off = 0;
-            at_bol = true;
-            list_clear(&next);
-            /* Recompute closure at new position */
-            list_clear(&cur);
-            add_epsilon(prog, &cur, prog->start_state, at_bol, false);
-            run_start_lp = lp; run_start_off = off;
-            continue;
-        }
-        unsigned char b = (unsigned char)lp->l_text[off];
-        bool is_nl = false;
+bool nfa_search_match_reverse(nfa_program* prog,
+                              struct line* start_lp,
+                              int start_off,
+                              struct line** match_lp,
+                              int* match_start,
+                              int* match_end) {
+    if (!prog || !start_lp || !match_lp || !match_start || !match_end) return false;
 
-        /* Step */
-        step(prog, &cur, norm_byte(b, prog->case_sensitive), is_nl, &next);
+    struct nfa_machine* m = reversed(prog);
+    struct line* lp = start_lp;
+    int limit = start_off;      /* a match must end by here */
+    bool found = false;
 
-        /* Epsilon-closure on next and check for match */
-        slist closure = {0};
-        for (int i = 0; i < next.n; i++) {
-            add_epsilon(prog, &closure, next.idx[i], false, false);
+    if (!m) return false;
+    dfa_prepare(m);
+    while (lp != curbp->b_linep) {
+        struct line_view v = view_of(lp, true);
+        int rs, re;
+        if (match_line(m, &v, v.n - limit, &rs, &re)) {
+            *match_lp = lp;
+            *match_start = v.n - re;
+            *match_end = v.n - rs;
+            found = true;
+            break;
         }
-        for (int i = 0; i < closure.n; i++) {
-            if (arena[closure.idx[i]].type == ST_MATCH) {
-                have_match = true;
-                if (beg_or_end == 1 /* PTEND */) { m_lp = lp; m_off = off + 1; }
-                else { m_lp = run_start_lp; m_off = run_start_off; }
+        lp = lback(lp);
+        limit = llength(lp);
+    }
+    dfa_done(m);
+    return found;
+}
+
+bool nfa_can_reverse(nfa_program* prog) {
+    return prog && reversed(prog) != NULL;
+}
+
+int nfa_program_groups(const nfa_program* prog) {
+    return prog ? prog->groups : 0;
+}
+
+/* Pike VM: a thread list, each thread with its own group offsets */
+struct pike_list {
+    int* idx;
+    int* cap;           /* NFA_SLOTS per thread */
+    int n;
+};
+
+/*
+ * Add s and what it reaches without input to l, in priority order: a
+ * split's out before its out1. A state already in l keeps the thread of
+ * higher priority that got there first.
+ */
+static void pike_add(struct nfa_machine* m, struct pike_list* l, int s, int* cap, int pos, int n) {
+    while (s >= 0 && m->seen[s] != m->seen_gen) {
+        const nfa_state* st = &m->st[s];
+        m->seen[s] = m->seen_gen;
+        switch (st->type) {
+            case ST_SPLIT:
+                pike_add(m, l, st->out, cap, pos, n);
+                s = st->out1;
                 break;
+            case ST_SAVE: {
+                int old = cap[st->c];
+                cap[st->c] = pos;
+                pike_add(m, l, st->out, cap, pos, n);
+                cap[st->c] = old;
+                return;
             }
+            case ST_BOL:
+                if (pos != 0) return;
+                s = st->out;
+                break;
+            case ST_EOL:
+                if (pos != n) return;
+                s = st->out;
+                break;
+            default:
+                l->idx[l->n] = s;
+                memcpy(&l->cap[l->n * NFA_SLOTS], cap, NFA_SLOTS * sizeof(int));
+                l->n++;
+                return;
         }
-        /* Prepare for next byte */
-        cur = closure; /* copy by value */
-        list_clear(&next);
-        off++;
-        at_bol = false;
-        if (have_match) break;
     }
+}
+
+bool nfa_match_groups(nfa_program* prog, struct line* lp, int ms, int me, int* sub, int nsub) {
+    struct nfa_machine* m;
+    struct pike_list l[2];
+    int cap[NFA_SLOTS];
+    int n;
 
-    if (have_match) {
-        *match_lp = m_lp; *match_off = m_off; return true;
+    if (!prog || !lp || !sub || nsub < 1 || ms < 0 || me < ms || me > llength(lp)) return false;
+    m = &prog->fwd;
+    if (!m->pike) {
+        m->pike = safe_alloc((size_t)m->n * 2 * (1 + NFA_SLOTS) * sizeof(int), "nfa groups",
+                             __FILE__, __LINE__);
+        if (!m->pike) return false;
     }
-    return false;
+    for (int i = 0; i < 2; i++) {
+        l[i].idx = m->pike + i * m->n;
+        l[i].cap = m->pike + 2 * m->n + i * m->n * NFA_SLOTS;
+        l[i].n = 0;
+    }
+    n = llength(lp);
+    for (int i = 0; i < NFA_SLOTS; i++) cap[i] = -1;
+    set_begin(m);
+    pike_add(m, &l[0], m->start, cap, ms, n);
+
+    for (int pos = ms, c = 0; ; pos++, c ^= 1) {
+        struct pike_list* cur = &l[c];
+        struct pike_list* next = &l[c ^ 1];
+
+        if (pos == me) {
+            for (int k = 0; k < cur->n; k++) {
+                if (m->st[cur->idx[k]].type != ST_MATCH) continue;
+                int* got = &cur->cap[k * NFA_SLOTS];
+                got[0] = ms;
+                got[1] = me;
+                for (int g = 0; g < nsub && g < NFA_GROUPS; g++) {
+                    bool set = got[2 * g] >= 0 && got[2 * g + 1] >= 0;
+                    sub[2 * g] = set ? got[2 * g] : -1;
+                    sub[2 * g + 1] = set ? got[2 * g + 1] : -1;
+                }
+                for (int g = NFA_GROUPS; g < nsub; g++) sub[2 * g] = sub[2 * g + 1] = -1;
+                return true;
+            }
+            return false;
+        }
+        next->n = 0;
+        set_begin(m);
+        unsigned char byte = norm_byte((unsigned char)lp->l_text[pos], m->cs);
+        for (int k = 0; k < cur->n; k++) {
+            if (!takes(&m->st[cur->idx[k]], byte)) continue;
+            memcpy(cap, &cur->cap[k * NFA_SLOTS], sizeof(cap));
+            pike_add(m, next, m->st[cur->idx[k]].out, cap, pos + 1, n);
+        }
+        if (next->n == 0) return false;
+    }
+}
+
+/* Iterate across buffer lines forward */
+bool nfa_search_forward(const nfa_program_info* prog,
+                        struct line* start_lp,
+                        int start_off,
+                        int beg_or_end,
+                        struct line** match_lp,
+                        int* match_off) {
+    int ms, me;
+
+    if (!prog || !match_off ||
+        !nfa_search_match(prog->program, start_lp, start_off, match_lp, &ms, &me)) return false;
+    *match_off = (beg_or_end == 1 /* PTEND */) ? me : ms;
+    return true;
+}
+
+void nfa_dfa_get_stats(nfa_dfa_stats* out) {
+    if (!out) return;
+    out->hits = atomic_load(&stat_hits);
+    out->misses = atomic_load(&stat_misses);
+    out->flushes = atomic_load(&stat_flushes);
+    out->fallbacks = atomic_load(&stat_fallbacks);
+    out->states = atomic_load(&stat_states);
+    out->compiles = atomic_load(&stat_compiles);
+    out->reuses = atomic_load(&stat_reuses);
 }
 
+void nfa_dfa_reset_stats(void) {
+    atomic_store(&stat_hits, 0);
+    atomic_store(&stat_misses, 0);
+    atomic_store(&stat_flushes, 0);
+    atomic_store(&stat_fallbacks, 0);
+    atomic_store(&stat_states, 0);
+    atomic_store(&stat_compiles, 0);
+    atomic_store(&stat_reuses, 0);
+}
@@ -12,6 +12,7 @@
 #include "edef.h"
 #include "efunc.h"
 #include "line.h"
+#include "line_index.h"
 #include "string_safe.h"
 
 int tabsize; /* Tab size (0: use real tabs) */
@@ -100,24 +101,10 @@ int showcpos(int f, int n)
 
 int getcline(void)
 {				/* get the current line number */
-	struct line *lp;	/* current line */
-	int numlines;	/* # of lines before point */
-
-	/* starting at the beginning of the buffer */
-	lp = lforw(curbp->b_linep);
-
-	/* start counting lines */
-	numlines = 0;
-	while (lp != curbp->b_linep) {
-		/* if we are on the current line, record it */
-		if (lp == curwp->w_dotp)
-			break;
-		++numlines;
-		lp = lforw(lp);
-	}
-
-	/* and return the resulting count */
-	return numlines + 1;
+	/* the header line sits just past the last line */
+	if (curwp->w_dotp == curbp->b_linep)
+		return (int)lindex_count(curbp) + 1;
+	return (int)lindex_number(curbp, curwp->w_dotp);
 }
 
 /*
@@ -211,6 +198,7 @@ int twiddle(int f, int n)
 	cl = lgetc(dotp, doto);
 	lputc(dotp, doto + 0, cr);
 	lputc(dotp, doto + 1, cl);
+	lsync(dotp, doto, 2);
 	lchange(WFEDIT);
 	return TRUE;
 }
@@ -411,7 +399,11 @@ int trim(int f, int n)
 				break;
 			length--;
 		}
-		lp->l_used = length;
+		if (length < lp->l_used) {
+			curwp->w_doto = length;
+			ldelete((long)(lp->l_used - length), FALSE);
+			curwp->w_doto = offset;
+		}
 
 		/* advance/or back to the next line */
 		forwline(TRUE, inc);
@@ -1176,7 +1168,7 @@ int fmatch(int ch)
 		opench = '[';
 
 	/* find the top line and set up for scan */
-	toplp = curwp->w_linep->l_bp;
+	toplp = lback(curwp->w_linep);
 	count = 1;
 	backchar(FALSE, 2);
 
@@ -1191,7 +1183,7 @@ int fmatch(int ch)
 		if (c == opench)
 			--count;
 		backchar(FALSE, 1);
-		if (curwp->w_dotp == curwp->w_bufp->b_linep->l_fp &&
+		if (curwp->w_dotp == lforw(curwp->w_bufp->b_linep) &&
 		    curwp->w_doto == 0)
 			break;
 	}
@@ -1342,12 +1334,15 @@ int move_line_up(int f, int n)
 		prevl = lback(curl);
 		
 		/* Relink the lines */
+		lindex_unlink(curl);
 		prevl->l_bp->l_fp = curl;
 		curl->l_bp = prevl->l_bp;
 		prevl->l_fp = curl->l_fp;
 		curl->l_fp->l_bp = prevl;
 		curl->l_fp = prevl;
 		prevl->l_bp = curl;
+		lindex_link(curbp, curl);
+		lsync(curl, 0, (long)llength(curl) + 1 + llength(prevl));
 		
 		/* Restore position */
 		curwp->w_dotp = curl;
@@ -1388,13 +1383,17 @@ int move_line_down(int f, int n)
 		curl = curwp->w_dotp;
 		nextl = lforw(curl);
 		
-		/* Relink the lines */
-		curl->l_bp->l_fp = nextl;
-		nextl->l_bp = curl->l_bp;
+		/* Relink the lines: the next one moves up, as lines may
+		   still be unbuilt after it */
+		lindex_unlink(nextl);
 		curl->l_fp = nextl->l_fp;
 		nextl->l_fp->l_bp = curl;
+		nextl->l_bp = curl->l_bp;
+		curl->l_bp->l_fp = nextl;
 		nextl->l_fp = curl;
 		curl->l_bp = nextl;
+		lindex_link(curbp, nextl);
+		lsync(nextl, 0, (long)llength(nextl) + 1 + llength(curl));
 		
 		/* Restore position */
 		curwp->w_dotp = curl;
@@ -126,6 +126,7 @@ int lowerregion(int f, int n)
 	int loffs;
 	int c;
 	int s;
+	long size;
 	struct region region;
 
 	if (curbp->b_mode & MDVIEW)	/* don't allow this command if      */
@@ -135,6 +136,7 @@ int lowerregion(int f, int n)
 	lchange(WFHARD);
 	linep = region.r_linep;
 	loffs = region.r_offset;
+	size = region.r_size;
 	while (region.r_size--) {
 		if (loffs == llength(linep)) {
 			linep = lforw(linep);
@@ -146,6 +148,7 @@ int lowerregion(int f, int n)
 			++loffs;
 		}
 	}
+	lsync(region.r_linep, region.r_offset, size);
 	return TRUE;
 }
 
@@ -163,6 +166,7 @@ int upperregion(int f, int n)
 	int loffs;
 	int c;
 	int s;
+	long size;
 	struct region region;
 
 	if (curbp->b_mode & MDVIEW)	/* don't allow this command if      */
@@ -172,6 +176,7 @@ int upperregion(int f, int n)
 	lchange(WFHARD);
 	linep = region.r_linep;
 	loffs = region.r_offset;
+	size = region.r_size;
 	while (region.r_size--) {
 		if (loffs == llength(linep)) {
 			linep = lforw(linep);
@@ -183,6 +188,7 @@ int upperregion(int f, int n)
 			++loffs;
 		}
 	}
+	lsync(region.r_linep, region.r_offset, size);
 	return TRUE;
 }
 
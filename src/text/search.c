@@ -57,6 +57,7 @@
  *	Modified by Petri Kutvonen
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include "string_safe.h"
 
@@ -64,9 +65,13 @@
 #include "edef.h"
 #include "efunc.h"
 #include "line.h"
+#include "line_index.h"
 #include "memory.h"
 #include "boyer_moore.h"
+#include "literal_scan.h"
 #include "nfa.h"
+#include "search_parallel.h"
+#include "undo.h"
 
 #if defined(MAGIC)
 /*
@@ -88,6 +93,7 @@ static int replaces(int kind, int f, int n);
 static int nextch(struct line **pcurline, int *pcuroff, int dir);
 static int mcstr(void);
 static int rmcstr(void);
+static void match_groups(int *sub);
 static int mceq(int bc, struct magic *mt);
 static int cclmake(char **ppatptr, struct magic *mcptr);
 static int biteq(int bc, char *cclmap);
@@ -127,14 +133,14 @@ int forwsearch(int f, int n)
 			else
 #endif
 				status = scanner(&pat[0], FORWARD, PTEND);
-		} while ((--n > 0) && status);
+		} while ((--n > 0) && status == TRUE);
 
 		/* Save away the match, or complain
 		 * if not there.
 		 */
 		if (status == TRUE)
 			savematch();
-		else
+		else if (status == FALSE)
 			mlwrite("Not found");
 	}
 	return status;
@@ -180,14 +186,14 @@ int forwhunt(int f, int n)
 		else
 #endif
 			status = scanner(&pat[0], FORWARD, PTEND);
-	} while ((--n > 0) && status);
+	} while ((--n > 0) && status == TRUE);
 
 	/* Save away the match, or complain
 	 * if not there.
 	 */
 	if (status == TRUE)
 		savematch();
-	else
+	else if (status == FALSE)
 		mlwrite("Not found");
 
 	return status;
@@ -228,14 +234,14 @@ int backsearch(int f, int n)
 			else
 #endif
 				status = scanner(&tap[0], REVERSE, PTBEG);
-		} while ((--n > 0) && status);
+		} while ((--n > 0) && status == TRUE);
 
 		/* Save away the match, or complain
 		 * if not there.
 		 */
 		if (status == TRUE)
 			savematch();
-		else
+		else if (status == FALSE)
 			mlwrite("Not found");
 	}
 	return status;
@@ -282,20 +288,193 @@ int backhunt(int f, int n)
 		else
 #endif
 			status = scanner(&tap[0], REVERSE, PTBEG);
-	} while ((--n > 0) && status);
+	} while ((--n > 0) && status == TRUE);
 
 	/* Save away the match, or complain
 	 * if not there.
 	 */
 	if (status == TRUE)
 		savematch();
-	else
+	else if (status == FALSE)
 		mlwrite("Not found");
 
 	return status;
 }
 
+/*
+ * allmatches -- Find every match of the search pattern in the current
+ *	buffer, keeping the matches if "list", else only counting them.
+ *	The worker threads of search_parallel.c do it when the pattern
+ *	suits their engines; otherwise it is done the old way, moving "."
+ *	from match to match and putting it back afterwards.
+ */
+static int allmatches(int list, struct psearch_result *res)
+{
+	struct line *odotp = curwp->w_dotp;
+	int odoto = curwp->w_doto;
+	struct psearch_match pm;
+	bool magic = false;
+	int status;
+
+#if	MAGIC
+	magic = (magical && (curwp->w_bufp->b_mode & MDMAGIC) != 0);
+#endif
+	status = psearch_buffer(curbp, &pat[0], magic,
+				(curwp->w_bufp->b_mode & MDEXACT) != 0, list, res);
+	if (status != ABORT)
+		return status;
+
+	res->threads = 1;
+	curwp->w_dotp = lforw(curbp->b_linep);
+	curwp->w_doto = 0;
+	for (;;) {
+#if	MAGIC
+		if (magic)
+			status = mcscanner(&mcpat[0], FORWARD, PTEND);
+		else
+#endif
+			status = scanner(&pat[0], FORWARD, PTEND);
+		if (status != TRUE)
+			break;
+		if (list) {
+			pm.lp = matchline;
+			pm.line = lindex_number(curbp, matchline);
+			pm.off = matchoff;
+			pm.elp = curwp->w_dotp;
+			pm.eoff = curwp->w_doto;
+			if (!psearch_add(res, &pm)) {
+				psearch_free(res);
+				status = ABORT;
+				break;
+			}
+		} else
+			res->count++;
+		/* Step over an empty match, or it is found again */
+		if (matchlen == 0 && forwchar(FALSE, 1) != TRUE)
+			break;
+	}
+	curwp->w_dotp = odotp;
+	curwp->w_doto = odoto;
+	return status == ABORT ? FALSE : TRUE;
+}
+
+/*
+ * countmatches -- Count the matches of a pattern in the whole buffer.
+ *	"." does not move.
+ *
+ * int f, n;		default flag / numeric argument
+ */
+int countmatches(int f, int n)
+{
+	struct psearch_result res;
+	int status;
+
+	if ((status = readpattern("Count matches", &pat[0], TRUE)) != TRUE)
+		return status;
+	if ((status = allmatches(FALSE, &res)) != TRUE)
+		return status;
+	mlwrite("%ld match%s", res.count, res.count == 1 ? "" : "es");
+	return TRUE;
+}
+
+/*
+ * listmatches -- List the lines of the buffer holding matches of a
+ *	pattern, each once with its line number, in the list buffer.
+ *
+ * int f, n;		default flag / numeric argument
+ */
+int listmatches(int f, int n)
+{
+	struct psearch_result res;
+	struct line *lp = NULL;
+	char line[MAXCOL + 16];
+	char epat[NPAT];
+	int status;
+	long i;
+
+	if ((status = readpattern("List matches", &pat[0], TRUE)) != TRUE)
+		return status;
+	if ((status = allmatches(TRUE, &res)) != TRUE)
+		return status;
+
+	blistp->b_flag &= ~BFCHG;	/* Don't complain!      */
+	if ((status = bclear(blistp)) != TRUE)
+		goto out;
+	expandp(&pat[0], &epat[0], NPAT);
+	snprintf(line, sizeof(line), "%ld match%s for \"%s\" in %s", res.count,
+		 res.count == 1 ? "" : "es", epat, curbp->b_bname);
+	if ((status = addline(line)) != TRUE)
+		goto out;
+	for (i = 0; i < res.count; ++i) {
+		int len;
+		int k;
+
+		if (res.match[i].lp == lp)	/* One entry per line */
+			continue;
+		lp = res.match[i].lp;
+		len = llength(lp) < MAXCOL ? llength(lp) : MAXCOL;
+		k = snprintf(line, sizeof(line), "%7ld: ", res.match[i].line);
+		memcpy(&line[k], lp->l_text, len);
+		line[k + len] = 0;
+		if ((status = addline(line)) != TRUE)
+			goto out;
+	}
+	status = showlist();
+	mlwrite("%ld match%s", res.count, res.count == 1 ? "" : "es");
+out:
+	psearch_free(&res);
+	return status;
+}
+
 #if	MAGIC
+#ifdef ENABLE_SEARCH_NFA
+/* Whether the NFA has been turned off for searching */
+static bool nfa_off(void)
+{
+	const char *env = getenv("UEMACS_SEARCH_NFA");
+
+	return env && strcmp(env, "0") == 0;
+}
+
+/*
+ * nfa_scan -- MAGIC search on the NFA and its lazy DFA.  "patrn" is the
+ *	pattern as typed, also when searching backward, which runs the
+ *	reversed program back from ".".  The program comes from the NFA's
+ *	cache, so repeating a search or replacing does not recompile it.  Sets matchline, matchoff and
+ *	matchlen as amatch() would, and "." to the start or end of the match
+ *	(beg_or_end already toggled by the direction).  Returns ABORT when
+ *	the pattern is one the NFA does not handle, so the caller can fall
+ *	back to amatch().
+ */
+static int nfa_scan(const char *patrn, int direct, int beg_or_end)
+{
+	bool cs = ((curwp->w_bufp->b_mode & MDEXACT) != 0);
+	nfa_program *prog;
+	struct line *mlp;
+	int ms, me;
+	bool found;
+
+	if (nfa_off() || !(prog = nfa_program_get(patrn, cs)))
+		return ABORT;
+	if (direct == FORWARD) {
+		found = nfa_search_match(prog, curwp->w_dotp, curwp->w_doto, &mlp, &ms, &me);
+	} else {
+		if (!nfa_can_reverse(prog))
+			return ABORT;
+		found = nfa_search_match_reverse(prog, curwp->w_dotp, curwp->w_doto, &mlp, &ms, &me);
+	}
+	if (!found)
+		return FALSE;
+	matchline = mlp;
+	matchoff = ms;
+	matchlen = me - ms;
+	curwp->w_dotp = mlp;
+	curwp->w_doto = ((beg_or_end == PTEND) == (direct == FORWARD)) ? me : ms;
+	curwp->w_flag |= WFMOVE;
+	return TRUE;
+}
+#endif
+
 /*
  * mcscanner -- Search for a meta-pattern in either direction.  If found,
  *	reset the "." to be at the start or just after the match string,
@@ -323,6 +502,22 @@ int mcscanner(struct magic *mcpatrn, int direct, int beg_or_end)
 	 */
 	mlenold = matchlen;
 
+#ifdef ENABLE_SEARCH_NFA
+	/* The whole pattern: let the NFA have it if it can.  amatch() would
+	 * take alternation, groups and the other repeats for plain text, so
+	 * a pattern using them that the NFA refuses is an error.
+	 */
+	if (mcpatrn == (direct == FORWARD ? &mcpat[0] : &tapcm[0])) {
+		int status = nfa_scan(pat, direct, beg_or_end);
+		if (status != ABORT)
+			return status;
+		if (nfa_pattern_extended(pat)) {
+			mlwrite("%%Pattern too complex");
+			return ABORT;
+		}
+	}
+#endif
+
 	/* Setup local scan pointers to global ".".
 	 */
 	curline = curwp->w_dotp;
@@ -554,45 +749,15 @@ int scanner(const char *patrn, int direct, int beg_or_end)
         /* Detect obvious unsupported constructs quickly: defer to legacy if contains '[' or ']' */
         /* Now supported: classes; proceed always */
 #ifdef ENABLE_SEARCH_NFA
-            bool cs = ((curwp->w_bufp->b_mode & MDEXACT) != 0);
-            nfa_program_info nfa = {0};
-            if (nfa_compile(patrn, cs, &nfa)) {
-                struct line* mlp = NULL; int moff = 0;
-                if (direct == FORWARD) {
-                    if (nfa_search_forward(&nfa, curwp->w_dotp, curwp->w_doto,
-                                           beg_or_end, &mlp, &moff)) {
-                        matchline = mlp; matchoff = moff;
-                        curwp->w_dotp = mlp; curwp->w_doto = moff;
-                        curwp->w_flag |= WFMOVE;
-                        return TRUE;
-                    }
-                } else {
-                    /* Reverse: forward scan from start of buffer to last <= current */
-                    struct line* lp = lforw(curbp->b_linep);
-                    int off = 0;
-                    struct line* last_lp = NULL; int last_off = 0;
-                    while (lp != curbp->b_linep) {
-                        struct line* t_lp = NULL; int t_off = 0;
-                        if (nfa_search_forward(&nfa, lp, off, beg_or_end, &t_lp, &t_off)) {
-                            /* Accept if <= current position */
-                            if (t_lp == curwp->w_dotp ? (t_off <= curwp->w_doto) : (t_lp != NULL)) {
-                                last_lp = t_lp; last_off = t_off;
-                                /* continue scanning from next char */
-                                lp = t_lp; off = t_off + 1;
-                                if (off > llength(lp)) { lp = lforw(lp); off = 0; }
-                                continue;
-                            }
-                        }
-                        /* advance line */
-                        lp = lforw(lp); off = 0;
-                    }
-                    if (last_lp) {
-                        matchline = last_lp; matchoff = last_off;
-                        curwp->w_dotp = last_lp; curwp->w_doto = last_off;
-                        curwp->w_flag |= WFMOVE;
-                        return TRUE;
-                    }
-                }
+            if (direct == FORWARD) {
+                if (nfa_scan(patrn, FORWARD, beg_or_end) == TRUE)
+                    return TRUE;
+            } else if (patlen < NPAT) {
+                /* Backward we are handed the pattern reversed; the NFA wants it as typed */
+                char fwd[NPAT];
+                rvstrcpy(fwd, (char *)patrn);
+                if (nfa_scan(fwd, REVERSE, beg_or_end) == TRUE)
+                    return TRUE;
             }
 #endif
     }
@@ -753,20 +918,46 @@ int scanner(const char *patrn, int direct, int beg_or_end)
         return FALSE;
     }
 
-    /* Fast path: Boyer–Moore within single lines when pattern is simple and reasonably long.
+    /* Forward literal: vectorised kernel over the lines as one stream, so
+     * short lines cost no per-line setup and matches may span lines.
+     */
+    if (direct == FORWARD && patlen > 0 && patlen <= LSCAN_MAX_PATTERN) {
+        struct literal_scan ls;
+        struct line *mlp, *elp;
+        int moff, eoff;
+        if (lscan_init(&ls, (const unsigned char*)patrn, patlen, case_sensitive) == 0) {
+            if (!lscan_search_forward(&ls, curline, curoff, curbp->b_linep,
+                                      &mlp, &moff, &elp, &eoff))
+                return FALSE;
+            matchline = mlp;
+            matchoff = moff;
+            if (beg_or_end == PTEND) {
+                curwp->w_dotp = elp;
+                curwp->w_doto = eoff;
+            } else {
+                curwp->w_dotp = mlp;
+                curwp->w_doto = moff;
+            }
+            curwp->w_flag |= WFMOVE;
+            return TRUE;
+        }
+    }
+
+    /* Reverse fast path: Boyer–Moore within single lines when pattern is simple and reasonably long.
      * Constraints: no newlines in pattern; length >= 5; non-MAGIC path.
      */
-    if (!pat_has_nl && patlen >= BMH_MIN_LEN) {
+    if (!pat_has_nl && patlen >= BMH_MIN_LEN && direct == REVERSE) {
         struct boyer_moore_context bm = {0};
         if (bm_init(&bm, (const unsigned char*)patrn, patlen, case_sensitive) == 0) {
-            if (direct == FORWARD) {
-                struct line *lp = curwp->w_dotp;
-                int off = curwp->w_doto;
-                while (lp != curbp->b_linep) {
-                    int n = llength(lp);
-                    if (n > 0) {
-                        int start = (lp == curwp->w_dotp) ? off : 0;
-                        int idx = bm_search(&bm, (const unsigned char*)lp->l_text, n, (start < n ? start : n - 1));
+            struct line *lp = curwp->w_dotp;
+            int off = curwp->w_doto;
+            while (true) {
+                if (lp == curbp->b_linep) break;
+                int n = llength(lp);
+                if (n > 0) {
+                    int start = (lp == curwp->w_dotp) ? (off - 1) : (n - 1);
+                    if (start >= 0) {
+                        int idx = bm_search_reverse(&bm, (const unsigned char*)lp->l_text, n, start);
                         if (idx >= 0) {
                             matchline = lp;
                             matchoff = idx;
@@ -782,104 +973,46 @@ int scanner(const char *patrn, int direct, int beg_or_end)
                             return TRUE;
                         }
                     }
-                    lp = lforw(lp);
-                }
-            } else { /* REVERSE */
-                struct line *lp = curwp->w_dotp;
-                int off = curwp->w_doto;
-                while (true) {
-                    if (lp == curbp->b_linep) break;
-                    int n = llength(lp);
-                    if (n > 0) {
-                        int start = (lp == curwp->w_dotp) ? (off - 1) : (n - 1);
-                        if (start >= 0) {
-                            int idx = bm_search_reverse(&bm, (const unsigned char*)lp->l_text, n, start);
-                            if (idx >= 0) {
-                                matchline = lp;
-                                matchoff = idx;
-                                if (beg_or_end == PTEND) {
-                                    curwp->w_dotp = lp;
-                                    curwp->w_doto = idx + patlen;
-                                } else {
-                                    curwp->w_dotp = lp;
-                                    curwp->w_doto = idx;
-                                }
-                                curwp->w_flag |= WFMOVE;
-                                bm_free(&bm);
-                                return TRUE;
-                            }
-                        }
-                    }
-                    /* Move to previous line */
-                    struct line *prev = lback(lp);
-                    if (prev == NULL) break;
-                    lp = prev;
                 }
+                /* Move to previous line */
+                struct line *prev = lback(lp);
+                if (prev == NULL) break;
+                lp = prev;
             }
         }
         bm_free(&bm);
     }
 
-    /* Short literal patterns (<=4) without newlines: memchr + memcmp per line */
-    if (!pat_has_nl && patlen > 0 && patlen <= 4) {
-        if (direct == FORWARD) {
-            struct line *lp = curwp->w_dotp;
-            int off = curwp->w_doto;
-            unsigned char first = (unsigned char)(case_sensitive ? patrn[0] : LOWER_ASCII(patrn[0]));
-            while (lp != curbp->b_linep) {
-                int n = llength(lp);
-                if (n >= patlen) {
-                    int start = (lp == curwp->w_dotp) ? off : 0;
-                    const unsigned char* text = (const unsigned char*)lp->l_text;
-                    for (int i = start; i <= n - patlen; ) {
-                        unsigned char c0 = (unsigned char)(case_sensitive ? text[i] : LOWER_ASCII(text[i]));
-                        if (c0 == first) {
-                            if (patlen == 1 || (case_sensitive ? memcmp(text + i, patrn, patlen) == 0
-                                                               : (LOWER_ASCII(text[i + (patlen>1?1:0)]) == LOWER_ASCII(patrn[1]) &&
-                                                                  (patlen<3 || LOWER_ASCII(text[i+2])==LOWER_ASCII(patrn[2])) &&
-                                                                  (patlen<4 || LOWER_ASCII(text[i+3])==LOWER_ASCII(patrn[3]))))) {
-                                matchline = lp; matchoff = i;
-                                if (beg_or_end == PTEND) { curwp->w_dotp = lp; curwp->w_doto = i + patlen; }
-                                else { curwp->w_dotp = lp; curwp->w_doto = i; }
-                                curwp->w_flag |= WFMOVE; return TRUE;
-                            }
-                        }
-                        /* advance by 1; memchr could accelerate, but keep portable */
-                        i++;
-                    }
-                }
-                lp = lforw(lp);
-            }
-        } else { /* REVERSE */
-            struct line *lp = curwp->w_dotp;
-            int off = curwp->w_doto;
-            unsigned char first = (unsigned char)(case_sensitive ? patrn[0] : LOWER_ASCII(patrn[0]));
-            while (true) {
-                if (lp == curbp->b_linep) break;
-                int n = llength(lp);
-                if (n >= patlen) {
-                    int start = (lp == curwp->w_dotp) ? (off - patlen) : (n - patlen);
-                    if (start > n - patlen) start = n - patlen;
-                    for (int i = start; i >= 0; --i) {
-                        unsigned char c0 = (unsigned char)(case_sensitive ? lp->l_text[i] : LOWER_ASCII(lp->l_text[i]));
-                        if (c0 == first) {
-                            if (patlen == 1 || (case_sensitive ? memcmp(lp->l_text + i, patrn, patlen) == 0
-                                                               : (LOWER_ASCII(lp->l_text[i + (patlen>1?1:0)]) == LOWER_ASCII(patrn[1]) &&
-                                                                  (patlen<3 || LOWER_ASCII(lp->l_text[i+2])==LOWER_ASCII(patrn[2])) &&
-                                                                  (patlen<4 || LOWER_ASCII(lp->l_text[i+3])==LOWER_ASCII(patrn[3]))))) {
-                                matchline = lp; matchoff = i;
-                                if (beg_or_end == PTEND) { curwp->w_dotp = lp; curwp->w_doto = i + patlen; }
-                                else { curwp->w_dotp = lp; curwp->w_doto = i; }
-                                curwp->w_flag |= WFMOVE; return TRUE;
-                            }
+    /* Short literal patterns (<=4) without newlines, backwards: first byte then compare */
+    if (!pat_has_nl && patlen > 0 && patlen <= 4 && direct == REVERSE) {
+        struct line *lp = curwp->w_dotp;
+        int off = curwp->w_doto;
+        unsigned char first = (unsigned char)(case_sensitive ? patrn[0] : LOWER_ASCII(patrn[0]));
+        while (true) {
+            if (lp == curbp->b_linep) break;
+            int n = llength(lp);
+            if (n >= patlen) {
+                int start = (lp == curwp->w_dotp) ? (off - patlen) : (n - patlen);
+                if (start > n - patlen) start = n - patlen;
+                for (int i = start; i >= 0; --i) {
+                    unsigned char c0 = (unsigned char)(case_sensitive ? lp->l_text[i] : LOWER_ASCII(lp->l_text[i]));
+                    if (c0 == first) {
+                        if (patlen == 1 || (case_sensitive ? memcmp(lp->l_text + i, patrn, patlen) == 0
+                                                           : (LOWER_ASCII(lp->l_text[i + (patlen>1?1:0)]) == LOWER_ASCII(patrn[1]) &&
+                                                              (patlen<3 || LOWER_ASCII(lp->l_text[i+2])==LOWER_ASCII(patrn[2])) &&
+                                                              (patlen<4 || LOWER_ASCII(lp->l_text[i+3])==LOWER_ASCII(patrn[3]))))) {
+                            matchline = lp; matchoff = i;
+                            if (beg_or_end == PTEND) { curwp->w_dotp = lp; curwp->w_doto = i + patlen; }
+                            else { curwp->w_dotp = lp; curwp->w_doto = i; }
+                            curwp->w_flag |= WFMOVE; return TRUE;
                         }
                     }
                 }
-                /* Move to previous line */
-                struct line *prev = lback(lp);
-                if (prev == NULL) break;
-                lp = prev;
             }
+            /* Move to previous line */
+            struct line *prev = lback(lp);
+            if (prev == NULL) break;
+            lp = prev;
         }
     }
 
@@ -1149,6 +1282,21 @@ static int replaces(int kind, int f, int n)
 
 	while ((f == FALSE || n > nummatch) &&
 	       (nlflag == FALSE || nlrepl == FALSE)) {
+		/* No more questions: do the rest in one pass
+		 * if the pattern allows it.
+		 */
+		if (kind == FALSE) {
+			int nbulk;
+
+			status = replace_all(f == FALSE ? -1 : n - nummatch, &nbulk);
+			if (status != ABORT) {
+				numsub += nbulk;
+				if (status != TRUE)
+					return status;
+				break;
+			}
+		}
+
 		/* Search for the pattern.
 		 * If we search with a regular expression,
 		 * matchlen is reset to the true length of
@@ -1156,7 +1304,7 @@ static int replaces(int kind, int f, int n)
 		 */
 #if	MAGIC
 		if ((magical && curwp->w_bufp->b_mode & MDMAGIC) != 0) {
-			if (!mcscanner(&mcpat[0], FORWARD, PTBEG))
+			if (mcscanner(&mcpat[0], FORWARD, PTBEG) != TRUE)
 				break;
 		} else
 #endif
@@ -1283,6 +1431,11 @@ static int replaces(int kind, int f, int n)
 		}
 
 		numsub++;	/* increment # of substitutions */
+
+		/* Step past an empty match, or it is found again.
+		 */
+		if (matchlen == 0 && forwchar(FALSE, 1) != TRUE)
+			break;
 	}
 
 	/* And report the results.
@@ -1291,6 +1444,190 @@ static int replaces(int kind, int f, int n)
 	return TRUE;
 }
 
+/* The matches a bulk replace has found so far */
+struct bulk_matches {
+	struct line **lp;	/* line of each match */
+	int *off;		/* and offset there */
+	long count;
+	long room;
+	long max;		/* stop after this many, -1 for all */
+	bool nomem;
+};
+
+static bool bulk_found(void *arg, struct line *mlp, int moff,
+		       struct line *elp, int eoff)
+{
+	struct bulk_matches *bm = arg;
+
+	(void) elp;
+	(void) eoff;
+	if (bm->count == bm->room) {
+		long nroom = bm->room ? bm->room * 2 : 1024;
+		struct line **nlp = safe_realloc(bm->lp, nroom * sizeof(*nlp), "bulk replace lines");
+		int *noff = nlp ? safe_realloc(bm->off, nroom * sizeof(*noff), "bulk replace offsets") : NULL;
+
+		if (nlp)
+			bm->lp = nlp;
+		if (!noff) {
+			bm->nomem = true;
+			return false;
+		}
+		bm->off = noff;
+		bm->room = nroom;
+	}
+	bm->lp[bm->count] = mlp;
+	bm->off[bm->count++] = moff;
+	return bm->max < 0 || bm->count < bm->max;
+}
+
+/*
+ * replace_all -- Replace the matches of pat from "." on with rpat, at most
+ *	"max" of them (-1 for no limit), without asking.  The matches are
+ *	found in one pass of the literal kernel first, then each line that
+ *	holds any is rewritten once, as one undo step for the lot and one
+ *	redisplay.  Returns ABORT, having done nothing, if the pattern or the
+ *	replacement spans lines or the pattern is a regular expression; the
+ *	caller then goes match by match.  "." is left after the last
+ *	replacement and the count of them is set in "nsub".
+ */
+int replace_all(long max, int *nsub)
+{
+	struct literal_scan ls;
+	struct bulk_matches bm = { .max = max };
+	struct line *lp, *prev;
+	long lnum;
+	char *text = NULL;
+	long room = 0;
+	long per_match;
+	int mlen = strlen(pat);
+	int rlength = strlen(rpat);
+	int use_meta = FALSE;
+	int status = TRUE;
+	long i, j;
+
+	*nsub = 0;
+#if	MAGIC
+	if (magical && (curwp->w_bufp->b_mode & MDMAGIC) != 0)
+		return ABORT;
+	use_meta = rmagical && (curwp->w_bufp->b_mode & MDMAGIC) != 0;
+#endif
+	if (strchr(pat, '\n') || strchr(rpat, '\n') ||
+	    lscan_init(&ls, (const unsigned char *)pat, mlen,
+		       (curwp->w_bufp->b_mode & MDEXACT) != 0) != 0)
+		return ABORT;
+	if (max == 0)
+		return TRUE;
+	/* Room for one replacement, each "&" in it the match itself */
+	per_match = use_meta ? (long)rlength * (mlen + 1) : rlength;
+
+	if (!lscan_search_all(&ls, curwp->w_dotp, curwp->w_doto, curbp->b_linep,
+			      bulk_found, &bm) || bm.nomem) {
+		status = FALSE;
+		goto out;
+	}
+	if (bm.count == 0)
+		goto out;
+
+	/* Each line from its first match to the end of its last */
+	undo_group_begin(curbp);
+	lp = curwp->w_dotp;
+	lnum = lindex_number(curbp, lp);
+	for (i = 0; i < bm.count; i = j) {
+		int start = bm.off[i];
+		int len = 0;
+		long need;
+
+		while (lp != bm.lp[i]) {
+			lp = lforw(lp);
+			lnum++;
+		}
+		for (j = i; j < bm.count && bm.lp[j] == lp; j++)
+			;
+		need = bm.off[j - 1] + mlen - start + (j - i) * per_match;
+		if (need > room) {
+			char *nt = safe_realloc(text, need, "bulk replace text");
+			if (!nt) {
+				status = FALSE;
+				break;
+			}
+			text = nt;
+			room = need;
+		}
+		for (long k = i; k < j; k++) {
+			const char *mp = &lp->l_text[bm.off[k]];
+
+			if (k > i) {
+				int gap = bm.off[k] - bm.off[k - 1] - mlen;
+				memcpy(text + len, mp - gap, gap);
+				len += gap;
+			}
+#if	MAGIC
+			if (use_meta) {
+				struct magic_replacement *rmcptr;
+
+				for (rmcptr = &rmcpat[0]; rmcptr->mc_type != MCNIL; rmcptr++) {
+					if (rmcptr->mc_type == LITCHAR) {
+						int rl = strlen(rmcptr->rstr);
+						memcpy(text + len, rmcptr->rstr, rl);
+						len += rl;
+					} else if (rmcptr->mc_type == DITTO) {
+						memcpy(text + len, mp, mlen);
+						len += mlen;
+					}
+				}
+				continue;
+			}
+#endif
+			memcpy(text + len, rpat, rlength);
+			len += rlength;
+		}
+
+		prev = lback(lp);	/* The line may move */
+		if (lreplace(lp, lnum, start, bm.off[j - 1] + mlen - start, text, len) != TRUE) {
+			status = FALSE;
+			break;
+		}
+		lp = lforw(prev);
+		curwp->w_dotp = lp;
+		curwp->w_doto = start + len;
+		*nsub += j - i;
+	}
+	undo_group_end(curbp);
+	lchange(WFHARD);
+	curwp->w_flag |= WFMOVE;
+
+out:
+	SAFE_FREE(bm.lp);
+	SAFE_FREE(bm.off);
+	SAFE_FREE(text);
+	return status;
+}
+
+#if	MAGIC
+/*
+ * match_groups -- Where the groups of the last match are, as offsets in
+ *	matchline: sub[2g] and sub[2g+1] for group g, both -1 when the group
+ *	took no part.  Only the NFA knows groups; a match found without it
+ *	has none.
+ */
+static void match_groups(int *sub)
+{
+	for (int i = 0; i < 2 * NFA_GROUPS; i++)
+		sub[i] = -1;
+#ifdef ENABLE_SEARCH_NFA
+	if (magical && matchline != NULL && matchline != curbp->b_linep) {
+		nfa_program *prog = nfa_program_get(pat, (curwp->w_bufp->b_mode & MDEXACT) != 0);
+
+		if (prog != NULL && !nfa_match_groups(prog, matchline, matchoff,
+						       matchoff + matchlen, sub, NFA_GROUPS)) {
+			for (int i = 0; i < 2 * NFA_GROUPS; i++)
+				sub[i] = -1;
+		}
+	}
+#endif
+}
+#endif
+
 /*
  * delins -- Delete a specified length from the current point
  *	then either insert the string directly, or make use of
@@ -1301,6 +1638,18 @@ int delins(int dlength, char *instr, int use_meta)
 	int status;
 #if	MAGIC
 	struct magic_replacement *rmcptr;
+	int sub[2 * NFA_GROUPS];
+
+	/* The match goes with the delete: keep its text, and where its
+	 * groups are, for the replacement to be built from.
+	 */
+	if ((rmagical && use_meta) &&
+		    (curwp->w_bufp->b_mode & MDMAGIC) != 0) {
+		match_groups(sub);
+		savematch();
+		if (patmatch == NULL)
+			return FALSE;
+	}
 #endif
 
 	/* Zap what we gotta,
@@ -1314,10 +1663,20 @@ int delins(int dlength, char *instr, int use_meta)
 		    (curwp->w_bufp->b_mode & MDMAGIC) != 0) {
 		rmcptr = &rmcpat[0];
 		while (rmcptr->mc_type != MCNIL && status == TRUE) {
-			if (rmcptr->mc_type == LITCHAR)
+			if (rmcptr->mc_type == LITCHAR) {
 				status = linstr(rmcptr->rstr);
-			else
+			} else if (rmcptr->mc_type == GROUP) {
+				/* Offsets into the match, held in patmatch */
+				int g = rmcptr->mc_group;
+
+				for (int i = sub[2 * g]; i < sub[2 * g + 1] && status == TRUE; i++) {
+					if (i < matchoff || i - matchoff >= (int)matchlen)
+						break;
+					status = linsert(1, patmatch[i - matchoff]);
+				}
+			} else {
 				status = linstr(patmatch);
+			}
 			rmcptr++;
 		}
 	} else
@@ -1539,6 +1898,22 @@ static int mcstr(void)
 	 */
 	mcptr->mc_type = MCNIL;
 
+#ifdef ENABLE_SEARCH_NFA
+	/* Alternation, groups and the other repeats are the NFA's alone,
+	 * but they still make the pattern a regular expression: one the NFA
+	 * must take, since amatch() would read them as plain text.
+	 */
+	if (status && nfa_pattern_extended(pat)) {
+		magical = TRUE;
+		if (nfa_off() || !nfa_program_get(pat, (curwp->w_bufp->b_mode & MDEXACT) != 0)) {
+			mlwrite("%%Pattern too complex");
+			mcclear();
+			magical = FALSE;
+			return FALSE;
+		}
+	}
+#endif
+
 	/* Set up the reverse array, if the status is good.  Please note the
 	 * structure assignment - your compiler may not like that.
 	 * If the status is not good, nil out the meta-pattern.
@@ -1608,6 +1983,29 @@ static int rmcstr(void)
 			break;
 
 		case MC_ESC:
+			/* \1 to \9 stand for what a group matched,
+			 * \0 for the whole match like '&'.
+			 */
+			if (isdigit((unsigned char) *(patptr + 1))) {
+				if (mj != 0) {
+					rmcptr->mc_type = LITCHAR;
+					if ((rmcptr->rstr =
+					     (char*)safe_alloc(mj + 1, "replace string", __FILE__, __LINE__)) == NULL) {
+						mlwrite("%%Out of memory");
+						status = FALSE;
+						break;
+					}
+					memcpy(rmcptr->rstr, patptr - mj, (size_t)mj);
+					rmcptr->rstr[mj] = '\0';
+					rmcptr++;
+					mj = 0;
+				}
+				rmcptr->mc_group = *++patptr - '0';
+				rmcptr->mc_type = rmcptr->mc_group ? GROUP : DITTO;
+				rmcptr++;
+				rmagical = TRUE;
+				break;
+			}
 			rmcptr->mc_type = LITCHAR;
 
 			/* We malloc mj plus two here, instead
@@ -0,0 +1,173 @@
+/*
+ * search_highlight.c - Every match of the last search shown on screen
+ *
+ * The display asks for the matches of each row it draws. They are kept in
+ * a small direct-mapped table keyed by the line, and are good for as long
+ * as the line's generation stamp and the buffer's search modes stay the
+ * same; any change to the text gives the line a new stamp, so a stale
+ * entry is never used. A new pattern, or the mode turned on or off, drops
+ * the whole table once, in hl_resolve().
+ *
+ * A line is searched with the literal kernel, or the NFA in MAGIC mode,
+ * on its own: matches running onto the next line are not shown, and
+ * empty ones are skipped.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "estruct.h"
+#include "edef.h"
+#include "efunc.h"
+#include "line.h"
+#include "memory.h"
+#include "string_safe.h"
+#include "literal_scan.h"
+#include "nfa.h"
+#include "search_highlight.h"
+
+#define HL_MODES    (MDEXACT | MDMAGIC)     /* Modes the matches depend on */
+
+struct hl_entry {
+	struct line *lp;	/* line the matches are for, NULL if none */
+	uint32_t gen;		/* ... its stamp then */
+	int mode;		/* ... and the search modes of its buffer */
+	int n;			/* matches */
+	int room;		/* spans allocated */
+	struct hl_span *span;
+};
+
+static bool hl_on;			/* highlight-matches is on */
+static bool hl_shown;			/* ... as of the last update */
+static char hl_pat[NPAT];		/* Pattern the table is for */
+static struct hl_entry hl_table[HL_SLOTS];
+
+static struct literal_scan hl_ls;	/* hl_pat made ready for the kernel */
+static int hl_lsmode = -1;		/* ... in these modes, -1 if not */
+#ifdef ENABLE_SEARCH_NFA
+static nfa_program *hl_prog;		/* ... or for the NFA */
+static int hl_progmode = -1;
+#endif
+
+void hl_flush(void)
+{
+	for (int i = 0; i < HL_SLOTS; i++) {
+		SAFE_FREE(hl_table[i].span);
+		memset(&hl_table[i], 0, sizeof(hl_table[i]));
+	}
+	hl_lsmode = -1;
+#ifdef ENABLE_SEARCH_NFA
+	nfa_program_free(hl_prog);
+	hl_prog = NULL;
+	hl_progmode = -1;
+#endif
+}
+
+bool hl_resolve(void)
+{
+	bool show = hl_on && pat[0] != '\0';
+	struct window *wp;
+
+	if (show == hl_shown && (!show || strcmp(pat, hl_pat) == 0))
+		return show;
+	hl_flush();
+	safe_strcpy(hl_pat, pat, NPAT);
+	hl_shown = show;
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp)
+		wp->w_flag |= WFHARD;
+	return show;
+}
+
+static bool hl_add(struct hl_entry *e, int from, int to)
+{
+	if (e->n == e->room) {
+		int nroom = e->room ? e->room * 2 : 8;
+		struct hl_span *ns = safe_realloc(e->span, nroom * sizeof(*ns), "match highlight spans");
+		if (!ns)
+			return false;
+		e->span = ns;
+		e->room = nroom;
+	}
+	e->span[e->n].from = from;
+	e->span[e->n].to = to;
+	e->n++;
+	return true;
+}
+
+/* Find the matches of hl_pat in "lp" for entry "e" */
+static void hl_scan(struct hl_entry *e, struct line *lp, int mode)
+{
+	int len = llength(lp);
+
+	e->n = 0;
+	if ((mode & MDMAGIC) != 0) {
+#ifdef ENABLE_SEARCH_NFA
+		struct line *mlp;
+		int ms, me;
+		int off = 0;
+
+		if (hl_progmode != mode) {
+			nfa_program_free(hl_prog);
+			hl_prog = nfa_program_new(hl_pat, (mode & MDEXACT) != 0);
+			hl_progmode = mode;
+		}
+		while (hl_prog && off <= len &&
+		       nfa_search_match_until(hl_prog, lp, off, lforw(lp), &mlp, &ms, &me) &&
+		       mlp == lp) {
+			if (me > ms && !hl_add(e, ms, me))
+				return;
+			off = me > ms ? me : me + 1;
+		}
+#endif
+		return;
+	}
+
+	if (hl_lsmode != mode) {
+		int plen = strlen(hl_pat);
+
+		/* A pattern holding a newline is never all on one line */
+		if (memchr(hl_pat, '\n', plen) ||
+		    lscan_init(&hl_ls, (const unsigned char *)hl_pat, plen,
+			       (mode & MDEXACT) != 0) != 0)
+			hl_ls.len = 0;
+		hl_lsmode = mode;
+	}
+	if (hl_ls.len == 0)
+		return;
+	for (int off = 0; off + hl_ls.len <= len; ) {
+		long k = lscan_find(&hl_ls, (const unsigned char *)lp->l_text + off, len - off);
+
+		if (k < 0 || !hl_add(e, off + k, off + k + hl_ls.len))
+			return;
+		off += k + hl_ls.len;
+	}
+}
+
+int hl_line(struct buffer *bp, struct line *lp, const struct hl_span **spans)
+{
+	uint32_t h = (uint32_t)((uintptr_t)lp >> 3) * 2654435761u;
+	struct hl_entry *e = &hl_table[h >> (32 - HL_BITS)];
+	int mode = bp->b_mode & HL_MODES;
+
+	if (lp == bp->b_linep)
+		return 0;
+	if (e->lp != lp || e->gen != lp->l_gen || e->mode != mode) {
+		hl_scan(e, lp, mode);
+		e->lp = lp;
+		e->gen = lp->l_gen;
+		e->mode = mode;
+	}
+	*spans = e->span;
+	return e->n;
+}
+
+/*
+ * Show every match of the search pattern on screen, or stop. With an
+ * argument, n > 0 turns it on and anything else off.
+ */
+int hilite_matches(int f, int n)
+{
+	hl_on = f ? n > 0 : !hl_on;
+	mlwrite(hl_on ? "(Highlighting matches)" : "(Not highlighting matches)");
+	return TRUE;
+}
@@ -0,0 +1,395 @@
+/*
+ * search_parallel.c - Whole-buffer search on a pool of worker threads
+ *
+ * Counting or listing every match of a pattern reads the whole buffer,
+ * so it is split: the lines are cut into chunks, a few per worker, and
+ * the workers take the next chunk off a shared counter until none are
+ * left. Literal patterns run the vectorised kernel of literal_scan.c,
+ * MAGIC ones an NFA program of each worker's own.
+ *
+ * A match belongs to the chunk it starts in. Only a literal pattern
+ * holding newlines can run on into the next chunk; its workers search up
+ * to that many lines past their chunk, and the joining step drops matches
+ * that overlap the one before, searching again from its end where the
+ * worker's own matches were thrown off by it.
+ *
+ * While the workers run, the buffer must not change and its line index
+ * must be complete; both hold because the editor thread completes the
+ * index first and waits for them, and they only read it. Nor may they
+ * write to the display: their allocations fail quietly, and the editor
+ * thread reports it once they are done.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "estruct.h"
+#include "edef.h"
+#include "efunc.h"
+#include "line.h"
+#include "line_index.h"
+#include "memory.h"
+#include "literal_scan.h"
+#include "nfa.h"
+#include "search_parallel.h"
+
+struct chunk {
+    struct line *first;         /* first line of the chunk */
+    struct line *end;           /* first line after it */
+    long endline;               /* ... and its number */
+    struct line *head;          /* searches stop here, past lines matches run into */
+    struct psearch_result r;    /* matches starting in the chunk */
+    bool nomem;
+};
+
+struct job {
+    struct buffer *bp;
+    const struct literal_scan *ls;  /* the literal pattern, NULL for MAGIC */
+    int spans;                      /* newlines in the literal pattern */
+    bool keep;                      /* keep the matches, not only count them */
+    struct chunk *chunk;
+    int nchunks;
+    atomic_int next;                /* next chunk to hand out */
+};
+
+struct worker {
+    struct job *job;
+    nfa_program *prog;
+    pthread_t tid;
+};
+
+int psearch_threads(void)
+{
+    const char *env = getenv("UEMACS_SEARCH_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        n = 1;
+    return n > PSEARCH_MAX_THREADS ? PSEARCH_MAX_THREADS : (int)n;
+}
+
+bool psearch_add(struct psearch_result *res, const struct psearch_match *pm)
+{
+    if ((size_t)res->count == res->room) {
+        size_t nroom = res->room ? res->room * 2 : 64;
+        struct psearch_match *nm = safe_realloc(res->match, nroom * sizeof(*nm),
+                                                "parallel search matches");
+        if (!nm)
+            return false;
+        res->match = nm;
+        res->room = nroom;
+    }
+    res->match[res->count++] = *pm;
+    return true;
+}
+
+static bool record(struct job *j, struct chunk *c, struct line *lp, int off,
+                   struct line *elp, int eoff)
+{
+    struct psearch_match pm;
+
+    if (!j->keep) {
+        c->r.count++;
+        return true;
+    }
+    pm.lp = lp;
+    pm.line = lindex_peek(j->bp, lp);
+    pm.off = off;
+    pm.elp = elp;
+    pm.eoff = eoff;
+    if (!psearch_add(&c->r, &pm)) {
+        c->nomem = true;
+        return false;
+    }
+    return true;
+}
+
+/* Whether "lp" is one of the lines searched past the end of chunk "c" */
+static bool past_end(const struct chunk *c, const struct line *lp)
+{
+    for (struct line *x = c->end; x != c->head; x = lforw(x)) {
+        if (x == lp)
+            return true;
+    }
+    return false;
+}
+
+struct literal_walk {
+    struct job *job;
+    struct chunk *chunk;
+};
+
+static bool literal_found(void *arg, struct line *mlp, int moff, struct line *elp, int eoff)
+{
+    struct literal_walk *lw = arg;
+
+    return !past_end(lw->chunk, mlp) && record(lw->job, lw->chunk, mlp, moff, elp, eoff);
+}
+
+static void scan_literal(struct job *j, struct chunk *c)
+{
+    struct literal_walk lw = { j, c };
+
+    if (!lscan_search_all(j->ls, c->first, 0, c->head, literal_found, &lw))
+        c->nomem = true;
+}
+
+#ifdef ENABLE_SEARCH_NFA
+static void scan_nfa(struct job *j, nfa_program *prog, struct chunk *c)
+{
+    struct line *lp = c->first;
+    int off = 0;
+    struct line *mlp;
+    int ms, me;
+
+    while (lp != c->end && nfa_search_match_until(prog, lp, off, c->end, &mlp, &ms, &me)) {
+        if (!record(j, c, mlp, ms, mlp, me))
+            return;
+        /* Step over an empty match, or it is found again */
+        lp = mlp;
+        off = me > ms ? me : me + 1;
+        if (off > llength(lp)) {
+            lp = lforw(lp);
+            off = 0;
+        }
+    }
+}
+#endif
+
+static void work(struct worker *w)
+{
+    struct job *j = w->job;
+    int i;
+
+    while ((i = atomic_fetch_add(&j->next, 1)) < j->nchunks) {
+        if (j->ls)
+            scan_literal(j, &j->chunk[i]);
+#ifdef ENABLE_SEARCH_NFA
+        else
+            scan_nfa(j, w->prog, &j->chunk[i]);
+#endif
+    }
+}
+
+static void *work_thread(void *arg)
+{
+    memory_quiet(true);
+    work(arg);
+    lscan_release();
+    return NULL;
+}
+
+static inline bool before(const struct psearch_match *m, long line, int off)
+{
+    return m->line < line || (m->line == line && m->off < off);
+}
+
+/* Joining the matches of the chunks: where the last one kept ends */
+struct joint {
+    struct job *job;
+    struct psearch_result *res;
+    struct chunk *chunk;        /* chunk being joined */
+    long k;                     /* its next match not yet dropped or kept */
+    struct line *lp;            /* end of the last match kept */
+    int off;
+    long line;
+    bool nomem;
+};
+
+static bool keep_match(struct joint *jt, const struct psearch_match *pm)
+{
+    if (!psearch_add(jt->res, pm)) {
+        jt->nomem = true;
+        return false;
+    }
+    jt->lp = pm->elp;
+    jt->off = pm->eoff;
+    jt->line = pm->line + jt->job->spans;
+    return true;
+}
+
+/* A match found searching on from the last one kept, until back in step */
+static bool joint_found(void *arg, struct line *mlp, int moff, struct line *elp, int eoff)
+{
+    struct joint *jt = arg;
+    const struct chunk *c = jt->chunk;
+    struct psearch_match pm = { mlp, 0, moff, elp, eoff };
+
+    if (past_end(c, mlp))
+        return false;
+    pm.line = lindex_number(jt->job->bp, mlp);
+    while (jt->k < c->r.count && before(&c->r.match[jt->k], pm.line, pm.off))
+        jt->k++;
+    if (jt->k < c->r.count && c->r.match[jt->k].line == pm.line &&
+        c->r.match[jt->k].off == pm.off)
+        return false;       /* back in step with the worker */
+    return keep_match(jt, &pm);
+}
+
+/*
+ * Join the matches of the chunks in order into res->match. A match that
+ * starts inside the one kept before it is dropped; as the worker went on
+ * from the dropped one, the search is taken up again from the end of the
+ * kept match until it meets the worker's matches again.
+ */
+static bool stitch(struct job *j, struct psearch_result *res)
+{
+    struct joint jt = { .job = j, .res = res };
+
+    for (int i = 0; i < j->nchunks; i++) {
+        struct chunk *c = &j->chunk[i];
+
+        jt.chunk = c;
+        jt.k = 0;
+        while (jt.k < c->r.count && before(&c->r.match[jt.k], jt.line, jt.off))
+            jt.k++;
+        if (jt.k > 0 && jt.line < c->endline) {
+            if (!lscan_search_all(j->ls, jt.lp, jt.off, c->head, joint_found, &jt) || jt.nomem)
+                return false;
+            /* Drop what the worker found inside the last match kept */
+            while (jt.k < c->r.count && before(&c->r.match[jt.k], jt.line, jt.off))
+                jt.k++;
+        }
+        for (; jt.k < c->r.count; jt.k++) {
+            if (!keep_match(&jt, &c->r.match[jt.k]))
+                return false;
+        }
+    }
+    return true;
+}
+
+int psearch_buffer(struct buffer *bp, const char *pattern, bool magic,
+                   bool case_sensitive, bool list, struct psearch_result *res)
+{
+    struct literal_scan ls;
+    struct job j = { .bp = bp };
+    struct worker *w = NULL;
+    struct line *first;
+    long nlines;
+    int nworkers, spawned = 0;
+    int status = TRUE;
+    int len;
+
+    memset(res, 0, sizeof(*res));
+    len = (int)strlen(pattern);
+    if (!magic) {
+        if (lscan_init(&ls, (const unsigned char *)pattern, len, case_sensitive) != 0)
+            return ABORT;
+        j.ls = &ls;
+        for (int i = 0; i < len; i++)
+            j.spans += pattern[i] == '\n';
+    } else {
+#ifndef ENABLE_SEARCH_NFA
+        return ABORT;
+#endif
+    }
+    j.keep = list || j.spans > 0;
+
+    /* Chunk bounds and match line numbers come from the line index;
+       the workers only walk lines, so every line must be built first */
+    if (!lbuildall(bp) || !lindex_complete(bp))
+        return FALSE;
+    nlines = lindex_count(bp);
+    first = lforw(bp->b_linep);
+
+    nworkers = nlines < PSEARCH_MIN_LINES ? 1 : psearch_threads();
+    j.nchunks = nworkers == 1 ? 1 : nworkers * PSEARCH_CHUNKS;
+    j.chunk = safe_alloc(j.nchunks * sizeof(struct chunk), "parallel search chunks",
+                         __FILE__, __LINE__);
+    w = safe_alloc(nworkers * sizeof(struct worker), "parallel search workers",
+                   __FILE__, __LINE__);
+    if (!j.chunk || !w) {
+        status = FALSE;
+        goto out;
+    }
+    for (int i = 0; i < j.nchunks; i++) {
+        struct chunk *c = &j.chunk[i];
+
+        c->first = i == 0 ? first : j.chunk[i - 1].end;
+        c->endline = i == j.nchunks - 1 ? nlines + 1 : 1 + nlines * (i + 1) / j.nchunks;
+        c->end = lindex_line(bp, c->endline);
+        c->head = c->end;
+        for (int s = 0; s < j.spans && c->head != bp->b_linep; s++)
+            c->head = lforw(c->head);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        w[i].job = &j;
+#ifdef ENABLE_SEARCH_NFA
+        if (magic && !(w[i].prog = nfa_program_new(pattern, case_sensitive))) {
+            status = i == 0 ? ABORT : FALSE;
+            goto out;
+        }
+#endif
+    }
+
+    /* Settle the kernel before the workers would race to pick it */
+    lscan_kernel_name();
+    atomic_init(&j.next, 0);
+    for (spawned = 1; spawned < nworkers; spawned++) {
+        if (pthread_create(&w[spawned].tid, NULL, work_thread, &w[spawned]) != 0)
+            break;      /* The threads there are share the work */
+    }
+    /* The editor thread works its share quietly too, and speaks for all */
+    memory_quiet(true);
+    work(&w[0]);
+    memory_quiet(false);
+    for (int i = 1; i < spawned; i++)
+        pthread_join(w[i].tid, NULL);
+    res->threads = spawned;
+
+    for (int i = 0; i < j.nchunks; i++) {
+        if (j.chunk[i].nomem)
+            status = FALSE;
+    }
+    if (status != TRUE) {
+        mlwrite("(OUT OF MEMORY: parallel search)");
+        goto out;
+    }
+    if (j.spans > 0) {
+        if (!stitch(&j, res))
+            status = FALSE;
+    } else if (list) {
+        for (int i = 0; i < j.nchunks && status == TRUE; i++) {
+            for (long k = 0; k < j.chunk[i].r.count && status == TRUE; k++) {
+                if (!psearch_add(res, &j.chunk[i].r.match[k]))
+                    status = FALSE;
+            }
+        }
+    } else {
+        for (int i = 0; i < j.nchunks; i++)
+            res->count += j.chunk[i].r.count;
+    }
+    if (!list) {
+        SAFE_FREE(res->match);
+        res->room = 0;
+    }
+
+out:
+    if (j.chunk) {
+        for (int i = 0; i < j.nchunks; i++)
+            psearch_free(&j.chunk[i].r);
+        SAFE_FREE(j.chunk);
+    }
+    if (w) {
+#ifdef ENABLE_SEARCH_NFA
+        for (int i = 0; i < nworkers; i++)
+            nfa_program_free(w[i].prog);
+#endif
+        SAFE_FREE(w);
+    }
+    if (status != TRUE) {
+        psearch_free(res);
+        res->threads = 0;
+    }
+    return status;
+}
+
+void psearch_free(struct psearch_result *res)
+{
+    SAFE_FREE(res->match);
+    res->count = 0;
+    res->room = 0;
+}
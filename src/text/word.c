@@ -137,6 +137,7 @@ int upperword(int f, int n)
 #endif
 				c -= 'a' - 'A';
 				lputc(curwp->w_dotp, curwp->w_doto, c);
+				lsync(curwp->w_dotp, curwp->w_doto, 1);
 				lchange(WFHARD);
 			}
 			if (forwchar(FALSE, 1) == FALSE)
@@ -173,6 +174,7 @@ int lowerword(int f, int n)
 #endif
 				c += 'a' - 'A';
 				lputc(curwp->w_dotp, curwp->w_doto, c);
+				lsync(curwp->w_dotp, curwp->w_doto, 1);
 				lchange(WFHARD);
 			}
 			if (forwchar(FALSE, 1) == FALSE)
@@ -210,6 +212,7 @@ int capword(int f, int n)
 #endif
 				c -= 'a' - 'A';
 				lputc(curwp->w_dotp, curwp->w_doto, c);
+				lsync(curwp->w_dotp, curwp->w_doto, 1);
 				lchange(WFHARD);
 			}
 			if (forwchar(FALSE, 1) == FALSE)
@@ -224,6 +227,7 @@ int capword(int f, int n)
 					c += 'a' - 'A';
 					lputc(curwp->w_dotp, curwp->w_doto,
 					      c);
+					lsync(curwp->w_dotp, curwp->w_doto, 1);
 					lchange(WFHARD);
 				}
 				if (forwchar(FALSE, 1) == FALSE)
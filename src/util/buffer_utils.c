@@ -11,6 +11,7 @@
 #include "edef.h"
 #include "efunc.h"
 #include "line.h"
+#include "line_index.h"
 #include "buffer_utils.h"
 
 // Buffer utility functions - consolidates common patterns
@@ -96,27 +97,15 @@ bool line_is_whitespace_only(struct line* lp) {
 struct line* find_line_number(struct buffer* bp, int line_num) {
     if (!bp || line_num < 1) return NULL;
     
-    int current_line = 1;
-    FOR_EACH_LINE_IN_BUFFER(lp, bp) {
-        if (current_line == line_num) {
-            return lp;
-        }
-        current_line++;
-    }
-    return NULL;
+    struct line* lp = lindex_line(bp, line_num);
+    return lp == bp->b_linep ? NULL : lp;
 }
 
 int get_line_number(struct buffer* bp, struct line* target_lp) {
     if (!bp || !target_lp) return -1;
     
-    int line_num = 1;
-    FOR_EACH_LINE_IN_BUFFER(lp, bp) {
-        if (lp == target_lp) {
-            return line_num;
-        }
-        line_num++;
-    }
-    return -1; // Not found
+    long line_num = lindex_number(bp, target_lp);
+    return line_num > 0 ? (int)line_num : -1; // Not found
 }
 
 // Window utility functions
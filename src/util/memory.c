@@ -11,66 +11,158 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "estruct.h"
 #include "edef.h"
 #include "efunc.h"
 #include "memory.h"
 
-/* Memory allocation tracking for debugging */
+/*
+ * Memory allocation tracking for debugging. Live blocks are kept in an
+ * open-addressed hash table keyed by pointer (linear probing, deletion by
+ * backward shift), so tracking and untracking cost O(1) however many lines
+ * a buffer holds. Builds without ENABLE_MEMORY_TRACKING skip it entirely;
+ * UEMACS_MEMTRACK=0 turns it off at run time. The table is behind a mutex
+ * because the parallel search workers allocate too.
+ */
 typedef struct alloc_record {
-    void* ptr;
+    void* ptr;              /* NULL marks an empty slot */
     size_t size;
     const char* context;
     const char* file;
     int line;
-    struct alloc_record* next;
 } alloc_record_t;
 
-static alloc_record_t* allocation_list = NULL;
+#define ALLOC_TABLE_MIN 1024    /* Initial slots, a power of two */
+
+/* Failures go unreported on threads that must not touch the display */
+static _Thread_local bool alloc_quiet;
+
+/* Set for the calling thread whether a failed allocation writes a message */
+void memory_quiet(bool quiet) {
+    alloc_quiet = quiet;
+}
+
+static alloc_record_t* alloc_table = NULL;
+static size_t alloc_table_size = 0;
 static size_t total_allocated = 0;
 static size_t peak_allocated = 0;
 static size_t allocation_count = 0;
 
-/* Thread-safe allocation tracking (basic protection) */
+#ifdef ENABLE_MEMORY_TRACKING
+static bool tracking_state;
+static pthread_once_t tracking_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tracking_init(void) {
+    const char* env = getenv("UEMACS_MEMTRACK");
+    tracking_state = !(env && strcmp(env, "0") == 0);
+}
+
+/* UEMACS_MEMTRACK is read once, whichever thread allocates first */
+static bool tracking_enabled(void) {
+    pthread_once(&tracking_once, tracking_init);
+    return tracking_state;
+}
+
+static inline size_t alloc_slot(const void* ptr, size_t mask) {
+    uintptr_t h = (uintptr_t)ptr >> 4;  /* Low bits are alignment */
+    h *= (uintptr_t)0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> (sizeof(uintptr_t) * 4)) & mask;
+}
+
+/* Double the table (or create it); FALSE if there is no memory for it. */
+static bool grow_alloc_table(void) {
+    size_t nsize = alloc_table_size ? alloc_table_size * 2 : ALLOC_TABLE_MIN;
+    alloc_record_t* ntable = calloc(nsize, sizeof(alloc_record_t));
+    if (!ntable) return false;
+
+    for (size_t i = 0; i < alloc_table_size; i++) {
+        if (!alloc_table[i].ptr) continue;
+        size_t j = alloc_slot(alloc_table[i].ptr, nsize - 1);
+        while (ntable[j].ptr)
+            j = (j + 1) & (nsize - 1);
+        ntable[j] = alloc_table[i];
+    }
+    free(alloc_table);
+    alloc_table = ntable;
+    alloc_table_size = nsize;
+    return true;
+}
+
 static void track_allocation(void* ptr, size_t size, const char* context, const char* file, int line) {
-    if (!ptr) return;
-    
-    alloc_record_t* record = malloc(sizeof(alloc_record_t));
-    if (!record) return;  /* Can't track, but allocation succeeded */
-    
+    if (!ptr || !tracking_enabled()) return;
+
+    pthread_mutex_lock(&alloc_lock);
+    /* Keep the load factor under 3/4 so probe runs stay short */
+    if ((allocation_count + 1) * 4 > alloc_table_size * 3 && !grow_alloc_table()) {
+        pthread_mutex_unlock(&alloc_lock);
+        return;  /* Can't track, but allocation succeeded */
+    }
+
+    size_t mask = alloc_table_size - 1;
+    size_t i = alloc_slot(ptr, mask);
+    while (alloc_table[i].ptr)
+        i = (i + 1) & mask;
+
+    alloc_record_t* record = &alloc_table[i];
     record->ptr = ptr;
     record->size = size;
     record->context = context;
     record->file = file;
     record->line = line;
-    record->next = allocation_list;
-    allocation_list = record;
-    
+
     total_allocated += size;
     allocation_count++;
-    
+
     if (total_allocated > peak_allocated) {
         peak_allocated = total_allocated;
     }
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-static void untrack_allocation(void* ptr) {
-    if (!ptr) return;
-    
-    alloc_record_t** current = &allocation_list;
-    while (*current) {
-        if ((*current)->ptr == ptr) {
-            alloc_record_t* to_free = *current;
-            total_allocated -= to_free->size;
-            allocation_count--;
-            *current = to_free->next;
-            free(to_free);
-            return;
+/* Forget "ptr", copying its record to "out" if given; FALSE if untracked. */
+static bool untrack_allocation(void* ptr, alloc_record_t* out) {
+    if (!ptr || !alloc_table) return false;
+
+    pthread_mutex_lock(&alloc_lock);
+    size_t mask = alloc_table_size - 1;
+    size_t i = alloc_slot(ptr, mask);
+    while (alloc_table[i].ptr != ptr) {
+        if (!alloc_table[i].ptr) {
+            pthread_mutex_unlock(&alloc_lock);
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    if (out) *out = alloc_table[i];
+    total_allocated -= alloc_table[i].size;
+    allocation_count--;
+
+    /* Pull later entries of the probe run back over the hole */
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; alloc_table[j].ptr; j = (j + 1) & mask) {
+        size_t home = alloc_slot(alloc_table[j].ptr, mask);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            alloc_table[hole] = alloc_table[j];
+            hole = j;
         }
-        current = &(*current)->next;
     }
+    alloc_table[hole].ptr = NULL;
+    pthread_mutex_unlock(&alloc_lock);
+    return true;
+}
+#else
+static inline void track_allocation(void* ptr, size_t size, const char* context, const char* file, int line) {
+    (void)ptr; (void)size; (void)context; (void)file; (void)line;
+}
+
+static inline bool untrack_allocation(void* ptr, alloc_record_t* out) {
+    (void)ptr; (void)out;
+    return false;
 }
+#endif
 
 /* Safe allocation with error reporting */
 void* safe_alloc(size_t size, const char* context, const char* file, int line) {
@@ -80,14 +172,16 @@ void* safe_alloc(size_t size, const char* context, const char* file, int line) {
     }
     
     if (size > SIZE_MAX / 2) {
-        mlwrite("(ALLOCATION TOO LARGE: %s)", context ? context : "unknown");
+        if (!alloc_quiet)
+            mlwrite("(ALLOCATION TOO LARGE: %s)", context ? context : "unknown");
         return NULL;
     }
     
     /* Use calloc for zero-initialized memory */
     void* ptr = calloc(1, size);
     if (!ptr) {
-        mlwrite("(OUT OF MEMORY: %s - %zu bytes)", context ? context : "unknown", size);
+        if (!alloc_quiet)
+            mlwrite("(OUT OF MEMORY: %s - %zu bytes)", context ? context : "unknown", size);
         return NULL;
     }
     
@@ -99,33 +193,34 @@ void* safe_alloc(size_t size, const char* context, const char* file, int line) {
 void* safe_realloc(void* old_ptr, size_t new_size, const char* context) {
     if (new_size == 0) {
         if (old_ptr) {
-            untrack_allocation(old_ptr);
+            untrack_allocation(old_ptr, NULL);
             free(old_ptr);
         }
         return NULL;
     }
     
     if (new_size > SIZE_MAX / 2) {
-        mlwrite("(REALLOCATION TOO LARGE: %s)", context ? context : "unknown");
+        if (!alloc_quiet)
+            mlwrite("(REALLOCATION TOO LARGE: %s)", context ? context : "unknown");
         return NULL;
     }
 
-    // Untrack the old pointer before reallocating
-    if (old_ptr) {
-        untrack_allocation(old_ptr);
-    }
+    // Untrack the old pointer before reallocating, keeping where it came from
+    alloc_record_t old = { .file = __FILE__, .line = __LINE__ };
+    bool tracked = old_ptr && untrack_allocation(old_ptr, &old);
     
     void* new_ptr = realloc(old_ptr, new_size);
     if (!new_ptr) {
-        mlwrite("(OUT OF MEMORY: %s - %zu bytes)", context ? context : "unknown", new_size);
-        // If realloc fails, the original block is untouched. We should re-track it.
-        if (old_ptr) {
-            track_allocation(old_ptr, 0, "realloc-fail", __FILE__, __LINE__); // Size is unknown here, but it's better to track it
+        if (!alloc_quiet)
+            mlwrite("(OUT OF MEMORY: %s - %zu bytes)", context ? context : "unknown", new_size);
+        // If realloc fails, the original block is untouched. Re-track it as it was.
+        if (tracked) {
+            track_allocation(old_ptr, old.size, old.context, old.file, old.line);
         }
         return NULL;
     }
     
-    track_allocation(new_ptr, new_size, context, __FILE__, __LINE__);
+    track_allocation(new_ptr, new_size, context, old.file, old.line);
     
     return new_ptr;
 }
@@ -134,41 +229,58 @@ void* safe_realloc(void* old_ptr, size_t new_size, const char* context) {
 void safe_free(void** ptr) {
     if (!ptr || !*ptr) return;
     
-    untrack_allocation(*ptr);
+    untrack_allocation(*ptr, NULL);
     free(*ptr);
     *ptr = NULL;  /* Prevent double-free */
 }
 
 /* Allocation report for debugging */
 void memory_report(void) {
+#ifdef ENABLE_MEMORY_TRACKING
+    if (!tracking_enabled()) {
+        mlwrite("Memory: tracking disabled (UEMACS_MEMTRACK=0)");
+        return;
+    }
+#else
+    mlwrite("Memory: tracking not built in");
+    return;
+#endif
     mlwrite("Memory: %zu bytes allocated (%zu peak) in %zu blocks", 
             total_allocated, peak_allocated, allocation_count);
     
-    if (allocation_list) {
+    if (allocation_count) {
         mlwrite("Memory leaks detected:");
-        alloc_record_t* current = allocation_list;
         int leak_count = 0;
-        while (current && leak_count < 10) {  /* Limit output */
+        size_t i;
+        for (i = 0; i < alloc_table_size && leak_count < 10; i++) {  /* Limit output */
+            alloc_record_t* current = &alloc_table[i];
+            if (!current->ptr) continue;
             mlwrite("  Leak: %zu bytes at %s:%d (%s)", 
                     current->size, current->file, current->line, 
                     current->context ? current->context : "unknown");
-            current = current->next;
             leak_count++;
         }
-        if (current) {
+        if ((size_t)leak_count < allocation_count) {
             mlwrite("  ... and more");
         }
     }
 }
 
+/* Live tracked blocks and their total size */
+void memory_usage(size_t* bytes, size_t* blocks) {
+    if (bytes) *bytes = total_allocated;
+    if (blocks) *blocks = allocation_count;
+}
+
 /* Cleanup all tracked allocations (for shutdown) */
 void memory_cleanup(void) {
-    while (allocation_list) {
-        alloc_record_t* next = allocation_list->next;
-        free(allocation_list->ptr);
-        free(allocation_list);
-        allocation_list = next;
+    for (size_t i = 0; i < alloc_table_size; i++) {
+        if (alloc_table[i].ptr)
+            free(alloc_table[i].ptr);
     }
+    free(alloc_table);
+    alloc_table = NULL;
+    alloc_table_size = 0;
     total_allocated = 0;
     allocation_count = 0;
 }
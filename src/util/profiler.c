@@ -10,6 +10,7 @@
 #include "edef.h"
 #include "efunc.h"
 #include "memory.h"
+#include "profiler.h"
 
 typedef struct perf_timer {
     const char* operation;
@@ -19,6 +20,8 @@ typedef struct perf_timer {
     struct perf_timer* next;
 } perf_timer_t;
 
+#define PERF_LATENCY_SAMPLES 4096     /* the most recent are kept */
+
 typedef struct perf_counters {
     uint64_t memory_allocated;
     uint64_t memory_peak;
@@ -28,6 +31,14 @@ typedef struct perf_counters {
     uint64_t display_updates;
     uint64_t file_reads;
     uint64_t file_writes;
+    uint64_t frames;            /* frames written to the terminal */
+    uint64_t frame_bytes;       /* ... their bytes */
+    uint64_t frame_writes;      /* ... and write() calls */
+    uint64_t frame_max;         /* largest frame */
+    uint64_t latency_count;     /* frames that showed a key ... */
+    uint64_t latency_max;       /* ... the longest key to screen, ns */
+    uint32_t latency_us[PERF_LATENCY_SAMPLES];
+    uint64_t deferred;          /* updates folded into a later frame */
     struct timespec start_time;
     perf_timer_t* timers;
 } perf_counters_t;
@@ -96,6 +107,36 @@ void perf_count_file_write(void) {
     perf_stats.file_writes++;
 }
 
+void perf_count_frame(size_t bytes, int writes) {
+    if (!perf_enabled) return;
+    perf_stats.frames++;
+    perf_stats.frame_bytes += bytes;
+    perf_stats.frame_writes += writes;
+    if (bytes > perf_stats.frame_max) {
+        perf_stats.frame_max = bytes;
+    }
+}
+
+void perf_count_latency(uint64_t ns) {
+    if (!perf_enabled) return;
+    uint64_t us = ns / 1000;
+    perf_stats.latency_us[perf_stats.latency_count++ % PERF_LATENCY_SAMPLES] =
+        us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    if (ns > perf_stats.latency_max) {
+        perf_stats.latency_max = ns;
+    }
+}
+
+void perf_count_deferred(void) {
+    if (!perf_enabled) return;
+    perf_stats.deferred++;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
 void perf_start_timing(const char* operation) {
     if (!perf_enabled) return;
     
@@ -142,6 +183,19 @@ void perf_report(void) {
     mlwrite("Display updates: %llu", perf_stats.display_updates);
     mlwrite("File reads: %llu", perf_stats.file_reads);
     mlwrite("File writes: %llu", perf_stats.file_writes);
+    mlwrite("Frames: %llu, %llu bytes (largest %llu) in %llu writes", perf_stats.frames,
+            perf_stats.frame_bytes, perf_stats.frame_max, perf_stats.frame_writes);
+    if (perf_stats.latency_count > 0) {
+        static uint32_t sorted[PERF_LATENCY_SAMPLES];
+        size_t n = perf_stats.latency_count < PERF_LATENCY_SAMPLES ?
+                   perf_stats.latency_count : PERF_LATENCY_SAMPLES;
+        memcpy(sorted, perf_stats.latency_us, n * sizeof(sorted[0]));
+        qsort(sorted, n, sizeof(sorted[0]), cmp_u32);
+        mlwrite("Key to screen: %llu frames, p50 %u us, p99 %u us, max %llu us",
+                perf_stats.latency_count, sorted[n / 2], sorted[n * 99 / 100],
+                perf_stats.latency_max / 1000);
+    }
+    mlwrite("Updates deferred: %llu", perf_stats.deferred);
     
     mlwrite("=== Timing Details ===");
     perf_timer_t* timer = perf_stats.timers;
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "internal/estruct.h"
 #include "internal/edef.h"
 #include "internal/line.h"
+#include "internal/line_index.h"
 #include "internal/efunc.h"
+#include "μemacs/display_matrix.h"
 
 // Profiler API
 void perf_init(void);
@@ -29,6 +33,7 @@ static double now_sec(void) {
 int main(void) {
     perf_init();
     init_editor_minimal("bench-editor");
+    vtinit();   // update() draws into the virtual screens
     bclear(curbp);
     curbp->b_mode &= ~MDVIEW;
 
@@ -58,13 +63,84 @@ int main(void) {
     for (int i = 0; i < insert_chars; ++i) linsert(1, 'a' + (i % 26));
     double t3 = now_sec();
 
+    // Measure full redraws with a 10k-line selection active
+    // (lines are linked by hand: linsert() would swamp the profiler)
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    const int sel_lines = 10000;
+    const int plen = (int)strlen(payload);
+    for (int i = 0; i < sel_lines; ++i) {
+        struct line* lp = lalloc(curbp, plen);
+        if (!lp) return 1;
+        memcpy(lp->l_text, payload, plen);
+        lp->l_bp = lback(curbp->b_linep); lp->l_fp = curbp->b_linep;
+        lback(curbp->b_linep)->l_fp = lp; curbp->b_linep->l_bp = lp;
+        lindex_link(curbp, lp);
+    }
+    curwp->w_markp = lforw(curbp->b_linep); curwp->w_marko = 3;
+    curwp->w_dotp = lback(curbp->b_linep); curwp->w_doto = 0;
+    curwp->w_linep = curwp->w_dotp;
+    for (int i = 0; i < sel_lines / 2; ++i) curwp->w_linep = lback(curwp->w_linep);
+    curwp->w_force = 0;
+    double t4 = now_sec();
+    for (int i = 0; i < iters; ++i) {
+        curwp->w_flag |= WFHARD;
+        update(TRUE);
+    }
+    double t5 = now_sec();
+    curwp->w_markp = NULL;
+
+    // Measure loading and dropping the bundled Poe text 100 times over
+    const char* big_file = "/tmp/uemacs_bench_load.txt";
+    const int copies = 100;
+    double load_ms = -1, clear_ms = -1, load_mb = 0;
+    FILE* src = fopen(UEMACS_SOURCE_DIR "/tests/data/poe-collected-works.txt", "rb");
+    FILE* dst = fopen(big_file, "wb");
+    if (src && dst) {
+        static char block[1 << 16];
+        size_t n, total = 0;
+        char* text = NULL;
+        while ((n = fread(block, 1, sizeof(block), src)) > 0) {
+            char* grown = realloc(text, total + n);
+            if (!grown) break;
+            text = grown;
+            memcpy(text + total, block, n);
+            total += n;
+        }
+        for (int i = 0; i < copies && text; ++i) fwrite(text, 1, total, dst);
+        free(text);
+        load_mb = (double)total * copies / (1024.0 * 1024.0);
+    }
+    if (src) fclose(src);
+    if (dst) {
+        fclose(dst);
+        curbp->b_flag &= ~BFCHG;
+        double t6 = now_sec();
+        readin(big_file, FALSE);
+        double t7 = now_sec();
+        curbp->b_flag &= ~BFCHG;
+        bclear(curbp);
+        double t8 = now_sec();
+        load_ms = (t7 - t6) * 1000.0;
+        clear_ms = (t8 - t7) * 1000.0;
+        unlink(big_file);
+    }
+
     printf("Redraw iterations: %d time: %.3f ms\n", iters, (t1 - t0) * 1000.0);
     printf("Insert chars: %d time: %.3f ms\n", insert_chars, (t3 - t2) * 1000.0);
+    printf("Selection redraws: %d (%d lines selected) time: %.3f ms\n",
+           iters, sel_lines, (t5 - t4) * 1000.0);
+    printf("Load poe x%d: %.1f MB read %.3f ms (%.0f MB/s), cleared %.3f ms\n",
+           copies, load_mb, load_ms, load_ms > 0 ? load_mb / (load_ms / 1000.0) : 0.0, clear_ms);
 
     // Print profiler results (timings for insert, update, scroll, etc.)
     perf_report();
 
     // Print display matrix stats (redraw/dirty region telemetry)
+    size_t cells_updated, partial_redraws, full_redraws;
+    display_matrix_get_stats(&cells_updated, &partial_redraws, &full_redraws);
+    printf("Display cells updated: %zu in %zu partial + %zu full redraws\n",
+           cells_updated, partial_redraws, full_redraws);
 #ifdef DEBUG
     extern void display_matrix_dump_stats(void);
     display_matrix_dump_stats();
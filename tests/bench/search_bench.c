@@ -1,12 +1,110 @@
+// Search-engine benchmark suite
+//
+// Runs a fixed set of searches over the bundled Poe corpus, repeated
+// --scale times into one buffer: literal (short, long, case-folded, no
+// match), cross-line, MAGIC on the NFA, backward, whole-buffer counts,
+// and patterns that are hard on a regex engine. A forward case searches
+// from the top to the bottom of the buffer match by match through
+// scanner(), as repeated searching does, a backward one from the bottom
+// up; each call is timed. Results go out as JSON: matches, MB/s over the
+// whole buffer, and the p50 and p99 latency of a single search.
+//
+// Each case is run --repeat times and keeps its best MB/s and latencies;
+// how far the runs spread is its noise. Cases that count the same matches
+// by other means (a sweep, one worker, all of them) are always checked to
+// agree. With --baseline, each result is also checked against the one of
+// the same name in a file this program wrote before (--json): fewer MB/s,
+// or a slower p50 or p99, by more than the tolerance plus the noise of
+// either run is a regression, as is a different count of matches. Any
+// regression makes the exit status 1, so "make bench" fails. Timings only
+// compare on the same machine and build, so the baseline is kept in the
+// build directory, by "make bench-baseline"; without one, only the counts
+// are checked.
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include "internal/estruct.h"
 #include "internal/edef.h"
 #include "internal/efunc.h"
 #include "internal/line.h"
+#include "internal/line_index.h"
+#include "internal/literal_scan.h"
+#include "internal/nfa.h"
+#include "internal/search_parallel.h"
+
+#ifndef UEMACS_SOURCE_DIR
+#define UEMACS_SOURCE_DIR "."
+#endif
+
+#define CORPUS          UEMACS_SOURCE_DIR "/tests/data/poe-collected-works.txt"
+#define DEFAULT_SCALE   8       // copies of the corpus in the buffer
+#define MIN_SECONDS     0.25    // each case runs at least this long
+#define MIN_RUNS        5       // ... and this many times over the buffer
+#define MAX_RUNS        200
+#define DEFAULT_TOL     0.30    // allowed loss against the baseline, beyond the noise
+#define DEFAULT_REPEAT  3       // runs of each case; the best of them counts
+#define SLACK_US        2.0     // latencies this close to the baseline always pass
+
+enum kind { LITERAL, MAGIC_NFA, COUNT_LITERAL, COUNT_MAGIC };
+
+struct bench_case {
+    const char* name;
+    const char* pattern;
+    enum kind kind;
+    int dir;            // FORWARD or REVERSE
+    bool exact;         // MDEXACT
+    int threads;        // COUNT_*: workers, 0 for as many as there are CPUs
+};
+
+static const struct bench_case cases[] = {
+    { "literal-short",      "the",                          LITERAL,   FORWARD, true,  0 },
+    { "literal-long",       "voice was that of a Frenchman", LITERAL,  FORWARD, true,  0 },
+    { "literal-fold",       "dUPIN",                        LITERAL,   FORWARD, false, 0 },
+    { "literal-miss",       "Zqxj",                         LITERAL,   FORWARD, true,  0 },
+    { "cross-line",         ",\n      the",                 LITERAL,   FORWARD, true,  0 },
+    { "reverse-literal",    "Dupin",                        LITERAL,   REVERSE, true,  0 },
+    { "magic-class",        "[Dd]upin",                     MAGIC_NFA, FORWARD, true,  0 },
+    { "magic-alternation",  "(Dupin|Frenchman|Morgue)s?",   MAGIC_NFA, FORWARD, true,  0 },
+    { "magic-wildcard",     "voice.*Frenchman",             MAGIC_NFA, FORWARD, true,  0 },
+    { "magic-fold",         "rue mor[a-z]+",                MAGIC_NFA, FORWARD, false, 0 },
+    { "magic-bounded",      "[0-9]{4}",                     MAGIC_NFA, FORWARD, true,  0 },
+    { "reverse-magic",      "Fren[a-z]+",                   MAGIC_NFA, REVERSE, true,  0 },
+    { "count-literal-1t",   "the",                          COUNT_LITERAL, FORWARD, true, 1 },
+    { "count-literal",      "the",                          COUNT_LITERAL, FORWARD, true, 0 },
+    { "count-magic",        "[Dd]upin",                     COUNT_MAGIC,   FORWARD, true, 0 },
+    // Hard on backtracking matchers, or on the lazy DFA's cache
+    { "patho-nested",       "(x+x+)+y",                     MAGIC_NFA, FORWARD, true,  0 },
+    { "patho-alternation",  "(a|aa)*b{3}",                  MAGIC_NFA, FORWARD, true,  0 },
+    { "patho-stars",        ".*.*.*=q",                     MAGIC_NFA, FORWARD, true,  0 },
+    { "patho-dfa-blowup",   "e.{12}q",                      MAGIC_NFA, FORWARD, true,  0 },
+};
+
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+// Cases that must find the same number of matches, whatever the timings
+static const char* const same_count[][2] = {
+    { "literal-short",  "count-literal-1t" },
+    { "literal-short",  "count-literal" },
+    { "magic-class",    "count-magic" },
+};
+
+struct result {
+    long matches;
+    long calls;
+    double mb_per_s;
+    double p50_us;
+    double p99_us;
+    double noise;       // spread of MB/s between the runs, as a fraction
+};
+
+// Latencies of single searches, in nanoseconds
+struct samples {
+    double* ns;
+    size_t n, room;
+};
 
 static void init_editor_minimal(const char* name) {
     term.t_nrow = 24 - 1;
@@ -17,57 +115,374 @@ static void init_editor_minimal(const char* name) {
     varinit();
 }
 
-static double now_sec(void) {
-    struct timeval tv; gettimeofday(&tv, NULL);
-    return tv.tv_sec + tv.tv_usec / 1e6;
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
 }
 
-int main(void) {
-    const int repeats = 2000; // modest count to keep runtime low
-    const int lines = 2000;   // generate a few thousand lines
+static void add_sample(struct samples* s, double ns) {
+    if (s->n == s->room) {
+        size_t nroom = s->room ? s->room * 2 : 4096;
+        double* nns = realloc(s->ns, nroom * sizeof(*nns));
+        if (!nns) return;
+        s->ns = nns;
+        s->room = nroom;
+    }
+    s->ns[s->n++] = ns;
+}
 
-    init_editor_minimal("bench-search");
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const struct samples* s, double p) {
+    if (s->n == 0) return 0;
+    size_t k = (size_t)(p * (s->n - 1) + 0.5);
+    return s->ns[k];
+}
+
+// The corpus "scale" times over as the lines of the current buffer; its
+// size in bytes, newlines included, or 0
+static size_t load_corpus(const char* path, int scale) {
+    FILE* f = fopen(path, "rb");
+    char* text;
+    long n;
+    size_t bytes = 0;
+
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = malloc(n + 1);
+    if (!text || fread(text, 1, n, f) != (size_t)n) {
+        fclose(f);
+        free(text);
+        return 0;
+    }
+    fclose(f);
+    if (n > 0 && text[n - 1] == '\n') n--;
+
+    curbp->b_flag &= ~BFCHG;
     bclear(curbp);
     curbp->b_mode &= ~MDVIEW;
+    // Lines are linked by hand: linsert() would take longer than the searches
+    for (int copy = 0; copy < scale; copy++) {
+        for (long i = 0; i <= n; ) {
+            char* nl = memchr(text + i, '\n', n - i);
+            int len = nl ? (int)(nl - (text + i)) : (int)(n - i);
+            struct line* lp = lalloc(curbp, len);
+            if (!lp) { free(text); return 0; }
+            memcpy(lp->l_text, text + i, len);
+            lp->l_bp = lback(curbp->b_linep); lp->l_fp = curbp->b_linep;
+            lback(curbp->b_linep)->l_fp = lp; curbp->b_linep->l_bp = lp;
+            lindex_link(curbp, lp);
+            bytes += len + 1;
+            i += len + 1;
+        }
+    }
+    free(text);
+    return bytes;
+}
+
+// Search the whole buffer once, match by match; returns the matches
+static long sweep(const struct bench_case* c, const char* arg, struct samples* s) {
+    long matches = 0;
+
+    if (c->dir == FORWARD) {
+        curwp->w_dotp = lforw(curbp->b_linep);
+        curwp->w_doto = 0;
+    } else {
+        curwp->w_dotp = lback(curbp->b_linep);
+        curwp->w_doto = llength(curwp->w_dotp);
+    }
+    for (;;) {
+        struct line* lp = curwp->w_dotp;
+        int off = curwp->w_doto;
+        double t0 = now_ns();
+        int found = scanner(arg, c->dir, c->dir == FORWARD ? PTEND : PTBEG);
+        add_sample(s, now_ns() - t0);
+        if (!found) break;
+        matches++;
+        // An empty match leaves "." where it was
+        if (curwp->w_dotp == lp && curwp->w_doto == off &&
+            (c->dir == FORWARD ? forwchar(FALSE, 1) : backchar(FALSE, 1)) != TRUE)
+            break;
+    }
+    return matches;
+}
+
+// Count every match in the buffer on the worker threads
+static long count_all(const struct bench_case* c, struct samples* s) {
+    struct psearch_result res = { 0 };
+    double t0 = now_ns();
+    psearch_buffer(curbp, c->pattern, c->kind == COUNT_MAGIC, c->exact, false, &res);
+    add_sample(s, now_ns() - t0);
+    return res.count;
+}
+
+static void run_once(const struct bench_case* c, size_t bytes, struct result* r) {
+    struct samples s = { 0 };
+    char arg[NPAT];
+    char nthreads[8];
+    const char* env = getenv("UEMACS_SEARCH_THREADS");
+    char* saved = env ? strdup(env) : NULL;
+    double total = 0;
+    int runs = 0;
+
+    memset(r, 0, sizeof(*r));
+    // Searching backward, scanner() is handed the pattern reversed
+    if (c->dir == REVERSE) rvstrcpy(arg, (char*)c->pattern);
+    else snprintf(arg, sizeof(arg), "%s", c->pattern);
+    curbp->b_mode &= ~(MDMAGIC | MDEXACT);
+    if (c->kind == MAGIC_NFA) curbp->b_mode |= MDMAGIC;
+    if (c->exact) curbp->b_mode |= MDEXACT;
+    if (c->kind == COUNT_LITERAL || c->kind == COUNT_MAGIC) {
+        snprintf(nthreads, sizeof(nthreads), "%d", c->threads ? c->threads : psearch_threads());
+        setenv("UEMACS_SEARCH_THREADS", nthreads, 1);
+    }
+
+    while (runs < MAX_RUNS && (runs < MIN_RUNS || total < MIN_SECONDS * 1e9)) {
+        double t0 = now_ns();
+        if (c->kind == LITERAL || c->kind == MAGIC_NFA) r->matches = sweep(c, arg, &s);
+        else r->matches = count_all(c, &s);
+        total += now_ns() - t0;
+        runs++;
+    }
+
+    if (saved) { setenv("UEMACS_SEARCH_THREADS", saved, 1); free(saved); }
+    else unsetenv("UEMACS_SEARCH_THREADS");
+    curbp->b_mode &= ~(MDMAGIC | MDEXACT);
 
-    // Create a dataset of repeated lines with embedded patterns
-    const char* base = "The quick brown fox jumps over the lazy dog 12345 abcde xyz\n";
-    curwp->w_dotp = curbp->b_linep; curwp->w_doto = 0;
-    for (int i = 0; i < lines; ++i) {
-        for (const char* p = base; *p; ++p) linsert(1, *p);
-        lnewline();
+    qsort(s.ns, s.n, sizeof(double), cmp_double);
+    r->calls = (long)s.n;
+    r->mb_per_s = (double)bytes * runs / (total / 1e9) / 1e6;
+    r->p50_us = percentile(&s, 0.50) / 1e3;
+    r->p99_us = percentile(&s, 0.99) / 1e3;
+    free(s.ns);
+}
+
+// The best of "repeat" runs of the case, and how much they differed
+static void run_case(const struct bench_case* c, size_t bytes, int repeat, struct result* r) {
+    double worst = 0;
+
+    for (int i = 0; i < repeat; i++) {
+        struct result one;
+        run_once(c, bytes, &one);
+        if (i == 0) {
+            *r = one;
+            worst = one.mb_per_s;
+            continue;
+        }
+        if (one.matches != r->matches) r->matches = -1;    // not even the same answer
+        if (one.mb_per_s > r->mb_per_s) r->mb_per_s = one.mb_per_s;
+        if (one.mb_per_s < worst) worst = one.mb_per_s;
+        if (one.p50_us < r->p50_us) r->p50_us = one.p50_us;
+        if (one.p99_us < r->p99_us) r->p99_us = one.p99_us;
     }
+    r->noise = r->mb_per_s > 0 ? (r->mb_per_s - worst) / r->mb_per_s : 0;
+}
+
+static const struct result* find_result(const struct result* res, const char* name) {
+    for (size_t i = 0; i < NCASES; i++)
+        if (strcmp(cases[i].name, name) == 0)
+            return res[i].calls ? &res[i] : NULL;
+    return NULL;
+}
+
+static void json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if (*s == '\n') fputs("\\n", f);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
 
-    struct line* first = lforw(curbp->b_linep);
-    curwp->w_dotp = first; curwp->w_doto = 0;
+static const char* kind_name(enum kind k) {
+    return k == LITERAL ? "literal" : k == MAGIC_NFA ? "nfa" : "parallel";
+}
 
-    // Patterns for benchmarks
-    const char* pat4 = "abcd";   // short path
-    const char* pat5 = "abcde";  // BMH path
+// One result per line, so that read_baseline() need not parse JSON in general
+static void write_json(FILE* f, int scale, size_t bytes, long lines, const struct result* res) {
+    fprintf(f, "{\n  \"suite\": \"search\",\n  \"corpus\": \"poe-collected-works.txt\",\n");
+    fprintf(f, "  \"scale\": %d,\n  \"bytes\": %zu,\n  \"lines\": %ld,\n", scale, bytes, lines);
+    fprintf(f, "  \"kernel\": \"%s\",\n  \"threads\": %d,\n  \"results\": [\n",
+            lscan_kernel_name(), psearch_threads());
+    for (size_t i = 0; i < NCASES; i++) {
+        const struct bench_case* c = &cases[i];
+        fprintf(f, "    {\"name\": \"%s\", \"pattern\": ", c->name);
+        json_string(f, c->pattern);
+        fprintf(f, ", \"engine\": \"%s\", \"direction\": \"%s\", \"exact\": %s, "
+                   "\"matches\": %ld, \"calls\": %ld, \"mb_per_s\": %.2f, "
+                   "\"p50_us\": %.3f, \"p99_us\": %.3f, \"noise\": %.3f}%s\n",
+                kind_name(c->kind), c->dir == FORWARD ? "forward" : "reverse",
+                c->exact ? "true" : "false", res[i].matches, res[i].calls,
+                res[i].mb_per_s, res[i].p50_us, res[i].p99_us, res[i].noise,
+                i + 1 < NCASES ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+static bool json_number(const char* line, const char* key, double* v) {
+    char k[32];
+    const char* p;
+    snprintf(k, sizeof(k), "\"%s\":", key);
+    if (!(p = strstr(line, k))) return false;
+    *v = strtod(p + strlen(k), NULL);
+    return true;
+}
 
-    // Warmup
-    scanner(pat4, FORWARD, PTBEG);
-    scanner(pat5, FORWARD, PTBEG);
+// The baseline result for case "name", from a file write_json() wrote
+static bool read_baseline(FILE* f, int* scale, const char* name, struct result* r) {
+    char line[1024], key[96];
+    double v;
 
-    // Time short path
-    double t0 = now_sec();
-    for (int i = 0; i < repeats; ++i) {
-        curwp->w_dotp = first; curwp->w_doto = 0;
-        (void)scanner(pat4, FORWARD, PTBEG);
+    rewind(f);
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    while (fgets(line, sizeof(line), f)) {
+        if (json_number(line, "scale", &v)) *scale = (int)v;
+        if (!strstr(line, key)) continue;
+        memset(r, 0, sizeof(*r));
+        if (json_number(line, "matches", &v)) r->matches = (long)v;
+        json_number(line, "mb_per_s", &r->mb_per_s);
+        json_number(line, "p50_us", &r->p50_us);
+        json_number(line, "p99_us", &r->p99_us);
+        json_number(line, "noise", &r->noise);
+        return true;
     }
-    double t1 = now_sec();
+    return false;
+}
 
-    // Time BMH path
-    double t2 = now_sec();
-    for (int i = 0; i < repeats; ++i) {
-        curwp->w_dotp = first; curwp->w_doto = 0;
-        (void)scanner(pat5, FORWARD, PTBEG);
+// Whether "now" is worse than "base" by more than the tolerance and the
+// noise either run saw; the tail is noisier, so p99 is allowed twice as much
+static bool regressed(const struct result* now, const struct result* base, double tol,
+                      char* why, size_t len) {
+    tol += now->noise > base->noise ? now->noise : base->noise;
+    if (base->mb_per_s > 0 && now->mb_per_s < base->mb_per_s * (1 - tol)) {
+        snprintf(why, len, "%.1f MB/s, baseline %.1f", now->mb_per_s, base->mb_per_s);
+        return true;
+    }
+    if (now->p50_us > base->p50_us * (1 + tol) + SLACK_US) {
+        snprintf(why, len, "p50 %.2f us, baseline %.2f", now->p50_us, base->p50_us);
+        return true;
     }
-    double t3 = now_sec();
+    if (now->p99_us > base->p99_us * (1 + 2 * tol) + SLACK_US) {
+        snprintf(why, len, "p99 %.2f us, baseline %.2f", now->p99_us, base->p99_us);
+        return true;
+    }
+    return false;
+}
 
-    printf("BMH_MIN_LEN=%d\n", BMH_MIN_LEN);
-    printf("Short literal (len=4): %.3f ms total\n", (t1 - t0) * 1000.0);
-    printf("BMH literal   (len=5): %.3f ms total\n", (t3 - t2) * 1000.0);
-    printf("Done.\n");
-    return 0;
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [--json FILE] [--baseline FILE] [--tolerance FRACTION]\n"
+                    "       [--repeat N] [--scale N] [--corpus FILE] [--only NAME]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    const char* json_path = NULL;
+    const char* baseline_path = NULL;
+    const char* corpus = CORPUS;
+    const char* only = NULL;
+    const char* env = getenv("BENCH_SEARCH_SCALE");
+    int scale = env ? atoi(env) : DEFAULT_SCALE;
+    double tol = getenv("BENCH_TOLERANCE") ? atof(getenv("BENCH_TOLERANCE")) : DEFAULT_TOL;
+    int repeat = getenv("BENCH_REPEAT") ? atoi(getenv("BENCH_REPEAT")) : DEFAULT_REPEAT;
+    struct result res[NCASES];
+    int failures = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "--json") == 0) json_path = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--baseline") == 0) baseline_path = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--tolerance") == 0) tol = atof(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--repeat") == 0) repeat = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--scale") == 0) scale = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--corpus") == 0) corpus = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--only") == 0) only = argv[++i];
+        else { usage(argv[0]); return 2; }
+    }
+    if (scale < 1) scale = 1;
+    if (repeat < 1) repeat = 1;
+
+    init_editor_minimal("bench-search");
+    size_t bytes = load_corpus(corpus, scale);
+    if (bytes == 0) {
+        fprintf(stderr, "bench_search: cannot load %s\n", corpus);
+        return 2;
+    }
+    long lines = lindex_count(curbp);
+    printf("Corpus %s x%d: %.1f MB in %ld lines, kernel %s, %d threads\n",
+           corpus, scale, bytes / 1e6, lines, lscan_kernel_name(), psearch_threads());
+    printf("  %-18s %10s %10s %10s %10s %7s\n", "case", "matches", "MB/s", "p50 us", "p99 us",
+           "noise");
+
+    for (size_t i = 0; i < NCASES; i++) {
+        const struct bench_case* c = &cases[i];
+        memset(&res[i], 0, sizeof(res[i]));
+#ifndef ENABLE_SEARCH_NFA
+        if (c->kind == MAGIC_NFA || c->kind == COUNT_MAGIC) continue;
+#endif
+        if (only && strcmp(only, c->name) != 0) continue;
+        run_case(c, bytes, repeat, &res[i]);
+        printf("  %-18s %10ld %10.1f %10.3f %10.3f %6.0f%%\n", c->name, res[i].matches,
+               res[i].mb_per_s, res[i].p50_us, res[i].p99_us, res[i].noise * 100);
+        if (res[i].matches < 0) {
+            printf("  %-18s WRONG: a different count of matches each run\n", c->name);
+            failures++;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(same_count) / sizeof(same_count[0]); i++) {
+        const struct result* a = find_result(res, same_count[i][0]);
+        const struct result* b = find_result(res, same_count[i][1]);
+        if (a && b && a->matches != b->matches) {
+            printf("  %-18s WRONG: %ld matches, %s found %ld\n", same_count[i][1],
+                   b->matches, same_count[i][0], a->matches);
+            failures++;
+        }
+    }
+
+    if (json_path) {
+        FILE* f = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (!f) {
+            fprintf(stderr, "bench_search: cannot write %s\n", json_path);
+            return 2;
+        }
+        write_json(f, scale, bytes, lines, res);
+        if (f != stdout) fclose(f);
+    }
+
+    FILE* f = baseline_path ? fopen(baseline_path, "r") : NULL;
+    if (baseline_path && !f)
+        printf("No baseline %s; timings not compared (make bench-baseline records one)\n",
+               baseline_path);
+    if (f) {
+        int base_scale = 0;
+        printf("Against %s (tolerance %.0f%% plus noise):\n", baseline_path, tol * 100);
+        for (size_t i = 0; i < NCASES; i++) {
+            struct result base;
+            char why[128];
+            if (res[i].calls == 0) continue;
+            if (!read_baseline(f, &base_scale, cases[i].name, &base)) {
+                printf("  %-18s new, no baseline\n", cases[i].name);
+                continue;
+            }
+            if (base_scale == scale && base.matches != res[i].matches) {
+                printf("  %-18s REGRESSED: %ld matches, baseline %ld\n", cases[i].name,
+                       res[i].matches, base.matches);
+                failures++;
+            } else if (regressed(&res[i], &base, tol, why, sizeof(why))) {
+                printf("  %-18s REGRESSED: %s\n", cases[i].name, why);
+                failures++;
+            }
+        }
+        fclose(f);
+    }
+    printf("%d regression%s\n", failures, failures == 1 ? "" : "s");
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    return failures ? 1 : 0;
 }
@@ -7,6 +7,10 @@
 #include "test_keymap.h"
 #include "test_api.h"
 #include "test_boyer_moore.h"
+#include "test_literal_scan.h"
+#include "test_nfa_dfa.h"
+#include "test_search_parallel.h"
+#include "test_search_highlight.h"
 #include "test_undo_deterministic.h"
 #include "test_undo_capacity.h"
 #include "test_stats.h"
@@ -16,6 +20,14 @@
 #include "test_search_engines.h"
 #include "test_atomic_stats.h"
 #include "test_fileio_robustness.h"
+#include "test_gap_storage.h"
+#include "test_line_index.h"
+#include "test_memory.h"
+#include "test_line_arena.h"
+#include "test_file_loader.h"
+#include "test_file_save.h"
+#include "test_undo_history.h"
+#include "test_display_damage.h"
 // 100% coverage completion test suites
 #include "test_terminal_display.h"
 #include "test_text_processing.h"
@@ -109,12 +121,15 @@ int main(int argc, char* argv[]) {
     all_phases_passed &= test_bmh_literals();
     all_phases_passed &= test_bmh_edge_cases();
     all_phases_passed &= test_bmh_additional_edges();
+    all_phases_passed &= test_literal_scan_kernels();
+    all_phases_passed &= test_literal_scan_stream();
     all_phases_passed &= test_paste_bracketed();
     all_phases_passed &= test_paste_partial_and_interleaved();
     all_phases_passed &= test_paste_macro_record_bypass();
     all_phases_passed &= test_paste_stress_fuzz();
     all_phases_passed &= test_undo_deterministic();
     all_phases_passed &= test_undo_capacity_wrap();
+    all_phases_passed &= test_undo_log_compact();
     all_phases_passed &= test_atomic_stats_updates();
     all_phases_passed &= test_phase3_selection_region();
     all_phases_passed &= test_phase4_command_validation();
@@ -128,13 +143,36 @@ int main(int argc, char* argv[]) {
     all_phases_passed &= test_undo_redo_invalidation();
     all_phases_passed &= test_bmh_threshold_switching();
     all_phases_passed &= test_nfa_edge_cases();
+    all_phases_passed &= test_nfa_dfa_agreement();
+    all_phases_passed &= test_nfa_dfa_cache();
+    all_phases_passed &= test_nfa_reverse_search();
+    all_phases_passed &= test_nfa_program_cache();
+    all_phases_passed &= test_search_parallel_agreement();
+    all_phases_passed &= test_search_parallel_stitch();
+    all_phases_passed &= test_search_highlight_spans();
     all_phases_passed &= test_cross_line_search();
     all_phases_passed &= test_search_performance();
     all_phases_passed &= test_case_insensitive_search();
+    all_phases_passed &= test_isearch_incremental();
+    all_phases_passed &= test_bulk_replace();
+    all_phases_passed &= test_nfa_extended_syntax();
+    all_phases_passed &= test_group_replace();
+    all_phases_passed &= test_nfa_too_complex();
     all_phases_passed &= test_atomic_stats_o1_operations();
     all_phases_passed &= test_atomic_stats_incremental();
     all_phases_passed &= test_atomic_stats_concurrency();
     all_phases_passed &= test_atomic_stats_bulk_accuracy();
+    all_phases_passed &= test_gap_storage_edits();
+    all_phases_passed &= test_gap_storage_file_roundtrip();
+    all_phases_passed &= test_gap_storage_lazy();
+    all_phases_passed &= test_gap_buffer_scattered_edits();
+    all_phases_passed &= test_line_index_consistency();
+    all_phases_passed &= test_memory_tracking_scale();
+    all_phases_passed &= test_line_arena_lifecycle();
+    all_phases_passed &= test_file_loader_lines();
+    all_phases_passed &= test_file_save_atomic();
+    all_phases_passed &= test_undo_history_persist();
+    all_phases_passed &= test_undo_history_corrupt();
 
     // File I/O robustness tests
     printf("\n[%sINFO%s] Running File I/O robustness tests...\n", BLUE, RESET);
@@ -153,6 +191,11 @@ int main(int argc, char* argv[]) {
     all_phases_passed &= test_terminal_capability_detection();
     all_phases_passed &= test_alternate_screen_mode();
     all_phases_passed &= test_display_matrix_operations();
+    all_phases_passed &= test_display_matrix_damage();
+    all_phases_passed &= test_frame_output();
+    all_phases_passed &= test_row_diff_kernels();
+    all_phases_passed &= test_scroll_blocks();
+    all_phases_passed &= test_redraw_schedule();
     all_phases_passed &= test_sigwinch_handling();
     all_phases_passed &= test_color_system();
     all_phases_passed &= test_cursor_operations();
@@ -0,0 +1,466 @@
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+#include "test_display_damage.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/redraw.h"
+#include "internal/row_diff.h"
+#include "μemacs/display_matrix.h"
+
+static void put_text(int row, int col, const char* text, uint8_t attr) {
+    for (; *text; ++text, ++col)
+        display_matrix_set_cell(row, col, (unsigned char)*text, attr, 7, 0);
+}
+
+static int expect_span(int row, int col, int want_start, int want_end) {
+    int end = -1;
+    int start = display_matrix_dirty_span(row, col, 80, &end);
+    if (start != want_start || (start >= 0 && end != want_end)) {
+        printf("[%sFAIL%s] row %d span from %d is [%d,%d), expected [%d,%d)\n", RED, RESET,
+               row, col, start, end, want_start, want_end);
+        return 0;
+    }
+    return 1;
+}
+
+// Test damage tracking of the display matrix as update() drives it
+int test_display_matrix_damage() {
+    int ok = 1;
+    size_t cells0, partial0, full0, cells, partial, full;
+
+    PHASE_START("DISPLAY: DAMAGE", "Only changed cells are sent to the terminal");
+
+    if (display_matrix_init(24, 80) != DISPLAY_MATRIX_SUCCESS) {
+        printf("[%sFAIL%s] Display matrix could not be set up\n", RED, RESET);
+        ok = 0;
+        PHASE_END("DISPLAY: DAMAGE", ok);
+        return ok;
+    }
+
+    // A freshly erased screen: blank, clean, and counted as a full redraw
+    display_matrix_get_stats(NULL, NULL, &full0);
+    display_matrix_reset(7, 0);
+    put_text(3, 0, "hello world", ATTR_NORMAL);
+    display_matrix_commit_updates();
+    display_matrix_get_stats(&cells0, &partial0, &full);
+    ok &= (full == full0 + 1);
+
+    // Rewriting the same text damages nothing
+    put_text(3, 0, "hello world", ATTR_NORMAL);
+    ok &= !display_matrix_is_line_dirty(3);
+    ok &= expect_span(3, 0, -1, -1);
+
+    // One typed character is one dirty cell
+    put_text(3, 11, "!", ATTR_NORMAL);
+    ok &= display_matrix_is_line_dirty(3);
+    ok &= expect_span(3, 0, 11, 12);
+    ok &= expect_span(3, 12, -1, -1);
+    display_matrix_commit_updates();
+    display_matrix_get_stats(&cells, &partial, &full);
+    if (cells != cells0 + 1 || partial != partial0 + 1) {
+        printf("[%sFAIL%s] one edit counted %zu cells, %zu redraws\n", RED, RESET,
+               cells - cells0, partial - partial0);
+        ok = 0;
+    }
+
+    // Changes a few cells apart share a span, distant ones do not
+    put_text(5, 2, "a", ATTR_NORMAL);
+    put_text(5, 6, "b", ATTR_NORMAL);
+    put_text(5, 40, "c", ATTR_REVERSE);
+    ok &= expect_span(5, 0, 2, 7);
+    ok &= expect_span(5, 7, 40, 41);
+    ok &= (display_matrix_get_cell(5, 40)->attr == ATTR_REVERSE);
+
+    // An attribute change alone damages the cell
+    display_matrix_commit_updates();
+    put_text(5, 40, "c", ATTR_NORMAL);
+    ok &= expect_span(5, 0, 40, 41);
+
+    // A row the terminal blanked by scrolling needs no output
+    display_matrix_copy_line(5, 6);
+    ok &= display_matrix_is_line_dirty(6);
+    display_matrix_blank_line(5, 7, 0);
+    ok &= !display_matrix_is_line_dirty(5);
+    ok &= (display_matrix_get_cell(5, 2)->codepoint == ' ');
+    display_matrix_commit_updates();
+
+    display_matrix_destroy();
+    ok &= (global_display_matrix == NULL);
+
+    if (ok)
+        printf("[%sSUCCESS%s] Damage confined to changed cells\n", GREEN, RESET);
+
+    PHASE_END("DISPLAY: DAMAGE", ok);
+    return ok;
+}
+
+// A full 300x100 screen, as update() would send it; its size
+static size_t send_screen(void) {
+    size_t n = 0;
+
+    for (int row = 0; row < 100; row++) {
+        ttputs("\033[K", 3);
+        for (int col = 0; col < 300; col++)
+            ttputc('a' + (row + col) % 26);
+        ttputc(0x00e9);     // two bytes in UTF-8
+        ttputs("\r\n", 2);
+        n += 3 + 300 + 2 + 2;
+    }
+    return n;
+}
+
+// Check that the terminal got "head", a frame of "n" bytes and "tail" at *at
+static int expect_frame(int fd, off_t* at, const char* head, size_t n, const char* tail,
+                        const char* what) {
+    size_t hn = strlen(head), tn = strlen(tail), want = hn + n + tn;
+    int writes = 0, ok = 1;
+    char* back = malloc(want + 1);
+
+    if (ttframe_last(&writes) != want || writes != 1) {
+        printf("[%sFAIL%s] %s: %zu bytes went out as %zu in %d writes\n", RED, RESET,
+               what, want, ttframe_last(NULL), writes);
+        ok = 0;
+    }
+    if (!back || pread(fd, back, want + 1, *at) != (ssize_t)want ||
+        memcmp(back, head, hn) != 0 || memcmp(back + want - tn, tail, tn) != 0) {
+        printf("[%sFAIL%s] %s: terminal did not get the frame as sent\n", RED, RESET, what);
+        ok = 0;
+    } else if (n > 1) {
+        ok &= memcmp(back + hn, "\033[Kabc", 6) == 0;
+        ok &= memcmp(back + hn + 3 + 300, "\xc3\xa9\r\n", 4) == 0;
+        ok &= memcmp(back + hn + n - 4, "\xc3\xa9\r\n", 4) == 0;
+    }
+    free(back);
+    *at += want;
+    return ok;
+}
+
+// Test that a frame reaches the terminal in one write, marked as one
+int test_frame_output() {
+    int ok = 1;
+    char path[] = "/tmp/uemacs_frame_XXXXXX";
+    int fd, saved;
+    off_t at = 0;
+    size_t n;
+
+    PHASE_START("DISPLAY: FRAME", "A frame is written to the terminal at once");
+
+    fd = mkstemp(path);
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    if (fd < 0 || saved < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+        printf("[%sFAIL%s] Could not redirect the terminal\n", RED, RESET);
+        ok = 0;
+        PHASE_END("DISPLAY: FRAME", ok);
+        return ok;
+    }
+    ttflush();
+
+    // Without synchronized update the cursor is hidden from a large frame
+    ttsetsync(FALSE);
+    n = send_screen();
+    ttflush();
+    ok &= expect_frame(fd, &at, "\033[?25l", n, "\033[?25h", "large frame");
+
+    // ... but not from one typed character
+    ttputc('x');
+    ttflush();
+    ok &= expect_frame(fd, &at, "", 1, "", "small frame");
+
+    // With it, every frame is marked, however small
+    ttsetsync(TRUE);
+    n = send_screen();
+    ttflush();
+    ok &= expect_frame(fd, &at, "\033[?2026h", n, "\033[?2026l", "synchronized frame");
+    ttputc('x');
+    ttflush();
+    ok &= expect_frame(fd, &at, "\033[?2026h", 1, "\033[?2026l", "synchronized character");
+
+    // A frame past the buffer's limit goes out in parts, still marked once
+    for (int pass = 0; pass < 2; pass++) {
+        const char* head = pass ? "\033[?2026h" : "\033[?25l";
+        const char* tail = pass ? "\033[?2026l" : "\033[?25h";
+        size_t big = 2 * 1024 * 1024 + 7, hn = strlen(head), tn = strlen(tail);
+        char edge[16];
+
+        ttsetsync(pass);
+        for (size_t i = 0; i < big; i++)
+            ttputc('a' + i % 26);
+        ttflush();
+        if (ttframe_last(NULL) != hn + big + tn ||
+            pread(fd, edge, hn, at) != (ssize_t)hn || memcmp(edge, head, hn) != 0 ||
+            pread(fd, edge, tn + 1, at + hn + big) != (ssize_t)tn ||
+            memcmp(edge, tail, tn) != 0) {
+            printf("[%sFAIL%s] %s frame of %zu bytes went out as %zu\n", RED, RESET,
+                   pass ? "synchronized" : "large", big, ttframe_last(NULL));
+            ok = 0;
+        }
+        at += hn + big + tn;
+    }
+
+    // Nothing more to send writes nothing, not even the marks
+    ttflush();
+    ttsetsync(FALSE);
+
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    if (lseek(fd, 0, SEEK_END) != at) {
+        printf("[%sFAIL%s] an empty frame reached the terminal\n", RED, RESET);
+        ok = 0;
+    }
+    close(fd);
+    unlink(path);
+
+    if (ok)
+        printf("[%sSUCCESS%s] Frames sent in one write, marked or with the cursor hidden\n",
+               GREEN, RESET);
+
+    PHASE_END("DISPLAY: FRAME", ok);
+    return ok;
+}
+
+// Every row diff kernel the CPU has must agree with a plain compare
+int test_row_diff_kernels() {
+    int ok = 1;
+    static const enum rdiff_kernel kernels[] = { RDIFF_SCALAR, RDIFF_SSE2, RDIFF_AVX2 };
+    static uint32_t a[3840 + 1], b[3840 + 1];
+    int tried = 0;
+
+    PHASE_START("DISPLAY: ROW DIFF", "SIMD and scalar row compares agree");
+
+    srand(4242);
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!rdiff_set_kernel(kernels[k])) continue;
+        tried++;
+        for (int round = 0; round < 4000 && ok; ++round) {
+            // Narrow rows for the block edges, a 4K-wide one now and then
+            int n = round % 50 == 0 ? 3840 : rand() % 70;
+            int changes = rand() % 4, want_first = -1, want_end = -1, first, end = -1;
+
+            for (int i = 0; i < n; ++i)
+                a[i] = b[i] = ' ' + rand() % 3;
+            for (int c = 0; c < changes && n > 0; ++c) {
+                int at = rand() % n;
+                b[at] = a[at] ^ (1u << (rand() % 32));  // any bit of the cell
+            }
+            for (int i = 0; i < n; ++i) {
+                if (a[i] != b[i]) {
+                    if (want_first < 0) want_first = i;
+                    want_end = i + 1;
+                }
+            }
+            first = rdiff_span(a, b, n, &end);
+            if (first != want_first || (first >= 0 && end != want_end)) {
+                printf("[%sFAIL%s] %s kernel: n=%d span [%d,%d), expected [%d,%d)\n", RED, RESET,
+                       rdiff_kernel_name(), n, first, end, want_first, want_end);
+                ok = 0;
+            }
+        }
+    }
+    rdiff_set_kernel(RDIFF_AUTO);
+    if (ok)
+        printf("[%sSUCCESS%s] %d kernels agree (default: %s)\n", GREEN, RESET, tried, rdiff_kernel_name());
+
+    PHASE_END("DISPLAY: ROW DIFF", ok);
+    return ok;
+}
+
+static int scroll_calls;
+static int scroll_log[8][3];
+
+static void record_scroll(int from, int to, int count) {
+    if (scroll_calls < 8) {
+        scroll_log[scroll_calls][0] = from;
+        scroll_log[scroll_calls][1] = to;
+        scroll_log[scroll_calls][2] = count;
+    }
+    scroll_calls++;
+}
+
+// Line "n" of the scroll test: different all along from every other
+static void scroll_line(char* text, int n) {
+    for (int i = 0; i < 50; i++)
+        text[i] = 'a' + (n * 7 + i * (n % 5 + 1)) % 26;
+    text[50] = '\0';
+}
+
+// Whether display row "row" shows line "n" of the scroll test
+static int row_shows(int row, int n) {
+    char want[64];
+
+    scroll_line(want, n);
+    for (int col = 0; want[col]; col++)
+        if (display_matrix_get_cell(row, col)->codepoint != (uint32_t)want[col])
+            return 0;
+    return 1;
+}
+
+// Test that rows moved on screen are scrolled, several blocks in one update
+int test_scroll_blocks() {
+    int ok = 1;
+    int fd, saved;
+    void (*old_scroll)(int, int, int) = term.t_scroll;
+    int (*old_cost)(int, int, int) = term.t_scrcost;
+    char text[80];
+    struct line *lp;
+
+    PHASE_START("DISPLAY: SCROLL", "Rows that moved are scrolled, not redrawn");
+
+    // The terminal's output goes nowhere; the scrolls are only recorded
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit("scroll-blocks");
+    varinit();
+    vtinit();
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    curbp->b_mode &= ~MDVIEW;
+    for (int i = 1; i <= 60; i++) {
+        scroll_line(text, i);
+        for (char* p = text; *p; ++p) linsert(1, *p);
+        lnewline();
+    }
+    curwp->w_dotp = lforw(curbp->b_linep);
+    curwp->w_doto = 0;
+    curwp->w_linep = curwp->w_dotp;
+    curwp->w_flag |= WFHARD;
+
+    term.t_scroll = record_scroll;
+    term.t_scrcost = NULL;
+
+    sgarbf = TRUE;
+    update(TRUE);
+    scroll_calls = 0;
+
+    // Lines 3, 10 and 11 go: lines 4-9 move up a row and 12 on up three
+    lp = lforw(lforw(curwp->w_linep));
+    curwp->w_dotp = lp;
+    curwp->w_doto = 0;
+    ldelete(llength(lp) + 1, FALSE);
+    for (int i = 0; i < 6; i++)
+        curwp->w_dotp = lforw(curwp->w_dotp);
+    ldelete(2 * (llength(curwp->w_dotp) + 1), FALSE);
+    update(FALSE);
+    TTclose();      // and the tty is as it was
+
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(fd);
+
+    if (scroll_calls != 2 ||
+        scroll_log[0][0] != 3 || scroll_log[0][1] != 2 || scroll_log[0][2] != 6 ||
+        scroll_log[1][0] != 11 || scroll_log[1][1] != 8 || scroll_log[1][2] != 11) {
+        printf("[%sFAIL%s] %d scrolls, first %d->%d x%d, second %d->%d x%d\n", RED, RESET,
+               scroll_calls, scroll_log[0][0], scroll_log[0][1], scroll_log[0][2],
+               scroll_log[1][0], scroll_log[1][1], scroll_log[1][2]);
+        ok = 0;
+    }
+    // What the terminal was left showing is the text, moved or redrawn
+    for (int row = 0, n = 1; row < curwp->w_ntrows; row++, n++) {
+        if (n == 3 || n == 10)
+            n += n == 3 ? 1 : 2;
+        if (!row_shows(row, n)) {
+            printf("[%sFAIL%s] row %d does not show line %d\n", RED, RESET, row, n);
+            ok = 0;
+            break;
+        }
+    }
+
+    term.t_scroll = old_scroll;
+    term.t_scrcost = old_cost;
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    if (ok)
+        printf("[%sSUCCESS%s] Two blocks scrolled in one update\n", GREEN, RESET);
+
+    PHASE_END("DISPLAY: SCROLL", ok);
+    return ok;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+int test_redraw_schedule() {
+    int ok = 1;
+    int fds[2], saved;
+    char c;
+
+    PHASE_START("DISPLAY: PACING", "Queued keys share a frame, a lone key is drawn at once");
+
+    // The keyboard is a pipe the test types into
+    saved = dup(STDIN_FILENO);
+    if (saved < 0 || pipe(fds) < 0 || dup2(fds[0], STDIN_FILENO) < 0) {
+        printf("[%sFAIL%s] Could not stand in for the keyboard\n", RED, RESET);
+        ok = 0;
+        PHASE_END("DISPLAY: PACING", ok);
+        return ok;
+    }
+    input_reset_parser_state();
+    redraw_set_interval(50);
+    redraw_drawn();
+
+    if (!redraw_due()) {
+        printf("[%sFAIL%s] No input waiting, but the frame was put off\n", RED, RESET);
+        ok = 0;
+    }
+    write(fds[1], "ab", 2);
+    if (redraw_due()) {
+        printf("[%sFAIL%s] Keys queued right after a frame, but another was drawn\n", RED, RESET);
+        ok = 0;
+    }
+    sleep_ms(60);
+    if (!redraw_due()) {
+        printf("[%sFAIL%s] Keys still queued after the interval, but no frame\n", RED, RESET);
+        ok = 0;
+    }
+    redraw_set_interval(0);
+    redraw_drawn();
+    if (!redraw_due()) {
+        printf("[%sFAIL%s] With $framems 0 a command was not followed by a frame\n", RED, RESET);
+        ok = 0;
+    }
+    redraw_set_interval(REDRAW_MS);
+
+    // The first key read starts the clock and the frame after it stops it
+    c = (char)tgetc();
+    sleep_ms(5);
+    tgetc();
+    redraw_drawn();
+    if (c != 'a' || redraw_latency() < 5000 || redraw_latency() > 1000000) {
+        printf("[%sFAIL%s] Key '%c' took %ld us to the screen\n", RED, RESET, c, redraw_latency());
+        ok = 0;
+    }
+    redraw_drawn();
+    if (redraw_latency() < 5000) {
+        printf("[%sFAIL%s] A frame with no new key replaced the latency\n", RED, RESET);
+        ok = 0;
+    }
+
+    dup2(saved, STDIN_FILENO);
+    close(saved);
+    close(fds[0]);
+    close(fds[1]);
+    input_reset_parser_state();
+    if (ok)
+        printf("[%sSUCCESS%s] Frames paced by queued input, key latency measured\n", GREEN, RESET);
+
+    PHASE_END("DISPLAY: PACING", ok);
+    return ok;
+}
@@ -0,0 +1,10 @@
+#ifndef UEMACS_TEST_DISPLAY_DAMAGE_H
+#define UEMACS_TEST_DISPLAY_DAMAGE_H
+
+int test_display_matrix_damage();
+int test_frame_output();
+int test_row_diff_kernels();
+int test_scroll_blocks();
+int test_redraw_schedule();
+
+#endif
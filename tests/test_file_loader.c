@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+#include "test_file_loader.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/line_index.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "loader"));
+    varinit();
+}
+
+static int line_is(long n, const char* text, int len) {
+    struct line* lp = lindex_line(curbp, n);
+    if (lp == curbp->b_linep || llength(lp) != len || memcmp(lp->l_text, text, len) != 0) {
+        printf("[%sFAIL%s] line %ld read wrong (%d bytes)\n", RED, RESET, n,
+               lp == curbp->b_linep ? -1 : llength(lp));
+        return 0;
+    }
+    return 1;
+}
+
+int test_file_loader_lines() {
+    int ok = 1;
+    const char* in_file = "/tmp/uemacs_loader_in.txt";
+    PHASE_START("FILE LOADER", "Bulk readin: NULs, long lines, last line");
+
+    static char longline[5000];
+    memset(longline, 'L', sizeof(longline));
+
+    FILE* fp = fopen(in_file, "wb");
+    if (!fp) {
+        ok = 0;
+        PHASE_END("FILE LOADER", ok);
+        return ok;
+    }
+    fputs("alpha\n\n", fp);
+    fwrite("nul\0byte\n", 1, 9, fp);
+    fwrite(longline, 1, sizeof(longline), fp);
+    fputs("\ncr\r\ntail", fp);
+    fclose(fp);
+
+    init_editor_minimal("loader");
+    curbp->b_flag &= ~BFCHG;
+    if (readin(in_file, FALSE) != TRUE) ok = 0;
+    if (lindex_count(curbp) != 6) {
+        printf("[%sFAIL%s] read %ld lines, expected 6\n", RED, RESET, lindex_count(curbp));
+        ok = 0;
+    } else {
+        ok &= line_is(1, "alpha", 5);
+        ok &= line_is(2, "", 0);
+        ok &= line_is(3, "nul\0byte", 8);
+        ok &= line_is(4, longline, (int)sizeof(longline));
+        ok &= line_is(5, "cr\r", 3);
+        ok &= line_is(6, "tail", 4);
+    }
+
+    // An empty file reads as an empty buffer
+    fp = fopen(in_file, "wb");
+    if (fp) fclose(fp);
+    curbp->b_flag &= ~BFCHG;
+    if (readin(in_file, FALSE) != TRUE || lindex_count(curbp) != 0) ok = 0;
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    unlink(in_file);
+
+    PHASE_END("FILE LOADER", ok);
+    return ok;
+}
@@ -0,0 +1,6 @@
+#ifndef UEMACS_TEST_FILE_LOADER_H
+#define UEMACS_TEST_FILE_LOADER_H
+
+int test_file_loader_lines();
+
+#endif
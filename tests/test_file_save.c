@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "test_utils.h"
+#include "test_file_save.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "save"));
+    varinit();
+}
+
+static int file_is(const char* path, const char* text, size_t len) {
+    static char got[8192];
+    size_t n = 0;
+    FILE* fp = fopen(path, "rb");
+    if (fp) {
+        n = fread(got, 1, sizeof(got), fp);
+        fclose(fp);
+    }
+    if (!fp || n != len || memcmp(got, text, len) != 0) {
+        printf("[%sFAIL%s] %s holds %zu bytes, expected %zu\n", RED, RESET, path, n, len);
+        return 0;
+    }
+    return 1;
+}
+
+/* Entries in "dir" besides "." and ".."; a leaked temp file shows here. */
+static int dir_entries(const char* dir) {
+    DIR* d = opendir(dir);
+    struct dirent* de;
+    int n = 0;
+    if (!d) return -1;
+    while ((de = readdir(d)) != NULL)
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) ++n;
+    closedir(d);
+    return n;
+}
+
+int test_file_save_atomic() {
+    int ok = 1;
+    char dir[] = "/tmp/uemacs_save_XXXXXX";
+    char file[64], link[64];
+    static char expect[4096];
+    size_t elen = 0;
+    struct stat st;
+    PHASE_START("FILE SAVE", "Vectored writeout renamed into place");
+
+    if (mkdtemp(dir) == NULL) {
+        ok = 0;
+        PHASE_END("FILE SAVE", ok);
+        return ok;
+    }
+    snprintf(file, sizeof(file), "%s/out.txt", dir);
+    snprintf(link, sizeof(link), "%s/link.txt", dir);
+
+    init_editor_minimal("save");
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    // Short lines go through the staging area, the long one by reference
+    const char* shortl[] = { "first", "", "third line" };
+    for (int i = 0; i < 3; ++i) {
+        for (const char* p = shortl[i]; *p; ++p) linsert(1, *p);
+        lnewline();
+        elen += (size_t)snprintf(expect + elen, sizeof(expect) - elen, "%s\n", shortl[i]);
+    }
+    for (int i = 0; i < 2000; ++i) {
+        linsert(1, 'x');
+        expect[elen++] = 'x';
+    }
+    expect[elen++] = '\n';
+
+    FILE* fp = fopen(file, "w");
+    if (fp) { fputs("old contents\n", fp); fclose(fp); }
+    chmod(file, 0640);
+
+    if (writeout(file) != TRUE) ok = 0;
+    ok &= file_is(file, expect, elen);
+    if (stat(file, &st) != 0 || (st.st_mode & 07777) != 0640) {
+        printf("[%sFAIL%s] file mode not kept\n", RED, RESET);
+        ok = 0;
+    }
+
+    // Saving through a symlink replaces its target and keeps the link
+    if (symlink("out.txt", link) == 0) {
+        linsert(1, 'y');
+        expect[elen - 1] = 'y';
+        expect[elen++] = '\n';
+        if (writeout(link) != TRUE) ok = 0;
+        ok &= file_is(file, expect, elen);
+        if (lstat(link, &st) != 0 || !S_ISLNK(st.st_mode)) {
+            printf("[%sFAIL%s] symlink replaced by a file\n", RED, RESET);
+            ok = 0;
+        }
+    }
+
+    // A file we may not write is refused, not replaced; root may write it
+    char ro[96];
+    snprintf(ro, sizeof(ro), "%s/readonly.txt", dir);
+    fp = fopen(ro, "w");
+    if (fp) { fputs("keep\n", fp); fclose(fp); }
+    chmod(ro, 0444);
+    int may = access(ro, W_OK) == 0;
+    if (writeout(ro) != (may ? TRUE : FALSE) ||
+        (!may && !file_is(ro, "keep\n", 5)) || (may && !file_is(ro, expect, elen))) {
+        printf("[%sFAIL%s] read-only file %s\n", RED, RESET, may ? "not saved" : "overwritten");
+        ok = 0;
+    }
+
+    // A save that cannot start leaves nothing behind
+    char bad[96];
+    snprintf(bad, sizeof(bad), "%s/missing/out.txt", dir);
+    if (writeout(bad) != FALSE) ok = 0;
+
+    if (dir_entries(dir) != 3) {
+        printf("[%sFAIL%s] %d entries left in %s\n", RED, RESET, dir_entries(dir), dir);
+        ok = 0;
+    }
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    unlink(ro);
+    unlink(link);
+    unlink(file);
+    rmdir(dir);
+
+    PHASE_END("FILE SAVE", ok);
+    return ok;
+}
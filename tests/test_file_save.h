@@ -0,0 +1,6 @@
+#ifndef UEMACS_TEST_FILE_SAVE_H
+#define UEMACS_TEST_FILE_SAVE_H
+
+int test_file_save_atomic();
+
+#endif
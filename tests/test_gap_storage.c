@@ -0,0 +1,416 @@
+#include "test_utils.h"
+#include "test_gap_storage.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/line_index.h"
+#include "μemacs/gapbuffer.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "gap"));
+    varinit();
+}
+
+// The gap text must equal the line list with a newline after every line
+static int gap_matches_lines(struct buffer* bp) {
+    size_t total = 0;
+    for (struct line* lp = lforw(bp->b_linep); lp != bp->b_linep; lp = lforw(lp))
+        total += (size_t)llength(lp) + 1;
+    if (gap_buffer_size(bp->b_gap) != total) {
+        printf("[%sFAIL%s] gap size %zu, lines hold %zu bytes\n", RED, RESET,
+               gap_buffer_size(bp->b_gap), total);
+        return 0;
+    }
+
+    char* text = malloc(total + 1);
+    if (!text) return 0;
+    gap_buffer_get_text(bp->b_gap, 0, total, text, total);
+    size_t pos = 0;
+    int ok = 1;
+    for (struct line* lp = lforw(bp->b_linep); lp != bp->b_linep && ok; lp = lforw(lp)) {
+        ok = memcmp(text + pos, lp->l_text, (size_t)llength(lp)) == 0
+             && text[pos + llength(lp)] == '\n';
+        pos += (size_t)llength(lp) + 1;
+    }
+    if (!ok) printf("[%sFAIL%s] gap text diverged from lines\n", RED, RESET);
+    free(text);
+    return ok;
+}
+
+int test_gap_storage_edits() {
+    int ok = 1;
+    PHASE_START("GAP STORAGE: EDITS", "Line edits mirrored into gap buffer");
+
+    init_editor_minimal("gapedit");
+    bclear(curbp);
+    curbp->b_mode &= ~MDVIEW;
+    if (buffer_set_storage(curbp, BSTORE_GAP) != TRUE || curbp->b_gap == NULL) {
+        printf("[%sFAIL%s] could not switch to gap storage\n", RED, RESET);
+        ok = 0;
+        PHASE_END("GAP STORAGE: EDITS", ok);
+        return ok;
+    }
+
+    // Typing into an empty buffer, splitting and joining lines
+    curwp->w_dotp = curbp->b_linep; curwp->w_doto = 0;
+    linsert_str("hello world\nsecond line\nthird");
+    ok &= gap_matches_lines(curbp);
+
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 5;
+    lnewline();
+    ok &= gap_matches_lines(curbp);
+
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = llength(curwp->w_dotp);
+    ldelete(1, FALSE);                       // join back
+    ok &= gap_matches_lines(curbp);
+
+    curwp->w_doto = 2;
+    ldelete(20, FALSE);                      // span across a line end
+    ok &= gap_matches_lines(curbp);
+
+    // Trailing blank line removal at end of buffer
+    curwp->w_dotp = lback(curbp->b_linep); curwp->w_doto = llength(curwp->w_dotp);
+    lnewline();
+    ldelete(1, FALSE);
+    ok &= gap_matches_lines(curbp);
+
+    // In-place rewrites go through lsync()
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 2;
+    twiddle(FALSE, 1);
+    ok &= gap_matches_lines(curbp);
+
+    // Many edits through the incremental line index
+    curwp->w_dotp = lback(curbp->b_linep); curwp->w_doto = 0;
+    for (int i = 0; i < 500; i++) {
+        linsert_str("abc\n");
+        if (i % 7 == 0) { curwp->w_doto = 0; ldelete(2, FALSE); }
+    }
+    ok &= gap_matches_lines(curbp);
+    if (gap_buffer_line_count(curbp->b_gap) - 1 != (size_t)atomic_load(&curbp->b_line_count) &&
+        !atomic_load(&curbp->b_stats_dirty)) {
+        printf("[%sFAIL%s] gap line count disagrees with buffer stats\n", RED, RESET);
+        ok = 0;
+    }
+
+    buffer_set_storage(curbp, BSTORE_LINES);
+    if (curbp->b_gap != NULL) ok = 0;
+
+    PHASE_END("GAP STORAGE: EDITS", ok);
+    return ok;
+}
+
+int test_gap_storage_file_roundtrip() {
+    int ok = 1;
+    const char* in_file = "/tmp/uemacs_gap_in.txt";
+    const char* out_file = "/tmp/uemacs_gap_out.txt";
+    PHASE_START("GAP STORAGE: FILES", "readin/writeout through gap buffer");
+
+    FILE* fp = fopen(in_file, "w");
+    if (!fp) {
+        ok = 0;
+        PHASE_END("GAP STORAGE: FILES", ok);
+        return ok;
+    }
+    for (int i = 0; i < 2000; i++) fprintf(fp, "line %d of the gap buffer test\n", i);
+    fprintf(fp, "no trailing newline");
+    fclose(fp);
+
+    init_editor_minimal("gapfile");
+    setenv("UEMACS_STORAGE", "gap", 1);
+    curbp->b_flag &= ~BFCHG;
+    int s = readin(in_file, FALSE);
+    unsetenv("UEMACS_STORAGE");
+    if (s != TRUE || curbp->b_storage != BSTORE_GAP) {
+        printf("[%sFAIL%s] readin did not use gap storage\n", RED, RESET);
+        ok = 0;
+        PHASE_END("GAP STORAGE: FILES", ok);
+        return ok;
+    }
+    ok &= gap_matches_lines(curbp);
+
+    int nlines = 0;
+    for (struct line* lp = lforw(curbp->b_linep); lp != curbp->b_linep; lp = lforw(lp)) nlines++;
+    if (nlines != 2001) {
+        printf("[%sFAIL%s] expected 2001 lines, got %d\n", RED, RESET, nlines);
+        ok = 0;
+    }
+
+    // Edit the first line and write the buffer out
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 0;
+    linsert_str("edited ");
+    ok &= gap_matches_lines(curbp);
+    if (writeout(out_file) != TRUE) ok = 0;
+
+    fp = fopen(out_file, "r");
+    char first[128] = {0};
+    long size = 0;
+    if (fp) {
+        if (!fgets(first, sizeof(first), fp)) first[0] = 0;
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+    if (strcmp(first, "edited line 0 of the gap buffer test\n") != 0) {
+        printf("[%sFAIL%s] first line written wrong: %s\n", RED, RESET, first);
+        ok = 0;
+    }
+    if ((size_t)size != gap_buffer_size(curbp->b_gap)) {
+        printf("[%sFAIL%s] wrote %ld bytes, buffer holds %zu\n", RED, RESET,
+               size, gap_buffer_size(curbp->b_gap));
+        ok = 0;
+    }
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    if (curbp->b_storage != BSTORE_LINES || curbp->b_gap != NULL) ok = 0;
+    unlink(in_file);
+    unlink(out_file);
+
+    PHASE_END("GAP STORAGE: FILES", ok);
+    return ok;
+}
+
+// Lines with a struct line, walking the raw links so none gets built
+static int built_lines(struct buffer* bp, int* unbuilt) {
+    int n = 0;
+    *unbuilt = bp->b_linep->l_hole;
+    for (struct line* lp = bp->b_linep->l_fp; lp != bp->b_linep; lp = lp->l_fp) {
+        *unbuilt += lp->l_hole;
+        n++;
+    }
+    return n;
+}
+
+static int line_is(struct line* lp, const char* text) {
+    return llength(lp) == (int)strlen(text) && memcmp(lp->l_text, text, strlen(text)) == 0;
+}
+
+int test_gap_storage_lazy() {
+    int ok = 1;
+    int unbuilt;
+    const char* in_file = "/tmp/uemacs_gap_lazy.txt";
+    const char* out_file = "/tmp/uemacs_gap_lazy_out.txt";
+    PHASE_START("GAP STORAGE: LAZY", "Lines built from gap text on demand");
+
+    FILE* fp = fopen(in_file, "w");
+    if (!fp) {
+        ok = 0;
+        PHASE_END("GAP STORAGE: LAZY", ok);
+        return ok;
+    }
+    for (int i = 0; i < 2000; i++) fprintf(fp, "line %d of the gap buffer test\n", i);
+    fprintf(fp, "no trailing newline");
+    fclose(fp);
+
+    init_editor_minimal("gaplazy");
+    setenv("UEMACS_STORAGE", "gap", 1);
+    curbp->b_flag &= ~BFCHG;
+    int s = readin(in_file, FALSE);
+    unsetenv("UEMACS_STORAGE");
+    if (s != TRUE || curbp->b_storage != BSTORE_GAP) {
+        printf("[%sFAIL%s] readin did not use gap storage\n", RED, RESET);
+        ok = 0;
+        PHASE_END("GAP STORAGE: LAZY", ok);
+        return ok;
+    }
+
+    // Reading in builds no more than the lines looked at
+    int built = built_lines(curbp, &unbuilt);
+    if (built > 2 * LBUILD_RUN || built + unbuilt != 2001) {
+        printf("[%sFAIL%s] after readin %d lines built, %d unbuilt\n", RED, RESET, built, unbuilt);
+        ok = 0;
+    }
+    if (lindex_count(curbp) != 2001) {
+        printf("[%sFAIL%s] index counts %ld lines\n", RED, RESET, lindex_count(curbp));
+        ok = 0;
+    }
+
+    // A jump deep into the file builds a run there and nothing between
+    gotoline(TRUE, 1500);
+    if (!line_is(curwp->w_dotp, "line 1499 of the gap buffer test") ||
+        !line_is(lback(curwp->w_dotp), "line 1498 of the gap buffer test") ||
+        lindex_number(curbp, curwp->w_dotp) != 1500) {
+        printf("[%sFAIL%s] goto line 1500 landed wrong\n", RED, RESET);
+        ok = 0;
+    }
+    built = built_lines(curbp, &unbuilt);
+    if (built > 4 * LBUILD_RUN || built + unbuilt != 2001) {
+        printf("[%sFAIL%s] after goto %d lines built, %d unbuilt\n", RED, RESET, built, unbuilt);
+        ok = 0;
+    }
+
+    // Status line statistics come from the gap text
+    int lines;
+    long bytes;
+    buffer_mark_stats_dirty(curbp);
+    buffer_get_stats_fast(curbp, &lines, &bytes, NULL);
+    if (lines != 2001 || (size_t)bytes != gap_buffer_size(curbp->b_gap) - 1 ||
+        built_lines(curbp, &unbuilt) != built) {
+        printf("[%sFAIL%s] stats %d lines, %ld bytes\n", RED, RESET, lines, bytes);
+        ok = 0;
+    }
+
+    // Edits next to unbuilt lines
+    curwp->w_doto = 0;
+    linsert_str("edited ");
+    curwp->w_doto = 4;
+    lnewline();
+    curwp->w_dotp = lindex_line(curbp, 1400);
+    curwp->w_doto = llength(curwp->w_dotp);
+    ldelete(3, FALSE);                       // join with the next line
+    gotoline(TRUE, 1700);
+    while (curwp->w_dotp->l_hole == 0 && lforw(curwp->w_dotp) != curbp->b_linep)
+        curwp->w_dotp = lforw(curwp->w_dotp);
+    struct line* moved = curwp->w_dotp;      // last line of a built run
+    long at = lindex_number(curbp, moved);
+    move_line_down(FALSE, 1);
+    if (lindex_number(curbp, moved) != at + 1) {
+        printf("[%sFAIL%s] moved line %ld down to %ld\n", RED, RESET,
+               at, lindex_number(curbp, moved));
+        ok = 0;
+    }
+    move_line_up(FALSE, 1);
+    if (!line_is(lindex_line(curbp, 1400), "line 1399 of the gap buffer testne 1400 of the gap buffer test")) {
+        printf("[%sFAIL%s] join next to unbuilt lines went wrong\n", RED, RESET);
+        ok = 0;
+    }
+
+    // The written file holds the gap text, and the lines agree with it
+    if (writeout(out_file) != TRUE) ok = 0;
+    fp = fopen(out_file, "r");
+    long size = 0;
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+    if ((size_t)size != gap_buffer_size(curbp->b_gap)) {
+        printf("[%sFAIL%s] wrote %ld bytes, buffer holds %zu\n", RED, RESET,
+               size, gap_buffer_size(curbp->b_gap));
+        ok = 0;
+    }
+    ok &= gap_matches_lines(curbp);
+    if (lindex_count(curbp) != 2001 || built_lines(curbp, &unbuilt) != 2001 || unbuilt != 0) {
+        printf("[%sFAIL%s] walking every line left %d unbuilt\n", RED, RESET, unbuilt);
+        ok = 0;
+    }
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    if (curbp->b_storage != BSTORE_LINES || curbp->b_gap != NULL) ok = 0;
+    unlink(in_file);
+    unlink(out_file);
+
+    PHASE_END("GAP STORAGE: LAZY", ok);
+    return ok;
+}
+
+// The gap text and its line index must match a plain copy of the text
+static int gap_matches_text(struct gap_buffer* gb, const char* text, size_t len) {
+    if (gap_buffer_size(gb) != len) {
+        printf("[%sFAIL%s] gap size %zu, text holds %zu bytes\n", RED, RESET,
+               gap_buffer_size(gb), len);
+        return 0;
+    }
+
+    char* got = malloc(len + 1);
+    if (!got) return 0;
+    gap_buffer_get_text(gb, 0, len, got, len);
+    int ok = memcmp(got, text, len) == 0;
+    free(got);
+    if (!ok) {
+        printf("[%sFAIL%s] gap text diverged from the copy\n", RED, RESET);
+        return 0;
+    }
+
+    size_t line = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && text[i] != '\n') continue;
+        if (gap_buffer_line_to_offset(gb, line) != start) {
+            printf("[%sFAIL%s] line %zu starts at %zu, index says %zu\n", RED, RESET,
+                   line, start, gap_buffer_line_to_offset(gb, line));
+            return 0;
+        }
+        line++;
+        start = i + 1;
+    }
+    if (gap_buffer_line_count(gb) != line) {
+        printf("[%sFAIL%s] index counts %zu lines, text has %zu\n", RED, RESET,
+               gap_buffer_line_count(gb), line);
+        return 0;
+    }
+    return 1;
+}
+
+// Apply the same replacement to the copy
+static void copy_replace(char* text, size_t* len, size_t pos, size_t dlen,
+                         const char* ins, size_t ilen) {
+    memmove(text + pos + ilen, text + pos + dlen, *len - pos - dlen);
+    memcpy(text + pos, ins, ilen);
+    *len = *len - dlen + ilen;
+}
+
+int test_gap_buffer_scattered_edits() {
+    int ok = 1;
+    PHASE_START("GAP BUFFER: SCATTER", "Scattered edits against a plain copy");
+
+    struct gap_buffer* gb = gap_buffer_create(0);
+    char* text = malloc(1 << 16);
+    size_t len = 0;
+    if (!gb || !text) {
+        ok = 0;
+        gap_buffer_destroy(gb);
+        free(text);
+        PHASE_END("GAP BUFFER: SCATTER", ok);
+        return ok;
+    }
+
+    // Typing, splitting and joining lines
+    const char* start = "hello world\nsecond line\nthird";
+    gap_buffer_insert(gb, 0, start, strlen(start));
+    copy_replace(text, &len, 0, 0, start, strlen(start));
+    ok &= gap_matches_text(gb, text, len);
+
+    gap_buffer_insert(gb, 5, "\n", 1);
+    copy_replace(text, &len, 5, 0, "\n", 1);
+    gap_buffer_delete(gb, 5, 1);
+    copy_replace(text, &len, 5, 1, "", 0);
+    ok &= gap_matches_text(gb, text, len);
+
+    // A deletion across a line end, and a replacement adding lines
+    gap_buffer_delete(gb, 8, 10);
+    copy_replace(text, &len, 8, 10, "", 0);
+    gap_buffer_replace(gb, 2, 3, "a\nb\nc", 5);
+    copy_replace(text, &len, 2, 3, "a\nb\nc", 5);
+    ok &= gap_matches_text(gb, text, len);
+
+    // Many scattered edits, moving the gap about
+    unsigned seed = 12345;
+    for (int i = 0; i < 2000 && len < 60000; i++) {
+        seed = seed * 1103515245u + 12345u;
+        size_t pos = len ? (seed >> 8) % (len + 1) : 0;
+        if (i % 3 == 2 && pos < len) {
+            size_t d = 1 + (seed >> 20) % 7;
+            if (d > len - pos) d = len - pos;
+            gap_buffer_delete(gb, pos, d);
+            copy_replace(text, &len, pos, d, "", 0);
+        } else {
+            const char* ins = (i % 2) ? "abc\n" : "xy";
+            gap_buffer_insert(gb, pos, ins, strlen(ins));
+            copy_replace(text, &len, pos, 0, ins, strlen(ins));
+        }
+    }
+    ok &= gap_matches_text(gb, text, len);
+
+    gap_buffer_destroy(gb);
+    free(text);
+    PHASE_END("GAP BUFFER: SCATTER", ok);
+    return ok;
+}
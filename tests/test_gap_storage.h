@@ -0,0 +1,9 @@
+#ifndef UEMACS_TEST_GAP_STORAGE_H
+#define UEMACS_TEST_GAP_STORAGE_H
+
+int test_gap_storage_edits();
+int test_gap_storage_file_roundtrip();
+int test_gap_storage_lazy();
+int test_gap_buffer_scattered_edits();
+
+#endif
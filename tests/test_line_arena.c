@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+#include "test_line_arena.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/line_arena.h"
+#include "internal/line_index.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "arena"));
+    varinit();
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int test_line_arena_lifecycle() {
+    int ok = 1;
+    const char* in_file = "/tmp/uemacs_arena_in.txt";
+    PHASE_START("LINE ARENA", "Slab-allocated lines, slot reuse and bulk release");
+
+    init_editor_minimal("arena");
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    curbp->b_mode &= ~MDVIEW;
+
+    // Short lines come from slabs, a long one gets a block of its own
+    curwp->w_dotp = curbp->b_linep; curwp->w_doto = 0;
+    for (int i = 0; i < 2000; i++) {
+        linsert_str("arena line");
+        lnewline();
+    }
+    struct line* first = lforw(curbp->b_linep);
+    if (first->l_slot == LSLOT_HEAP || first->l_slot == LSLOT_BIG) {
+        printf("[%sFAIL%s] short line not slab allocated (slot %d)\n", RED, RESET, first->l_slot);
+        ok = 0;
+    }
+    curwp->w_dotp = first; curwp->w_doto = llength(first);
+    for (int i = 0; i < LARENA_MAXTEXT + 100; i++) linsert(1, 'x');
+    first = lforw(curbp->b_linep);
+    if (first->l_slot != LSLOT_BIG || llength(first) != 10 + LARENA_MAXTEXT + 100
+        || memcmp(first->l_text, "arena linexx", 12) != 0) {
+        printf("[%sFAIL%s] long line grew wrong (slot %d, %d bytes)\n",
+               RED, RESET, first->l_slot, llength(first));
+        ok = 0;
+    }
+
+    // Freed slots are reused before new slabs are cut
+    size_t slabs = larena_slabs(curbp);
+    for (int round = 0; round < 5; round++) {
+        curwp->w_dotp = lindex_line(curbp, 100); curwp->w_doto = 0;
+        ldelete(500L * 11, FALSE);
+        for (int i = 0; i < 500; i++) {
+            linsert_str("arena line");
+            lnewline();
+        }
+    }
+    if (larena_slabs(curbp) > slabs + 1) {
+        printf("[%sFAIL%s] slabs grew from %zu to %zu despite free slots\n",
+               RED, RESET, slabs, larena_slabs(curbp));
+        ok = 0;
+    }
+    if (lindex_count(curbp) != 2001) {
+        printf("[%sFAIL%s] %ld lines after delete/insert rounds, expected 2001\n",
+               RED, RESET, lindex_count(curbp));
+        ok = 0;
+    }
+
+    // Clearing drops the arena and leaves the window on the header
+    curwp->w_dotp = lindex_line(curbp, 1500);
+    curwp->w_markp = lindex_line(curbp, 10);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    if (larena_slabs(curbp) != 0 || curbp->b_arena != NULL || lindex_count(curbp) != 0
+        || curwp->w_dotp != curbp->b_linep || curwp->w_linep != curbp->b_linep
+        || curwp->w_markp != curbp->b_linep) {
+        printf("[%sFAIL%s] bclear left lines or window pointers behind\n", RED, RESET);
+        ok = 0;
+    }
+    curwp->w_markp = NULL;
+
+    // Read and drop a large file
+    FILE* fp = fopen(in_file, "w");
+    if (!fp) ok = 0;
+    else {
+        for (int i = 0; i < 200000; i++) fprintf(fp, "line %d of the arena test\n", i);
+        fclose(fp);
+        double t0 = now_ms();
+        if (readin(in_file, FALSE) != TRUE) ok = 0;
+        double t1 = now_ms();
+        if (lindex_count(curbp) != 200000) {
+            printf("[%sFAIL%s] read %ld lines, expected 200000\n", RED, RESET, lindex_count(curbp));
+            ok = 0;
+        }
+        size_t nslabs = larena_slabs(curbp);
+        curbp->b_flag &= ~BFCHG;
+        double t2 = now_ms();
+        bclear(curbp);
+        double t3 = now_ms();
+        printf("[%sINFO%s] 200000 lines in %zu slabs: read %.1f ms, cleared %.1f ms\n",
+               BLUE, RESET, nslabs, t1 - t0, t3 - t2);
+        unlink(in_file);
+    }
+
+    PHASE_END("LINE ARENA", ok);
+    return ok;
+}
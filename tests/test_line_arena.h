@@ -0,0 +1,6 @@
+#ifndef UEMACS_TEST_LINE_ARENA_H
+#define UEMACS_TEST_LINE_ARENA_H
+
+int test_line_arena_lifecycle();
+
+#endif
@@ -0,0 +1,107 @@
+#include "test_utils.h"
+#include "test_line_index.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/line_index.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "lindex"));
+    varinit();
+}
+
+// Compare the index against a plain walk of the line list
+static int index_matches_walk(struct buffer* bp) {
+    long n = 0;
+    for (struct line* lp = lforw(bp->b_linep); lp != bp->b_linep; lp = lforw(lp)) {
+        n++;
+        if (lindex_number(bp, lp) != n || lindex_line(bp, n) != lp) {
+            printf("[%sFAIL%s] line %ld: index says %ld\n", RED, RESET, n, lindex_number(bp, lp));
+            return 0;
+        }
+    }
+    if (lindex_count(bp) != n || lindex_line(bp, n + 1) != bp->b_linep) {
+        printf("[%sFAIL%s] index counts %ld lines, list has %ld\n", RED, RESET, lindex_count(bp), n);
+        return 0;
+    }
+    return 1;
+}
+
+int test_line_index_consistency() {
+    int ok = 1;
+    PHASE_START("LINE INDEX", "O(log n) line numbers through edits");
+
+    init_editor_minimal("lindex");
+    bclear(curbp);
+    curbp->b_mode &= ~MDVIEW;
+
+    // Grow well past several chunk splits
+    curwp->w_dotp = curbp->b_linep; curwp->w_doto = 0;
+    for (int i = 0; i < 3000; i++) {
+        linsert_str("line");
+        lnewline();
+    }
+    ok &= index_matches_walk(curbp);
+
+    // Insert lines in the middle and at the top
+    curwp->w_dotp = lindex_line(curbp, 1500); curwp->w_doto = 0;
+    for (int i = 0; i < 300; i++) lnewline();
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 0;
+    for (int i = 0; i < 300; i++) lnewline();
+    ok &= index_matches_walk(curbp);
+
+    // Join lines (ldelnewline) and delete whole lines across chunks
+    curwp->w_dotp = lindex_line(curbp, 700); curwp->w_doto = 0;
+    ldelete(2000, FALSE);
+    ok &= index_matches_walk(curbp);
+
+    // Move lines around
+    curwp->w_dotp = lindex_line(curbp, 200); curwp->w_doto = 0;
+    move_line_up(FALSE, 5);
+    move_line_down(FALSE, 20);
+    ok &= index_matches_walk(curbp);
+
+    // gotoline lands on the indexed line; past the end lands on the header
+    gotoline(TRUE, 1234);
+    if (curwp->w_dotp != lindex_line(curbp, 1234) || getcline() != 1234) {
+        printf("[%sFAIL%s] gotoline(1234) landed on line %d\n", RED, RESET, getcline());
+        ok = 0;
+    }
+    gotoline(TRUE, 1000000);
+    if (curwp->w_dotp != curbp->b_linep) ok = 0;
+
+    // A line linked in behind the index is counted, not indexed, by a
+    // peek; completing the index takes it in
+    struct line* at = lindex_line(curbp, 500);
+    struct line* nl = lalloc(curbp, 0);
+    if (nl) {
+        nl->l_bp = at->l_bp;
+        nl->l_fp = at;
+        at->l_bp->l_fp = nl;
+        at->l_bp = nl;
+        if (lindex_peek(curbp, nl) != 500 || nl->l_chunk != NULL) {
+            printf("[%sFAIL%s] peek gave %ld for an unindexed line 500\n",
+                   RED, RESET, lindex_peek(curbp, nl));
+            ok = 0;
+        }
+        if (!lindex_complete(curbp) || nl->l_chunk == NULL) {
+            printf("[%sFAIL%s] completing the index left a line out\n", RED, RESET);
+            ok = 0;
+        }
+        ok &= index_matches_walk(curbp);
+    }
+
+    // Clearing the buffer empties the index
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    if (lindex_count(curbp) != 0) ok = 0;
+
+    PHASE_END("LINE INDEX", ok);
+    return ok;
+}
@@ -0,0 +1,6 @@
+#ifndef UEMACS_TEST_LINE_INDEX_H
+#define UEMACS_TEST_LINE_INDEX_H
+
+int test_line_index_consistency();
+
+#endif
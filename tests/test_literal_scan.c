@@ -0,0 +1,145 @@
+#include <stdlib.h>
+
+#include "test_utils.h"
+#include "test_literal_scan.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/line_index.h"
+#include "internal/literal_scan.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "literal-scan"));
+    varinit();
+}
+
+static unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + 32) : c;
+}
+
+static long naive_find(const unsigned char* text, size_t n, const unsigned char* pat, int m, bool cs) {
+    for (size_t i = 0; i + m <= n; ++i) {
+        int j = 0;
+        while (j < m && (cs ? text[i + j] == pat[j] : fold(text[i + j]) == fold(pat[j]))) j++;
+        if (j == m) return (long)i;
+    }
+    return -1;
+}
+
+// Every kernel the CPU has must agree with a plain search
+int test_literal_scan_kernels() {
+    int ok = 1;
+    static const enum lscan_kernel kernels[] = { LSCAN_SCALAR, LSCAN_SSE2, LSCAN_AVX2 };
+    /* '@' and '`' differ from letters by 0x20 only: they pass the folded filter */
+    static const char alphabet[] = "abAB@`\n";
+    unsigned char text[300];
+    unsigned char pat[40];
+    int tried = 0;
+
+    PHASE_START("LSCAN: KERNELS", "SIMD and scalar literal kernels agree");
+
+    srand(12345);
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!lscan_set_kernel(kernels[k])) continue;
+        tried++;
+        for (int round = 0; round < 3000 && ok; ++round) {
+            size_t n = (size_t)(rand() % (int)sizeof(text));
+            int m = 1 + rand() % 12;
+            bool cs = rand() & 1;
+            for (size_t i = 0; i < n; ++i) text[i] = alphabet[rand() % 7];
+            for (int i = 0; i < m; ++i) pat[i] = alphabet[rand() % 6];
+            /* Plant the pattern now and then so matches are common too */
+            if (n >= (size_t)m && (round & 1)) memcpy(text + rand() % (n - m + 1), pat, m);
+
+            struct literal_scan ls;
+            lscan_init(&ls, pat, m, cs);
+            long got = lscan_find(&ls, text, n);
+            long want = naive_find(text, n, pat, m, cs);
+            if (got != want) {
+                printf("[%sFAIL%s] %s kernel: n=%zu m=%d cs=%d got %ld want %ld\n", RED, RESET,
+                       lscan_kernel_name(), n, m, cs, got, want);
+                ok = 0;
+            }
+        }
+    }
+    lscan_set_kernel(LSCAN_AUTO);
+    if (ok)
+        printf("[%sSUCCESS%s] %d kernels agree (default: %s)\n", GREEN, RESET, tried, lscan_kernel_name());
+
+    PHASE_END("LSCAN: KERNELS", ok);
+    return ok;
+}
+
+static struct line* append_line(const char* text, int len) {
+    struct line* lp = lalloc(curbp, len);
+    memcpy(lp->l_text, text, len);
+    lp->l_bp = lback(curbp->b_linep); lp->l_fp = curbp->b_linep;
+    lback(curbp->b_linep)->l_fp = lp; curbp->b_linep->l_bp = lp;
+    lindex_link(curbp, lp);
+    return lp;
+}
+
+// Buffer searches: matches across line ends and across the kernel's windows
+int test_literal_scan_stream() {
+    int ok = 1;
+    char row[100];
+    struct line *mlp, *elp;
+    int moff, eoff;
+    struct literal_scan ls;
+
+    PHASE_START("LSCAN: STREAM", "Literal search over lines as one stream");
+
+    init_editor_minimal("lscan-stream");
+    bclear(curbp);
+
+    // A pattern spanning an empty line
+    struct line* l1 = append_line("alpha", 5);
+    append_line("", 0);
+    struct line* l3 = append_line("beta", 4);
+    lscan_init(&ls, (const unsigned char*)"ha\n\nBE", 6, false);
+    ok &= lscan_search_forward(&ls, l1, 0, curbp->b_linep, &mlp, &moff, &elp, &eoff);
+    ok &= (mlp == l1 && moff == 3 && elp == l3 && eoff == 2);
+    // ... but not from past its start, nor with the newline after the last line
+    ok &= !lscan_search_forward(&ls, l1, 4, curbp->b_linep, &mlp, &moff, &elp, &eoff);
+    lscan_init(&ls, (const unsigned char*)"beta\n", 5, true);
+    ok &= !lscan_search_forward(&ls, l1, 0, curbp->b_linep, &mlp, &moff, &elp, &eoff);
+    if (!ok) printf("[%sFAIL%s] Cross-line match wrong\n", RED, RESET);
+
+    // ~1000 lines of 99 bytes: the token is moved across the 64K window edges
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    memset(row, 'x', sizeof(row));
+    for (int i = 0; i < 1000; ++i) append_line(row, 99);
+    for (int at = 65536 - 260; at < 65536 + 20 && ok; at += 7) {
+        struct line* lp = lforw(curbp->b_linep);
+        int line = at / 100, off = at % 100;
+        for (int i = 0; i < line; ++i) lp = lforw(lp);
+        if (off > 95) continue;
+        memcpy(lp->l_text + off, "Tok", 3);
+        curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 0;
+        if (!scanner("tOK", FORWARD, PTEND) || curwp->w_dotp != lp || curwp->w_doto != off + 3 ||
+            matchline != lp || matchoff != off) {
+            printf("[%sFAIL%s] Token at line %d offset %d not found there\n", RED, RESET, line, off);
+            ok = 0;
+        }
+        memcpy(lp->l_text + off, "xxx", 3);
+    }
+    // A pattern longer than a line, spanning a window edge
+    lscan_init(&ls, (const unsigned char*)"xxx", 3, true);
+    ok &= lscan_search_forward(&ls, lforw(curbp->b_linep), 97, curbp->b_linep, &mlp, &moff, &elp, &eoff);
+    ok &= (moff == 0 && mlp == lforw(lforw(curbp->b_linep)));
+
+    if (ok)
+        printf("[%sSUCCESS%s] Stream matches found across lines and windows\n", GREEN, RESET);
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    PHASE_END("LSCAN: STREAM", ok);
+    return ok;
+}
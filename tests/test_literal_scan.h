@@ -0,0 +1,7 @@
+#ifndef UEMACS_TEST_LITERAL_SCAN_H
+#define UEMACS_TEST_LITERAL_SCAN_H
+
+int test_literal_scan_kernels();
+int test_literal_scan_stream();
+
+#endif
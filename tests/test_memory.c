@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "test_utils.h"
+#include "test_memory.h"
+
+#include "internal/memory.h"
+
+int test_memory_tracking_scale() {
+    int ok = 1;
+    PHASE_START("MEMORY TRACKING", "O(1) tracking of many live blocks");
+
+    const int count = 200000;
+    void** blocks = malloc(sizeof(void*) * count);
+    if (!blocks) {
+        ok = 0;
+        PHASE_END("MEMORY TRACKING", ok);
+        return ok;
+    }
+
+    size_t base_bytes, base_blocks, bytes, nblocks;
+    memory_usage(&base_bytes, &base_blocks);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (int i = 0; i < count; i++) {
+        blocks[i] = safe_alloc(16 + (i % 64), "memory test block", __FILE__, __LINE__);
+        if (!blocks[i]) ok = 0;
+    }
+    memory_usage(&bytes, &nblocks);
+    // Tracking may be compiled out or disabled; then nothing is counted
+    bool tracked = nblocks != base_blocks;
+    if (tracked && nblocks != base_blocks + count) {
+        printf("[%sFAIL%s] %zu blocks tracked, expected %zu\n", RED, RESET,
+               nblocks - base_blocks, (size_t)count);
+        ok = 0;
+    }
+
+    // Grow every other block: the record must follow the new pointer
+    for (int i = 0; i < count; i += 2) {
+        void* p = safe_realloc(blocks[i], 200, "memory test grow");
+        if (p) blocks[i] = p; else ok = 0;
+    }
+    memory_usage(&bytes, &nblocks);
+    if (tracked && nblocks != base_blocks + count) ok = 0;
+
+    // Oldest first: the worst order for a most-recent-first list
+    for (int i = 0; i < count; i++)
+        SAFE_FREE(blocks[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(blocks);
+
+    memory_usage(&bytes, &nblocks);
+    if (nblocks != base_blocks || bytes != base_bytes) {
+        printf("[%sFAIL%s] %zu bytes in %zu blocks left after freeing, expected %zu in %zu\n",
+               RED, RESET, bytes, nblocks, base_bytes, base_blocks);
+        ok = 0;
+    }
+    printf("[%sINFO%s] %d blocks allocated, grown and freed in %.1f ms (tracking %s)\n",
+           BLUE, RESET, count,
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+           tracked ? "on" : "off");
+
+    PHASE_END("MEMORY TRACKING", ok);
+    return ok;
+}
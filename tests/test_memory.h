@@ -0,0 +1,6 @@
+#ifndef UEMACS_TEST_MEMORY_H
+#define UEMACS_TEST_MEMORY_H
+
+int test_memory_tracking_scale();
+
+#endif
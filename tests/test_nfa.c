@@ -15,12 +15,12 @@ struct nfa_program_info {
 };
 extern int nfa_compile(const char *pattern, int case_sensitive, struct nfa_program_info *nfa);
 extern int nfa_search_forward(struct nfa_program_info *nfa, struct line *start_line, int start_off, int flags, struct line **match_line, int *match_off);
-extern struct line* lalloc(int used);
+extern struct line* lalloc(struct buffer* bp, int used);
 
 // Helper: create a buffer with two lines: "foo\nbar"
 static struct line* make_buffer(void) {
-    struct line* l1 = lalloc(3); memcpy(l1->l_text, "foo", 3); l1->l_used = 3;
-    struct line* l2 = lalloc(3); memcpy(l2->l_text, "bar", 3); l2->l_used = 3;
+    struct line* l1 = lalloc(NULL, 3); memcpy(l1->l_text, "foo", 3); l1->l_used = 3;
+    struct line* l2 = lalloc(NULL, 3); memcpy(l2->l_text, "bar", 3); l2->l_used = 3;
     l1->l_fp = l2; l2->l_bp = l1;
     l1->l_bp = l2->l_fp = NULL;
     return l1;
@@ -108,7 +108,7 @@ NFA_FUNC(test_empty_pattern, {
 NFA_FUNC(test_anchors_only, {
     struct nfa_program_info nfa = {0};
     assert(nfa_compile("^$", 1, &nfa));
-    struct line* l = lalloc(0); l->l_used = 0;
+    struct line* l = lalloc(NULL, 0); l->l_used = 0;
     struct line* mlp = NULL; int moff = 0;
     assert(nfa_search_forward(&nfa, l, 0, 0, &mlp, &moff));
     assert(mlp == l && moff == 0);
@@ -117,7 +117,7 @@ NFA_FUNC(test_anchors_only, {
 NFA_FUNC(test_negated_class, {
     struct nfa_program_info nfa = {0};
     assert(nfa_compile("[^a]oo", 1, &nfa));
-    struct line* l = lalloc(3); memcpy(l->l_text, "foo", 3); l->l_used = 3;
+    struct line* l = lalloc(NULL, 3); memcpy(l->l_text, "foo", 3); l->l_used = 3;
     struct line* mlp = NULL; int moff = 0;
     assert(!nfa_search_forward(&nfa, l, 0, 0, &mlp, &moff));
     l->l_text[0] = 'b';
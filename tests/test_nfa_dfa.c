@@ -0,0 +1,408 @@
+#include <stdlib.h>
+
+#include "test_utils.h"
+#include "test_nfa_dfa.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/line_index.h"
+#include "internal/nfa.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "nfa-dfa"));
+    varinit();
+}
+
+static struct line* append_line(const char* text, int len) {
+    struct line* lp = lalloc(curbp, len);
+    memcpy(lp->l_text, text, len);
+    lp->l_bp = lback(curbp->b_linep); lp->l_fp = curbp->b_linep;
+    lback(curbp->b_linep)->l_fp = lp; curbp->b_linep->l_bp = lp;
+    lindex_link(curbp, lp);
+    return lp;
+}
+
+#ifdef ENABLE_SEARCH_NFA
+/* Backtracking reference: longest end of a match of pat at text[i], or -1 */
+static int ref_atom(const char* p, int* alen, unsigned char c) {
+    if (*p == '.') { *alen = 1; return 1; }
+    if (*p == '[') {
+        const char* q = p + 1;
+        bool neg = (*q == '^'), in = false;
+        if (neg) q++;
+        for (; *q != ']'; q++) in |= ((unsigned char)*q == c);
+        *alen = (int)(q - p) + 1;
+        return neg ? !in : in;
+    }
+    *alen = 1;
+    return (unsigned char)*p == c;
+}
+
+static int ref_here(const char* p, const char* text, int i, int n) {
+    int alen;
+    if (*p == '\0') return i;
+    if (*p == '$' && p[1] == '\0') return i == n ? i : -1;
+    ref_atom(p, &alen, 0);
+    if (p[alen] == '*') {
+        int best = ref_here(p + alen + 1, text, i, n);
+        for (int j = i; j < n && ref_atom(p, &alen, (unsigned char)text[j]); j++) {
+            int e = ref_here(p + alen + 1, text, j + 1, n);
+            if (e > best) best = e;
+        }
+        return best;
+    }
+    if (i < n && ref_atom(p, &alen, (unsigned char)text[i]))
+        return ref_here(p + alen, text, i + 1, n);
+    return -1;
+}
+
+static bool ref_search(const char* pat, const char* text, int from, int n, int* ms, int* me) {
+    bool bol = (*pat == '^');
+    for (int s = from; s <= n; s++) {
+        if (bol && s > 0) break;
+        int e = ref_here(pat + bol, text, s, n);
+        if (e >= 0) { *ms = s; *me = e; return true; }
+    }
+    return false;
+}
+
+/* Does pat match exactly text[i..e)? */
+static bool ref_exact(const char* p, const char* text, int i, int e, int n) {
+    int alen;
+    if (*p == '\0') return i == e;
+    if (*p == '$' && p[1] == '\0') return i == e && e == n;
+    ref_atom(p, &alen, 0);
+    if (p[alen] == '*') {
+        if (ref_exact(p + alen + 1, text, i, e, n)) return true;
+        for (int j = i; j < e && ref_atom(p, &alen, (unsigned char)text[j]); j++)
+            if (ref_exact(p + alen + 1, text, j + 1, e, n)) return true;
+        return false;
+    }
+    return i < e && ref_atom(p, &alen, (unsigned char)text[i]) &&
+           ref_exact(p + alen, text, i + 1, e, n);
+}
+
+/* Backward: the match ending nearest before "limit", longest of those */
+static bool ref_search_back(const char* pat, const char* text, int limit, int n, int* ms, int* me) {
+    bool bol = (*pat == '^');
+    for (int e = limit; e >= 0; e--)
+        for (int s = 0; s <= e && (!bol || s == 0); s++)
+            if (ref_exact(pat + bol, text, s, e, n)) { *ms = s; *me = e; return true; }
+    return false;
+}
+
+/* A random pattern in the subset the NFA compiles */
+static void random_pattern(char* pat) {
+    static const char* atoms[] = { "a", "b", "c", ".", "[ab]", "[^a]" };
+    char* p = pat;
+    if (rand() % 5 == 0) *p++ = '^';
+    int k = 1 + rand() % 4;
+    for (int i = 0; i < k; i++) {
+        const char* a = atoms[rand() % 6];
+        strcpy(p, a); p += strlen(a);
+        if (rand() % 3 == 0) *p++ = '*';
+    }
+    if (rand() % 5 == 0) *p++ = '$';
+    *p = '\0';
+}
+#endif
+
+// The DFA-filtered search finds the same leftmost-longest matches as a plain backtracker
+int test_nfa_dfa_agreement() {
+    int ok = 1;
+    PHASE_START("NFA: DFA AGREEMENT", "Lazy DFA search agrees with a reference matcher");
+
+#ifdef ENABLE_SEARCH_NFA
+    char text[40], pat[40];
+    nfa_program* prog;
+    struct line *mlp;
+    int ms, me, rs, re;
+
+    init_editor_minimal("nfa-dfa-agree");
+    srand(4242);
+    for (int round = 0; round < 2000 && ok; round++) {
+        int n = rand() % (int)sizeof(text);
+        for (int i = 0; i < n; i++) text[i] = "abcd"[rand() % 4];
+        random_pattern(pat);
+        curbp->b_flag &= ~BFCHG;
+        bclear(curbp);
+        struct line* lp = append_line(text, n);
+        int from = n ? rand() % (n + 1) : 0;
+
+        if (!(prog = nfa_program_get(pat, true))) {
+            printf("[%sFAIL%s] '%s' did not compile\n", RED, RESET, pat);
+            ok = 0;
+            break;
+        }
+        bool got = nfa_search_match(prog, lp, from, &mlp, &ms, &me);
+        bool want = ref_search(pat, text, from, n, &rs, &re);
+        if (got != want || (got && (mlp != lp || ms != rs || me != re))) {
+            printf("[%sFAIL%s] '%s' in '%.*s' from %d: got %d [%d,%d) want %d [%d,%d)\n", RED, RESET,
+                   pat, n, text, from, got, got ? ms : -1, got ? me : -1, want, rs, re);
+            ok = 0;
+        }
+    }
+    if (ok)
+        printf("[%sSUCCESS%s] 2000 random patterns matched alike\n", GREEN, RESET);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+#else
+    printf("[%sINFO%s] NFA regex engine not compiled in, skipping\n", YELLOW, RESET);
+#endif
+
+    PHASE_END("NFA: DFA AGREEMENT", ok);
+    return ok;
+}
+
+// Backward search on the reversed program finds what a backward reference scan does,
+// and reads only the lines between the cursor and the match
+int test_nfa_reverse_search() {
+    int ok = 1;
+    PHASE_START("NFA: REVERSE", "Backward MAGIC search on the reversed program");
+
+#ifdef ENABLE_SEARCH_NFA
+    char text[40], pat[40], row[80];
+    nfa_program* prog;
+    nfa_dfa_stats st;
+    struct line *mlp;
+    int ms, me, rs, re;
+
+    init_editor_minimal("nfa-reverse");
+    srand(777);
+    for (int round = 0; round < 2000 && ok; round++) {
+        int n = rand() % (int)sizeof(text);
+        for (int i = 0; i < n; i++) text[i] = "abcd"[rand() % 4];
+        random_pattern(pat);
+        curbp->b_flag &= ~BFCHG;
+        bclear(curbp);
+        struct line* lp = append_line(text, n);
+        int limit = n ? rand() % (n + 1) : 0;
+
+        if (!(prog = nfa_program_get(pat, true)) || !nfa_can_reverse(prog)) {
+            printf("[%sFAIL%s] '%s' did not compile reversed\n", RED, RESET, pat);
+            ok = 0;
+            break;
+        }
+        bool got = nfa_search_match_reverse(prog, lp, limit, &mlp, &ms, &me);
+        bool want = ref_search_back(pat, text, limit, n, &rs, &re);
+        if (got != want || (got && (mlp != lp || ms != rs || me != re))) {
+            printf("[%sFAIL%s] '%s' in '%.*s' back from %d: got %d [%d,%d) want %d [%d,%d)\n", RED, RESET,
+                   pat, n, text, limit, got, got ? ms : -1, got ? me : -1, want, rs, re);
+            ok = 0;
+        }
+    }
+
+    // backsearch in MAGIC mode, two lines up in a long buffer
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    memset(row, 'x', sizeof(row));
+    for (int i = 0; i < 1000; i++) append_line(row, sizeof(row));
+    struct line* hit = append_line("ERROR: connect timeout, retrying", 32);
+    append_line(row, sizeof(row));
+    struct line* dot = append_line(row, sizeof(row));
+    curbp->b_mode |= MDMAGIC;
+    curwp->w_dotp = dot; curwp->w_doto = 40;
+    nfa_dfa_reset_stats();
+    strcpy(pat, "err.*t");
+    rvstrcpy(tap, pat);
+    if (!scanner(tap, REVERSE, PTBEG) || curwp->w_dotp != hit || curwp->w_doto != 0 ||
+        matchoff != 0 || matchlen != 27) {
+        printf("[%sFAIL%s] Backward 'err.*t' not found at the start of its line\n", RED, RESET);
+        ok = 0;
+    }
+    nfa_dfa_get_stats(&st);
+    if (st.hits + st.misses > 200) {
+        printf("[%sFAIL%s] Backward search read %llu bytes for a match 2 lines up\n", RED, RESET,
+               (unsigned long long)(st.hits + st.misses));
+        ok = 0;
+    }
+    curbp->b_mode &= ~MDMAGIC;
+
+    if (ok)
+        printf("[%sSUCCESS%s] Reversed program agrees with a backward scan\n", GREEN, RESET);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+#else
+    printf("[%sINFO%s] NFA regex engine not compiled in, skipping\n", YELLOW, RESET);
+#endif
+
+    PHASE_END("NFA: REVERSE", ok);
+    return ok;
+}
+
+// Transitions are served from the cache once built; a thrashing pattern falls back to the NFA
+int test_nfa_dfa_cache() {
+    int ok = 1;
+    PHASE_START("NFA: DFA CACHE", "Lazy DFA cache hits, flushes and NFA fallback");
+
+#ifdef ENABLE_SEARCH_NFA
+    nfa_program* prog;
+    nfa_dfa_stats st;
+    char row[80];
+
+    init_editor_minimal("nfa-dfa-cache");
+    bclear(curbp);
+    memset(row, 'x', sizeof(row));
+    for (int i = 0; i < 500; i++) append_line(row, sizeof(row));
+    struct line* hit = append_line("12:00 ERROR: read timeout on fd 3", 33);
+
+    // Mid-line match, case folded, found through scanner() in MAGIC mode
+    curbp->b_mode |= MDMAGIC;
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 0;
+    nfa_dfa_reset_stats();
+    if (!scanner("error.*timeout", FORWARD, PTEND) || curwp->w_dotp != hit ||
+        matchoff != 6 || matchlen != 19 || curwp->w_doto != 25) {
+        printf("[%sFAIL%s] error.*timeout not matched at [6,25)\n", RED, RESET);
+        ok = 0;
+    }
+    // Spelled without a required literal, every line goes through the DFA;
+    // searching again hits the cache for every byte
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 0;
+    ok &= scanner("e[r]r[o]r.*t[i]m[e]o[u]t", FORWARD, PTEND);
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 0;
+    nfa_dfa_reset_stats();
+    ok &= scanner("e[r]r[o]r.*t[i]m[e]o[u]t", FORWARD, PTEND) && curwp->w_doto == 25;
+    nfa_dfa_get_stats(&st);
+    if (st.misses != 0 || st.hits < 500 * sizeof(row)) {
+        printf("[%sFAIL%s] Warm search: %llu hits, %llu misses\n", RED, RESET,
+               (unsigned long long)st.hits, (unsigned long long)st.misses);
+        ok = 0;
+    }
+    // End anchor
+    curwp->w_dotp = lforw(curbp->b_linep); curwp->w_doto = 0;
+    if (!scanner("fd [0-9]$", FORWARD, PTBEG) || curwp->w_dotp != hit || curwp->w_doto != 29) {
+        printf("[%sFAIL%s] Anchored 'fd [0-9]$' not found\n", RED, RESET);
+        ok = 0;
+    }
+    curbp->b_mode &= ~MDMAGIC;
+
+    // 2^10 state sets: the cache fills before it pays off and the NFA takes over
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    srand(99);
+    for (int i = 0; i < 40; i++) {
+        /* a 'c' every 10 bytes: no match before the last line */
+        for (int j = 0; j < (int)sizeof(row); j++) row[j] = (j % 10 == 9) ? 'c' : "ab"[rand() % 2];
+        append_line(row, sizeof(row));
+    }
+    struct line* last = append_line("bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbabbbbbbbbbb", 41);
+    struct line* mlp;
+    int ms, me;
+    nfa_dfa_reset_stats();
+    prog = nfa_program_new("[ab]*a[ab][ab][ab][ab][ab][ab][ab][ab][ab][ab]", true);
+    if (!prog || !nfa_search_match(prog, lforw(curbp->b_linep), 0, &mlp, &ms, &me) ||
+        mlp != last || ms != 0 || me != 41) {
+        printf("[%sFAIL%s] Thrashing pattern matched wrongly\n", RED, RESET);
+        ok = 0;
+    }
+    nfa_dfa_get_stats(&st);
+    if (st.fallbacks != 1) {
+        printf("[%sFAIL%s] Expected one fallback to the NFA, got %llu\n", RED, RESET,
+               (unsigned long long)st.fallbacks);
+        ok = 0;
+    }
+    nfa_program_free(prog);
+
+    if (ok)
+        printf("[%sSUCCESS%s] Cache served warm searches; thrashing fell back to the NFA\n", GREEN, RESET);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+#else
+    printf("[%sINFO%s] NFA regex engine not compiled in, skipping\n", YELLOW, RESET);
+#endif
+
+    PHASE_END("NFA: DFA CACHE", ok);
+    return ok;
+}
+
+// Programs are compiled once and reused from the LRU cache; each keeps its own state
+int test_nfa_program_cache() {
+    int ok = 1;
+    PHASE_START("NFA: PROGRAM CACHE", "Compiled programs reused across searches");
+
+#ifdef ENABLE_SEARCH_NFA
+    nfa_dfa_stats st;
+    char pat[16];
+
+    init_editor_minimal("nfa-cache");
+    bclear(curbp);
+    struct line* l1 = append_line("one fish two fish", 17);
+    struct line* l2 = append_line("red fish blue fish", 18);
+
+    // forwhunt-style repeats compile once
+    nfa_cache_clear();
+    nfa_dfa_reset_stats();
+    curbp->b_mode |= MDMAGIC;
+    curwp->w_dotp = l1; curwp->w_doto = 0;
+    int found = 0;
+    while (scanner("f[i]sh", FORWARD, PTEND)) found++;
+    nfa_dfa_get_stats(&st);
+    if (found != 4 || st.compiles != 1 || st.reuses != 4) {
+        printf("[%sFAIL%s] 4 matches want 1 compile: got %d matches, %llu compiles, %llu reuses\n",
+               RED, RESET, found, (unsigned long long)st.compiles, (unsigned long long)st.reuses);
+        ok = 0;
+    }
+    // ... and case sensitivity is part of the key
+    curbp->b_mode |= MDEXACT;
+    curwp->w_dotp = l1; curwp->w_doto = 0;
+    ok &= scanner("f[i]sh", FORWARD, PTEND);
+    curbp->b_mode &= ~(MDEXACT | MDMAGIC);
+    nfa_dfa_get_stats(&st);
+    if (st.compiles != 2) {
+        printf("[%sFAIL%s] Exact-case search reused the folding program\n", RED, RESET);
+        ok = 0;
+    }
+
+    // The least recently used program is dropped once the cache is full
+    nfa_program* first = nfa_program_get("b.ue", false);
+    for (int i = 0; i < 16; i++) {
+        snprintf(pat, sizeof(pat), "x%d.", i);
+        nfa_program_get(pat, false);
+        if (i % 2 == 0) ok &= (nfa_program_get("b.ue", false) == first);
+    }
+    nfa_dfa_reset_stats();
+    for (int i = 0; i < 16; i++) {
+        snprintf(pat, sizeof(pat), "x%d.", i);
+        nfa_program_get(pat, false);
+    }
+    nfa_program_get("b.ue", false);
+    nfa_dfa_get_stats(&st);
+    if (!ok || st.reuses != 0) {
+        printf("[%sFAIL%s] LRU eviction order wrong\n", RED, RESET);
+        ok = 0;
+    }
+
+    // Two programs searching in turn keep their own sets and DFAs
+    nfa_program* a = nfa_program_new("t.o", false);
+    nfa_program* b = nfa_program_new("bl.*sh$", false);
+    struct line* mlp;
+    int ms, me;
+    bool ra = a && nfa_search_match(a, l1, 0, &mlp, &ms, &me) && mlp == l1 && ms == 9 && me == 12;
+    bool rb = b && nfa_search_match(b, l1, 0, &mlp, &ms, &me) && mlp == l2 && ms == 9 && me == 18;
+    bool ra2 = a && !nfa_search_match(a, l1, 10, &mlp, &ms, &me);
+    bool rb2 = b && nfa_search_match_reverse(b, l2, 18, &mlp, &ms, &me) && ms == 9 && me == 18;
+    if (!(ra && rb && ra2 && rb2)) {
+        printf("[%sFAIL%s] Interleaved programs: %d %d %d %d\n", RED, RESET, ra, rb, ra2, rb2);
+        ok = 0;
+    }
+    nfa_program_free(a);
+    nfa_program_free(b);
+
+    if (ok)
+        printf("[%sSUCCESS%s] Programs compiled once, evicted least recently used first\n", GREEN, RESET);
+    nfa_cache_clear();
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+#else
+    printf("[%sINFO%s] NFA regex engine not compiled in, skipping\n", YELLOW, RESET);
+#endif
+
+    PHASE_END("NFA: PROGRAM CACHE", ok);
+    return ok;
+}
@@ -0,0 +1,9 @@
+#ifndef UEMACS_TEST_NFA_DFA_H
+#define UEMACS_TEST_NFA_DFA_H
+
+int test_nfa_dfa_agreement();
+int test_nfa_dfa_cache();
+int test_nfa_reverse_search();
+int test_nfa_program_cache();
+
+#endif
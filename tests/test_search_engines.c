@@ -4,8 +4,10 @@
 #include "internal/efunc.h"
 #include "internal/line.h"
 #include "internal/nfa.h"
+#include "internal/undo.h"
 #include "test_boyer_moore.h"
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 
 static void init_editor_minimal(const char* name) {
@@ -415,4 +417,414 @@ int test_case_insensitive_search() {
 
     PHASE_END("SEARCH: CASE-INSENSITIVE", ok);
     return ok;
-}
\ No newline at end of file
+}
+// Type "typed" into an incremental search one character at a time from
+// (lp,off), checking each step against a fresh search for the prefix
+static int isearch_agrees(const char* typed, struct line* lp, int off) {
+    char prefix[NPAT];
+    int n = (int)strlen(typed);
+
+    pat[0] = '\0';
+    curwp->w_dotp = lp;
+    curwp->w_doto = off;
+    for (int i = 0; i < n; i++) {
+        pat[i] = typed[i];
+        pat[i + 1] = '\0';
+        int sts = isearch_extend(pat, 1);
+        struct line* got_lp = curwp->w_dotp;
+        int got_off = curwp->w_doto;
+
+        memcpy(prefix, typed, i + 1);
+        prefix[i + 1] = '\0';
+        curwp->w_dotp = lp;
+        curwp->w_doto = off;
+        int want = scanner(prefix, FORWARD, PTEND);
+        if (sts != want || (want && (got_lp != curwp->w_dotp || got_off != curwp->w_doto))) {
+            printf("[%sFAIL%s] ISearch for \"%s\" went astray at \"%s\"\n", RED, RESET, typed, prefix);
+            return 0;
+        }
+        curwp->w_dotp = got_lp;
+        curwp->w_doto = got_off;
+    }
+    return 1;
+}
+
+// Test incremental search extending its match in place or searching on
+int test_isearch_incremental() {
+    int ok = 1;
+    PHASE_START("SEARCH: ISEARCH", "Testing incremental search as characters are typed");
+
+    init_editor_minimal("search-isearch");
+    bclear(curbp);
+    curbp->b_mode &= ~(MDVIEW | MDMAGIC | MDEXACT);
+
+    const char* lines[] = { "ne nee needl", "xneedle NEEDLE", "needles" };
+    curwp->w_dotp = curbp->b_linep;
+    curwp->w_doto = 0;
+    for (int i = 0; i < 3; i++) {
+        lnewline();
+        curwp->w_dotp = lback(curbp->b_linep);
+        curwp->w_doto = 0;
+        for (const char* p = lines[i]; *p; ++p) linsert(1, *p);
+    }
+    struct line* top = lforw(curbp->b_linep);
+
+    // Prefixes that match in place, that run on to the next line, and
+    // that have to move on past decoys
+    const char* typed[] = { "needle", "needl\nx", "NEEDLES", "ee", "e n" };
+    for (int i = 0; i < 5; i++)
+        ok &= isearch_agrees(typed[i], top, 0);
+    ok &= isearch_agrees("needle", lforw(top), 3);
+
+    // The next match, as Control-S finds it, follows on from the last
+    if (ok) {
+        curwp->w_dotp = top;
+        curwp->w_doto = 0;
+        strcpy(pat, "needle");
+        int found = isearch_forward(pat, top, 0) && scanmore(pat, 1) &&
+                    scanmore(pat, 1);
+        if (!found || curwp->w_dotp != lforw(lforw(top)) || curwp->w_doto != 6) {
+            printf("[%sFAIL%s] Repeated ISearch did not reach the third match\n", RED, RESET);
+            ok = 0;
+        }
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] ISearch kept pace with a fresh search at every keystroke\n", GREEN, RESET);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: ISEARCH", ok);
+    return ok;
+}
+
+// Replace "from" by "to" in "line" left to right, ignoring case, skipping
+// the text before "start"
+static int replace_line(const char* line, int start, const char* from, const char* to,
+                        char* out, int* nsub) {
+    int flen = (int)strlen(from), tlen = (int)strlen(to), len = 0;
+
+    for (int i = 0; line[i]; ) {
+        if (i >= start && strncasecmp(line + i, from, flen) == 0) {
+            memcpy(out + len, to, tlen);
+            len += tlen;
+            i += flen;
+            (*nsub)++;
+        } else {
+            out[len++] = line[i++];
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// Test replace-string rewriting every line once, as one undo step
+int test_bulk_replace() {
+    int ok = 1;
+    PHASE_START("SEARCH: BULK REPLACE", "Testing replace-string in one pass");
+
+    init_editor_minimal("search-replace");
+    bclear(curbp);
+    curbp->b_mode &= ~(MDVIEW | MDMAGIC | MDEXACT);
+
+    const char* words[] = { "foo", "bar ", "FOO", "fo", "o" };
+    char lines[300][64];
+    int nlines = 300;
+    unsigned seed = 7;
+
+    curwp->w_dotp = curbp->b_linep;
+    curwp->w_doto = 0;
+    for (int i = 0; i < nlines; i++) {
+        int len = 0;
+        while (len < 40) {
+            seed = seed * 1103515245u + 12345u;
+            const char* w = words[(seed >> 16) % 5];
+            memcpy(lines[i] + len, w, strlen(w));
+            len += (int)strlen(w);
+        }
+        lines[i][len] = '\0';
+        lnewline();
+        curwp->w_dotp = lback(curbp->b_linep);
+        curwp->w_doto = 0;
+        for (const char* p = lines[i]; *p; ++p) linsert(1, *p);
+    }
+    curbp->b_flag &= ~BFCHG;
+
+    // From the middle of the second line, with a longer replacement
+    strcpy(pat, "foo");
+    strcpy(rpat, "<foo>");
+    curwp->w_dotp = lforw(lforw(curbp->b_linep));
+    curwp->w_doto = 5;
+    int nsub = 0, want = 0;
+    int status = replace_all(-1, &nsub);
+
+    struct line* lp = lforw(curbp->b_linep);
+    char expect[256];
+    for (int i = 0; i < nlines && ok; i++, lp = lforw(lp)) {
+        int len = i == 0 ? (int)strlen(lines[i]) : replace_line(lines[i], i == 1 ? 5 : 0, "foo", "<foo>", expect, &want);
+        const char* text = i == 0 ? lines[i] : expect;
+        if (llength(lp) != len || memcmp(lp->l_text, text, len) != 0) {
+            printf("[%sFAIL%s] Line %d reads \"%.*s\", want \"%s\"\n", RED, RESET, i + 1, llength(lp), lp->l_text, text);
+            ok = 0;
+        }
+    }
+    if (status != TRUE || nsub != want) {
+        printf("[%sFAIL%s] %d substitutions made, want %d\n", RED, RESET, nsub, want);
+        ok = 0;
+    }
+
+    // One undo puts every line back
+    if (ok && undo_cmd(0, 0) == TRUE) {
+        lp = lforw(curbp->b_linep);
+        for (int i = 0; i < nlines && ok; i++, lp = lforw(lp)) {
+            if (llength(lp) != (int)strlen(lines[i]) || memcmp(lp->l_text, lines[i], llength(lp)) != 0) {
+                printf("[%sFAIL%s] Line %d not restored by one undo\n", RED, RESET, i + 1);
+                ok = 0;
+            }
+        }
+    } else if (ok) {
+        printf("[%sFAIL%s] Undo after replace failed\n", RED, RESET);
+        ok = 0;
+    }
+
+    // A count stops it early; a shorter replacement shrinks lines in place
+    if (ok) {
+        strcpy(rpat, "");
+        curwp->w_dotp = lforw(curbp->b_linep);
+        curwp->w_doto = 0;
+        if (replace_all(3, &nsub) != TRUE || nsub != 3) {
+            printf("[%sFAIL%s] Replace limited to 3 made %d\n", RED, RESET, nsub);
+            ok = 0;
+        }
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] %d replacements in one pass, undone in one step\n", GREEN, RESET, want);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: BULK REPLACE", ok);
+    return ok;
+}
+
+// Test alternation, groups and counted repeats, and what the groups match
+int test_nfa_extended_syntax() {
+    int ok = 1;
+    PHASE_START("SEARCH: NFA-EXTENDED", "Testing alternation, groups, +, ? and {m,n}");
+
+    init_editor_minimal("search-extended");
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    static const struct {
+        const char* pattern;
+        const char* text;
+        int ms, me;         // leftmost-longest match, -1 for none
+        int g1s, g1e;       // group 1 within it, -1 when unset
+    } cases[] = {
+        { "cat|dog",            "hot dog stand",        4, 7,   -1, -1 },
+        { "(cat|dog)s?",        "two dogs",             4, 8,   4, 7 },
+        { "a+b",                "xxaaab",               2, 6,   -1, -1 },
+        { "a+b",                "xxb",                  -1, -1, -1, -1 },
+        { "colou?r",            "the color red",        4, 9,   -1, -1 },
+        { "ab{2,3}c",           "abc abbc abbbbc",      4, 8,   -1, -1 },
+        { "x{3}",               "xx xxxx",              3, 6,   -1, -1 },
+        { "(ab){2,}",           "ab abababx",           3, 9,   7, 9 },
+        { "([0-9]+)-([0-9]+)",  "call 555-1234 now",    5, 13,  5, 8 },
+        { "^(foo|bar)$",        "bar",                  0, 3,   0, 3 },
+        { "^(foo|bar)$",        "bars",                 -1, -1, -1, -1 },
+        { "(a|ab)(c|bcd)",      "abcd",                 0, 4,   0, 1 },
+        { "(x)?y",              "zy",                   1, 2,   -1, -1 },
+        { "a{2}b|b",            "aab",                  0, 3,   -1, -1 },
+        { "{a}",                "x{a}",                 1, 4,   -1, -1 },
+        { "x|^y",               "zy",                   -1, -1, -1, -1 },
+        { "(end$|mid)x",        "endx midx",            5, 9,   5, 8 },
+    };
+
+    curwp->w_dotp = curbp->b_linep;
+    curwp->w_doto = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        nfa_program* prog = nfa_program_new(cases[i].pattern, true);
+        struct line *lp, *mlp;
+        int ms = -1, me = -1;
+
+        if (!prog) {
+            printf("[%sFAIL%s] \"%s\" did not compile\n", RED, RESET, cases[i].pattern);
+            ok = 0;
+            continue;
+        }
+        curbp->b_flag &= ~BFCHG;
+        bclear(curbp);
+        curwp->w_dotp = curbp->b_linep;
+        curwp->w_doto = 0;
+        lnewline();
+        curwp->w_dotp = lp = lforw(curbp->b_linep);
+        curwp->w_doto = 0;
+        for (const char* p = cases[i].text; *p; ++p) linsert(1, *p);
+
+        if (!nfa_search_match(prog, lp, 0, &mlp, &ms, &me)) ms = me = -1;
+        if (ms != cases[i].ms || me != cases[i].me) {
+            printf("[%sFAIL%s] \"%s\" in \"%s\" matched [%d,%d), want [%d,%d)\n", RED, RESET,
+                   cases[i].pattern, cases[i].text, ms, me, cases[i].ms, cases[i].me);
+            ok = 0;
+        } else if (ms >= 0) {
+            int sub[2 * NFA_GROUPS];
+            int rs, re;
+
+            if (!nfa_match_groups(prog, lp, ms, me, sub, NFA_GROUPS) || sub[0] != ms || sub[1] != me ||
+                sub[2] != cases[i].g1s || sub[3] != cases[i].g1e) {
+                printf("[%sFAIL%s] \"%s\" in \"%s\": group 1 at [%d,%d), want [%d,%d)\n", RED, RESET,
+                       cases[i].pattern, cases[i].text, sub[2], sub[3], cases[i].g1s, cases[i].g1e);
+                ok = 0;
+            }
+            // Backward from the end of the match finds it again
+            if (!nfa_search_match_reverse(prog, lp, me, &mlp, &rs, &re) || re != me) {
+                printf("[%sFAIL%s] \"%s\" in \"%s\" not found backward\n", RED, RESET,
+                       cases[i].pattern, cases[i].text);
+                ok = 0;
+            }
+        }
+        nfa_program_free(prog);
+    }
+
+    // Syntax the original matcher lacks, and malformed patterns
+    if (!nfa_pattern_extended("a|b") || !nfa_pattern_extended("x{2}") ||
+        nfa_pattern_extended("a\\|b") || nfa_pattern_extended("[(|)]*") || nfa_pattern_extended("{x}")) {
+        printf("[%sFAIL%s] Extended syntax not told from the original\n", RED, RESET);
+        ok = 0;
+    }
+    const char* bad[] = { "*a", "a**", "(ab", "ab)", "a|+" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        nfa_program* prog = nfa_program_new(bad[i], true);
+        if (prog) {
+            printf("[%sFAIL%s] Malformed \"%s\" compiled\n", RED, RESET, bad[i]);
+            nfa_program_free(prog);
+            ok = 0;
+        }
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] Extended syntax and groups match as expected\n", GREEN, RESET);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: NFA-EXTENDED", ok);
+    return ok;
+}
+
+// Test replace-string building each replacement from the groups of its match
+int test_group_replace() {
+    int ok = 1;
+    PHASE_START("SEARCH: GROUP REPLACE", "Testing \\N and & in the replacement");
+
+    init_editor_minimal("search-groups");
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    curbp->b_mode &= ~(MDVIEW | MDEXACT);
+    curbp->b_mode |= MDMAGIC;
+
+    static const struct {
+        const char* text;
+        const char* command;
+        const char* want;
+    } cases[] = {
+        { "xabcd abcd",     "replace-string \"(ab)(cd)\" \"[\\2\\1]\"",     "x[cdab] [cdab]" },
+        { "555-1234 12-3",  "replace-string \"([0-9]+)-([0-9]+)\" \"\\2.\\1\"", "1234.555 3.12" },
+        { "cat dog",        "replace-string \"(cat|dog)\" \"<&:\\1>\"",          "<cat:cat> <dog:dog>" },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct line* lp;
+
+        curbp->b_flag &= ~BFCHG;
+        bclear(curbp);
+        curwp->w_dotp = curbp->b_linep;
+        curwp->w_doto = 0;
+        lnewline();
+        curwp->w_dotp = lp = lforw(curbp->b_linep);
+        curwp->w_doto = 0;
+        for (const char* p = cases[i].text; *p; ++p) linsert(1, *p);
+        curwp->w_dotp = lp;
+        curwp->w_doto = 0;
+
+        int status = docmd(cases[i].command);
+        lp = lforw(curbp->b_linep);
+        if (status != TRUE || llength(lp) != (int)strlen(cases[i].want) ||
+            memcmp(lp->l_text, cases[i].want, llength(lp)) != 0) {
+            printf("[%sFAIL%s] %s on \"%s\" gave \"%.*s\", want \"%s\"\n", RED, RESET,
+                   cases[i].command, cases[i].text, llength(lp), lp->l_text, cases[i].want);
+            ok = 0;
+        }
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] Groups substituted from each match\n", GREEN, RESET);
+    curbp->b_mode &= ~MDMAGIC;
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: GROUP REPLACE", ok);
+    return ok;
+}
+
+// Put "text" in the buffer as its one line and dot at "at" on it
+static struct line* one_line(const char* text, int at) {
+    struct line* lp;
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    curwp->w_dotp = curbp->b_linep;
+    curwp->w_doto = 0;
+    lnewline();
+    curwp->w_dotp = lforw(curbp->b_linep);
+    curwp->w_doto = 0;
+    for (const char* p = text; *p; ++p) linsert(1, *p);
+    // A long line moves as it grows
+    curwp->w_dotp = lp = lforw(curbp->b_linep);
+    curwp->w_doto = at;
+    return lp;
+}
+
+int test_nfa_too_complex(void) {
+    int ok = 1;
+    PHASE_START("SEARCH: TOO COMPLEX", "Regular expressions the NFA refuses are errors");
+
+    init_editor_minimal("search-complex");
+    curbp->b_mode &= ~(MDVIEW | MDEXACT);
+    curbp->b_mode |= MDMAGIC;
+
+    // Too big for the NFA either way: not taken for the text it spells
+    const char* huge = "(abcdefghij){200}";
+    struct line* lp = one_line(huge, 0);
+    if (docmd("search-forward \"(abcdefghij){200}\"") == TRUE || curwp->w_doto != 0) {
+        printf("[%sFAIL%s] %s matched as plain text\n", RED, RESET, huge);
+        ok = 0;
+    }
+
+    // Fits forward but not reversed: forward finds it, backward refuses
+    char text[1024];
+    size_t n = 0;
+    for (int i = 0; i < 200; i++) { memcpy(text + n, "abcd", 4); n += 4; }
+    memcpy(text + n, " (abcd){200}", 13);
+    lp = one_line(text, 0);
+    if (docmd("search-forward \"(abcd){200}\"") != TRUE || curwp->w_doto != 800) {
+        printf("[%sFAIL%s] forward search for (abcd){200} ended at %d\n", RED, RESET,
+               curwp->w_doto);
+        ok = 0;
+    }
+    curwp->w_dotp = lp;
+    curwp->w_doto = llength(lp);
+    if (docmd("search-reverse \"(abcd){200}\"") == TRUE || curwp->w_doto != llength(lp)) {
+        printf("[%sFAIL%s] reverse search for (abcd){200} took it as plain text\n", RED, RESET);
+        ok = 0;
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] Refused patterns reported, not matched literally\n", GREEN, RESET);
+    curbp->b_mode &= ~MDMAGIC;
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: TOO COMPLEX", ok);
+    return ok;
+}
@@ -7,5 +7,10 @@ int test_nfa_edge_cases(void);
 int test_cross_line_search(void);
 int test_search_performance(void);
 int test_case_insensitive_search(void);
+int test_isearch_incremental(void);
+int test_bulk_replace(void);
+int test_nfa_extended_syntax(void);
+int test_group_replace(void);
+int test_nfa_too_complex(void);
 
 #endif // TEST_SEARCH_ENGINES_H
\ No newline at end of file
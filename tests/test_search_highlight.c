@@ -0,0 +1,155 @@
+#include <string.h>
+#include <strings.h>
+
+#include "test_utils.h"
+#include "test_search_highlight.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/search_highlight.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "search-highlight"));
+    varinit();
+}
+
+static void insert_lines(const char** lines, int n) {
+    curwp->w_dotp = curbp->b_linep;
+    curwp->w_doto = 0;
+    for (int i = 0; i < n; i++) {
+        lnewline();
+        curwp->w_dotp = lback(curbp->b_linep);
+        curwp->w_doto = 0;
+        for (const char* p = lines[i]; *p; ++p) linsert(1, *p);
+    }
+}
+
+// The spans of "lp" against a plain left to right search, ignoring case
+static bool spans_agree(struct line* lp, const char* p) {
+    const struct hl_span* hl = NULL;
+    int n = hl_line(curbp, lp, &hl);
+    int plen = (int)strlen(p), k = 0;
+
+    for (int i = 0; i + plen <= llength(lp); ) {
+        if (strncasecmp(lp->l_text + i, p, plen) == 0) {
+            if (k >= n || hl[k].from != i || hl[k].to != i + plen)
+                return false;
+            k++;
+            i += plen;
+        } else {
+            i++;
+        }
+    }
+    return k == n;
+}
+
+int test_search_highlight_spans() {
+    int ok = 1;
+    PHASE_START("SEARCH: HIGHLIGHT", "Matches of the search pattern kept per visible line");
+
+    const char* lines[] = { "abab xab", "nothing here", "AB ab aB", "aaab" };
+    init_editor_minimal("search-highlight");
+    bclear(curbp);
+    curbp->b_mode &= ~(MDVIEW | MDMAGIC | MDEXACT);
+    insert_lines(lines, 4);
+
+    strcpy(pat, "ab");
+    hilite_matches(TRUE, 1);
+    curwp->w_flag = 0;
+    if (!hl_resolve() || !(curwp->w_flag & WFHARD)) {
+        printf("[%sFAIL%s] Turning highlighting on did not redraw\n", RED, RESET);
+        ok = 0;
+    }
+    for (struct line* lp = lforw(curbp->b_linep); lp != curbp->b_linep; lp = lforw(lp))
+        if (!spans_agree(lp, "ab")) {
+            printf("[%sFAIL%s] Wrong matches in \"%.*s\"\n", RED, RESET, llength(lp), lp->l_text);
+            ok = 0;
+        }
+
+    // An edit gives the line a new stamp, and its matches are found again
+    struct line* second = lforw(lforw(curbp->b_linep));
+    uint32_t gen = second->l_gen;
+    curwp->w_dotp = second;
+    curwp->w_doto = 0;
+    linsert(1, 'b');
+    linsert(1, 'a');
+    curwp->w_dotp = second = lforw(lforw(curbp->b_linep));
+    curwp->w_doto = 0;
+    linsert(1, 'a');
+    if (second->l_gen == gen || !spans_agree(curwp->w_dotp, "ab")) {
+        printf("[%sFAIL%s] Matches not refreshed after an edit\n", RED, RESET);
+        ok = 0;
+    }
+
+    // A new pattern drops what was kept
+    strcpy(pat, "b a");
+    curwp->w_flag = 0;
+    if (!hl_resolve() || !(curwp->w_flag & WFHARD) ||
+        !spans_agree(lforw(lforw(lforw(curbp->b_linep))), "b a")) {
+        printf("[%sFAIL%s] New pattern not shown\n", RED, RESET);
+        ok = 0;
+    }
+    curwp->w_flag = 0;
+    if (!hl_resolve() || curwp->w_flag != 0) {
+        printf("[%sFAIL%s] Unchanged pattern redrew the screen\n", RED, RESET);
+        ok = 0;
+    }
+
+#ifdef ENABLE_SEARCH_NFA
+    {
+        const struct hl_span* hl = NULL;
+        curbp->b_mode |= MDMAGIC;
+        strcpy(pat, "a*b");
+        hl_resolve();
+        int n = hl_line(curbp, lback(curbp->b_linep), &hl);
+        if (n != 1 || hl[0].from != 0 || hl[0].to != 4) {
+            printf("[%sFAIL%s] MAGIC pattern gave %d matches\n", RED, RESET, n);
+            ok = 0;
+        }
+        // An edit to another line keeps these matches; touching this one finds them again
+        struct line* last = lback(curbp->b_linep);
+        curwp->w_dotp = lforw(curbp->b_linep);
+        curwp->w_doto = 0;
+        linsert(1, 'b');
+        last->l_text[3] = 'x';              // behind the cache's back: "aaax"
+        n = hl_line(curbp, last, &hl);
+        if (n != 1 || hl[0].from != 0 || hl[0].to != 4) {
+            printf("[%sFAIL%s] Edit to another line dropped the matches (%d)\n", RED, RESET, n);
+            ok = 0;
+        }
+        ltouch(last);
+        n = hl_line(curbp, last, &hl);
+        if (n != 0) {
+            printf("[%sFAIL%s] Touched line kept %d stale matches\n", RED, RESET, n);
+            ok = 0;
+        }
+        lputc(last, 3, 'b');
+        n = hl_line(curbp, last, &hl);
+        if (n != 1 || hl[0].from != 0 || hl[0].to != 4) {
+            printf("[%sFAIL%s] Restored line gave %d matches\n", RED, RESET, n);
+            ok = 0;
+        }
+        curbp->b_mode &= ~MDMAGIC;
+    }
+#endif
+
+    hilite_matches(TRUE, 0);
+    if (hl_resolve()) {
+        printf("[%sFAIL%s] Highlighting did not turn off\n", RED, RESET);
+        ok = 0;
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] Matches found per line and refreshed on edits only\n", GREEN, RESET);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: HIGHLIGHT", ok);
+    return ok;
+}
@@ -0,0 +1,6 @@
+#ifndef UEMACS_TEST_SEARCH_HIGHLIGHT_H
+#define UEMACS_TEST_SEARCH_HIGHLIGHT_H
+
+int test_search_highlight_spans();
+
+#endif
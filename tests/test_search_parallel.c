@@ -0,0 +1,174 @@
+#include <stdlib.h>
+
+#include "test_utils.h"
+#include "test_search_parallel.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/line_index.h"
+#include "internal/search_parallel.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "search-parallel"));
+    varinit();
+}
+
+static struct line* append_line(const char* text, int len) {
+    struct line* lp = lalloc(curbp, len);
+    memcpy(lp->l_text, text, len);
+    lp->l_bp = lback(curbp->b_linep); lp->l_fp = curbp->b_linep;
+    lback(curbp->b_linep)->l_fp = lp; curbp->b_linep->l_bp = lp;
+    lindex_link(curbp, lp);
+    return lp;
+}
+
+/* Matches found by forward searches repeated from the top, as the editor does */
+static long sequential_matches(const char* pat, struct psearch_match* out, long max) {
+    long n = 0;
+
+    curwp->w_dotp = lforw(curbp->b_linep);
+    curwp->w_doto = 0;
+    while (scanner(pat, FORWARD, PTEND) == TRUE) {
+        if (n < max) {
+            out[n].lp = matchline;
+            out[n].off = matchoff;
+        }
+        n++;
+        if (matchlen == 0 && forwchar(FALSE, 1) != TRUE)
+            break;
+    }
+    return n;
+}
+
+static bool same_matches(const struct psearch_result* res, const struct psearch_match* want, long n) {
+    if (res->count != n)
+        return false;
+    for (long i = 0; i < n; i++) {
+        if (res->match[i].lp != want[i].lp || res->match[i].off != want[i].off ||
+            res->match[i].line != lindex_number(curbp, want[i].lp))
+            return false;
+    }
+    return true;
+}
+
+int test_search_parallel_agreement() {
+    int ok = 1;
+    PHASE_START("SEARCH: PARALLEL COUNT", "Worker threads find what a sequential search finds");
+
+    const char* pats[] = { "abc", "ERROR", "b", "q.*z", "^ab", "c$", "[xy]" };
+    const bool magic[] = { false, false, false, true, true, true, true };
+#ifdef ENABLE_SEARCH_NFA
+    int npats = (int)(sizeof(pats) / sizeof(pats[0]));
+#else
+    int npats = 3;      /* MAGIC patterns need the NFA */
+#endif
+    long nlines = 20000;
+    struct psearch_match* want = malloc(sizeof(*want) * 200000);
+    unsigned seed = 12345;
+    char text[96];
+
+    init_editor_minimal("search-parallel");
+    bclear(curbp);
+    for (long i = 0; i < nlines; i++) {
+        int len = (int)(seed % 80);
+        for (int k = 0; k < len; k++) {
+            seed = seed * 1103515245u + 12345u;
+            text[k] = "abcqzxy ERROR"[(seed >> 16) % 13];
+        }
+        append_line(text, len);
+    }
+    setenv("UEMACS_SEARCH_THREADS", "4", 1);
+
+    for (int p = 0; p < npats && want; p++) {
+        struct psearch_result res;
+        long n;
+
+        if (magic[p])
+            curbp->b_mode |= MDMAGIC;
+        n = sequential_matches(pats[p], want, 200000);
+        if (psearch_buffer(curbp, pats[p], magic[p], false, true, &res) != TRUE ||
+            res.threads != 4 || !same_matches(&res, want, n)) {
+            printf("[%sFAIL%s] \"%s\": %ld matches listed on %d threads, want %ld\n",
+                   RED, RESET, pats[p], res.count, res.threads, n);
+            ok = 0;
+        }
+        psearch_free(&res);
+        if (psearch_buffer(curbp, pats[p], magic[p], false, false, &res) != TRUE ||
+            res.count != n || res.match != NULL) {
+            printf("[%sFAIL%s] \"%s\": counted %ld, want %ld\n", RED, RESET, pats[p], res.count, n);
+            ok = 0;
+        }
+        curbp->b_mode &= ~MDMAGIC;
+    }
+    // A MAGIC pattern spanning lines is beyond the NFA: left to the caller
+    {
+        struct psearch_result res;
+        if (psearch_buffer(curbp, "a.\nb", true, false, false, &res) != ABORT) {
+            printf("[%sFAIL%s] Unsupported pattern was not refused\n", RED, RESET);
+            ok = 0;
+        }
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] %d patterns counted and listed in order on 4 threads\n",
+               GREEN, RESET, npats);
+    unsetenv("UEMACS_SEARCH_THREADS");
+    free(want);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: PARALLEL COUNT", ok);
+    return ok;
+}
+
+int test_search_parallel_stitch() {
+    int ok = 1;
+    PHASE_START("SEARCH: PARALLEL STITCH", "Matches spanning chunk boundaries joined in order");
+
+    long nlines = 20001;
+    const char* pats[] = { "x\nx", "x\nx\nx", "\nx\n" };
+    long expect[] = { 10000, 6667, 10000 };
+    struct psearch_match* want = malloc(sizeof(*want) * 20000);
+
+    init_editor_minimal("search-stitch");
+    bclear(curbp);
+    for (long i = 0; i < nlines; i++)
+        append_line("x", 1);
+
+    // Odd thread counts put chunk boundaries at odd and even lines alike
+    for (int threads = 1; threads <= 7 && want; threads += 2) {
+        char nthreads[8];
+        snprintf(nthreads, sizeof(nthreads), "%d", threads);
+        setenv("UEMACS_SEARCH_THREADS", nthreads, 1);
+        for (int p = 0; p < 3; p++) {
+            struct psearch_result res, cnt;
+            long n = sequential_matches(pats[p], want, 20000);
+            int s1 = psearch_buffer(curbp, pats[p], false, true, true, &res);
+            int s2 = psearch_buffer(curbp, pats[p], false, true, false, &cnt);
+            if (n != expect[p] || s1 != TRUE || s2 != TRUE ||
+                !same_matches(&res, want, n) || cnt.count != n) {
+                printf("[%sFAIL%s] Pattern %d on %d threads: listed %ld, counted %ld, want %ld (%ld)\n",
+                       RED, RESET, p, threads, res.count, cnt.count, n, expect[p]);
+                ok = 0;
+            }
+            psearch_free(&res);
+        }
+    }
+
+    if (ok)
+        printf("[%sSUCCESS%s] Multi-line matches stitched across chunks on 1 to 7 threads\n",
+               GREEN, RESET);
+    unsetenv("UEMACS_SEARCH_THREADS");
+    free(want);
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+
+    PHASE_END("SEARCH: PARALLEL STITCH", ok);
+    return ok;
+}
@@ -0,0 +1,7 @@
+#ifndef UEMACS_TEST_SEARCH_PARALLEL_H
+#define UEMACS_TEST_SEARCH_PARALLEL_H
+
+int test_search_parallel_agreement();
+int test_search_parallel_stitch();
+
+#endif
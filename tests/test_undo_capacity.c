@@ -57,3 +57,67 @@ int test_undo_capacity_wrap() {
     PHASE_END("UNDO: CAP", ok);
     return ok;
 }
+
+int test_undo_log_compact() {
+    int ok = 1;
+    PHASE_START("UNDO: LOG", "Coalesced records, byte-sized history, no cap");
+
+    init_editor_minimal("undo-log");
+    bclear(curbp);
+    curbp->b_mode &= ~MDVIEW;
+
+    curwp->w_dotp = curbp->b_linep;
+    curwp->w_doto = 0;
+    lnewline();
+    curwp->w_dotp = lforw(curbp->b_linep);
+    curwp->w_doto = 0;
+
+    // One long typed word is one record: memory follows the bytes typed
+    size_t base = undo_memory(curbp);
+    const int typed = 20000;
+    for (int i = 0; i < typed; ++i) linsert(1, 'a' + (i % 26));
+    size_t used = undo_memory(curbp) - base;
+    if (used > 2 * (size_t)typed + 65536) {
+        ok = 0; printf("[%sFAIL%s] %d keystrokes took %zu undo bytes\n", RED, RESET, typed, used);
+    }
+    if (!undo_cmd(0,0) || llength(curwp->w_dotp) != 0) {
+        ok = 0; printf("[%sFAIL%s] typed run did not undo as one step\n", RED, RESET);
+    }
+
+    // Backspacing over a word merges into one record that restores it intact
+    const char* text = "hello world";
+    for (const char* p = text; *p; ++p) linsert(1, *p);
+    undo_group_end(curbp);
+    for (int i = 0; i < 5; ++i) {
+        curwp->w_doto--;
+        ldelete(1, FALSE);
+    }
+    if (!undo_cmd(0,0) || llength(curwp->w_dotp) != 11
+        || memcmp(curwp->w_dotp->l_text, text, 11) != 0) {
+        ok = 0; printf("[%sFAIL%s] backspace run did not restore text\n", RED, RESET);
+    }
+
+    // Far beyond the old 10000 operation limit, every step still undoes
+    curwp->w_doto = 0;
+    ldelete(11, FALSE);
+    const int steps = 30000;
+    for (int i = 0; i < steps; ++i) {
+        undo_group_begin(curbp);
+        linsert(1, 'A' + (i % 26));
+        undo_group_end(curbp);
+    }
+    int undone = 0;
+    while (undone < steps && undo_cmd(0,0)) ++undone;
+    if (undone != steps || llength(curwp->w_dotp) != 0) {
+        ok = 0; printf("[%sFAIL%s] undid %d/%d steps, %d chars left\n",
+                       RED, RESET, undone, steps, llength(curwp->w_dotp));
+    }
+    int redone = 0;
+    while (redo_cmd(0,0)) ++redone;
+    if (redone != steps || llength(curwp->w_dotp) != steps) {
+        ok = 0; printf("[%sFAIL%s] redid %d/%d steps\n", RED, RESET, redone, steps);
+    }
+
+    PHASE_END("UNDO: LOG", ok);
+    return ok;
+}
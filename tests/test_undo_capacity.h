@@ -2,6 +2,7 @@
 #define UEMACS_TEST_UNDO_CAPACITY_H
 
 int test_undo_capacity_wrap();
+int test_undo_log_compact();
 
 #endif
 
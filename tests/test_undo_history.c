@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "test_utils.h"
+#include "test_undo_history.h"
+
+#include "internal/estruct.h"
+#include "internal/edef.h"
+#include "internal/efunc.h"
+#include "internal/line.h"
+#include "internal/undo.h"
+#include "internal/undo_log.h"
+
+static void init_editor_minimal(const char* name) {
+    term.t_nrow = 24 - 1;
+    term.t_ncol = 80;
+    term.t_mrow = 24;
+    term.t_mcol = 80;
+    edinit((char*)(name ? name : "undo-history"));
+    varinit();
+}
+
+static int first_line_is(const char* text) {
+    struct line* lp = lforw(curbp->b_linep);
+    int len = (int)strlen(text);
+    if (lp == curbp->b_linep || llength(lp) != len || memcmp(lp->l_text, text, len) != 0) {
+        printf("[%sFAIL%s] first line is \"%.*s\", expected \"%s\"\n", RED, RESET,
+               lp == curbp->b_linep ? 0 : llength(lp), lp == curbp->b_linep ? "" : lp->l_text, text);
+        return 0;
+    }
+    return 1;
+}
+
+static void type_at_end(const char* text) {
+    curwp->w_dotp = lforw(curbp->b_linep);
+    curwp->w_doto = llength(curwp->w_dotp);
+    undo_group_begin(curbp);
+    for (const char* p = text; *p; ++p) linsert(1, *p);
+    undo_group_end(curbp);
+}
+
+static void write_file(const char* path, const char* text) {
+    FILE* fp = fopen(path, "w");
+    if (fp) { fputs(text, fp); fclose(fp); }
+}
+
+static long read_all(const char* path, unsigned char* buf, long room) {
+    FILE* fp = fopen(path, "rb");
+    long n = 0;
+    if (fp) { n = (long)fread(buf, 1, (size_t)room, fp); fclose(fp); }
+    return n;
+}
+
+static void write_all(const char* path, const unsigned char* buf, long n) {
+    FILE* fp = fopen(path, "wb");
+    if (fp) { fwrite(buf, 1, (size_t)n, fp); fclose(fp); }
+}
+
+int test_undo_history_persist() {
+    int ok = 1;
+    char dir[] = "/tmp/uemacs_undo_hist_XXXXXX";
+    char file[96], hist[PATH_MAX];
+    PHASE_START("UNDO: HISTORY", "Undo history saved with the file and read back");
+
+    if (mkdtemp(dir) == NULL) {
+        ok = 0;
+        PHASE_END("UNDO: HISTORY", ok);
+        return ok;
+    }
+    snprintf(file, sizeof(file), "%s/doc.txt", dir);
+    setenv("UEMACS_UNDO_HISTORY", dir, 1);
+    write_file(file, "one\n");
+
+    init_editor_minimal("undo-history");
+    curbp->b_flag &= ~BFCHG;
+    curbp->b_mode &= ~MDVIEW;
+    if (readin(file, FALSE) != TRUE) ok = 0;
+
+    // Two saves: the second appends to the history file
+    type_at_end(" two");
+    if (filesave(0, 0) != TRUE) ok = 0;
+    type_at_end(" three");
+    if (filesave(0, 0) != TRUE) ok = 0;
+    if (!undo_history_file(file, hist, sizeof(hist)) || access(hist, R_OK) != 0) {
+        ok = 0; printf("[%sFAIL%s] no history file kept\n", RED, RESET);
+    }
+
+    // A later session reads nothing back until undo walks into it
+    curbp->b_flag &= ~BFCHG;
+    if (readin(file, FALSE) != TRUE) ok = 0;
+    if (undo_memory(curbp) != 0) {
+        ok = 0; printf("[%sFAIL%s] history was read eagerly\n", RED, RESET);
+    }
+    ok &= first_line_is("one two three");
+    if (!undo_cmd(0, 0)) ok = 0;
+    ok &= first_line_is("one two");
+    if (!undo_cmd(0, 0)) ok = 0;
+    ok &= first_line_is("one");
+    if (undo_cmd(0, 0)) {
+        ok = 0; printf("[%sFAIL%s] undo went past the start of history\n", RED, RESET);
+    }
+    if (!redo_cmd(0, 0)) ok = 0;
+    ok &= first_line_is("one two");
+
+    // A new edit there replaces the rest; the file is cut back to match
+    type_at_end(" 2");
+    if (filesave(0, 0) != TRUE) ok = 0;
+    curbp->b_flag &= ~BFCHG;
+    if (readin(file, FALSE) != TRUE) ok = 0;
+    ok &= first_line_is("one two 2");
+    if (!undo_cmd(0, 0)) ok = 0;
+    ok &= first_line_is("one two");
+    if (!undo_cmd(0, 0)) ok = 0;
+    ok &= first_line_is("one");
+
+    // History of text changed behind our back is not used
+    write_file(file, "other\n");
+    curbp->b_flag &= ~BFCHG;
+    if (readin(file, FALSE) != TRUE) ok = 0;
+    if (undo_cmd(0, 0)) {
+        ok = 0; printf("[%sFAIL%s] stale history applied\n", RED, RESET);
+    }
+    ok &= first_line_is("other");
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    unsetenv("UEMACS_UNDO_HISTORY");
+    unlink(hist);
+    unlink(file);
+    rmdir(dir);
+
+    PHASE_END("UNDO: HISTORY", ok);
+    return ok;
+}
+
+// The edit record just before the closing save point of a history file
+static struct undo_record* last_edit(unsigned char* buf, long n) {
+    size_t saved = undo_record_size(24);
+    struct undo_record* sp = (struct undo_record*)(buf + n - saved);
+    if ((long)saved > n || sp->r_type != UNDO_SAVED || sp->r_prev == 0 ||
+        (long)(saved + sp->r_prev) > n)
+        return NULL;
+    return (struct undo_record*)(buf + n - saved - sp->r_prev);
+}
+
+int test_undo_history_corrupt() {
+    int ok = 1;
+    char dir[] = "/tmp/uemacs_undo_bad_XXXXXX";
+    char file[96], hist[PATH_MAX];
+    static unsigned char good[4096], bad[4096];
+    long n = 0;
+    PHASE_START("UNDO: DAMAGED HISTORY", "Broken records in a history file are not applied");
+
+    if (mkdtemp(dir) == NULL) {
+        ok = 0;
+        PHASE_END("UNDO: DAMAGED HISTORY", ok);
+        return ok;
+    }
+    snprintf(file, sizeof(file), "%s/doc.txt", dir);
+    setenv("UEMACS_UNDO_HISTORY", dir, 1);
+    write_file(file, "one\n");
+
+    init_editor_minimal("undo-damaged");
+    curbp->b_flag &= ~BFCHG;
+    curbp->b_mode &= ~MDVIEW;
+    if (readin(file, FALSE) != TRUE) ok = 0;
+    type_at_end(" two");
+    if (filesave(0, 0) != TRUE) ok = 0;
+    if (!undo_history_file(file, hist, sizeof(hist)) ||
+        (n = read_all(hist, good, sizeof(good))) <= 0 || n == (long)sizeof(good) ||
+        last_edit(good, n) == NULL) {
+        ok = 0; printf("[%sFAIL%s] no history file to damage\n", RED, RESET);
+    }
+
+    // Each damage in turn: text not ended, unknown type, length past the record
+    for (int kind = 0; ok && kind < 3; kind++) {
+        memcpy(bad, good, (size_t)n);
+        struct undo_record* rp = last_edit(bad, n);
+        if (kind == 0) rp->r_text[rp->r_len] = 'x';
+        if (kind == 1) rp->r_type = 9;
+        if (kind == 2) rp->r_len += 64;
+        write_all(hist, bad, n);
+        curbp->b_flag &= ~BFCHG;
+        if (readin(file, FALSE) != TRUE) ok = 0;
+        if (undo_cmd(0, 0)) {
+            ok = 0; printf("[%sFAIL%s] damaged record %d was applied\n", RED, RESET, kind);
+        }
+        ok &= first_line_is("one two");
+    }
+
+    // A whole record placed past the text lands at its end, not out of bounds
+    if (ok) {
+        memcpy(bad, good, (size_t)n);
+        struct undo_record* rp = last_edit(bad, n);
+        rp->r_line = 1000000;
+        rp->r_off = 1 << 20;
+        write_all(hist, bad, n);
+        curbp->b_flag &= ~BFCHG;
+        if (readin(file, FALSE) != TRUE) ok = 0;
+        undo_cmd(0, 0);
+        if (curwp->w_doto > llength(curwp->w_dotp)) {
+            ok = 0; printf("[%sFAIL%s] undo left dot past its line\n", RED, RESET);
+        }
+        ok &= first_line_is("one two");
+    }
+
+    curbp->b_flag &= ~BFCHG;
+    bclear(curbp);
+    unsetenv("UEMACS_UNDO_HISTORY");
+    unlink(hist);
+    unlink(file);
+    rmdir(dir);
+
+    PHASE_END("UNDO: DAMAGED HISTORY", ok);
+    return ok;
+}
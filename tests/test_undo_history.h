@@ -0,0 +1,7 @@
+#ifndef UEMACS_TEST_UNDO_HISTORY_H
+#define UEMACS_TEST_UNDO_HISTORY_H
+
+int test_undo_history_persist();
+int test_undo_history_corrupt();
+
+#endif